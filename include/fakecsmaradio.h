@@ -22,6 +22,7 @@ void encode_rs_8(data_t *data, data_t *parity,int pad);
 int decode_rs_8(data_t *data, int *eras_pos, int no_eras, int pad);
 #define FEC_LENGTH 32
 #define FEC_MAX_BYTES 223
+#include "rs_frame.h"
 
 extern long long start_time;
 extern long long total_transmission_time;
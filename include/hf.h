@@ -30,6 +30,10 @@ struct hf_station {
   // (used to condition the selection of which station to talk to.  Basically if we
   // keep failing to connect, then we will be more likely to try other stations first)
   int consecutive_connection_failures;
+
+  // Set once we have seen that this station can decode ASCII-64 encoded
+  // fragments (see hf_encode_fragment()).
+  int dense_fragments;
 };
 
 #define MAX_HF_STATIONS 1024
@@ -67,6 +71,11 @@ int hf_radio_mark_ready(void);
 int hf_next_station_to_call(void);
 int hf_radio_pause_for_turnaround(void);
 int hf_process_fragment(char *fragment);
+int hf_fragment_dense_ok(void);
+int hf_fragment_count(int len,int dense);
+int hf_fragment_dense_fits(unsigned char *packet,int len);
+int hf_encode_fragment(unsigned char *packet,int len,int piece,int pieces,
+		       int dense,char *fragment);
 char *radio_type_name(int radio_type);
 char *radio_type_description(int radio_type);
 char *hf_state_name(int state);
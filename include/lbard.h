@@ -43,11 +43,25 @@ extern int target_transmissions_per_4seconds;
 // 1 byte : size and meshms flag byte
 #define BAR_LENGTH (8+8+4+1)
 
-struct segment_list {
-  unsigned char *data;
+/*
+  A manifest or payload that is being received.  Pieces are copied straight
+  into data[] at their offset in the stream, and the byte ranges we hold are
+  kept as a sorted array of disjoint, non-adjacent extents.
+*/
+struct partial_extent {
   int start_offset;
-  int length;
-  struct segment_list *prev,*next;
+  int end_offset;
+};
+
+// Upper bound on the size of a manifest or payload we will reassemble
+#define MAX_PARTIAL_STREAM_LENGTH (16*1024*1024)
+
+struct partial_stream {
+  unsigned char *data;
+  int data_size;
+  struct partial_extent *extents;
+  int extent_count;
+  int extent_slots;
 };
 
 struct recent_sender {
@@ -63,14 +77,19 @@ struct recent_senders {
 struct partial_bundle {
   // Data from the piece headers for keeping track
   char *bid_prefix;
+  unsigned char bid_prefix_bin[8];
   long long bundle_version;
 
+  // Used to choose which partial to abandon when they are all in use
+  int addressed_to_us;
+  time_t last_piece_time;
+
   int recent_bytes;
   
-  struct segment_list *manifest_segments;
+  struct partial_stream manifest;
   int manifest_length;
 
-  struct segment_list *body_segments;
+  struct partial_stream body;
   int body_length;
 
   struct recent_senders senders;
@@ -84,9 +103,24 @@ struct partial_bundle {
 #define DEFAULT_PEER_KEEPALIVE_INTERVAL 20
 extern int peer_keepalive_interval;
 
+// Packets identify their sender by this many leading bytes of its SID
+#define PEER_PREFIX_BYTES 6
+
 struct peer_state {
   char *sid_prefix;
-  unsigned char sid_prefix_bin[4];
+  unsigned char sid_prefix_bin[PEER_PREFIX_BYTES];
+
+  // Position in peer_records[], next peer in the same peer hash bucket, and
+  // neighbours in the list of peers ordered by last_message_time (see peers.c)
+  int peer_index;
+  struct peer_state *hash_next;
+  struct peer_state *lru_newer;
+  struct peer_state *lru_older;
+  // Position in the active peer list + 1, and slot in the expiry wheel + 1,
+  // or zero if not in them.
+  int active_position;
+  int expiry_slot;
+  struct peer_state *expiry_next;
 
   // random 32 bit instance ID, used to work out when LBARD has died and restarted
   // on a peer, so that we can restart the sync process.
@@ -101,6 +135,11 @@ struct peer_state {
 
   time_t last_timestamp_received;
 
+  // Error level from their last 'E' field (see fecreport.c), and when we got
+  // it, or zero if they have never sent one.
+  int fec_report;
+  long long fec_report_time;
+
   // Used to log RSSI of receipts from this sender, so that we can show in the stats display
   int rssi_accumulator;
   int rssi_counter;
@@ -206,6 +245,19 @@ extern long long next_message_update_time;
 extern long long congestion_update_time;
 extern int message_update_interval;
 extern int message_update_interval_randomness;
+extern double congestion_ratio;
+extern int congestion_transmissions_seen;
+extern int congestion_transmissions_byus;
+
+extern long long radio_packets_sent;
+extern long long radio_bytes_sent;
+extern long long radio_packets_received;
+extern long long radio_bytes_received;
+extern long long radio_fec_frames_corrected;
+extern long long radio_fec_bytes_corrected;
+extern long long radio_fec_frames_rejected;
+extern long long message_type_count[256];
+extern long long message_type_bytes[256];
 
 extern int monitor_mode;
 
@@ -251,6 +303,10 @@ struct bundle_record {
   
   long long last_priority;
   int num_peers_that_dont_have_it;
+
+  // Cached result of calculate_bundle_intrinsic_priority(), maintained by
+  // bundle_priority_update()
+  long long intrinsic_priority;
 };
 
 // New unified BAR + optional bundle record for BAR tree structure
@@ -323,18 +379,34 @@ extern int fresh_bundle_count;
 
 extern char *bid_of_cached_bundle;
 extern long long cached_version;
-// extern int cached_manifest_len;
-// extern unsigned char *cached_manifest;
 extern int cached_manifest_encoded_len;
 extern unsigned char *cached_manifest_encoded;
 extern int cached_body_len;
 extern unsigned char *cached_body;
+extern long long bundle_cache_hits;
+extern long long bundle_cache_misses;
+extern long long bundle_cache_evictions;
+extern long long bundle_cache_bytes;
+
+// Bumped whenever the state shown on the status pages changes, so that the
+// pages are only re-rendered when they would look different.
+extern long long bundles_generation;
+extern long long peers_generation;
+extern long long tx_queue_generation;
+extern long long partials_generation;
 
 extern unsigned int option_flags;
 #define FLAG_NO_RANDOMIZE_REDIRECT_OFFSET 1
 #define FLAG_NO_RANDOMIZE_START_OFFSET 2
 #define FLAG_NO_BITMAP_PROGRESS 4
 #define FLAG_NO_HARD_LOWER 8
+#define FLAG_ADAPTIVE_FEC 16
+
+// 'E' fields (see fecreport.c)
+#define FEC_REPORT_LENGTH 2
+#define FEC_REPORT_UNKNOWN 255
+// Peers that haven't sent one for this long might not decode the other codes
+#define FEC_REPORT_MAX_AGE_MS 60000
 
 extern FILE *debug_file;
 extern int debug_bundles;
@@ -381,26 +453,53 @@ int saw_piece(char *peer_prefix,int for_me,
 	      int is_manifest_piece,unsigned char *piece,
 
 	      char *prefix, char *servald_server, char *credential);
-int saw_length(char *peer_prefix,char *bid_prefix,long long version,
+int saw_length(char *peer_prefix,unsigned char *bid_prefix_bin,long long version,
 	       int body_length);
 int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
 		char *prefix, char *servald_server,char *credential);
 int load_rhizome_db(int timeout,
 		    char *prefix, char *serval_server,
 		    char *credential, char **token);
-int parse_json_line(char *line,char fields[][8192],int num_fields);
+int json_parse_line_inplace(char *line,char **fields,int num_fields);
 int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 			  unsigned char *body_data,int body_length,
 			  char *servald_server,char *credential);
+int rhizome_log_rejected_bundle(unsigned char *manifest_data,int manifest_length,
+				unsigned char *body_data,int body_length,
+				int result_code);
+// Called with the HTTP result code once servald has finished with a bundle
+typedef int (*rhizome_import_callback)(int result,
+				       unsigned char *manifest,int manifest_length,
+				       void *context);
+int rhizome_import_bundle(unsigned char *manifest_data,int manifest_length,
+			  unsigned char *body_data,int body_length,
+			  char *servald_server,char *credential,
+			  rhizome_import_callback callback,void *context);
+int rhizome_import_queue_full(void);
+extern int rhizome_imports_queued;
+extern long long rhizome_imports_completed;
+extern long long rhizome_imports_failed;
+extern long long rhizome_imports_retried;
 int prime_bundle_cache(int bundle_number,char *prefix,
 		       char *servald_server, char *credential);
 int hex_byte_value(char *hexstring);
 int find_highest_priority_bundle(void);
 int find_highest_priority_bar(void);
 int find_peer_by_prefix(char *peer_prefix);
+struct peer_state *peer_find_bin(unsigned char *sid_prefix_bin);
+int peer_register(struct peer_state *p);
+int peer_replace(struct peer_state *old,struct peer_state *p);
+int peer_saw_message(struct peer_state *p);
 int clear_partial(struct partial_bundle *p);
+int partial_find(unsigned char *bid_prefix_bin);
+int partials_in_flight(void);
+int partial_allocate(unsigned char *bid_prefix_bin,long long version);
 int dump_partial(struct partial_bundle *p);
-int merge_segments(struct segment_list **s);
+int partial_stream_reserve(struct partial_stream *s,int length);
+int partial_stream_add(struct partial_stream *s,int offset,
+		       unsigned char *bytes,int length,int *next_byte_useful);
+int partial_stream_bytes(struct partial_stream *s);
+int partial_stream_complete(struct partial_stream *s,int length);
 int free_peer(struct peer_state *p);
 int peer_note_bar(struct peer_state *p,
 		  char *bid_prefix,long long version, char *recipient_prefix,
@@ -414,14 +513,43 @@ int update_my_message(int serialfd,
 		      char *servald_server,char *credential);
 size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream);
 int radio_send_message(int serialfd, unsigned char *msg_out,int offset);
+int radio_fec_parity_bytes(int length);
+int radio_fec_error_level(void);
 int radio_receive_bytes(unsigned char *buffer, int bytes, int monitor_mode);
 ssize_t write_all(int fd, const void *buf, size_t len);
 int radio_read_bytes(int serialfd, int monitor_mode);
 ssize_t read_nonblock(int fd, void *buf, size_t len);
 
+#define HTTP_LATENCY_BUCKETS 10
+extern const int http_latency_bucket_ms[HTTP_LATENCY_BUCKETS];
+extern long long http_latency_buckets[HTTP_LATENCY_BUCKETS+1];
+extern long long http_requests;
+extern long long http_request_failures;
+extern long long http_request_us_total;
+extern long long http_connections_opened;
+extern long long http_connections_reused;
 int http_get_simple(char *server_and_port, char *auth_token,
 		    char *path, FILE *outfile, int timeout_ms,
 		    long long *last_read_time, int outputheaders);
+struct http_buffer {
+  unsigned char *data;
+  int len;
+  int alloc;
+  // Set if data is a mapped spill file rather than malloc()'d memory
+  int mmapped;
+  // Descriptor of the spill file, kept open so that it can grow (valid only if mmapped)
+  int spill_fd;
+};
+int http_get_buffer(char *server_and_port, char *auth_token,
+		    char *path, struct http_buffer *b, int timeout_ms);
+int http_buffer_free(struct http_buffer *b);
+const char *http_spill_dir(void);
+char *http_build_bundle_post(char *server_and_port, char *auth_token,
+			     char *path,
+			     unsigned char *manifest_data, int manifest_length,
+			     unsigned char *body_data, int body_length,
+			     int *request_length);
+int connect_to_port(char *host,int port);
 int http_post_bundle(char *server_and_port, char *auth_token,
 		     char *path,
 		     unsigned char *manifest_data, int manifest_length,
@@ -434,7 +562,7 @@ int generate_progress_string(struct partial_bundle *partial,
 int show_progress(FILE *f,int verbose);
 int show_progress_json(FILE *f,int verbose);
 int request_wanted_content_from_peers(int *offset,int mtu, unsigned char *msg_out);
-int dump_segment_list(struct segment_list *s);
+int dump_partial_stream(struct partial_stream *s);
 
 int energy_experiment(char *port, char *interface_name,char *broadcast_address);
 int energy_experiment_master(char *broadcast_address,
@@ -489,7 +617,9 @@ int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv);
 int http_process(struct sockaddr *cliaddr,
 		 char *servald_server,char *credential,
 		 char *my_sid_hex,
-		 int socket);
+		 char *request,FILE *out);
+int http_accept(int listen_fd);
+int http_connection_ready(int fd,void *context);
 int chartohex(int c);
 int random_active_peer(void);
 int append_bytes(int *offset,int mtu,unsigned char *msg_out,
@@ -542,6 +672,7 @@ int bundle_calculate_tree_key(sync_key_t *sync_key,
 int dump_bytes(FILE *f,char *msg,unsigned char *bytes,int length);
 int urandombytes(unsigned char *buf, size_t len);
 int active_peer_count(void);
+int active_peers_fec_report(void);
 int sync_dequeue_bundle(struct peer_state *p,int bundle);
 int meshms_parse_command(int argc,char **argv);
 int meshmb_parse_command(int argc,char **argv);
@@ -565,6 +696,9 @@ int progress_log_bundle_receipt(char *bid_prefix, long long version);
 int http_get_async(char *server_and_port, char *auth_token,
 		   char *path, int timeout_ms);
 int http_read_next_line(int sock, char *line, int *len, int maxlen);
+int http_read_next_line_inplace(int sock, char **line, int *len);
+int http_close_async(int sock);
+extern int load_rhizome_db_socket;
 int load_rhizome_db_async(char *servald_server,
 			  char *credential, char *token);
 
@@ -596,10 +730,14 @@ int hf_radio_ready(void);
 int hf_radio_pause_for_turnaround(void);
 int hf_radio_send_now(void);
 int eeprom_read(int fd);
-int http_report_network_status(int socket,char *topic);
-int http_report_network_status_json(int socket);
-int http_send_file(int socket,char *filename,char *mime_type);
-int send_status_home_page(int socket);
+int http_report_network_status(FILE *out,char *topic);
+int http_report_network_status_json(FILE *out);
+int http_report_time_accounting_json(FILE *out);
+int metrics_write(FILE *f);
+int http_report_metrics(FILE *out);
+int http_send_file(FILE *out,char *filename,char *mime_type);
+int http_send_buffer(FILE *out,char *data,int len,char *mime_type);
+int send_status_home_page(FILE *out);
 
 char *find_sender_name(char *sender);
 
@@ -609,7 +747,7 @@ int _report_file(const char *filename,const char *file,
 #define report_file(X) _report_file(X,__FILE__,__LINE__,__FUNCTION__)
 int partial_update_recent_senders(struct partial_bundle *p,char *sender_prefix_hex);
 int partial_update_request_bitmap(struct partial_bundle *p);
-int partial_find_missing_byte(struct segment_list *s,int *isFirstMissingByte);
+int partial_find_missing_byte(struct partial_stream *s,int *isFirstMissingByte);
 int hex_to_val(int c);
 int sync_parse_progress_bitmap(struct peer_state *p,unsigned char *msg,int *offset);
 int dump_progress_bitmap(FILE *f, unsigned char *b,int blocks);
@@ -622,6 +760,12 @@ int process_ota_bundle(char *bid,char *version);
 int setup_periodic_requests(char *filename);
 int make_periodic_requests(void);
 int lookup_bundle_by_prefix(const unsigned char *prefix,int len);
+int bundle_index_find_bid(const unsigned char *bid_bin);
+int bundle_index_add(int bundle_number);
+int bundle_index_prefix_range(const unsigned char *prefix,int prefix_bits,
+			      int *first);
+int bundle_index_hex_prefix_range(const char *hex_prefix,int *first);
+int bundle_index_at(int position);
 int progress_bitmap_translate(struct peer_state *p,int new_body_offset);
 int dump_peer_tx_bitmap(int peer);
 int announce_bundle_length(int mtu, unsigned char *msg,int *offset,
@@ -634,12 +778,17 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 int sync_tree_send_message(int *offset,int mtu, unsigned char *msg_out);
 int sync_build_bar_in_slot(int slot,unsigned char *bid_bin,
 			   long long bundle_version);
+int append_fec_report(unsigned char *msg_out,int *offset);
 int append_generationid(unsigned char *msg_out,int *offset);
+int bundle_priority_update(int bundle);
+int bundle_priority_peer_changed(char *sid_prefix);
+long long bundle_intrinsic_priority(int bundle);
 
 int account_time_pause();
 int account_time_resume();
 int account_time(char *source);
 int show_time_accounting(FILE *f);
+int time_accounting_json(FILE *f);
 
 int log_rssi(struct peer_state *p,int rssi);
 int log_rssi_timewarp(long long delta);
@@ -650,9 +799,40 @@ int describe_bundle(int fn, FILE *f,FILE *bundlelogfile,int bn,int peerid,
 		    int manifest_offset,int body_offset);
 
 int stun_serviceloop(void);
+int stun_socket(void);
 int autodetect_radio_type(int fd);
+extern int outernet_socket;
 int outernet_rx_setup(char *socket_filename);
 int outernet_rx_serviceloop(void);
 int set_nonblock(int fd);
 
+// Main loop event reactor
+#define REACTOR_MAX_FDS 64
+#define REACTOR_MAX_TIMERS 32
+// Upper bound on how long we sleep, even if no timer is due
+#define REACTOR_MAX_WAIT_MS 1000
+// Timers due further in the future than this are assumed to be the result of
+// the clock running backwards
+#define REACTOR_MAX_TIMER_PERIOD 300000
+// How often the main loop services things that don't have a file descriptor
+// to wait on
+#define RADIO_SERVICE_INTERVAL_MS 50
+#define RADIO_NOT_READY_RETRY_MS 50
+#define BUNDLELIST_SERVICE_INTERVAL_MS 1000
+typedef int (*reactor_fd_callback)(int fd,void *context);
+// Returns the absolute gettime_ms() time at which the timer should next run
+typedef long long (*reactor_timer_callback)(long long now,void *context);
+extern long long reactor_wakeups;
+int reactor_init(void);
+int reactor_watch_fd(int fd,char *name,reactor_fd_callback callback,
+		     void *context);
+int reactor_want_write(int fd,int want_write);
+int reactor_want_read(int fd,int want_read);
+int reactor_unwatch_fd(int fd);
+int reactor_add_timer(char *name,long long due,
+		      reactor_timer_callback callback,void *context);
+int reactor_timer_set_due(int timer,long long due);
+int reactor_timewarp(long long delta);
+int reactor_run_once(void);
+
 #include "util.h"
@@ -0,0 +1,22 @@
+int message_parser_46(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_66(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_61(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_41(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_42(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_51(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_70(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_71(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_50(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_4C(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_45(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_47(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_4D(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_52(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_53(struct peer_state *,char *, char *, char *,unsigned char *,int);
+int message_parser_54(struct peer_state *,char *, char *, char *,unsigned char *,int);
+#define message_parser_46 message_parser_41
+#define message_parser_66 message_parser_41
+#define message_parser_61 message_parser_41
+#define message_parser_51 message_parser_50
+#define message_parser_70 message_parser_50
+#define message_parser_71 message_parser_50
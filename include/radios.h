@@ -0,0 +1,18 @@
+#include "radio_type.h"
+
+#define RADIOTYPE_MIN 0
+#define RADIOTYPE_HF2020 0
+#define RADIOTYPE_HFBARRETT 1
+#define RADIOTYPE_HFCODAN 2
+#define RADIOTYPE_NORADIO 3
+#define RADIOTYPE_OUTERNET 4
+#define RADIOTYPE_RFD900 5
+#define RADIOTYPE_MAX 5
+
+#include "drivers/drv_hf2020.h"
+#include "drivers/drv_hfbarrett.h"
+#include "drivers/drv_hfcodan.h"
+#include "drivers/drv_null.h"
+#include "drivers/drv_outernet.h"
+#include "drivers/drv_rfd900.h"
+
@@ -0,0 +1,35 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __LBARD_RS_FRAME_H
+#define __LBARD_RS_FRAME_H
+
+// Frames protected with this many parity bytes are plain CCSDS (255,223)
+// codewords, as sent by all versions of LBARD.
+#define RS_FRAME_DEFAULT_PARITY 32
+#define RS_FRAME_MAX_PARITY 48
+// Longest frame, including parity and code marker
+#define RS_FRAME_MAX_BYTES 256
+
+int rs_frame_max_payload(int parity_bytes);
+int rs_frame_encode(unsigned char *frame,int payload_len,int parity_bytes);
+int rs_frame_decode(unsigned char *frame,int frame_len,
+		    int *payload_len,int *parity_bytes);
+
+#endif
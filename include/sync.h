@@ -8,7 +8,18 @@ Synchronize two sets of keys, which are likely to contain many common values
 */
 
 #define KEY_LEN 8
+
+/* Number of key bits consumed by each level of the tree, i.e., the tree has a
+   fan-out of 1<<PREFIX_STEP_BITS.  Wider trees are shallower, so fewer sync
+   records need to be exchanged to locate a difference, but each node summarises
+   more of the key space.  All nodes that sync with each other must be built
+   with the same value.  Use "make syncbench" to compare them. */
+#ifndef PREFIX_STEP_BITS
 #define PREFIX_STEP_BITS 1
+#endif
+#if (PREFIX_STEP_BITS!=1)&&(PREFIX_STEP_BITS!=2)&&(PREFIX_STEP_BITS!=4)
+#error "PREFIX_STEP_BITS must be 1, 2 or 4"
+#endif
 #define SYNC_MAX_RETRIES 1
 
 typedef struct {
@@ -31,6 +42,7 @@ void sync_free_peer_state(struct sync_state *state, void *peer_context);
 // if the key is already present, the context will be updated
 void sync_add_key(struct sync_state *state, const sync_key_t *key, void *key_context);
 int sync_key_exists(const struct sync_state *state, const sync_key_t *key);
+unsigned sync_key_count(const struct sync_state *state);
 int sync_has_transmit_queued(const struct sync_state *state);
 
 // ask for a message to be inserted into buff, returns packet length
@@ -0,0 +1,86 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+  Binary event trace.
+
+  Hot paths record fixed size events in a ring buffer instead of formatting
+  text.  Recording an event is a single atomic increment of the ring index
+  and a 64 byte copy, so it is cheap enough to leave on in production.  The
+  ring is drained to a file by a background thread (lbard "trace=<file>"),
+  and/or dumped on demand via http://localhost:<port>/trace.bin.
+  tracedecode turns either into text or CSV.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "LBTRACE"
+#define TRACE_FORMAT_VERSION 1
+
+// Must be a power of two
+#define TRACE_RING_RECORDS 16384
+#define TRACE_PAYLOAD_BYTES 24
+
+/*
+  Event types, with names for the three numeric arguments.  Only ever add to
+  the end of this list, so that old traces can still be decoded.
+*/
+#define TRACE_EVENTS \
+  TRACE_EVENT(TRACE_DROPPED,"dropped","records","","") \
+  TRACE_EVENT(TRACE_MESSAGE_RX,"message_rx","number","length","rssi") \
+  TRACE_EVENT(TRACE_FIELD_RX,"field_rx","type","offset","length") \
+  TRACE_EVENT(TRACE_PIECE_RX,"piece_rx","offset","bytes","version") \
+  TRACE_EVENT(TRACE_PIECE_STORED,"piece_stored","offset","bytes","new_bytes") \
+  TRACE_EVENT(TRACE_PIECE_HAVE,"piece_have","recent","bundle","version") \
+  TRACE_EVENT(TRACE_PIECE_BITMAPS,"piece_bitmaps","bundle","offset","bytes") \
+  TRACE_EVENT(TRACE_REPORT_FLUSH,"report_flush","length","remaining","") \
+  TRACE_EVENT(TRACE_REPORT_NO_SPACE,"report_no_space","length","remaining","") \
+  TRACE_EVENT(TRACE_TX_STUFFED,"tx_stuffed","bytes","mtu","peers") \
+  TRACE_EVENT(TRACE_FILTER_PACKET,"filter_packet","from","to","length") \
+  TRACE_EVENT(TRACE_FILTER_RULE,"filter_rule","rule","allow","") \
+  TRACE_EVENT(TRACE_FILTER_FRAGMENT,"filter_fragment","type","offset","length")
+
+#define TRACE_EVENT(id,name,a,b,c) id,
+enum trace_event_type { TRACE_EVENTS TRACE_EVENT_COUNT };
+#undef TRACE_EVENT
+
+// Flags for TRACE_PIECE_*
+#define TRACE_FLAG_MANIFEST 0x01
+#define TRACE_FLAG_END      0x02
+#define TRACE_FLAG_FOR_ME   0x04
+
+struct trace_record {
+  // Wall clock, so that traces from several programs can be merged
+  int64_t time_us;
+  // Low bits of the ring index + 1.  Zero while the record is being written.
+  uint32_t sequence;
+  uint16_t type;
+  uint8_t payload_len;
+  uint8_t flags;
+  int64_t a,b,c;
+  // Usually SID and/or BID prefixes
+  uint8_t payload[TRACE_PAYLOAD_BYTES];
+};
+
+struct trace_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+extern int trace_enabled;
+
+#define TRACE(type,flags,a,b,c,payload,len) \
+  do { if (trace_enabled) trace_event((type),(flags),(a),(b),(c),(payload),(len)); } while(0)
+
+void trace_event(int type,int flags,int64_t a,int64_t b,int64_t c,
+		 const void *payload,int len);
+int trace_enable(void);
+int trace_start_writer(char *filename);
+void trace_stop_writer(void);
+int trace_dump(FILE *f);
+const char *trace_event_name(int type);
+const char *trace_event_arg_name(int type,int arg);
+
+#endif
@@ -0,0 +1,4 @@
+#define VERSION_STRING "3c363313f2b83710bd794542e56dc4e2"
+#define GIT_VERSION_STRING "553f868821+DIRTY"
+#define GIT_BRANCH "master"
+#define BUILD_DATE "Sat Oct 17 05:19:02 UTC 2026"
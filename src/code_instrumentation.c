@@ -2,8 +2,9 @@
 
 #include <time.h>
 #include <stdio.h>
-#include <stdarg.h> 
-#include <string.h> 
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 
 #define BUFFER_SIZE 256
 
@@ -11,28 +12,129 @@ void code_instrumentation_log(const char* fileName, int line, const char* functi
 {
 	if (logLevel <= COMPILE_LOG_LEVEL)
 	{
-		time_t now = time(0);
-		struct tm* localtm = localtime(&now);
-
+		// asctime() is slow, so only format the time once per second
+		static time_t timeBufferTime = 0;
 		static char timeBuffer[BUFFER_SIZE];
-		strcpy(timeBuffer, asctime(localtm));
-		*(timeBuffer + strlen(timeBuffer) - 1) = '\0';
+		time_t now = time(0);
+		if (now != timeBufferTime)
+		{
+			struct tm* localtm = localtime(&now);
+			strcpy(timeBuffer, asctime(localtm));
+			*(timeBuffer + strlen(timeBuffer) - 1) = '\0';
+			timeBufferTime = now;
+		}
 
-		static char formatBuffer[BUFFER_SIZE];
-		snprintf(formatBuffer, BUFFER_SIZE, "%s: %s (%d) - %s:\n  %s\n", timeBuffer, fileName, line, functionName, msg);
+		fprintf(stderr, "%s: %s (%d) - %s:\n  ", timeBuffer, fileName, line, functionName);
 		va_list args;
 		va_start(args, msg);
-		vfprintf(stderr, formatBuffer, args);
+		vfprintf(stderr, msg, args);
+		va_end(args);
+		fputc('\n', stderr);
+	}
+}
+
+// Usage counts for every LOG_ENTRY/LOG_EXIT pair that has been reached.
+// If entries are not balanced with exits, we have a rogue return somewhere.
+
+static struct code_instrumentation_site *sites = NULL;
+static int siteCount = 0;
+
+// When the first site was registered, so that we can work out how fast the
+// cycle counter runs.
+static unsigned long long startTicks = 0;
+static struct timespec startTime;
+
+void code_instrumentation_register(struct code_instrumentation_site *site)
+{
+	if (! sites)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &startTime);
+		startTicks = code_instrumentation_ticks();
 	}
+	site->next = sites;
+	sites = site;
+	siteCount++;
+}
+
+static double code_instrumentation_ticks_per_usec(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double usecs = (now.tv_sec - startTime.tv_sec) * 1000000.0
+		+ (now.tv_nsec - startTime.tv_nsec) / 1000.0;
+	if (usecs < 1000)
+		// Too soon to tell
+		return 1000;
+	return (code_instrumentation_ticks() - startTicks) / usecs;
+#else
+	return 1000;
+#endif
 }
 
-// To do: store usage counts for functions. Also can allow us to find rogue mid-function 'return's: 
-// if an entry is not balanced with an exit, we have a rogue return somewhere
+static int code_instrumentation_compare(const void *a, const void *b)
+{
+	const struct code_instrumentation_site *sa = *(struct code_instrumentation_site **)a;
+	const struct code_instrumentation_site *sb = *(struct code_instrumentation_site **)b;
+	if (sa->totalTicks < sb->totalTicks) return 1;
+	if (sa->totalTicks > sb->totalTicks) return -1;
+	return 0;
+}
 
-void code_instrumentation_entry(const char* functionName)
+// Write a table of all sites, those with the most cumulative time first.
+int code_instrumentation_report(FILE *f, int html)
 {
+	if (! f)
+		return -1;
+
+	struct code_instrumentation_site **sorted = calloc(siteCount + 1, sizeof(*sorted));
+	if (! sorted)
+		return -1;
+	int count = 0;
+	for (struct code_instrumentation_site *site = sites; site && count < siteCount; site = site->next)
+		sorted[count++] = site;
+	qsort(sorted, count, sizeof(*sorted), code_instrumentation_compare);
+
+	double ticksPerUsec = code_instrumentation_ticks_per_usec();
+
+	if (html)
+		fprintf(f,
+			"<h2>Function profile</h2>\n"
+			"<table border=1 padding=2>\n"
+			"<tr><th>Function</th><th>File</th><th>Calls</th><th>Unbalanced</th>"
+			"<th>Total</th><th>Mean</th><th>Max</th></tr>\n");
+	else
+		fprintf(f, "%-40s %-32s %10s %10s %12s %10s %10s\n",
+			"Function", "File", "Calls", "Unbalanced", "Total(us)", "Mean(us)", "Max(us)");
+
+	for (int i = 0; i < count; i++)
+	{
+		struct code_instrumentation_site *site = sorted[i];
+		double total = site->totalTicks / ticksPerUsec;
+		double mean = site->exits ? total / site->exits : 0;
+		double max = site->maxTicks / ticksPerUsec;
+		if (html)
+			fprintf(f,
+				"<tr><td>%s</td><td>%s</td><td>%llu</td><td>%llu</td>"
+				"<td>%.0f us</td><td>%.1f us</td><td>%.1f us</td></tr>\n",
+				site->functionName, site->fileName, site->entries,
+				site->entries - site->exits, total, mean, max);
+		else
+			fprintf(f, "%-40s %-32s %10llu %10llu %12.0f %10.1f %10.1f\n",
+				site->functionName, site->fileName, site->entries,
+				site->entries - site->exits, total, mean, max);
+	}
+
+	if (html)
+		fprintf(f, "</table>\n");
+
+	free(sorted);
+	return 0;
 }
 
-void code_instrumentation_exit(const char* functionName)
+// For atexit()
+void code_instrumentation_report_at_exit(void)
 {
+	fprintf(stderr, "Function profile:\n");
+	code_instrumentation_report(stderr, 0);
 }
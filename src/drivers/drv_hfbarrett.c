@@ -39,6 +39,18 @@ int ale_command_state=-1;
 //  1: executed
 //  2: understood by the radio, but nothing has happened
 
+// Station we are about to call, once barrett_call_time is reached
+static int barrett_call_station=-1;
+static long long barrett_call_time=0;
+// Deadline for the radio to drop the link after we asked it to, and when to
+// next ask it for the link table while we wait.
+static long long barrett_abort_deadline=0;
+static long long barrett_next_probe=0;
+// Don't do anything until this time, e.g., while the radio reboots
+static long long barrett_hold_until=0;
+
+static int hfbarrett_tx_service(int serialfd);
+
 int hfbarrett_my_turn_to_send(void)
 {
   if (hfbarrett_ready_test())
@@ -105,9 +117,11 @@ int hfbarrett_initialise(int serialfd)
 int hfbarrett_serviceloop(int serialfd)
 {
 	char cmd[1024];
-	unsigned char buffer[8192];
-  int count;
-  int time_to_abort;
+
+  // Advance any packet that is being sent
+  hfbarrett_tx_service(serialfd);
+
+  if (gettime_ms()<barrett_hold_until) return 0;
 
   switch(hf_state) {
 
@@ -127,45 +141,48 @@ int hfbarrett_serviceloop(int serialfd)
     // If the radio is not receiving a message
     // call-out time, then pick a hf station to call
 
-    if ((ale_inprogress==0)&&(hf_link_partner==-1)&&(hf_station_count>0)&&(time(0)>=hf_next_call_time)) {
+    if (barrett_call_station>-1) {
+      // Waiting out the random delay before placing a call
+      if (gettime_ms()<barrett_call_time) break;
+      int next_station=barrett_call_station;
+      barrett_call_station=-1;
+
+      // The AXLINK commmand creates a link which is unusable. So we connect sending the message CONNECTED.
+      // A link will be established after the mesage is received.
+      // XXX - But AXNMSG will make the receiving side alarm, so AXLINK is really better.
+      // Also, AXLINK is probably the more appropriate to use, when a clover or rapidM modem is fitted, as we
+      // just want the ALE side to establish the call.
+      init_buffer((unsigned char*)cmd, 1024);
+      // snprintf(cmd,1024,"AXNMSG%s%sCONNECTING\r\n", hf_stations[next_station].index, self_hf_station.index);
+      snprintf(cmd,1024,"AXLINK%s%s\r\n", hf_stations[next_station].index, self_hf_station.index);
+      //printf("sending '%s' to try to make ALE call.\n",cmd);
+
+      // Recheck that, after the random delay, the radio is still idle
+      // before sending
+      if ((ale_inprogress==0)&&(hf_link_partner==-1)){
+	write(serialfd,cmd,strlen(cmd));
+
+	hf_state = HF_CALLREQUESTED;
+
+	fprintf(stderr,"HF: Attempting to call station #%d '%s'\n",
+		next_station,hf_stations[next_station].name);
+	hf_next_call_time=time(0)+ALElink_establishment_time;
+      }else{
+	printf("The radio is not idle. The call request is not sent.\n");
+      }
+    }
+    else if ((ale_inprogress==0)&&(hf_link_partner==-1)&&(hf_station_count>0)&&(time(0)>=hf_next_call_time)) {
       int next_station = hf_next_station_to_call();
       if (next_station>-1) {
 			  // Ensure we have a clear line for new command (we were getting some
 			  // errors here intermittantly).				
 			  write(serialfd,"\r\n",2);
 
-			  // The AXLINK commmand creates a link which is unusable. So we connect sending the message CONNECTED.
-			  // A link will be established after the mesage is received.
-			  // XXX - But AXNMSG will make the receiving side alarm, so AXLINK is really better.
-			  // Also, AXLINK is probably the more appropriate to use, when a clover or rapidM modem is fitted, as we
-			  // just want the ALE side to establish the call.
-			  init_buffer((unsigned char*)cmd, 1024);
-			  // snprintf(cmd,1024,"AXNMSG%s%sCONNECTING\r\n", hf_stations[next_station].index, self_hf_station.index);
-			  snprintf(cmd,1024,"AXLINK%s%s\r\n", hf_stations[next_station].index, self_hf_station.index);
-			  //printf("sending '%s' to try to make ALE call.\n",cmd);			  
-			  
 	      // We add a random 0 - 4 seconds to avoid lock-step failure modes,
         // e.g., where both radios keep trying to talk to each other at
         // the same time.
-			  sleep(random()%4);
-			  
-			  //Update the radio replies before sending cmd
-				count = read_nonblock(serialfd,buffer,8192);
-		  	if (count) hfbarrett_receive_bytes(buffer,count);
-			  
-			  // Recheck that, after the sleep(random), the radio is still idle
-			  // before sending
-			  if (ale_inprogress==0){
-			    write(serialfd,cmd,strlen(cmd));
-
-			    hf_state = HF_CALLREQUESTED;
-					
-			    fprintf(stderr,"HF: Attempting to call station #%d '%s'\n",
-				    next_station,hf_stations[next_station].name);
-			    hf_next_call_time=time(0)+ALElink_establishment_time;
-        }else{
-          printf("The radio is not idle. The call request is not sent.\n");
-        }
+	barrett_call_station=next_station;
+	barrett_call_time=gettime_ms()+(random()%4)*1000;
 		  }
     }
     else if (hf_link_partner>-1)
@@ -240,35 +257,34 @@ int hfbarrett_serviceloop(int serialfd)
     // As LBARD established only one ALE link,
     // it is the same thing as saying: abroting ALE link
     
-    printf("Aborting the current established ALE link\n");
-    while (hf_link_partner>-1){
-      time_to_abort=0;
-      ale_command_state=0;
-      write_all(serialfd,"AXTLNK99\r\n",10);
-      while(ale_command_state==0){
-        sleep(1); //once a second
-        write_all(serialfd,"AILTBL\r\n",8);
-			  init_buffer(buffer, 8192);
-			  count = read_nonblock(serialfd,buffer,8192);
-			  
-			  // Looking at the radio responses and process line(s):
-			  if (count) hfbarrett_receive_bytes(buffer,count);
-        
-			  if (time_to_abort>=20){
-			    ale_command_state=2; //command executed but nothing has happened
-			    printf("Aborting failed. Retrying to abort again.\n");
-			  }
-			  time_to_abort++;
-		  }
-	  }
+    if (hf_link_partner>-1) {
+      long long now=gettime_ms();
+      if ((!barrett_abort_deadline)||(now>=barrett_abort_deadline)) {
+	if (barrett_abort_deadline)
+	  printf("Aborting failed. Retrying to abort again.\n");
+	else
+	  printf("Aborting the current established ALE link\n");
+	ale_command_state=0;
+	write_all(serialfd,"AXTLNK99\r\n",10);
+	barrett_abort_deadline=now+20000;
+	barrett_next_probe=now+1000;
+      } else if (now>=barrett_next_probe) {
+	// Ask for the link table once a second, so that we see when the link
+	// has gone
+	write_all(serialfd,"AILTBL\r\n",8);
+	barrett_next_probe=now+1000;
+      }
+      break;
+    }
+    barrett_abort_deadline=0;
 	  hf_state=HF_DISCONNECTED;
 	  printf("Let time to the other radio to terminate\n");
-		sleep(10); //Let time to the other size to terminate
+    barrett_hold_until=gettime_ms()+10000;
     
     break;
 
 	case HF_ALESENDING: //6
-    // This state is managed in the hfbarret_send_packet function
+    // Handled by hfbarrett_tx_service() above
 		break;
 
   case HF_RADIOCONFUSED: //7
@@ -277,7 +293,8 @@ int hfbarrett_serviceloop(int serialfd)
     printf("Rebooting the radio.\n");
     write(serialfd,"*",1);
     hf_state=HF_DISCONNECTED;
-    sleep(10);
+    // Give it time to come back up
+    barrett_hold_until=gettime_ms()+10000;
     
     break;
 
@@ -289,6 +306,8 @@ int hfbarrett_serviceloop(int serialfd)
 	if (previous_state!=hf_state){
 		fprintf(stderr,"\nBarrett radio changed to state 0x%04x\n",hf_state);
 		previous_state=hf_state;
+		// Forget about any call we were about to make
+		barrett_call_station=-1;
   }
   return 0;
 }
@@ -339,10 +358,13 @@ int hfbarrett_process_line(char *l)
 		}
 	}
 
-  if (sscanf(l,"AIAMDM%s",tmp)==1) {
-    fprintf(stderr,"Barrett radio saw ALE AMD message '%s'\n",&tmp[6]);
+  // ASCII-64 encoded fragments can contain spaces, so take the whole rest of
+  // the line, rather than using sscanf()
+  if ((!strncmp(l,"AIAMDM",6))&&(strlen(l)>12)) {
+    strcpy(tmp,&l[12]);
+    fprintf(stderr,"Barrett radio saw ALE AMD message '%s'\n",tmp);
     message_failure=0;
-    hf_process_fragment(&tmp[6]);
+    hf_process_fragment(tmp);
   }
 
   if (sscanf(l, "AISTAT%s", tmp)==1){
@@ -460,6 +482,186 @@ int hfbarrett_receive_bytes(unsigned char *bytes,int count)
   return 0;
 }
 
+/*
+  Sending a packet takes several ALE messages, each of which can take the radio
+  tens of seconds to get onto the air, and the radio also needs time to settle
+  between them.  Rather than waiting for all of that in hfbarrett_send_packet(),
+  the packet is queued, and each fragment is walked through the following
+  states by hfbarrett_serviceloop(), with each wait kept as a deadline, so that
+  the rest of LBARD keeps running in the meantime.  The radio's responses are
+  fed to us by the main loop via hfbarrett_receive_bytes() as they arrive.
+*/
+#define BARRETT_TX_IDLE 0
+#define BARRETT_TX_WAIT_XON 1    // Waiting for the radio to accept commands
+#define BARRETT_TX_BACKOFF 2     // Random delay before issuing AXNMSG
+#define BARRETT_TX_WAIT_SENT 3   // Waiting for AIMESS1 to say it was sent
+#define BARRETT_TX_SETTLE 4      // Letting the radio settle after a fragment
+
+// How long the whole packet, and each fragment, may take before we give up.
+#define BARRETT_TX_PACKET_TIMEOUT_MS 200000
+#define BARRETT_TX_FRAGMENT_TIMEOUT_MS 60000
+// How often we look at the radio's state while waiting for a fragment to go.
+#define BARRETT_TX_POLL_INTERVAL_MS 1000
+#define BARRETT_TX_SETTLE_MS 3000
+#define BARRETT_TX_XOFF_RETRY_MS 1000
+
+#define BARRETT_FRAGMENT_BYTES 43
+#define BARRETT_MAX_FRAGMENTS 6
+
+struct barrett_tx {
+  int state;
+  unsigned char packet[BARRETT_FRAGMENT_BYTES*BARRETT_MAX_FRAGMENTS];
+  int len;
+  // Use ASCII-64 rather than hex for this packet's fragments
+  int dense;
+  int pieces;
+  int fragment;
+  // Set once the radio has confirmed the current fragment as sent
+  int fragment_sent;
+  char message[4096];
+
+  long long packet_deadline;
+  long long fragment_deadline;
+  // When to next do something in the current state
+  long long next_action;
+};
+
+static struct barrett_tx barrett_tx={BARRETT_TX_IDLE};
+
+static int hfbarrett_tx_finish(int next_hf_state,int sent)
+{
+  barrett_tx.state=BARRETT_TX_IDLE;
+  hf_message_sequence_number++;
+  // hfbarrett_serviceloop() gives the other side a turn when it sees us go
+  // from HF_ALESENDING back to HF_ALELINK.
+  previous_state=HF_ALESENDING;
+  hf_state=next_hf_state;
+  if (sent) {
+    char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
+    if (timestr[0]) timestr[strlen(timestr)-1]=0;
+    fprintf(stderr,"  [%s] Finished sending packet, next in %ld seconds.\n",
+	    timestr,hf_next_packet_time-time(0));
+  }
+  return 0;
+}
+
+static int hfbarrett_tx_prepare_fragment(void)
+{
+  char fragment[1024];
+
+  hf_encode_fragment(barrett_tx.packet,barrett_tx.len,
+		     barrett_tx.fragment,barrett_tx.pieces,
+		     barrett_tx.dense,fragment);
+
+  snprintf(barrett_tx.message,sizeof(barrett_tx.message),"AXNMSG%s%02d%s\r\n",
+	   barrett_link_partner_string,
+	   (int)strlen(fragment),fragment);
+
+  barrett_tx.fragment_sent=0;
+  barrett_tx.state=BARRETT_TX_WAIT_XON;
+  return 0;
+}
+
+static int hfbarrett_tx_service(int serialfd)
+{
+  long long now=gettime_ms();
+
+  if (barrett_tx.state==BARRETT_TX_IDLE) return 0;
+
+  // Something else, e.g., the link dropping, has taken the radio out of
+  // sending mode, so abandon the packet.
+  if (hf_state!=HF_ALESENDING) {
+    printf("Radio left ALESENDING state. Abandoning packet.\n");
+    barrett_tx.state=BARRETT_TX_IDLE;
+    hf_message_sequence_number++;
+    return 0;
+  }
+
+  if (now<barrett_tx.next_action) return 0;
+
+  switch(barrett_tx.state) {
+  case BARRETT_TX_WAIT_XON:
+    if (now>barrett_tx.packet_deadline) {
+      fprintf(stderr,"Failed to send packet in reasonable amount of time. Aborting.\n");
+      return hfbarrett_tx_finish(HF_ALELINK,0);
+    }
+    if (pause_tx!=0x011) {
+      printf("\nThe radio is not ready to receive a command (XOFF)\n ");
+      // Let time to the radio to empty its internal buffer
+      barrett_tx.next_action=now+BARRETT_TX_XOFF_RETRY_MS;
+      break;
+    }
+    printf("Atempting to send one fragment: %s", barrett_tx.message);
+    // We add a random 0 - 4 seconds to avoid lock-step failure modes,
+    // e.g., where both radios keep trying to talk to each other at
+    // the same time.
+    barrett_tx.state=BARRETT_TX_BACKOFF;
+    barrett_tx.next_action=now+(random()%4)*1000;
+    break;
+
+  case BARRETT_TX_BACKOFF:
+    // Recheck that, after the random delay, the radio is still idle
+    // before sending
+    if (ale_inprogress==0)
+      write_all(serialfd,barrett_tx.message,strlen(barrett_tx.message));
+    else if (ale_inprogress==2) {
+      printf("The radio is receiving a call. Leaving ALESENDING state to ALELINK.\n");
+      write_all(serialfd,"AXABORT\r\n",9);
+      return hfbarrett_tx_finish(HF_ALELINK,0);
+    }
+    // Look at the ALE indications sent by the radio after the command to send
+    // a message was sent until we know if the message has been sent or if it
+    // hasn't
+    ale_command_state=0;
+    barrett_tx.state=BARRETT_TX_WAIT_SENT;
+    barrett_tx.fragment_deadline=now+BARRETT_TX_FRAGMENT_TIMEOUT_MS;
+    barrett_tx.next_action=now+BARRETT_TX_POLL_INTERVAL_MS;
+    break;
+
+  case BARRETT_TX_WAIT_SENT:
+    if (ale_command_state==1) {
+      char timestr[100]; time_t t=time(0); ctime_r(&t,timestr);
+      if (timestr[0]) timestr[strlen(timestr)-1]=0;
+      fprintf(stderr,"  [%s] Sent %s",timestr,barrett_tx.message);
+      barrett_tx.fragment_sent=1;
+    } else if (now>barrett_tx.fragment_deadline) {
+      printf("Something wrong occured with the radio.\n");
+      return hfbarrett_tx_finish(HF_RADIOCONFUSED,0);
+    } else if (ale_inprogress==0) {
+      printf("Radio turned into idle before sending message. Aborting message and try again.\n");
+      write_all(serialfd,"AXABORT\r\n",9);
+      ale_command_state=2;
+    } else if (ale_inprogress==2) {
+      ale_command_state=2;
+      printf("While trying to send a message, another message is received. Abort sending message and pause to listen to this message\n");
+      write_all(serialfd,"AXABORT\r\n",9);
+      return hfbarrett_tx_finish(HF_ALELINK,0);
+    } else {
+      // Any ALE send will take a while, so check again in a second
+      barrett_tx.next_action=now+BARRETT_TX_POLL_INTERVAL_MS;
+      break;
+    }
+    // Let time to the radio to be ready for the next step
+    barrett_tx.state=BARRETT_TX_SETTLE;
+    barrett_tx.next_action=now+BARRETT_TX_SETTLE_MS;
+    break;
+
+  case BARRETT_TX_SETTLE:
+    if (!barrett_tx.fragment_sent) {
+      // Try the same fragment again
+      barrett_tx.state=BARRETT_TX_WAIT_XON;
+      break;
+    }
+    barrett_tx.fragment++;
+    if (barrett_tx.fragment>=barrett_tx.pieces)
+      // The whole message has been sent (all the fragments)
+      return hfbarrett_tx_finish(HF_ALELINK,1);
+    hfbarrett_tx_prepare_fragment();
+    break;
+  }
+  return 0;
+}
+
 int hfbarrett_send_packet(int serialfd,unsigned char *out, int len)
 {
   // We can send upto 90 ALE encoded bytes.  ALE bytes are 6-bit, so we can send
@@ -470,154 +672,34 @@ int hfbarrett_send_packet(int serialfd,unsigned char *out, int len)
   // We can use the first
   // two bytes for fragmentation, since we would still like to support 256-byte
   // messages.  This means we need upto 4 pieces for each message.
-  char message[8192];
-  char fragment[8192];
-
-  int i;
-
-  time_t absolute_timeout=time(0)+200;
 
+  // The packet is only queued here: hfbarrett_serviceloop() does the sending.
   if (!hfbarrett_ready_test()) return -1;
-  
+  if (barrett_tx.state!=BARRETT_TX_IDLE) return -1;
+  if ((len<1)||(len>sizeof(barrett_tx.packet))) {
+    fprintf(stderr,"Packet of %d bytes is too long to send via Barrett HF\n",len);
+    return -1;
+  }
+
+  bcopy(out,barrett_tx.packet,len);
+  barrett_tx.len=len;
   // How many pieces to send (1-6)
   // This means we have 36 possible fragment indications, if we wish to imply the
   // number of fragments in the fragment counter.
-  int pieces=len/43; if (len%43) pieces++;
-  
-  previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
+  barrett_tx.dense=hf_fragment_dense_ok();
+  barrett_tx.pieces=hf_fragment_count(len,barrett_tx.dense);
+  barrett_tx.fragment=0;
+  barrett_tx.packet_deadline=gettime_ms()+BARRETT_TX_PACKET_TIMEOUT_MS;
+  barrett_tx.next_action=0;
+  hfbarrett_tx_prepare_fragment();
+
   hf_state=HF_ALESENDING;
   
-  fprintf(stderr,"Sending message of %d bytes via Barratt HF\n",len);
-  for(i=0;i<len;i+=43) {
-		//printf("Nb of loops=%d\n", i);
-    // Indicate radio type in fragment header
-    fragment[0]=0x41+(hf_message_sequence_number&0x07);
-    fragment[1]=0x30+(i/43);
-    fragment[2]=0x30+pieces;
-    int frag_len=43; if (len-i<43) frag_len=len-i;
-    hex_encode(&out[i],&fragment[3],frag_len,radio_get_type());
-
-    unsigned char buffer[8192];
-
-    int count;
-
-    usleep(100000);
-    count = read_nonblock(serialfd,buffer,8192);
-
-    //if (count) dump_bytes(stderr,"presend",buffer,count);
-    if (count) hfbarrett_receive_bytes(buffer,count);
-    
-    snprintf(message,8192,"AXNMSG%s%02d%s\r\n",
-	     barrett_link_partner_string,
-	     (int)strlen(fragment),fragment);
-
-		int time_to_send_frag;
-		ale_command_state=0;
-    while (ale_command_state!=1) {
-      if (time(0)>absolute_timeout) {
-	fprintf(stderr,"Failed to send packet in reasonable amount of time. Aborting.\n");
-	hf_message_sequence_number++;
-	previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
-	hf_state=HF_ALELINK;
-	return -1;
-      }
-      
-      // Check if there if we reveived an XON from the radio
-			count = read_nonblock(serialfd,buffer,8192);
-			if (count) hfbarrett_receive_bytes(buffer,count);
-			if (pause_tx==0x011){
-			  
-			  //Send command to send a message
-		    printf("Atempting to send one fragment: %s", message);
-
-	      // We add a random 0 - 4 seconds to avoid lock-step failure modes,
-        // e.g., where both radios keep trying to talk to each other at
-        // the same time.
-			  sleep(random()%4);
-			  
-			  //Update the radio replies before sending cmd
-				count = read_nonblock(serialfd,buffer,8192);
-		  	if (count) hfbarrett_receive_bytes(buffer,count);
-			  
-			  // Recheck that, after the sleep(random), the radio is still idle
-			  // before sending
-			  if (ale_inprogress==0)
-  		    write_all(serialfd,message,strlen(message));
-		    else if (ale_inprogress==2){
-		      printf("The radio is receiving a call. Leaving ALESENDING state to ALELINK.\n");
-		      previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
-		      hf_state=HF_ALELINK;
-		      write_all(serialfd,"AXABORT\r\n",9);
-		      //hf_radio_pause_for_turnaround();
-		      return -1;
-	      }
-
-        count=-1;
-
-				// Look at the ALE indications sent byt the radio after the command to send 
-				// a message was sent until we know if the message has been sent or if it hasn't
-				time_to_send_frag=0;
-				ale_command_state=0;
-				while(ale_command_state==0){
-				
-				  if(time_to_send_frag>60){
-				    printf("Something wrong occured with the radio.\n");
-				    previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
-				    hf_state=HF_RADIOCONFUSED; 
-				    return -1; 
-				  }
-				
-				  //printf("Sleeping for upto %d more seconds while waiting for message to TX.\n",ale_command_state);
-					// Any ALE send will take a while, check the radio's responses every second
-					sleep(1);
-
-					init_buffer(buffer, 8192);
-					count = read_nonblock(serialfd,buffer,8192);
-					//if (count) dump_bytes(stderr,"received",buffer,count);
-					if (count) hfbarrett_receive_bytes(buffer,count);
-					//printf("buffer is: %s\n", buffer);
-					//if (strstr((const char *)buffer,"AIMESS1")){
-					if (ale_command_state==1){
-						char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
-		 				if (timestr[0]) timestr[strlen(timestr)-1]=0;
-						fprintf(stderr,"  [%s] Sent %s",timestr,message);
-					}
-					else if (ale_inprogress==0){
-					  printf("Radio turned into idle before sending message. Aborting message and try again.\n");
-						write_all(serialfd,"AXABORT\r\n",9);
-						ale_command_state=2;
-					}
-					else if (ale_inprogress==2){
-		        ale_command_state=2;
-		        printf("While trying to send a message, another message is received. Abort sending message and pause to listen to this message\n");
-		        write_all(serialfd,"AXABORT\r\n",9);
-		        previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
-		        hf_state=HF_ALELINK;
-		        //hf_radio_pause_for_turnaround();
-		        return -1;
-	        }
-	                
-					time_to_send_frag++;
-				}        
-			
-      sleep(3); // Let time to the radio to be ready for the next step
+  fprintf(stderr,"Sending message of %d bytes via Barratt HF in %d %s fragments\n",
+	  len,barrett_tx.pieces,barrett_tx.dense?"ASCII-64":"hex");
 
-  
-    	} else{
-				printf("\nThe radio is not ready to receive a command (XOFF)\n ");				
-				sleep(1);	// Let time to the radio to empty its internal buffer
-			}
-		}
-  }
-  // The whole message has been sent (all the fragments)
-  //hf_radio_pause_for_turnaround(); //Done in the service loop
-  previous_state=hf_state; //necessary because LBARD will nor run the service loop while being in HF_ALESENDING state
-  hf_state=HF_ALELINK;
-  hf_message_sequence_number++;
-  char timestr[100]; time_t now=time(0); ctime_r(&now,timestr);
-  if (timestr[0]) timestr[strlen(timestr)-1]=0;
-  fprintf(stderr,"  [%s] Finished sending packet, next in %ld seconds.\n",
-	  timestr,hf_next_packet_time-time(0));
+  // Get the first fragment on its way straight away
+  hfbarrett_tx_service(serialfd);
   
   return 0;
 }
@@ -136,6 +136,7 @@ int hfcodan_serviceloop(int serialfd)
 int hfcodan_process_line(char *l)
 {
   int channel,caller,callee,day,month,hour,minute;
+  int fragment_start=0;
   
   //  fprintf(stderr,"Codan radio (state 0x%04x) says: %s\n",hf_state,l);
   if (hf_state&HF_COMMANDISSUED) {
@@ -153,9 +154,14 @@ int hfcodan_process_line(char *l)
     // Incoming ALE message -- so don't try sending anything for a little while
     hf_radio_pause_for_turnaround();
   } else if (!strcmp(l,"AMD CALL FINISHED")) ale_inprogress=0;
-  else if (sscanf(l,"AMD-CALL: %d, %d, %d, %d/%d %d:%d, \"%[^\"]\"",
-		  &channel,&caller,&callee,&day,&month,&hour,&minute,fragment)==8) {
-    // Saw a fragment
+  else if ((sscanf(l,"AMD-CALL: %d, %d, %d, %d/%d %d:%d, \"%n",
+		   &channel,&caller,&callee,&day,&month,&hour,&minute,&fragment_start)==7)
+	   &&fragment_start&&strrchr(&l[fragment_start],'"')) {
+    // Saw a fragment.  ASCII-64 encoded fragments can contain quotes, so the
+    // fragment runs to the last quote on the line.
+    int fragment_len=strrchr(&l[fragment_start],'"')-&l[fragment_start];
+    bcopy(&l[fragment_start],fragment,fragment_len);
+    fragment[fragment_len]=0;
     hf_process_fragment(fragment);
     // We must also by definition be connected
     hf_state=HF_ALELINK;
@@ -241,16 +247,19 @@ int hfcodan_send_packet(int serialfd,unsigned char *out, int len)
   // How many pieces to send (1-6)
   // This means we have 36 possible fragment indications, if we wish to imply the
   // number of fragments in the fragment counter.
-  int pieces=len/43; if (len%43) pieces++;
+  // Escaped spaces can make ASCII-64 fragments too long, in which case we
+  // send this packet as hex.
+  int dense=hf_fragment_dense_ok()&&hf_fragment_dense_fits(out,len);
+  int pieces=hf_fragment_count(len,dense);
+  if (pieces<0) {
+    fprintf(stderr,"Packet of %d bytes is too long to send via Codan HF\n",len);
+    return -1;
+  }
   
-  fprintf(stderr,"Sending message of %d bytes via Codan HF\n",len);
-  for(i=0;i<len;i+=43) {
-    // Indicate radio type in fragment header
-    fragment[0]=0x30+(hf_message_sequence_number&0x07);
-    fragment[1]=0x30+(i/43);
-    fragment[2]=0x30+pieces;
-    int frag_len=43; if (len-i<43) frag_len=len-i;
-    hex_encode(&out[i],&fragment[3],frag_len,radio_get_type());
+  fprintf(stderr,"Sending message of %d bytes via Codan HF in %d %s fragments\n",
+	  len,pieces,dense?"ASCII-64":"hex");
+  for(i=0;i<pieces;i++) {
+    hf_encode_fragment(out,len,i,pieces,dense,fragment);
     
     snprintf(message,8192,"amd %s\r\n",fragment);
     write_all(serialfd,message,strlen(message));
@@ -58,9 +58,18 @@ long long congestion_update_time=0;
 
 #define MAX_PACKET_SIZE 255
 
-// This need only be the maximum control header size + maximum packet size
-#define RADIO_RXBUFFER_SIZE 64+MAX_PACKET_SIZE
-unsigned char radio_rx_buffer[RADIO_RXBUFFER_SIZE];
+/*
+  Received bytes go into a ring buffer that is stored twice over, so that the
+  most recent RADIO_RX_RING_SIZE bytes are always contiguous in memory, ending
+  just before the pointer returned by rfd900_rx_append().  This lets us check
+  for frame trailers and hand whole packets to saw_packet() without moving or
+  copying anything.
+  The ring need only hold the maximum control header size + maximum packet
+  size, but must be a power of two.
+*/
+#define RADIO_RX_RING_SIZE 512
+unsigned char radio_rx_ring[RADIO_RX_RING_SIZE*2];
+unsigned int radio_rx_ring_head=0;
 
 int last_rx_rssi=-1;
 unsigned char *packet_data=NULL;
@@ -80,6 +89,11 @@ extern char *prefix;
 
 int target_transmissions_per_4seconds=TARGET_TRANSMISSIONS_PER_4SECONDS;
 
+// Outcome of the last congestion update, for the /metrics page
+double congestion_ratio=0;
+int congestion_transmissions_seen=0;
+int congestion_transmissions_byus=0;
+
 int rfd900_serviceloop(int serialfd)
 {
   // Deal with clocks running backwards sometimes
@@ -174,6 +188,9 @@ int rfd900_serviceloop(int serialfd)
       }
     }
     
+    congestion_ratio=ratio;
+    congestion_transmissions_seen=radio_transmissions_seen;
+    congestion_transmissions_byus=radio_transmissions_byus;
     radio_transmissions_seen=0;
     radio_transmissions_byus=0;
   }
@@ -181,13 +198,26 @@ int rfd900_serviceloop(int serialfd)
   return 0;
 }
 
+static unsigned char *rfd900_rx_append(unsigned char byte)
+{
+  unsigned int pos=radio_rx_ring_head&(RADIO_RX_RING_SIZE-1);
+  radio_rx_ring[pos]=byte;
+  radio_rx_ring[pos+RADIO_RX_RING_SIZE]=byte;
+  radio_rx_ring_head++;
+  return &radio_rx_ring[pos+RADIO_RX_RING_SIZE+1];
+}
+
 int rfd900_receive_bytes(unsigned char *bytes,int count)
 {
   int i;
   for(i=0;i<count;i++) {
-      
-    bcopy(&radio_rx_buffer[1],&radio_rx_buffer[0],RADIO_RXBUFFER_SIZE-1);
-    radio_rx_buffer[RADIO_RXBUFFER_SIZE-1]=bytes[i];
+
+    // rx[-1] is the byte just received, rx[-2] the one before it, and so on.
+    unsigned char *rx=rfd900_rx_append(bytes[i]);
+
+    // Each kind of frame trailer ends in a distinctive byte, so only look
+    // further back if this byte could end one.
+    if ((rx[-1]!=0xa4)&&(rx[-1]!=0xdd)&&(rx[-1]!=0x55)) continue;
 
     /*
       The revised RFD900+ firmware for the Mesh Extender 2.0 sends a little
@@ -204,7 +234,7 @@ int rfd900_receive_bytes(unsigned char *bytes,int count)
       Postamble - 4 bytes 0xf0, 0x9f, 0x93, 0xa4
     */
 #define REPORT_LENGTH (4+4+2+6+2+4)
-    int template[REPORT_LENGTH]={
+    static const int template[REPORT_LENGTH]={
       0xf0, 0x9f, 0x93, 0xa5,
       -1,-1,-1,-1,
       0xc2,0xb0,
@@ -212,28 +242,28 @@ int rfd900_receive_bytes(unsigned char *bytes,int count)
       -1,-1,
       0xf0,0x9f,0x93,0xa4};
     int isReport=1;
-    for(int i=0;i<REPORT_LENGTH;i++)
+    for(int i=REPORT_LENGTH-1;i>=0;i--)
       if (template[i]!=-1)
-	if (radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+i]!=template[i])
+	if (rx[-REPORT_LENGTH+i]!=template[i])
 	  { isReport=0;
 	    break; }
     if (isReport) {
-      char tempstring[5]={radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+0],
-			  radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+1],
-			  radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+2],
-			  radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+3],
+      char tempstring[5]={rx[-REPORT_LENGTH+4+0],
+			  rx[-REPORT_LENGTH+4+1],
+			  rx[-REPORT_LENGTH+4+2],
+			  rx[-REPORT_LENGTH+4+3],
 			  0};
       radio_last_heartbeat_time=gettime_ms();
       radio_temperature=atoi(tempstring);
       printf("Radio temperature = %dC, frequency band = %c%c\n",
 	     radio_temperature,
-	     radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+4+2+6+0],
-	     radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+4+2+6+1]);
+	     rx[-REPORT_LENGTH+4+4+2+6+0],
+	     rx[-REPORT_LENGTH+4+4+2+6+1]);
       if (debug_gpio) {
 	printf("GPIO ADC values = [");
 	for(int j=0;j<6;j++) {
 	  printf("%c",
-		 radio_rx_buffer[RADIO_RXBUFFER_SIZE-REPORT_LENGTH+4+4+2+j]);
+		 rx[-REPORT_LENGTH+4+4+2+j]);
 	}
 	printf("]  Radio TX interval = %dms, TX seen = %d, TX us = %d\n",
 	       message_update_interval,
@@ -241,9 +271,9 @@ int rfd900_receive_bytes(unsigned char *bytes,int count)
 	       radio_transmissions_byus);
       }
       
-    } else if ((radio_rx_buffer[RADIO_RXBUFFER_SIZE-1]==0xdd)
-	       &&(radio_rx_buffer[RADIO_RXBUFFER_SIZE-8]==0xec)
-	       &&(radio_rx_buffer[RADIO_RXBUFFER_SIZE-9]==0xce))
+    } else if ((rx[-1]==0xdd)
+	       &&(rx[-8]==0xec)
+	       &&(rx[-9]==0xce))
       // Support old-style RFD900 Mesh Extender firmware reports
       {
 	if (debug_gpio) {
@@ -251,28 +281,28 @@ int rfd900_receive_bytes(unsigned char *bytes,int count)
 	  for(int j=0;j<6;j++) {
 	    printf("%s0x%02x",
 		   j?",":"",
-		   radio_rx_buffer[RADIO_RXBUFFER_SIZE-7+j]);
+		   rx[-7+j]);
 	  }
 	  printf(".  Radio TX interval = %dms, TX seen = %d, TX us = %d\n",
 		 message_update_interval,
 		 radio_transmissions_seen,
 		 radio_transmissions_byus);
 	}
-      } else if ((radio_rx_buffer[RADIO_RXBUFFER_SIZE-1]==0x55)
-		 &&(radio_rx_buffer[RADIO_RXBUFFER_SIZE-8]==0x55)
-		 &&(radio_rx_buffer[RADIO_RXBUFFER_SIZE-9]==0xaa))
+      } else if ((rx[-1]==0x55)
+		 &&(rx[-8]==0x55)
+		 &&(rx[-9]==0xaa))
       {
 	// Found RFD900 CSMA envelope: packet was immediately before this
-	int packet_bytes=radio_rx_buffer[RADIO_RXBUFFER_SIZE-4];
+	int packet_bytes=rx[-4];
 	radio_last_heartbeat_time=gettime_ms();
-	radio_temperature=radio_rx_buffer[RADIO_RXBUFFER_SIZE-5];
-	last_rx_rssi=radio_rx_buffer[RADIO_RXBUFFER_SIZE-7];
+	radio_temperature=rx[-5];
+	last_rx_rssi=rx[-7];
 	
-	int buffer_space=radio_rx_buffer[RADIO_RXBUFFER_SIZE-3];
-	buffer_space+=radio_rx_buffer[RADIO_RXBUFFER_SIZE-2]*256;	
+	int buffer_space=rx[-3];
+	buffer_space+=rx[-2]*256;	
 
 	if (packet_bytes>MAX_PACKET_SIZE) packet_bytes=0;       
-	packet_data = &radio_rx_buffer[RADIO_RXBUFFER_SIZE-9-packet_bytes];
+	packet_data = &rx[-9-packet_bytes];
 	radio_transmissions_seen++;
 	
 	if (packet_bytes) {
@@ -4,6 +4,7 @@
 // 
 
 #include "fakecsmaradio.h"
+#include "trace.h"
 
 int filter_verbose=1;
 
@@ -304,6 +305,15 @@ char *fragment_name(int type)
 int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
 		    struct filterable *f, int log_pieces)
 {  
+  if (trace_enabled) {
+    unsigned char ids[6+8];
+    memcpy(ids,f->sender_sid_prefix,6);
+    memcpy(&ids[6],f->bid_prefix,8);
+    trace_event(TRACE_FILTER_FRAGMENT,
+		(f->is_manifest_piece?TRACE_FLAG_MANIFEST:0),
+		f->type,f->packet_start,f->fragment_length,ids,sizeof(ids));
+  }
+
   if (filter_verbose) {
     fprintf(stderr,"T+%lldms : from sid:%02X%02X%02X%02X%02X%02X* to sid:%02X%02X[%02X%02X]*\n",
 	    gettime_ms()-start_time,
@@ -380,7 +390,8 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
 
   int match=0;
   int r;
-  fprintf(stderr,"There are %d filter rules.\n",filter_rule_count);
+  if (filter_verbose)
+    fprintf(stderr,"There are %d filter rules.\n",filter_rule_count);
   for(r=0;r<filter_rule_count;r++) {
 
     // Ignore packet-level filters
@@ -391,6 +402,7 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
     match=1;
 #if 1
     //    if ((f->type=='p')||(f->type=='P')||(f->type=='q')||(f->type=='Q')) {
+    if (filter_verbose)
       fprintf(stderr,"FILTER: rule: src=%d, dst=%d, mP=%d, pP=%d  -- fragment: src=%d, dst=%d, mP=%d, pP=%d, party_match=%d\n",
 	      filter_rules[r]->src,filter_rules[r]->dst,
 	      filter_rules[r]->manifestP,filter_rules[r]->bodyP,
@@ -416,7 +428,9 @@ int filter_fragment(uint8_t *packet_in,uint8_t *packet_out,int *out_len,
   }
 
   if (match) {
-    fprintf(stderr,"         *** Fragment dropped due to filter rule #%d\n",r);
+    TRACE(TRACE_FILTER_RULE,0,r,0,0,f->sender_sid_prefix,6);
+    if (filter_verbose)
+      fprintf(stderr,"         *** Fragment dropped due to filter rule #%d\n",r);
     return 1;
   }
   
@@ -489,14 +503,17 @@ int filter_process_packet(int from,int to,
       int party_match = filter_rule_party_match(filter_rules[r],from,to);
       
       if (party_match) {
+	TRACE(TRACE_FILTER_RULE,0,r,filter_rules[r]->allowP,0,packet,6);
 	if (!filter_rules[r]->allowP) {
-	  fprintf(stderr,"Dropped packet due to rule #%d\n",r);
+	  if (filter_verbose)
+	    fprintf(stderr,"Dropped packet due to rule #%d\n",r);
 	  *packet_len=0;
 	  return 0;
 	}
 	else {
 	  // Keeping packet due to positive match rule
-	  fprintf(stderr,"Keeping packet due to rule #%d\n",r);
+	  if (filter_verbose)
+	    fprintf(stderr,"Keeping packet due to rule #%d\n",r);
 	  break;
 	}
       }
@@ -509,11 +526,13 @@ int filter_process_packet(int from,int to,
   // Extract SID prefix of sender
   memcpy(f.sender_sid_prefix,&packet[offset],6); offset+=6;
 
+  TRACE(TRACE_FILTER_PACKET,0,from,to,*packet_len,f.sender_sid_prefix,6);
   if (to==-1) {
     packet_count++;
-    fprintf(stderr,">>> %s Packet #%d : length=%d bytes\n",
-	    timestamp_str(f.sender_sid_prefix),
-	    packet_count,*packet_len);
+    if (filter_verbose)
+      fprintf(stderr,">>> %s Packet #%d : length=%d bytes\n",
+	      timestamp_str(f.sender_sid_prefix),
+	      packet_count,*packet_len);
   }  
   
   // Ignore msg number and is_retransmission flag bytes
@@ -523,7 +542,18 @@ int filter_process_packet(int from,int to,
   memcpy(packet_out,packet,6+1+1);
   out_len=6+1+1;
 
-  len-=FEC_LENGTH; // FEC length
+  // Strip the FEC, which may be of any of the strengths LBARD can choose from.
+  {
+    uint8_t decoded[RS_FRAME_MAX_BYTES];
+    int payload_len,parity_bytes;
+    if ((len<=RS_FRAME_MAX_BYTES)&&(len>0)) {
+      memcpy(decoded,packet,len);
+      if (rs_frame_decode(decoded,len,&payload_len,&parity_bytes)>=0)
+	len=payload_len;
+      else
+	len-=FEC_LENGTH;
+    } else len-=FEC_LENGTH;
+  }
   
   while(offset<len) {
     switch(packet[offset]) {
@@ -549,6 +579,12 @@ int filter_process_packet(int from,int to,
       f.fragment_length=offset-f.packet_start;
       filter_fragment(packet,packet_out,&out_len,&f,to==-1);
       break;
+    case 'E': // FEC error level report: 'E' + 1 byte
+      // We don't filter these, just copy the bytes
+      memcpy(&packet_out[out_len],&packet[offset],2);
+      out_len+=2;
+      offset+=2;
+      break;
     case 'G':  // 32-bit instance ID of peer
       filterable_erase_fragment(&f,offset);
       f.type=packet[offset++];
@@ -663,8 +699,9 @@ int filter_process_packet(int from,int to,
 int filter_and_enqueue_packet_for_client(int from,int to, long long delivery_time,
 					 uint8_t *packet_in,int packet_len)
 {
-  fprintf(stderr,"Filter and enqueue %d bytes from %d -> %d\n",
-	  packet_len,from,to);
+  if (filter_verbose)
+    fprintf(stderr,"Filter and enqueue %d bytes from %d -> %d\n",
+	    packet_len,from,to);
 
   uint8_t packet[256];
   memcpy(packet,packet_in,packet_len);
@@ -852,6 +889,13 @@ int main(int argc,char **argv)
   
   if (argv&&argv[1]) radio_types=argv[1];
   if (getenv("LBARD_REAL_RADIOS")&&strlen(getenv("LBARD_REAL_RADIOS"))) radio_types=getenv("LBARD_REAL_RADIOS");
+  if (getenv("FAKECSMARADIO_TRACE")&&strlen(getenv("FAKECSMARADIO_TRACE"))) {
+    // Record packets and fragments in a binary trace (see tracedecode),
+    // instead of describing each one on stderr.
+    if (trace_start_writer(getenv("FAKECSMARADIO_TRACE"))) exit(-1);
+    filter_verbose=0;
+    fprintf(stderr,"Writing binary trace to '%s'\n",getenv("FAKECSMARADIO_TRACE"));
+  }
   radio_count=1;
   for(int i=0;radio_types[i];i++) if (radio_types[i]==',') radio_count++;
   fprintf(stderr,"radio_count=%d\n",radio_count);
@@ -18,6 +18,9 @@
  * FCR - An integer literal or variable specifying the first consecutive root of the
  *       Reed-Solomon generator polynomial. Integer variable or literal.
  * PRIM - The primitive root of the generator poly. Integer variable or literal.
+ * COMPUTE_SYNDROMES - Optional. If defined, COMPUTE_SYNDROMES(s) is used to fill
+ *         s[] with the syndromes in polynomial form, instead of evaluating data[]
+ *         directly
  * DEBUG - If set to 1 or more, do various internal consistency checking. Leave this
  *         undefined for production code
 
@@ -79,6 +82,10 @@
   int syn_error, count;
 
   /* form the syndromes; i.e., evaluate data(x) at roots of g(x) */
+#ifdef COMPUTE_SYNDROMES
+  /* Faster code-specific version supplied by the includer */
+  COMPUTE_SYNDROMES(s);
+#else
   for(i=0;i<NROOTS;i++)
     s[i] = data[0];
 
@@ -91,6 +98,7 @@
       }
     }
   }
+#endif
 
   /* Convert syndromes to index form, checking for nonzero condition */
   syn_error = 0;
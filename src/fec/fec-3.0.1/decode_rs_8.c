@@ -11,6 +11,14 @@
 
 #include "fixed.h"
 
+#ifndef RS_NO_TABLES
+/* Table-driven syndromes, from rs_fast.c. For a clean frame these come out
+ * all zero without evaluating anything, so the decoder returns straight away.
+ */
+int rs_8_syndromes(const data_t *data,int pad,data_t *s);
+#define COMPUTE_SYNDROMES(s) rs_8_syndromes(data,pad,s)
+#endif
+
 int decode_rs_8(data_t *data, int *eras_pos, int no_eras, int pad){
   int retval;
  
@@ -9,18 +9,28 @@
 #endif
 
 
-static enum {UNKNOWN=0,MMX,SSE,SSE2,ALTIVEC,PORT} cpu_mode;
+static enum {UNKNOWN=0,MMX,SSE,SSE2,ALTIVEC,PORT,TABLE} cpu_mode;
 
 static void encode_rs_8_c(data_t *data, data_t *parity,int pad);
+/* Table-driven version in rs_fast.c, using SSE2 or AVX2 where the compiler
+ * targets them */
+void encode_rs_8_table(data_t *data, data_t *parity,int pad);
 #if __vec__
 static void encode_rs_8_av(data_t *data, data_t *parity,int pad);
 #endif
 
 void encode_rs_8(data_t *data, data_t *parity,int pad){
   if(cpu_mode == UNKNOWN){
+#ifdef RS_NO_TABLES
     cpu_mode = PORT;
+#else
+    cpu_mode = TABLE;
+#endif
   }
   switch(cpu_mode){
+  case TABLE:
+    encode_rs_8_table(data,parity,pad);
+    return;
 #if __vec__
   case ALTIVEC:
     encode_rs_8_av(data,parity,pad);
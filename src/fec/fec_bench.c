@@ -0,0 +1,121 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Benchmark for the CCSDS Reed-Solomon code that protects every radio frame.
+
+  Encodes a set of random frames, then decodes them clean and with various
+  numbers of corrupted bytes, reporting frames per second for each, and
+  checking that every frame comes back intact.  Build with -DRS_NO_TABLES to
+  measure the generic fec-3.0.1 code instead of rs_fast.c, e.g., via
+  "make fecbench".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rs_frame.h"
+
+void encode_rs_8(unsigned char *data,unsigned char *parity,int pad);
+int decode_rs_8(unsigned char *data,int *eras_pos,int no_eras,int pad);
+
+#define FRAME_COUNT 1024
+// A typical full LBARD packet
+#define PAYLOAD_BYTES 200
+#define FRAME_BYTES (PAYLOAD_BYTES+RS_FRAME_DEFAULT_PARITY)
+#define PAD (255-FRAME_BYTES)
+
+unsigned char frames[FRAME_COUNT][FRAME_BYTES];
+
+#ifdef RS_NO_TABLES
+#define VARIANT "portable"
+#else
+#define VARIANT "table"
+#endif
+
+static double bench_seconds(clock_t cpu)
+{
+  double seconds=cpu*1.0/CLOCKS_PER_SEC;
+  // Don't divide by zero on very fast machines or tiny runs
+  if (seconds<=0) seconds=1.0/CLOCKS_PER_SEC;
+  return seconds;
+}
+
+// Decode every frame with the given number of corrupted bytes.
+// Returns the number of frames that did not come back intact.
+static int bench_decode(int errors,int rounds)
+{
+  unsigned char copy[FRAME_BYTES];
+  int bad=0;
+  clock_t cpu=0;
+
+  for(int r=0;r<rounds;r++)
+    for(int f=0;f<FRAME_COUNT;f++) {
+      memcpy(copy,frames[f],FRAME_BYTES);
+      for(int e=0;e<errors;e++) {
+	// Distinct positions, so that exactly errors bytes are wrong
+	int pos=(f*7+e*(FRAME_BYTES/errors))%FRAME_BYTES;
+	copy[pos]^=1+(random()%255);
+      }
+      clock_t start=clock();
+      int corrected=decode_rs_8(copy,NULL,0,PAD);
+      cpu+=clock()-start;
+      // decode_rs_8() only corrects the data bytes, not the parity
+      if (corrected!=errors||memcmp(copy,frames[f],PAYLOAD_BYTES)) bad++;
+    }
+
+  double seconds=bench_seconds(cpu);
+  fprintf(stderr,"%-8s decode, %2d errors: %10.0f frames/sec%s\n",
+	  VARIANT,errors,rounds*FRAME_COUNT/seconds,
+	  bad?" (FAILED)":"");
+  return bad;
+}
+
+int main(int argc,char **argv)
+{
+  int rounds=argc>1?atoi(argv[1]):20;
+  int seed=argc>2?atoi(argv[2]):1;
+  if (rounds<1) {
+    fprintf(stderr,"usage: fecbench [rounds] [seed]\n");
+    exit(-1);
+  }
+
+  srandom(seed);
+  for(int f=0;f<FRAME_COUNT;f++)
+    for(int i=0;i<PAYLOAD_BYTES;i++) frames[f][i]=random();
+
+  clock_t start=clock();
+  for(int r=0;r<rounds;r++)
+    for(int f=0;f<FRAME_COUNT;f++)
+      encode_rs_8(frames[f],&frames[f][PAYLOAD_BYTES],PAD);
+  double seconds=bench_seconds(clock()-start);
+  fprintf(stderr,"%-8s encode:            %10.0f frames/sec\n",
+	  VARIANT,rounds*FRAME_COUNT/seconds);
+
+  int bad=0;
+  bad+=bench_decode(0,rounds);
+  bad+=bench_decode(1,rounds);
+  bad+=bench_decode(4,rounds);
+  bad+=bench_decode(RS_FRAME_DEFAULT_PARITY/4-1,rounds);
+  bad+=bench_decode(RS_FRAME_DEFAULT_PARITY/2,rounds);
+
+  return bad?1:0;
+}
@@ -0,0 +1,154 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Table-driven arithmetic for the CCSDS (255,223) Reed-Solomon code used by
+  encode_rs_8() and decode_rs_8().
+
+  The generic fec-3.0.1 code multiplies via log/antilog tables one symbol and
+  one root at a time, so both encoding a frame and computing its syndromes
+  costs around 255*32 table lookups and modulo reductions.  Instead:
+
+  1. We precompute, for every possible feedback byte f, the 32 byte row that
+     the encoder's shift register is XORed with (f times each generator
+     coefficient).  Each data byte then costs one 32 byte shift and XOR,
+     which is two SSE2 registers, or one AVX2 register.
+
+  2. To compute the syndromes of a received frame, we run its data bytes
+     through the same shift register, and XOR the result with the received
+     parity bytes.  This gives the received word modulo the generator
+     polynomial, which has the same value as the received word at each root.
+     For a clean frame it is all zeroes, and we are done without evaluating
+     anything, so decode_rs.h skips straight past Berlekamp-Massey and the
+     Chien search.  Otherwise we only need to evaluate a 32 byte polynomial,
+     rather than a 255 byte one, at each root.
+*/
+
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fec-3.0.1/fixed.h"
+
+#undef A0
+#define A0 (NN)
+
+// feedback_rows[f][k] = f * GENPOLY[NROOTS-1-k]
+static data_t feedback_rows[256][NROOTS] __attribute__((aligned(32)));
+// root_multiply[i][v] = v * alpha^((FCR+i)*PRIM)
+static data_t root_multiply[NROOTS][256];
+static int rs_fast_ready=0;
+
+static void rs_fast_init(void)
+{
+  for(int f=0;f<256;f++)
+    for(int k=0;k<NROOTS;k++) {
+      if (!f) feedback_rows[f][k]=0;
+      else
+	feedback_rows[f][k]=ALPHA_TO[MODNN(INDEX_OF[f]+GENPOLY[NROOTS-1-k])];
+    }
+  for(int i=0;i<NROOTS;i++)
+    for(int v=0;v<256;v++) {
+      if (!v) root_multiply[i][v]=0;
+      else
+	root_multiply[i][v]=ALPHA_TO[MODNN(INDEX_OF[v]+(FCR+i)*PRIM)];
+    }
+  rs_fast_ready=1;
+}
+
+// Run len data bytes through the encoder shift register, leaving the
+// parity bytes in parity[].
+static void rs_fast_remainder(const data_t *data,int len,data_t *parity)
+{
+  if (!rs_fast_ready) rs_fast_init();
+
+#if defined(__AVX2__)
+  __m256i sr=_mm256_setzero_si256();
+  for(int i=0;i<len;i++) {
+    int f=(data[i]^_mm256_cvtsi256_si32(sr))&0xff;
+    // Shift the whole register down one byte: alignr only works within
+    // each 128-bit lane, so feed it the upper lane moved down.
+    __m256i upper=_mm256_permute2x128_si256(sr,sr,0x81);
+    sr=_mm256_alignr_epi8(upper,sr,1);
+    sr=_mm256_xor_si256(sr,_mm256_load_si256((__m256i *)feedback_rows[f]));
+  }
+  _mm256_storeu_si256((__m256i *)parity,sr);
+#elif defined(__SSE2__)
+  __m128i lo=_mm_setzero_si128();
+  __m128i hi=_mm_setzero_si128();
+  for(int i=0;i<len;i++) {
+    int f=(data[i]^_mm_cvtsi128_si32(lo))&0xff;
+    lo=_mm_or_si128(_mm_srli_si128(lo,1),_mm_slli_si128(hi,15));
+    hi=_mm_srli_si128(hi,1);
+    lo=_mm_xor_si128(lo,_mm_load_si128((__m128i *)&feedback_rows[f][0]));
+    hi=_mm_xor_si128(hi,_mm_load_si128((__m128i *)&feedback_rows[f][16]));
+  }
+  _mm_storeu_si128((__m128i *)&parity[0],lo);
+  _mm_storeu_si128((__m128i *)&parity[16],hi);
+#else
+  data_t sr[NROOTS];
+  memset(sr,0,sizeof(sr));
+  for(int i=0;i<len;i++) {
+    int f=data[i]^sr[0];
+    const data_t *row=feedback_rows[f];
+    for(int k=0;k<NROOTS-1;k++) sr[k]=sr[k+1]^row[k];
+    sr[NROOTS-1]=row[NROOTS-1];
+  }
+  memcpy(parity,sr,NROOTS);
+#endif
+}
+
+void encode_rs_8_table(data_t *data,data_t *parity,int pad)
+{
+  rs_fast_remainder(data,NN-NROOTS-pad,parity);
+}
+
+/*
+  Compute the syndromes of the NN-pad byte received word in data[], in
+  polynomial form, as decode_rs.h would.  Returns non-zero if any of them
+  are non-zero.
+*/
+int rs_8_syndromes(const data_t *data,int pad,data_t *s)
+{
+  data_t remainder[NROOTS];
+  int len=NN-NROOTS-pad;
+  int nonzero=0;
+
+  rs_fast_remainder(data,len,remainder);
+  for(int k=0;k<NROOTS;k++) {
+    remainder[k]^=data[len+k];
+    nonzero|=remainder[k];
+  }
+  if (!nonzero) {
+    memset(s,0,NROOTS);
+    return 0;
+  }
+
+  // remainder[0] is the coefficient of x^(NROOTS-1)
+  for(int i=0;i<NROOTS;i++) {
+    const data_t *multiply=root_multiply[i];
+    data_t v=0;
+    for(int k=0;k<NROOTS;k++) v=multiply[v]^remainder[k];
+    s[i]=v;
+  }
+  return 1;
+}
@@ -0,0 +1,174 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Reed-Solomon protection of radio frames, with a choice of code strengths.
+
+  Frames with RS_FRAME_DEFAULT_PARITY parity bytes are shortened CCSDS
+  (255,223) codewords, exactly as all versions of LBARD have always sent, so
+  that older nodes can still hear us.  Frames using any of the other codes are
+  shortened codewords of a general RS code over GF(256) with 8, 16 or 48 parity
+  bytes, followed by one marker byte that says which.  The markers are far
+  enough apart in Hamming distance that a couple of bit errors in the marker
+  don't stop us decoding the frame.
+
+  To decode, we first try the CCSDS code, and only if that fails look at the
+  marker.  A frame using one of the other codes has a vanishingly small chance
+  of looking like a CCSDS codeword.
+
+  Like saw_packet() always has, we only accept a frame if fewer than a quarter
+  of the parity bytes had to be used to correct it, so as to keep the chance of
+  a miscorrection very small.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "fec-3.0.1/char.h"
+#include "fec-3.0.1/rs-common.h"
+#include "rs_frame.h"
+
+void encode_rs_8(data_t *data, data_t *parity,int pad);
+int decode_rs_8(data_t *data, int *eras_pos, int no_eras, int pad);
+void *init_rs_char(int symsize,int gfpoly,int fcr,int prim,int nroots,int pad);
+void encode_rs_char(void *rs,data_t *data,data_t *parity);
+int decode_rs_char(void *rs,data_t *data,int *eras_pos,int no_eras);
+
+#define RS_CODEWORD_BYTES 255
+
+struct rs_frame_code {
+  int parity_bytes;
+  unsigned char marker;
+  // First root of the generator polynomial.  The codes use disjoint sets of
+  // roots, as otherwise every codeword of a stronger code would also be a
+  // codeword of the weaker ones, and a corrupted marker could lead us to
+  // accept a frame using the wrong code.
+  int fcr;
+  struct rs *rs;
+};
+
+static struct rs_frame_code rs_frame_codes[]={
+  {8,0x07,1,NULL},
+  {16,0x38,9,NULL},
+  {48,0xc0,25,NULL},
+  {0,0,0,NULL}
+};
+
+static struct rs_frame_code *rs_frame_code(int parity_bytes)
+{
+  for(int i=0;rs_frame_codes[i].parity_bytes;i++)
+    if (rs_frame_codes[i].parity_bytes==parity_bytes) {
+      if (!rs_frame_codes[i].rs)
+	// Conventional field polynomial and primitive element
+	rs_frame_codes[i].rs=init_rs_char(8,0x11d,rs_frame_codes[i].fcr,1,
+					  parity_bytes,0);
+      if (!rs_frame_codes[i].rs) return NULL;
+      return &rs_frame_codes[i];
+    }
+  return NULL;
+}
+
+int rs_frame_max_payload(int parity_bytes)
+{
+  if (parity_bytes==RS_FRAME_DEFAULT_PARITY)
+    return RS_CODEWORD_BYTES-parity_bytes;
+  if (!rs_frame_code(parity_bytes)) return -1;
+  return RS_CODEWORD_BYTES-parity_bytes;
+}
+
+// Append parity (and marker, if required) to the payload_len bytes in frame[].
+// Returns the length of the resulting frame, or -1 on error.
+int rs_frame_encode(unsigned char *frame,int payload_len,int parity_bytes)
+{
+  if (payload_len<0||payload_len>rs_frame_max_payload(parity_bytes)) return -1;
+
+  if (parity_bytes==RS_FRAME_DEFAULT_PARITY) {
+    encode_rs_8(frame,&frame[payload_len],
+		RS_CODEWORD_BYTES-RS_FRAME_DEFAULT_PARITY-payload_len);
+    return payload_len+parity_bytes;
+  }
+
+  struct rs_frame_code *code=rs_frame_code(parity_bytes);
+  if (!code) return -1;
+  // The codec itself doesn't care about the amount of padding, so we just
+  // set it for each frame.
+  code->rs->pad=RS_CODEWORD_BYTES-parity_bytes-payload_len;
+  encode_rs_char(code->rs,frame,&frame[payload_len]);
+  frame[payload_len+parity_bytes]=code->marker;
+  return payload_len+parity_bytes+1;
+}
+
+static int bits_set(unsigned char v)
+{
+  int count=0;
+  for(;v;v&=v-1) count++;
+  return count;
+}
+
+/*
+  Correct frame[] in place.  Returns the number of errors corrected, and sets
+  *payload_len and *parity_bytes, or returns -1 if the frame could not be
+  decoded (in which case frame[] is left untouched).
+*/
+int rs_frame_decode(unsigned char *frame,int frame_len,
+		    int *payload_len,int *parity_bytes)
+{
+  unsigned char copy[RS_FRAME_MAX_BYTES];
+  int eras_pos[RS_FRAME_MAX_PARITY];
+
+  if (frame_len<=0||frame_len>RS_FRAME_MAX_BYTES) return -1;
+
+  // Decode a copy, so that a failed attempt doesn't scramble the frame for
+  // the next one.
+  if (frame_len>RS_FRAME_DEFAULT_PARITY
+      &&frame_len<=RS_CODEWORD_BYTES) {
+    bcopy(frame,copy,frame_len);
+    int errors=decode_rs_8(copy,NULL,0,RS_CODEWORD_BYTES-frame_len);
+    if (errors>=0&&errors*4<RS_FRAME_DEFAULT_PARITY) {
+      bcopy(copy,frame,frame_len);
+      *payload_len=frame_len-RS_FRAME_DEFAULT_PARITY;
+      *parity_bytes=RS_FRAME_DEFAULT_PARITY;
+      return errors;
+    }
+  }
+
+  // Find the code whose marker is nearest to the last byte
+  unsigned char marker=frame[frame_len-1];
+  struct rs_frame_code *code=NULL;
+  for(int i=0;rs_frame_codes[i].parity_bytes;i++)
+    if (bits_set(marker^rs_frame_codes[i].marker)<=2)
+      code=rs_frame_code(rs_frame_codes[i].parity_bytes);
+  if (!code) return -1;
+
+  int codeword_len=frame_len-1;
+  if (codeword_len<=code->parity_bytes||codeword_len>RS_CODEWORD_BYTES) return -1;
+  bcopy(frame,copy,codeword_len);
+  int pad=RS_CODEWORD_BYTES-codeword_len;
+  code->rs->pad=pad;
+  int errors=decode_rs_char(code->rs,copy,eras_pos,0);
+  if (errors<0||errors*4>=code->parity_bytes) return -1;
+  // An error in the padding means we have miscorrected
+  for(int i=0;i<errors;i++)
+    if (eras_pos[i]<pad) return -1;
+  bcopy(copy,frame,codeword_len);
+  *payload_len=codeword_len-code->parity_bytes;
+  *parity_bytes=code->parity_bytes;
+  return errors;
+}
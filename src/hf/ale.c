@@ -161,21 +161,138 @@ int hf_radio_pause_for_turnaround(void)
   return 0;
 }
 
+/*
+  Packets are sent as a series of up to six ALE AMD messages, each of which
+  starts with a three character header: the sequence number, offset by a
+  character that identifies the radio type and payload encoding, then the piece
+  number and the total number of pieces.
+
+  The payload was originally hex, which carries only 4 bits per character.
+  ALE messages can carry any of the 64 ASCII characters 0x20 - 0x5f, so we can
+  instead carry 6 bits per character using ascii64_encode(), which takes a
+  200 byte packet from six fragments down to four.  Older versions of LBARD
+  ignore fragments with headers they don't recognise, so we only send these to
+  a station once it has told us it can decode them.  Stations that can, append
+  HF_DENSE_CAPABLE to the hex fragments they send.  Old versions skip it, as it
+  is not a hex digit.
+
+  Radios may trim trailing spaces from messages, and ASCII-64 groups always
+  carry 3 bytes, so ASCII-64 fragments end with a digit giving the number of
+  bytes in the last group (0 meaning all 3).
+
+  Codan radios need spaces to be escaped as "\ ".  We assume that the radio
+  sends the escape over the air, and that the receiving radio passes it on to
+  us unchanged, so hf_process_fragment() removes it again before decoding.  As
+  every space is escaped, a backslash followed by a space is always an escape.
+  The escapes count against the 90 character limit of an ALE 2G AMD message,
+  so a packet whose ASCII-64 fragments would be too long with them is sent as
+  hex instead (see hf_fragment_dense_fits()).
+*/
+#define HF_HEX_FRAGMENT_BYTES 43
+#define HF_DENSE_FRAGMENT_BYTES 63
+#define HF_MAX_FRAGMENTS 6
+#define HF_DENSE_CAPABLE '+'
+// ALE 2G AMD messages can be at most 90 characters long
+#define HF_MAX_FRAGMENT_CHARS 90
+
+// First header character for sequence number zero
+#define HF_CODAN_HEX_BASE '0'
+#define HF_BARRETT_HEX_BASE 'A'
+#define HF_CODAN_DENSE_BASE 'I'
+#define HF_BARRETT_DENSE_BASE 'Q'
+
 int pieces_seen[6]={0,0,0,0,0,0};
-unsigned char accummulated_packet[256];
+unsigned char accummulated_packet[HF_DENSE_FRAGMENT_BYTES*HF_MAX_FRAGMENTS];
+
+int hf_fragment_dense_ok(void)
+{
+  if (hf_link_partner<0) return 0;
+  return hf_stations[hf_link_partner].dense_fragments;
+}
+
+int hf_fragment_count(int len,int dense)
+{
+  int fragment_bytes=dense?HF_DENSE_FRAGMENT_BYTES:HF_HEX_FRAGMENT_BYTES;
+  int pieces=len/fragment_bytes;
+  if (len%fragment_bytes) pieces++;
+  if (pieces>HF_MAX_FRAGMENTS) return -1;
+  return pieces;
+}
 
+// Write the header and payload for one piece of a packet into fragment[].
+// Returns the length of the fragment.
+int hf_encode_fragment(unsigned char *packet,int len,int piece,int pieces,
+		       int dense,char *fragment)
+{
+  int radio_type=radio_get_type();
+  int fragment_bytes=dense?HF_DENSE_FRAGMENT_BYTES:HF_HEX_FRAGMENT_BYTES;
+  int offset=piece*fragment_bytes;
+  int frag_len=fragment_bytes;
+  if (len-offset<fragment_bytes) frag_len=len-offset;
+
+  // Indicate radio type and encoding in fragment header
+  char base;
+  if (radio_type==RADIOTYPE_HFCODAN)
+    base=dense?HF_CODAN_DENSE_BASE:HF_CODAN_HEX_BASE;
+  else
+    base=dense?HF_BARRETT_DENSE_BASE:HF_BARRETT_HEX_BASE;
+  fragment[0]=base+(hf_message_sequence_number&0x07);
+  fragment[1]=0x30+piece;
+  fragment[2]=0x30+pieces;
+
+  if (dense) {
+    // ascii64_encode() always encodes whole groups of 3 bytes
+    unsigned char padded[HF_DENSE_FRAGMENT_BYTES];
+    bzero(padded,sizeof(padded));
+    bcopy(&packet[offset],padded,frag_len);
+    ascii64_encode(padded,&fragment[3],frag_len,radio_type);
+    int flen=strlen(fragment);
+    fragment[flen++]='0'+(frag_len%3);
+    fragment[flen]=0;
+  } else {
+    hex_encode(&packet[offset],&fragment[3],frag_len,radio_type);
+    int flen=strlen(fragment);
+    fragment[flen++]=HF_DENSE_CAPABLE;
+    fragment[flen]=0;
+  }
+  return strlen(fragment);
+}
+
+// Returns 1 if every ASCII-64 fragment of the packet, including any escapes,
+// fits in an AMD message.
+int hf_fragment_dense_fits(unsigned char *packet,int len)
+{
+  char fragment[256];
+  int pieces=hf_fragment_count(len,1);
+  if (pieces<0) return 0;
+  for(int piece=0;piece<pieces;piece++)
+    if (hf_encode_fragment(packet,len,piece,pieces,1,fragment)>HF_MAX_FRAGMENT_CHARS)
+      return 0;
+  return 1;
+}
 
 int hf_process_fragment(char *fragment)
 {
   int peer_radio=-1;
   int sequence=-1;
-  if ((fragment[0]>='0')&&(fragment[0]<='7')) {
+  int dense=0;
+  if ((fragment[0]>=HF_CODAN_HEX_BASE)&&(fragment[0]<=HF_CODAN_HEX_BASE+7)) {
+    peer_radio=RADIOTYPE_HFCODAN;
+    sequence=fragment[0]-HF_CODAN_HEX_BASE;
+  }
+  if ((fragment[0]>=HF_BARRETT_HEX_BASE)&&(fragment[0]<=HF_BARRETT_HEX_BASE+7)) {
+    peer_radio=RADIOTYPE_HFBARRETT;
+    sequence=fragment[0]-HF_BARRETT_HEX_BASE;
+  }
+  if ((fragment[0]>=HF_CODAN_DENSE_BASE)&&(fragment[0]<=HF_CODAN_DENSE_BASE+7)) {
     peer_radio=RADIOTYPE_HFCODAN;
-    sequence=fragment[0]-'0';
+    sequence=fragment[0]-HF_CODAN_DENSE_BASE;
+    dense=1;
   }
-  if ((fragment[0]>='A')&&(fragment[0]<='H')) {
+  if ((fragment[0]>=HF_BARRETT_DENSE_BASE)&&(fragment[0]<=HF_BARRETT_DENSE_BASE+7)) {
     peer_radio=RADIOTYPE_HFBARRETT;
-    sequence=fragment[0]-'A';
+    sequence=fragment[0]-HF_BARRETT_DENSE_BASE;
+    dense=1;
   }
   int piece_number=(fragment[1]-'0');
   int pieces=(fragment[2]-'0');
@@ -183,19 +300,57 @@ int hf_process_fragment(char *fragment)
   fprintf(stderr,"Checking if message is a fragment (piece %d/%d, peer=%d).\n",
 	  piece_number,pieces,peer_radio);
   if (peer_radio<0) return -1;
-  if (pieces<1||pieces>6) return -1;
-  if (piece_number<0||piece_number>5) return -1;
-  fprintf(stderr,"Received piece %d/%d of packet sequence #%d from a %s radio.\n",
-	  piece_number+1,pieces,sequence,radio_type_name(peer_radio));
+  if (pieces<1||pieces>HF_MAX_FRAGMENTS) return -1;
+  if (piece_number<0||piece_number>=pieces) return -1;
+  fprintf(stderr,"Received piece %d/%d of packet sequence #%d from a %s radio%s.\n",
+	  piece_number+1,pieces,sequence,radio_type_name(peer_radio),
+	  dense?" (ASCII-64)":"");
+
+  int fragment_len=strlen(fragment);
+  int packet_offset;
+  if (dense) {
+    // Strip the trailing count of bytes in the last group
+    if (fragment_len<5) return -1;
+    int last_group=fragment[fragment_len-1]-'0';
+    if (last_group<0||last_group>2) return -1;
+    char payload[HF_DENSE_FRAGMENT_BYTES*4/3+1];
+    int payload_len=0;
+    for(int i=3;i<fragment_len-1;i++) {
+      // ascii64_encode() escapes spaces for Codan radios
+      if ((peer_radio==RADIOTYPE_HFCODAN)&&(fragment[i]=='\\')
+	  &&(fragment[i+1]==' '))
+	i++;
+      if (payload_len>=sizeof(payload)-1) return -1;
+      payload[payload_len++]=fragment[i];
+    }
+    payload[payload_len]=0;
 
-  int packet_offset=piece_number*43;
-  int i;
-  for(i=3;i<strlen(fragment);i+=2) {
-    if (ishex(fragment[i+0])&&ishex(fragment[i+1])) {
-      int v=(chartohexnybl(fragment[i+0])<<4)+chartohexnybl(fragment[i+1]);
-      accummulated_packet[packet_offset++]=v;
+    unsigned char decoded[HF_DENSE_FRAGMENT_BYTES+4];
+    int decoded_len=ascii64_decode(payload,decoded,sizeof(decoded),peer_radio);
+    if (decoded_len<3) return -1;
+    if (last_group) decoded_len-=3-last_group;
+    if (decoded_len>HF_DENSE_FRAGMENT_BYTES) return -1;
+
+    packet_offset=piece_number*HF_DENSE_FRAGMENT_BYTES;
+    bcopy(decoded,&accummulated_packet[packet_offset],decoded_len);
+    packet_offset+=decoded_len;
+  } else {
+    packet_offset=piece_number*HF_HEX_FRAGMENT_BYTES;
+    int i;
+    for(i=3;i<fragment_len;i+=2) {
+      if (ishex(fragment[i+0])&&ishex(fragment[i+1])) {
+	int v=(chartohexnybl(fragment[i+0])<<4)+chartohexnybl(fragment[i+1]);
+	accummulated_packet[packet_offset++]=v;
+      }
     }
   }
+
+  // Remember whether the station at the other end can take ASCII-64 encoded
+  // fragments from us.
+  if (hf_link_partner>-1)
+    hf_stations[hf_link_partner].dense_fragments
+      =dense||(fragment[fragment_len-1]==HF_DENSE_CAPABLE);
+  
   if (piece_number==(pieces-1)) {
     // We have a terminal piece: so assume we have the whole packet.
     // (the FEC will reject it if it is incorrectly assembled).
@@ -44,6 +44,7 @@ int hf_parse_linkcandidate(char *l)
 	while(l[l_pointer] != 0)
 		{
 		struct hf_station new_hf_station;
+		bzero(&new_hf_station,sizeof(new_hf_station));
 		//get index			
 		str_part(tmp, l, l_pointer, 2);
 		str_copy(new_hf_station.index, tmp);				
@@ -8,12 +8,18 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
+#include <poll.h>
 
 #include "sync.h"
 #include "lbard.h"
 #include "serial.h"
 
+// Bodies larger than this are received into an unlinked file in $TMPDIR (or
+// /tmp if that is unset) that is mapped into memory, instead of onto the heap.
+#define HTTP_SPILL_THRESHOLD (1024*1024)
+
 struct json_parse_state {
   int parse_state;
   int on_new_line;
@@ -161,42 +167,125 @@ int json_flatten(struct json_parse_state *p,char *body, int body_len)
   return 0;
 }
 
-int json_body(int sock,long long timeout_time)
+/*
+  Connections to servald.
+
+  Resolving the server name and opening a new TCP connection for every request
+  costs far more than the requests themselves, so we cache the resolved address,
+  and keep a small pool of HTTP/1.1 keep-alive connections open between requests.
+
+  Each connection has a readahead buffer, so that we can parse response headers
+  and line-oriented bodies without reading one byte per system call.  Waiting
+  for data is done with poll(), rather than sleeping and retrying.
+*/
+#define HTTP_MAX_CONNECTIONS 8
+#define HTTP_READAHEAD_BYTES 16384
+// Don't reuse connections that have been idle for longer than this, in case
+// servald has quietly given up on them.
+#define HTTP_IDLE_TIMEOUT_MS 10000
+
+#define HTTP_MAX_HOSTS 4
+
+struct http_host {
+  char name[256];
+  int port;
+  struct sockaddr_in addr;
+};
+
+struct http_connection {
+  int sock;
+  char server_name[256];
+  int server_port;
+
+  // Handed out to a caller, and so not available for reuse
+  int busy;
+  long long last_used;
+
+  // Details of the response currently being read
+  int content_length;
+  int chunked;
+  int keep_alive;
+
+  unsigned char buffer[HTTP_READAHEAD_BYTES];
+  int buffer_offset;
+  int buffer_len;
+  // Set while skipping the remainder of an over-long line
+  int discarding_line;
+};
+
+struct http_host http_hosts[HTTP_MAX_HOSTS];
+int http_host_count=0;
+
+struct http_connection http_connections[HTTP_MAX_CONNECTIONS];
+int http_connections_initialised=0;
+
+long long http_connections_opened=0;
+long long http_connections_reused=0;
+
+// How long servald takes to respond to our requests, up to the end of the
+// response headers.  Bucket i counts requests that took at most
+// http_latency_bucket_ms[i], and the last bucket counts the rest.
+const int http_latency_bucket_ms[HTTP_LATENCY_BUCKETS]={5,10,25,50,100,250,500,1000,2500,5000};
+long long http_latency_buckets[HTTP_LATENCY_BUCKETS+1];
+long long http_requests=0;
+long long http_request_failures=0;
+long long http_request_us_total=0;
+
+static void http_note_latency(long long us,int failed)
 {
-  // Now output the JSON lines
-  struct json_parse_state parse_state;
-  bzero(&parse_state, sizeof(parse_state));
-  
-  while(1) {
-    char line[1024];
-    int r=read_nonblock(sock,line,1024);
-    if (r>0) {
-      if (json_flatten(&parse_state,line,r)) break;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // Quit on timeout
-      close(sock);
-      return -1;
-    }
-  }  
-  json_new_line(&parse_state);
-  close(sock);
-  return 0;
+  int b;
+  for(b=0;b<HTTP_LATENCY_BUCKETS;b++)
+    if (us<=http_latency_bucket_ms[b]*1000LL) break;
+  http_latency_buckets[b]++;
+  http_requests++;
+  if (failed) http_request_failures++;
+  http_request_us_total+=us;
 }
 
-int connect_to_port(char *host,int port)
+int http_resolve(char *host,int port,struct sockaddr_in *addr)
 {
+  for(int i=0;i<http_host_count;i++)
+    if ((http_hosts[i].port==port)&&(!strcmp(http_hosts[i].name,host))) {
+      *addr=http_hosts[i].addr;
+      return 0;
+    }
+
   struct hostent *hostent;
   hostent = gethostbyname(host);
   if (!hostent) {
     return -1;
   }
 
+  bzero(addr,sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;     
+  addr->sin_port = htons(port);   
+  addr->sin_addr = *((struct in_addr *)hostent->h_addr);
+
+  if (strlen(host)<sizeof(http_hosts[0].name)) {
+    int slot=http_host_count;
+    if (slot>=HTTP_MAX_HOSTS) slot=random()%HTTP_MAX_HOSTS;
+    else http_host_count++;
+    strcpy(http_hosts[slot].name,host);
+    http_hosts[slot].port=port;
+    http_hosts[slot].addr=*addr;
+  }
+  return 0;
+}
+
+int http_forget_host(char *host,int port)
+{
+  for(int i=0;i<http_host_count;i++)
+    if ((http_hosts[i].port==port)&&(!strcmp(http_hosts[i].name,host))) {
+      http_hosts[i]=http_hosts[--http_host_count];
+      return 0;
+    }
+  return -1;
+}
+
+int connect_to_port(char *host,int port)
+{
   struct sockaddr_in addr;  
-  addr.sin_family = AF_INET;     
-  addr.sin_port = htons(port);   
-  addr.sin_addr = *((struct in_addr *)hostent->h_addr);
-  bzero(&(addr.sin_zero),8);     
+  if (http_resolve(host,port,&addr)) return -1;
 
   int sock=socket(AF_INET, SOCK_STREAM, 0);
   if (sock==-1) {
@@ -207,11 +296,401 @@ int connect_to_port(char *host,int port)
   if (connect(sock,(struct sockaddr *)&addr,sizeof(struct sockaddr)) == -1) {
     // perror("connect() to port failed");
     close(sock);
+    // Resolve the name again next time, in case the address has changed
+    http_forget_host(host,port);
     return -1;
   }
   return sock;
 }
 
+int http_connection_close(struct http_connection *c)
+{
+  if (c->sock>=0) close(c->sock);
+  c->sock=-1;
+  c->busy=0;
+  c->buffer_offset=0;
+  c->buffer_len=0;
+  c->discarding_line=0;
+  return 0;
+}
+
+// Check that an idle connection has not been closed by the server
+int http_connection_alive(struct http_connection *c)
+{
+  unsigned char b;
+  errno=0;
+  int r=recv(c->sock,&b,1,MSG_PEEK|MSG_DONTWAIT);
+  // Any data on an idle connection is unexpected, and EOF means the
+  // server has hung up on us.
+  if (r>=0) return 0;
+  if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) return 1;
+  return 0;
+}
+
+struct http_connection *http_connection_open(char *server_name,int server_port)
+{
+  long long now=gettime_ms();
+  
+  if (!http_connections_initialised) {
+    for(int i=0;i<HTTP_MAX_CONNECTIONS;i++) http_connections[i].sock=-1;
+    http_connections_initialised=1;
+  }
+
+  // Reuse an idle connection to this server, if we have one
+  for(int i=0;i<HTTP_MAX_CONNECTIONS;i++) {
+    struct http_connection *c=&http_connections[i];
+    if ((c->sock<0)||c->busy) continue;
+    if ((now-c->last_used)>HTTP_IDLE_TIMEOUT_MS||(!http_connection_alive(c))) {
+      http_connection_close(c);
+      continue;
+    }
+    if ((c->server_port==server_port)&&(!strcmp(c->server_name,server_name))) {
+      c->busy=1;
+      c->buffer_offset=0; c->buffer_len=0;
+      http_connections_reused++;
+      return c;
+    }
+  }
+
+  // Otherwise find a free slot, closing the least recently used idle
+  // connection if necessary.
+  struct http_connection *c=NULL;
+  for(int i=0;i<HTTP_MAX_CONNECTIONS;i++) {
+    if (http_connections[i].sock<0) { c=&http_connections[i]; break; }
+    if (!http_connections[i].busy)
+      if ((!c)||(http_connections[i].last_used<c->last_used))
+	c=&http_connections[i];
+  }
+  if (!c) {
+    fprintf(stderr,"All %d HTTP connections to servald are in use.\n",
+	    HTTP_MAX_CONNECTIONS);
+    return NULL;
+  }
+  http_connection_close(c);
+  
+  if (strlen(server_name)>=sizeof(c->server_name)) return NULL;
+  int sock=connect_to_port(server_name,server_port);
+  if (sock<0) return NULL;
+  set_nonblock(sock);
+  http_connections_opened++;
+
+  c->sock=sock;
+  strcpy(c->server_name,server_name);
+  c->server_port=server_port;
+  c->busy=1;
+  c->buffer_offset=0; c->buffer_len=0;
+  return c;
+}
+
+// Finish with a connection, and return it to the pool if the whole of the
+// last response has been consumed, and the server is willing to keep it open.
+int http_connection_release(struct http_connection *c)
+{
+  if (!c) return 0;
+  if (c->keep_alive
+      &&(c->content_length==0)&&(!c->chunked)
+      &&(c->buffer_offset==c->buffer_len)) {
+    c->busy=0;
+    c->last_used=gettime_ms();
+    return 0;
+  }
+  return http_connection_close(c);
+}
+
+struct http_connection *http_connection_by_socket(int sock)
+{
+  if (sock<0) return NULL;
+  for(int i=0;i<HTTP_MAX_CONNECTIONS;i++)
+    if (http_connections[i].busy&&(http_connections[i].sock==sock))
+      return &http_connections[i];
+  return NULL;
+}
+
+#define HTTP_FILL_EOF 0
+#define HTTP_FILL_TIMEOUT -1
+#define HTTP_FILL_ERROR -2
+
+// Read more data into the readahead buffer, waiting until timeout_time for
+// some to arrive.  A timeout_time of zero means don't wait at all.
+int http_fill(struct http_connection *c,long long timeout_time)
+{
+  if (c->buffer_offset) {
+    bcopy(&c->buffer[c->buffer_offset],c->buffer,c->buffer_len-c->buffer_offset);
+    c->buffer_len-=c->buffer_offset;
+    c->buffer_offset=0;
+  }
+  if (c->buffer_len>=HTTP_READAHEAD_BYTES) return HTTP_FILL_ERROR;
+
+  while(1) {
+    int r=read(c->sock,&c->buffer[c->buffer_len],HTTP_READAHEAD_BYTES-c->buffer_len);
+    if (r>0) {
+      c->buffer_len+=r;
+      return r;
+    }
+    if (!r) return HTTP_FILL_EOF;
+    if ((errno!=EAGAIN)&&(errno!=EWOULDBLOCK)&&(errno!=EINTR)) return HTTP_FILL_ERROR;
+
+    long long remaining=timeout_time-gettime_ms();
+    if (remaining<=0) return HTTP_FILL_TIMEOUT;
+    struct pollfd fds={.fd=c->sock,.events=POLLIN};
+    poll(&fds,1,remaining);
+  }
+}
+
+int http_write_all(struct http_connection *c,const void *buf,int len,
+		   long long timeout_time)
+{
+  const unsigned char *b=buf;
+  int written=0;
+  while(written<len) {
+    int r=write(c->sock,&b[written],len-written);
+    if (r>0) { written+=r; continue; }
+    if ((r<0)&&(errno!=EAGAIN)&&(errno!=EWOULDBLOCK)&&(errno!=EINTR)) {
+      perror("http_write_all(): write");
+      return -1;
+    }
+    long long remaining=timeout_time-gettime_ms();
+    if (remaining<=0) return -1;
+    struct pollfd fds={.fd=c->sock,.events=POLLOUT};
+    poll(&fds,1,remaining);
+  }
+  return written;
+}
+
+// Read a CR/LF or LF terminated line, without the terminator.
+// Returns the length of the line, or one of the HTTP_FILL_ codes if no complete
+// line could be read.
+int http_read_line(struct http_connection *c,char *line,int maxlen,
+		   long long timeout_time)
+{
+  while(1) {
+    unsigned char *start=&c->buffer[c->buffer_offset];
+    int available=c->buffer_len-c->buffer_offset;
+    unsigned char *eol=memchr(start,'\n',available);
+    if (eol) {
+      int len=eol-start;
+      c->buffer_offset+=len+1;
+      if (len&&(start[len-1]=='\r')) len--;
+      if (len>=maxlen) len=maxlen-1;
+      bcopy(start,line,len);
+      line[len]=0;
+      return len;
+    }
+    int r=http_fill(c,timeout_time);
+    if (r<=0) return (r==HTTP_FILL_EOF)?HTTP_FILL_ERROR:r;
+  }
+}
+
+// Read the status line and headers of a response.  Returns the HTTP response
+// code, or -1 on failure.  If echo is supplied, the headers are copied to it.
+int http_read_response_header(struct http_connection *c,long long timeout_time,
+			      FILE *echo)
+{
+  char line[1024];
+  int http_response=-1;
+  int http_minor_version=1;
+  int first=1;
+
+  c->content_length=-1;
+  c->chunked=0;
+  c->keep_alive=1;
+  
+  while(1) {
+    int len=http_read_line(c,line,sizeof(line),timeout_time);
+    if (len<0) return -1;
+    if (echo) fprintf(echo,"%s\r\n",line);
+    if (first) {
+      if (sscanf(line,"HTTP/1.%d %d",&http_minor_version,&http_response)!=2)
+	return -1;
+      // HTTP/1.0 servers close the connection unless told otherwise
+      if (!http_minor_version) c->keep_alive=0;
+      first=0;
+      continue;
+    }
+    // Have we found end of headers?
+    if (!len) break;
+    
+    if (!strncasecmp(line,"Content-Length:",15))
+      c->content_length=atoi(&line[15]);
+    else if (!strncasecmp(line,"Transfer-Encoding:",18)) {
+      if (strcasestr(&line[18],"chunked")) c->chunked=1;
+    } else if (!strncasecmp(line,"Connection:",11)) {
+      if (strcasestr(&line[11],"close")) c->keep_alive=0;
+      if (strcasestr(&line[11],"keep-alive")) c->keep_alive=1;
+    }
+  }
+
+  // We can only reuse the connection if we can tell where the body ends
+  if ((c->content_length<0)&&(!c->chunked)) c->keep_alive=0;
+  
+  return http_response;
+}
+
+// Pass the body of the response to sink() as it arrives.  If sink returns
+// non-zero, reading stops early, and the connection can't be reused, and if it
+// returns a negative value, this is treated as an error.
+// Returns the number of body bytes read, or -1 on error or timeout.
+typedef int (*http_body_sink)(void *context,unsigned char *data,int len);
+int http_read_body(struct http_connection *c,long long timeout_time,
+		   http_body_sink sink,void *context,long long *last_read_time)
+{
+  int total=0;
+  int chunk_remaining=c->chunked?0:c->content_length;
+  
+  while(1) {
+    if (c->chunked&&(!chunk_remaining)) {
+      char line[128];
+      // Skip the CR/LF at the end of the previous chunk
+      if (total) if (http_read_line(c,line,sizeof(line),timeout_time)<0) return -1;
+      if (http_read_line(c,line,sizeof(line),timeout_time)<0) return -1;
+      chunk_remaining=strtol(line,NULL,16);
+      if (!chunk_remaining) {
+	// Skip any trailers
+	int len;
+	do {
+	  len=http_read_line(c,line,sizeof(line),timeout_time);
+	} while (len>0);
+	if (len<0) return -1;
+	c->chunked=0;
+	c->content_length=0;
+	return total;
+      }
+    }
+    if (!c->chunked&&!chunk_remaining) {
+      c->content_length=0;
+      return total;
+    }
+
+    if (c->buffer_offset==c->buffer_len) {
+      int r=http_fill(c,timeout_time);
+      if (r==HTTP_FILL_EOF) {
+	// Without a length, the body is everything up until the server
+	// closes the connection.
+	if (chunk_remaining<0) { c->keep_alive=0; return total; }
+	return -1;
+      }
+      if (r<0) {
+	if (r==HTTP_FILL_TIMEOUT)
+	  fprintf(stderr,"HTTP read timeout (read %d of %d bytes)\n",
+		  total,c->content_length);
+	return -1;
+      }
+      if (last_read_time) *last_read_time=gettime_ms();
+    }
+
+    int n=c->buffer_len-c->buffer_offset;
+    if ((chunk_remaining>=0)&&(n>chunk_remaining)) n=chunk_remaining;
+    int stop=0;
+    if (sink) stop=sink(context,&c->buffer[c->buffer_offset],n);
+    c->buffer_offset+=n;
+    total+=n;
+    if (chunk_remaining>0) chunk_remaining-=n;
+    if (stop<0) return -1;
+    if (stop) { c->keep_alive=0; return total; }
+  }
+}
+
+// Start a request on a pooled connection to server_and_port
+struct http_connection *http_request_start(char *server_and_port,
+					   char *request,int request_len,
+					   long long timeout_time)
+{
+  char server_name[1024];
+  int server_port=-1;
+
+  if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return NULL;
+
+  struct http_connection *c=http_connection_open(server_name,server_port);
+  if (!c) return NULL;
+
+  if (http_write_all(c,request,request_len,timeout_time)!=request_len) {
+    // A reused connection may have been closed under us, so try once more on
+    // a fresh one.
+    http_connection_close(c);
+    c=http_connection_open(server_name,server_port);
+    if (!c) return NULL;
+    if (http_write_all(c,request,request_len,timeout_time)!=request_len) {
+      http_connection_close(c);
+      return NULL;
+    }
+  }
+  return c;
+}
+
+// Send a request, and read the response headers, retrying once on a fresh
+// connection if a reused keep-alive connection turns out to have been closed.
+struct http_connection *http_request(char *server_and_port,
+				     char *request,int request_len,
+				     long long timeout_time,FILE *echo,
+				     int *http_response)
+{
+  long long start=gettime_us();
+  for(int attempt=0;attempt<2;attempt++) {
+    long long reused_before=http_connections_reused;
+    struct http_connection *c=http_request_start(server_and_port,
+						 request,request_len,
+						 timeout_time);
+    if (!c) break;
+    int reused=(http_connections_reused!=reused_before);
+
+    *http_response=http_read_response_header(c,timeout_time,echo);
+    if (*http_response>=0) {
+      http_note_latency(gettime_us()-start,0);
+      return c;
+    }
+
+    http_connection_close(c);
+    if (!reused) break;
+  }
+  http_note_latency(gettime_us()-start,1);
+  return NULL;
+}
+
+// Read exactly len bytes of body into dest, using whatever is already in the
+// readahead buffer first, and then reading directly from the socket.
+int http_read_body_direct(struct http_connection *c,unsigned char *dest,int len,
+			  long long timeout_time)
+{
+  int n=c->buffer_len-c->buffer_offset;
+  if (n>len) n=len;
+  bcopy(&c->buffer[c->buffer_offset],dest,n);
+  c->buffer_offset+=n;
+  
+  while(n<len) {
+    int r=read(c->sock,&dest[n],len-n);
+    if (r>0) { n+=r; continue; }
+    if (!r) break;
+    if ((errno!=EAGAIN)&&(errno!=EWOULDBLOCK)&&(errno!=EINTR)) break;
+    long long remaining=timeout_time-gettime_ms();
+    if (remaining<=0) {
+      fprintf(stderr,"HTTP read timeout (read %d of %d bytes)\n",n,len);
+      break;
+    }
+    struct pollfd fds={.fd=c->sock,.events=POLLIN};
+    poll(&fds,1,remaining);
+  }
+  if (n==len) c->content_length=0;
+  return n;
+}
+
+int http_json_sink(void *context,unsigned char *data,int len)
+{
+  return json_flatten((struct json_parse_state *)context,(char *)data,len);
+}
+
+int json_body(struct http_connection *c,long long timeout_time)
+{
+  // Now output the JSON lines
+  struct json_parse_state parse_state;
+  bzero(&parse_state, sizeof(parse_state));
+
+  int r=http_read_body(c,timeout_time,http_json_sink,&parse_state,NULL);
+  json_new_line(&parse_state);
+  http_connection_release(c);
+  if (r<0) return -1;
+  return 0;
+}
+
 int num_to_char(int n)
 {
   assert(n>=0); assert(n<64);
@@ -251,6 +730,17 @@ int base64_append(char *out,int *out_offset,unsigned char *bytes,int count)
   return 0;
 }
 
+int http_file_sink(void *context,unsigned char *data,int len)
+{
+  FILE *outfile=context;
+  int written=fwrite(data,1,len,outfile);      
+  if (written!=len) {
+    fprintf(stderr,"Short write of HTTP data to file: %d of %d bytes\n",written,len);
+    return -1;
+  }
+  return 0;
+}
+
 int http_get_simple(char *server_and_port, char *auth_token,
 		    char *path, FILE *outfile, int timeout_ms,
 		    long long *last_read_time, int outputHeaders)
@@ -279,145 +769,234 @@ int http_get_simple(char *server_and_port, char *auth_token,
   // Build request
   if (auth_token)
     snprintf(request,2048,
-	     "GET %s HTTP/1.1\n"
-	     "Authorization: Basic %s\n"
-	     "Host: %s:%d\n"
-	     "Accept: */*\n"
-	     "\n",
+	     "GET %s HTTP/1.1\r\n"
+	     "Authorization: Basic %s\r\n"
+	     "Host: %s:%d\r\n"
+	     "Accept: */*\r\n"
+	     "\r\n",
 	     path,
 	     authdigest,
 	     server_name,server_port);
   else
     snprintf(request,2048,
-	     "GET %s HTTP/1.1\n"
-	     "Host: %s:%d\n"
-	     "Accept: */*\n"
-	     "\n",
+	     "GET %s HTTP/1.1\r\n"
+	     "Host: %s:%d\r\n"
+	     "Accept: */*\r\n"
+	     "\r\n",
 	     path,
 	     server_name,server_port);
-    
   
-  int sock=connect_to_port(server_name,server_port);
-  if (sock<0) return -1;
+  int http_response=-999;
+  struct http_connection *c=http_request(server_and_port,request,strlen(request),
+					 timeout_time,outputHeaders?outfile:NULL,
+					 &http_response);
+  if (!c) return -1;
 
-  write_all(sock,request,strlen(request));
+  // Got headers, read body and write to file
+  int rxlen=http_read_body(c,timeout_time,http_file_sink,outfile,last_read_time);
+  http_connection_release(c);
+  fflush(outfile);
+  if (rxlen<0) {
+    fprintf(stderr,"  HTTP download of '%s' failed or was too short. Returning error.\n",
+	    path);
+    return -1;
+  }
+  
+  return http_response;
+}
 
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response=-999;
-  #define LINE_BYTES 65536
-  char line[LINE_BYTES];
-  int len=0;
-  int empty_count=0;
-  int content_length=-1;
-  set_nonblock(sock);
-  int r;
-  while(len<1024) {
-    r=read_nonblock(sock,&line[len],1);
-    if (r==1) {
-      if (outputHeaders) fputc(line[len],outfile);
-      if ((line[len]=='\n')||(line[len]=='\r')) {
-	if (len) empty_count=0; else empty_count++;
-	line[len+1]=0;
-	if (sscanf(line,"Content-Length: %d",&content_length)==1) {
-	  // got content length
-	  // fprintf(stderr,"HTTP Content-Length = %d\n",content_length);
-	}
-	if (sscanf(line,"HTTP/1.0 %d",&http_response)==1) {
-	  // got http response
-	  // fprintf(stderr,"HTTP Response = %d\n",http_response);
-	}
-	if (sscanf(line,"HTTP/1.1 %d",&http_response)==1) {
-	  // got http response
-	  // fprintf(stderr,"HTTP Response = %d\n",http_response);
-	}
-	len=0;
-	// Have we found end of headers?
-	if (empty_count==3) break;
-      } else len++;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
+int http_buffer_free(struct http_buffer *b)
+{
+  if (b->data) {
+    if (b->mmapped) munmap(b->data,b->alloc);
+    else free(b->data);
   }
+  if (b->mmapped) close(b->spill_fd);
+  bzero(b,sizeof(struct http_buffer));
+  return 0;
+}
 
-  // Got headers, read body and write to file
-  // fprintf(stderr,"  reading body...\n");
+const char *http_spill_dir(void)
+{
+  const char *dir=getenv("TMPDIR");
+  if (dir&&dir[0]) return dir;
+  return "/tmp";
+}
 
-  int rxlen=0;
-  r=0;
-  while(r>-1) {
-    errno=0;
-    r=read_nonblock(sock,line,LINE_BYTES);
-    if (r>0) {
-      // fprintf(stderr,"read %d body bytes @ T%lld\n",r,timeout_time-gettime_ms());
-      if (last_read_time) *last_read_time=gettime_ms();
-      int written=fwrite(line,1,r,outfile);      
-      if (written!=r) {
-	fprintf(stderr,"Short write of HTTP data to file: %d of %d bytes\n",written,r);
-	close(sock);
-	return -1;
-      }
-      fflush(outfile);
-      rxlen+=r;
-      if (content_length>-1) {
-	if (rxlen>=content_length) break;
-      }
-    } else {
-      // If no error and no data, then it really is EOF
-      if (!errno) break;
-      // ... else, wait a little while, and try again.
-      usleep(10000);
+// Make sure that there is space for at least len bytes in the buffer.
+// Buffers for bodies larger than HTTP_SPILL_THRESHOLD are backed by an unlinked
+// temporary file, so that large bundles don't have to fit in RAM.
+int http_buffer_reserve(struct http_buffer *b,int len)
+{
+  if (len<=b->alloc) return 0;
+
+  if (b->mmapped) {
+    // Extend the spill file and map it again. The mapping is shared, so the
+    // bytes already received are still there in the file.
+    if (ftruncate(b->spill_fd,len)) { perror("ftruncate"); return -1; }
+    unsigned char *m=mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,b->spill_fd,0);
+    if (m==MAP_FAILED) { perror("mmap"); return -1; }
+    munmap(b->data,b->alloc);
+    b->data=m;
+    b->alloc=len;
+    return 0;
+  }
+
+  if (len>HTTP_SPILL_THRESHOLD) {
+    char filename[1024];
+    if (snprintf(filename,1024,"%s/lbard-spill.XXXXXX",http_spill_dir())>=1024) {
+      fprintf(stderr,"Spill directory name is too long\n");
+      return -1;
     }
+    int fd=mkstemp(filename);
+    if (fd<0) { perror("mkstemp"); return -1; }
+    unlink(filename);
+    if (ftruncate(fd,len)) { perror("ftruncate"); close(fd); return -1; }
+    unsigned char *m=mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (m==MAP_FAILED) { perror("mmap"); close(fd); return -1; }
+    if (b->len) bcopy(b->data,m,b->len);
+    free(b->data);
+    b->data=m;
+    b->alloc=len;
+    b->mmapped=1;
+    b->spill_fd=fd;
+    return 0;
+  }
 
-    if (gettime_ms()>timeout_time) {
-      fprintf(stderr,"HTTP read timeout (read %d of %d bytes)\n",
-	      rxlen,content_length);
-      close(sock);
+  unsigned char *d=realloc(b->data,len);
+  if (!d) return -1;
+  b->data=d;
+  b->alloc=len;
+  return 0;
+}
+
+int http_buffer_sink(void *context,unsigned char *data,int len)
+{
+  struct http_buffer *b=context;
+  if ((b->len+len)>b->alloc) {
+    int size=b->alloc?b->alloc:65536;
+    while(size<(b->len+len)) size*=2;
+    if (http_buffer_reserve(b,size)) {
+      fprintf(stderr,"Could not grow HTTP buffer beyond %d bytes\n",b->alloc);
       return -1;
     }
-    
   }
+  bcopy(data,&b->data[b->len],len);
+  b->len+=len;
+  return 0;
+}
+
+int http_get_buffer(char *server_and_port, char *auth_token,
+		    char *path, struct http_buffer *b, int timeout_ms)
+{
+  // Send simple HTTP request to server, and read the body straight into memory.
+
+  char server_name[1024];
+  int server_port=-1;
+
+  bzero(b,sizeof(struct http_buffer));
+  
+  if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return -1;
+
+  long long timeout_time=gettime_ms()+timeout_ms;
   
-  close(sock);
-  {
-    struct stat s;
-    int r=fstat(fileno(outfile),&s);
-    if (0) fprintf(stderr,"  HTTP download file: length=%lld, stat result=%d\n",
-		   (long long)s.st_size,r);
-    if (errno) perror("fstat");
-    if (s.st_size<content_length) {
-      fprintf(stderr,"  HTTP download file is too short. Returning error.\n");
+  if (auth_token&&strlen(auth_token)>500) return -1;
+  if (strlen(path)>500) return -1;
+  
+  // Big enough for the longest path, credentials and server name we accept
+  char request[4096];
+  char authdigest[1024];
+  int request_len;
+  int zero=0;
+
+  if (auth_token) {
+    bzero(authdigest,1024);
+    base64_append(authdigest,&zero,(unsigned char *)auth_token,strlen(auth_token));
+  }
+
+  // Build request
+  if (auth_token)
+    request_len=snprintf(request,sizeof(request),
+	     "GET %s HTTP/1.1\r\n"
+	     "Authorization: Basic %s\r\n"
+	     "Host: %s:%d\r\n"
+	     "Accept: */*\r\n"
+	     "\r\n",
+	     path,
+	     authdigest,
+	     server_name,server_port);
+  else
+    request_len=snprintf(request,sizeof(request),
+	     "GET %s HTTP/1.1\r\n"
+	     "Host: %s:%d\r\n"
+	     "Accept: */*\r\n"
+	     "\r\n",
+	     path,
+	     server_name,server_port);
+  if (request_len<0||request_len>=sizeof(request)) {
+    fprintf(stderr,"HTTP request for %s is too long.\n",path);
+    return -1;
+  }
+
+  int http_response=-999;
+  struct http_connection *c=http_request(server_and_port,request,request_len,
+					 timeout_time,NULL,&http_response);
+  if (!c) return -1;
+
+  int content_length=c->content_length;
+  if ((content_length>=0)&&(!c->chunked)) {
+    // We know how big the body is, so read it directly into a buffer of the
+    // right size.
+    if (http_buffer_reserve(b,content_length?content_length:1)) {
+      http_connection_close(c);
       return -1;
     }
+    b->len=http_read_body_direct(c,b->data,content_length,timeout_time);
+  } else {
+    if (http_read_body(c,timeout_time,http_buffer_sink,b,NULL)<0) {
+      http_connection_close(c);
+      http_buffer_free(b);
+      return -1;
+    }
+    content_length=b->len;
+  }
+  http_connection_release(c);
 
+  if (b->len<content_length) {
+    fprintf(stderr,"  HTTP body is too short (%d of %d bytes). Returning error.\n",
+	    b->len,content_length);
+    http_buffer_free(b);
+    return -1;
   }
   
   return http_response;
 }
 
-int http_post_bundle(char *server_and_port, char *auth_token,
-		     char *path,
-		     unsigned char *manifest_data, int manifest_length,
-		     unsigned char *body_data, int body_length,
-		    int timeout_ms)
+/*
+  Build the multipart POST request for inserting a bundle into servald.
+  Returns a malloc()'d buffer that the caller must free, or NULL on error.
+*/
+char *http_build_bundle_post(char *server_and_port, char *auth_token,
+			     char *path,
+			     unsigned char *manifest_data, int manifest_length,
+			     unsigned char *body_data, int body_length,
+			     int *request_length)
 {
 
   char server_name[1024];
   int server_port=-1;
 
   // Limit bundle size to 5MB via this transport, to limit memory consumption.
-  if (body_length>(5*1024*1024)) return -1;
+  if (body_length>(5*1024*1024)) return NULL;
   
-  if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return -1;
+  if (sscanf(server_and_port,"%[^:]:%d",server_name,&server_port)!=2) return NULL;
 
-  long long timeout_time=gettime_ms()+timeout_ms;
+  if (strlen(auth_token)>500) return NULL;
+  if (strlen(path)>500) return NULL;
+  if (manifest_length>4096) return NULL;
   
-  if (strlen(auth_token)>500) return -1;
-  if (strlen(path)>500) return -1;
-  
-  char request[8192+body_length];
+  char *request=malloc(8192+body_length);
+  if (!request) return NULL;
   char authdigest[1024];
   int zero=0;
 
@@ -520,48 +1099,35 @@ int http_post_bundle(char *server_and_port, char *auth_token,
 		  "    subtotal_len=%d, difference+present=%d (should match content_length)\n",
 		  subtotal_len,total_len-subtotal_len+present_len);
   
-  int sock=connect_to_port(server_name,server_port);
-  if (sock<0) return -1;
+  *request_length=total_len;
+  return request;
+}
+
+int http_post_bundle(char *server_and_port, char *auth_token,
+		     char *path,
+		     unsigned char *manifest_data, int manifest_length,
+		     unsigned char *body_data, int body_length,
+		    int timeout_ms)
+{
+  long long timeout_time=gettime_ms()+timeout_ms;
 
-  // Write request
-  write_all(sock,request,total_len);
+  int total_len=0;
+  char *request=http_build_bundle_post(server_and_port,auth_token,path,
+				       manifest_data,manifest_length,
+				       body_data,body_length,&total_len);
+  if (!request) return -1;
 
-  // Read reply, streaming output to file after we have skipped the header
   int http_response=-1;
-  char line[1024];
-  int len=0;
-  int empty_count=0;
-  set_nonblock(sock);
-  int r;
-  while(len<1024) {
-    r=read_nonblock(sock,&line[len],1);
-    if (r==1) {
-      if ((line[len]=='\n')||(line[len]=='\r')) {
-	if (len) empty_count=0; else empty_count++;
-	line[len+1]=0;
-	// if (len) printf("Line of response: %s\n",line);
-	if (sscanf(line,"HTTP/1.0 %d",&http_response)==1) {
-	  // got http response
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,path);
-	}
-	if (sscanf(line,"HTTP/1.1 %d",&http_response)==1) {
-	  // got http response
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,path);
-	}
-	len=0;
-	// Have we found end of headers?
-	if (empty_count==3) break;
-      } else len++;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // If still in header, just quit on timeout
-      close(sock); 
-      return -1;
-    }
-  }
-  close(sock);
+  struct http_connection *c=http_request(server_and_port,request,total_len,
+					 timeout_time,NULL,&http_response);
+  free(request);
+  if (!c) return -1;
+  if (http_response<200 || http_response > 209)
+    fprintf(stderr,"HTTP Error: %d\n     (URL: '%s')\n",http_response,path);
+
+  // Discard the body of the response, so that the connection can be reused
+  http_read_body(c,timeout_time,NULL,NULL,NULL);
+  http_connection_release(c);
   return http_response;  
 }
 
@@ -655,51 +1221,17 @@ int http_post_meshms_common(char *server_and_port, char *auth_token,
 
   //  fprintf(stderr,"Request:\n%s\n",request);
   
-  int sock=connect_to_port(server_name,server_port);
-  if (sock<0) return -1;
-
-  // Write request
-  write_all(sock,request,total_len);
-
-  // Read reply, streaming output to file after we have skipped the header
   int http_response=-1;
-  char line[1024];
-  int len=0;
-  int empty_count=0;
-  set_nonblock(sock);
-  int r;
-  while(len<1024) {
-    r=read_nonblock(sock,&line[len],1);
-    if (r==1) {
-      if ((line[len]=='\n')||(line[len]=='\r')) {
-	if (len) empty_count=0; else empty_count++;
-	line[len+1]=0;
-	// if (len) printf("Line of response: %s\n",line);
-	if (sscanf(line,"HTTP/1.0 %d",&http_response)==1) {
-	  // got http response
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,url);
-	  
-	}
-	if (sscanf(line,"HTTP/1.1 %d",&http_response)==1) {
-	  // got http response
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,url);
-	}
-	len=0;
-	// Have we found end of headers?
-	if (empty_count==3) break;
-      } else len++;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
-  close(sock);
+  struct http_connection *c=http_request(server_and_port,request,total_len,
+					 timeout_time,NULL,&http_response);
+  if (!c) return -1;
+  if (http_response<200 || http_response > 209)
+    fprintf(stderr,"HTTP Error: %d\n     (URL: '%s')\n",http_response,url);
+
+  // Discard the body of the response, so that the connection can be reused
+  http_read_body(c,timeout_time,NULL,NULL,NULL);
+  http_connection_release(c);
   return http_response;
-  
 }
 
 int http_meshmb_post(char *server_and_port, char *auth_token,
@@ -771,56 +1303,22 @@ int http_json_request(char *server_and_port, char *auth_token,
 
   // fprintf(stderr,"Request:\n%s\n",request);
   
-  int sock=connect_to_port(server_name,server_port);
-  if (sock<0) {
-    fprintf(stderr,"Could not open socket to servald\n");
+  int http_response=-1;
+  struct http_connection *c=http_request(server_and_port,request,total_len,
+					 timeout_time,NULL,&http_response);
+  if (!c) {
+    fprintf(stderr,"Could not open socket to servald, or read response headers\n");
     return -1;
   }
-
-  // Write request
-  write_all(sock,request,total_len);
-
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response=-999;
-  char line[1024];
-  int len=0;
-  int empty_count=0;
-  set_nonblock(sock);
-  int r;
-  while(len<1024) {
-    r=read_nonblock(sock,&line[len],1);
-    if (r==1) {
-      if ((line[len]=='\n')||(line[len]=='\r')) {
-	if (len) empty_count=0; else empty_count++;
-	line[len+1]=0;
-	// if (len) printf("Line of response: %s\n",line);
-	if (sscanf(line,"HTTP/1.0 %d",&http_response)==1) {
-	  // got http response
-	  // fprintf(stderr,"  HTTP response from servald is: %d\n",http_response);
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,url);
-	}
-	if (sscanf(line,"HTTP/1.1 %d",&http_response)==1) {
-	  // got http response
-	  // fprintf(stderr,"  HTTP response from servald is: %d\n",http_response);
-	  if (http_response<200 || http_response > 209)
-	    fprintf(stderr,"HTTP Error: %s\n     (URL: '%s')\n",line,url);
-	}
-	len=0;
-	// Have we found end of headers?
-	if (empty_count==3) break;
-      } else len++;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // If still in header, just quit on timeout
-      close(sock);
-      fprintf(stderr,"Premature end of data while reading HTTP headers\n");
-      return -1;
-    }
-  }
+  if (http_response<200 || http_response > 209)
+    fprintf(stderr,"HTTP Error: %d\n     (URL: '%s')\n",http_response,url);
 
   if (http_response>=200 && http_response <= 209)
-    json_body(sock,timeout_time);  
+    json_body(c,timeout_time);  
+  else {
+    http_read_body(c,timeout_time,NULL,NULL,NULL);
+    http_connection_release(c);
+  }
 
   return http_response;  
 }
@@ -948,7 +1446,8 @@ int http_get_async(char *server_and_port, char *auth_token,
 		   char *path, int timeout_ms)
 {
   // Send simple HTTP request to server, and return socket or -1 when we have parsed
-  // the headers.
+  // the headers.  The body is then read using http_read_next_line(), and the
+  // socket must be closed using http_close_async().
 
   char server_name[1024];
   int server_port=-1;
@@ -969,86 +1468,49 @@ int http_get_async(char *server_and_port, char *auth_token,
 
   // Build request
   snprintf(request,2048,
-	   "GET %s HTTP/1.1\n"
-	   "Authorization: Basic %s\n"
-	   "Host: %s:%d\n"
-	   "Accept: */*\n"
-	   "\n",
+	   "GET %s HTTP/1.1\r\n"
+	   "Authorization: Basic %s\r\n"
+	   "Host: %s:%d\r\n"
+	   "Accept: */*\r\n"
+	   "\r\n",
 	   path,
 	   authdigest,
 	   server_name,server_port);
   
-  int sock=connect_to_port(server_name,server_port);
-  if (sock<0) return -1;
-
-  write_all(sock,request,strlen(request));
-
-  // Read reply, streaming output to file after we have skipped the header
   int http_response=-1;
-  #define LINE_BYTES 65536
-  char line[LINE_BYTES];
-  int len=0;
-  int empty_count=0;
-  int content_length=-1;
-  int header_bytes=0;
-  set_nonblock(sock);
-  int r;
-  while(len<1024) {
-    header_bytes++;
-    r=read_nonblock(sock,&line[len],1);
-    if (r==1) {
-      if ((line[len]=='\n')||(line[len]=='\r')) {
-	if (len) empty_count=0; else empty_count++;
-	line[len+1]=0;
-	if (sscanf(line,"Content-Length: %d",&content_length)==1) {
-	  // got content length
-	}
-	if (sscanf(line,"HTTP/1.0 %d",&http_response)==1) {
-	  // got http response
-	}
-	if (sscanf(line,"HTTP/1.1 %d",&http_response)==1) {
-	  // got http response
-	}
-	len=0;
-	// Have we found end of headers?
-	if (empty_count==3) break;
-      } else len++;
-    } else usleep(1000);
-    if (gettime_ms()>timeout_time) {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
+  struct http_connection *c=http_request(server_and_port,request,strlen(request),
+					 timeout_time,NULL,&http_response);
+  if (!c) return -1;
 
   // Got headers
-  if (0) printf("Read %d header bytes (response code %d). Ready for async fetch.\n",
-		header_bytes,http_response);
-  return sock;
+  if (0) printf("Read headers (response code %d). Ready for async fetch.\n",
+		http_response);
+  return c->sock;
 }
 
 int http_read_next_line(int sock, char *line, int *len, int maxlen)
 {
-  set_nonblock(sock);
-  int r;
+  struct http_connection *c=http_connection_by_socket(sock);
+  if (!c) return 1;
+  
   while((*len)<maxlen) {
-    errno=0;
-    r=read_nonblock(sock,&line[*len],1);
-    if (r==1) {
-      if ((line[*len]=='\n')||(line[*len]=='\r')) {
-	line[(*len)+1]=0;
-	*len=0;
-	// Got a line
-	return 0;
-      } else (*len)++;
-    } else
+    if (c->buffer_offset==c->buffer_len) {
+      int r=http_fill(c,0);
       // Not enough data for a full line yet
-      return -1;
-    if ((!r)&&(!errno)) {
-      // End of connection
-      close(sock);
-      return 1;
+      if (r==HTTP_FILL_TIMEOUT) return -1;
+      if (r<=0) {
+	// End of connection
+	http_connection_close(c);
+	return 1;
+      }
     }
+    line[*len]=c->buffer[c->buffer_offset++];
+    if ((line[*len]=='\n')||(line[*len]=='\r')) {
+      line[(*len)+1]=0;
+      *len=0;
+      // Got a line
+      return 0;
+    } else (*len)++;
   }
 
   // Over-long line: truncate and return
@@ -1057,3 +1519,58 @@ int http_read_next_line(int sock, char *line, int *len, int maxlen)
   return 0;
 }
 
+/*
+  Return the next complete line of an async response, without copying it out
+  of the connection's readahead buffer.  The line is NUL terminated in place, and
+  remains valid until the next call for this socket.  A partial line is simply
+  left in the buffer until the rest of it arrives, so parsing resumes cleanly
+  across partial reads.  Lines too long to fit in the buffer are discarded.
+
+  Returns 0 if a line was returned, -1 if no complete line is available yet, or
+  1 if the connection has ended, in which case it has been closed.
+*/
+int http_read_next_line_inplace(int sock, char **line, int *len)
+{
+  struct http_connection *c=http_connection_by_socket(sock);
+  if (!c) return 1;
+
+  while(1) {
+    unsigned char *start=&c->buffer[c->buffer_offset];
+    int available=c->buffer_len-c->buffer_offset;
+    unsigned char *eol=memchr(start,'\n',available);
+    if (eol) {
+      c->buffer_offset+=eol-start+1;
+      if (c->discarding_line) {
+	c->discarding_line=0;
+	continue;
+      }
+      *eol=0;
+      *len=eol-start;
+      if ((*len)&&(start[(*len)-1]=='\r')) start[--(*len)]=0;
+      *line=(char *)start;
+      return 0;
+    }
+    if (available>=HTTP_READAHEAD_BYTES) {
+      // Over-long line: throw it away
+      c->discarding_line=1;
+      c->buffer_offset=c->buffer_len;
+    }
+
+    int r=http_fill(c,0);
+    // Not enough data for a full line yet
+    if (r==HTTP_FILL_TIMEOUT) return -1;
+    if (r<=0) {
+      // End of connection
+      http_connection_close(c);
+      return 1;
+    }
+  }
+}
+
+int http_close_async(int sock)
+{
+  struct http_connection *c=http_connection_by_socket(sock);
+  if (c) return http_connection_close(c);
+  if (sock>=0) close(sock);
+  return 0;
+}
@@ -43,9 +43,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #include "sync.h"
 #include "lbard.h"
+#include "trace.h"
 
 char *inreach_gateway_ip=NULL;
 time_t inreach_gateway_time=0;
@@ -79,18 +82,20 @@ int urldecode(char *s)
   
 }
 
+/*
+  Work out the response to a complete request (headers and all, NUL
+  terminated), and write it to out.
+*/
 int http_process(struct sockaddr *cliaddr,
 		 char *servald_server,char *credential,
 		 char *my_sid_hex,
-		 int socket)
+		 char *request,FILE *out)
 {
-  char buffer[8192];
   char uri[8192];
   int version_major, version_minor;
   int offset;
-  int request_len = read(socket,buffer,8192);
-  if (debug_http) printf("Read %d bytes of request.\n",request_len);
-  int r=sscanf(buffer,"GET %[^ ] HTTP/%d.%d\n%n",
+  if (debug_http) printf("Read %d bytes of request.\n",(int)strlen(request));
+  int r=sscanf(request,"GET %8191[^ ] HTTP/%d.%d\n%n",
 	       uri,&version_major,&version_minor,&offset);
   if (debug_http) {
     printf("  scanned %d fields.\n",r);
@@ -153,8 +158,7 @@ int http_process(struct sockaddr *cliaddr,
 	  
 	}
 	
-	write_all(socket,m,strlen(m));
-	close(socket);
+	fputs(m,out);
 	return 0;      
       } else if (!strcasecmp(uri,"/inreachgateway/register")) {
 	if (inreach_gateway_ip) free(inreach_gateway_ip);
@@ -164,8 +168,7 @@ int http_process(struct sockaddr *cliaddr,
 	inreach_gateway_time=time(0);
 	char m[1024];
 	snprintf(m,1024,"HTTP/1.0 201 OK\nServer: Serval LBARD\n\n");
-	write_all(socket,m,strlen(m));
-	close(socket);
+	fputs(m,out);
 	return 0;	
       } else if (!strcasecmp(uri,"/inreachgateway/query")) {
 	char m[1024];
@@ -175,23 +178,19 @@ int http_process(struct sockaddr *cliaddr,
 		   (int)strlen(inreach_gateway_ip),inreach_gateway_ip);
 	else
 	  snprintf(m,1024,"HTTP/1.0 204 OK\nServer: Serval LBARD\n\n");
-	write_all(socket,m,strlen(m));
-	close(socket);
+	fputs(m,out);
 	return 0;	
       } else if (!strcasecmp(uri,"/js/Chart.min.js")) {
-	http_send_file(socket,"/etc/serval/Chart.min.js","text/javascript");
-	close(socket);
+	http_send_file(out,"/etc/serval/Chart.min.js","text/javascript");
 	return 0;
       } else if (!strcasecmp(uri,"/")) {
 	// Display default home page
 	// (now uses javascript to show individual parts of the page)
-	send_status_home_page(socket);
-	close(socket);
+	send_status_home_page(out);
 	return 0;	
       } else if (!strncasecmp(uri,"/status/",8)) {
 	// Report on current peer status
-	http_report_network_status(socket,&uri[8]);
-	close(socket);
+	http_report_network_status(out,&uri[8]);
 	return 0;	
       } else if (!strcasecmp(uri,"/avacado/testmode1")) {
 	system("/sbin/ifconfig adhoc0 down");
@@ -205,8 +204,7 @@ int http_process(struct sockaddr *cliaddr,
 		 "\n"
 		 "Test Mode #1 selected\n"
 		 );
-	write_all(socket,m,strlen(m));
-	close(socket);
+	fputs(m,out);
 	return 0;	
       } else if (!strncasecmp(uri,"/avacado/renamessid/",20)) {
 	char cmd[1024];
@@ -232,68 +230,420 @@ int http_process(struct sockaddr *cliaddr,
 		 "\n"
 		 "SSID Renamed\n"
 		 );
-	write_all(socket,m,strlen(m));
-	close(socket);
+	fputs(m,out);
+	return 0;	
+      } else if (!strcasecmp(uri,"/metrics")) {
+	// Counters for Prometheus, built in memory
+	http_report_metrics(out);
+	return 0;
+      } else if (!strcasecmp(uri,"/trace.bin")) {
+	// Snapshot of the binary event trace ring, for tracedecode
+	char *body=NULL;
+	size_t body_len=0;
+	FILE *f=open_memstream(&body,&body_len);
+	if (f) {
+	  trace_dump(f);
+	  fclose(f);
+	  http_send_buffer(out,body,body_len,"application/octet-stream");
+	  free(body);
+	}
+	return 0;
+      } else if (!strcasecmp(uri,"/timeaccounting.json")) {
+	// Main loop latency histograms
+	http_report_time_accounting_json(out);
 	return 0;	
       } else if (!strcasecmp(uri,"/status.json")) {
 	// Report on current peer status
-	http_report_network_status_json(socket);
-	close(socket);
+	http_report_network_status_json(out);
 	return 0;	
       } else {
 	// Unknown URL -- Pass to servald on port 4110
-	FILE *fsock=fdopen(socket,"w");
-	if (fsock) {
+	char *page=NULL;
+	size_t page_len=0;
+	FILE *f=open_memstream(&page,&page_len);
+	if (f) {
 	  long long last_read_time=0;
-	  int result=http_get_simple(servald_server,NULL,"/",fsock,2000,&last_read_time,1);
-	  fclose(fsock);
+	  int result=http_get_simple(servald_server,NULL,"/",f,2000,&last_read_time,1);
+	  fclose(f);
+	  if (result==200) fwrite(page,page_len,1,out);
+	  free(page);
 	  if (result==200) return 0;
 	}
       }
-    }
+    } else uri[0]=0;
   fprintf(stderr,"Saw unknown HTTP request '%s'\n",uri);
   char *m="HTTP/1.0 400 Couldn't parse message\nServer: Serval LBARD\n\n";
-  write_all(socket,m,strlen(m));
-  close(socket);
+  fputs(m,out);
   return 0;
 }
 
-int http_send_file(int socket,char *filename,char *mime_type)
+static int http_send_header(FILE *out,char *mime_type,int len)
+{
+  char m[1024];
+  snprintf(m,1024,
+	   "HTTP/1.0 200 OK\n"
+	   "Server: Serval LBARD\n"
+	   "Content-Type: %s\n"
+	   "Access-Control-Allow-Origin: *\n"
+	   "Access-Control-Allow-Methods: GET\n"
+	   "Content-length: %d\n\n",
+	   mime_type,
+	   len);
+  fputs(m,out);
+  return 0;
+}
+
+// Send a page that we have rendered in memory
+int http_send_buffer(FILE *out,char *data,int len,char *mime_type)
+{
+  http_send_header(out,mime_type,len);
+  fwrite(data,len,1,out);
+  return 0;
+}
+
+int http_send_file(FILE *out,char *filename,char *mime_type)
 {
   char m[1024];
   FILE *f=fopen(filename,"r");
   if (!f) {
     snprintf(m,1024,"HTTP/1.0 404 File not found\nServer: Serval LBARD\n\nCould not read file '%s'\n",filename);
-    write_all(socket,m,strlen(m));
+    fputs(m,out);
     return -1;
   }
   struct stat s;
   if (fstat(fileno(f),&s)) {
     snprintf(m,1024,"HTTP/1.0 404 File not found\nServer: Serval LBARD\n\nCould not read file '%s'\n",filename);
-    write_all(socket,m,strlen(m));
+    fputs(m,out);
+    fclose(f);
     return -1;
   }
 
   int len=s.st_size;
   
-  snprintf(m,1024,
-	   "HTTP/1.0 200 OK\n"
-	   "Server: Serval LBARD\n"
-	   "Content-Type: %s\n"
-	   "Access-Control-Allow-Origin: *\n"
-	   "Access-Control-Allow-Methods: GET\n"
-	   "Content-length: %d\n\n",
-	   mime_type,
-	   len);
-  write_all(socket,m,strlen(m));
+  http_send_header(out,mime_type,len);
 
   char buffer[1024+1];
   int count=fread(buffer,1,1024,f);
   while(count>0) {
-    write_all(socket,buffer,count);
+    fwrite(buffer,count,1,out);
     count=fread(buffer,1,1024,f);
   }
   fclose(f);
   return 0;
   
 }
+
+/*
+  Connections to our HTTP server.
+
+  Each connection is watched by the reactor, so that a slow or idle client
+  can't hold up the radio.  Requests are read into a fixed size buffer until
+  the blank line that ends the headers arrives, then the response is built in
+  memory and written out as fast as the client will take it.  Connections are
+  kept alive where HTTP/1.1 (or Connection: keep-alive) allows it, and the
+  response says how long it is.
+*/
+
+#define HTTP_MAX_CONNECTIONS 16
+#define HTTP_MAX_REQUEST 8192
+// How long a client has to send a complete request
+#define HTTP_REQUEST_TIMEOUT_MS 5000
+// How long a kept-alive connection can sit idle between requests
+#define HTTP_KEEPALIVE_TIMEOUT_MS 15000
+// How long a client can go without accepting any more of a response
+#define HTTP_SEND_TIMEOUT_MS 10000
+
+struct http_connection {
+  int fd;
+  struct sockaddr cliaddr;
+
+  char request[HTTP_MAX_REQUEST+1];
+  int request_len;
+
+  char *response;
+  size_t response_len;
+  size_t response_sent;
+  int keep_alive;
+  // The client has closed its end, so we just finish answering what it sent
+  int read_closed;
+
+  long long deadline;
+};
+
+static struct http_connection http_connections[HTTP_MAX_CONNECTIONS];
+static int http_connection_count=0;
+static int http_timer=-1;
+
+static void http_connection_close(struct http_connection *c)
+{
+  reactor_unwatch_fd(c->fd);
+  close(c->fd);
+  free(c->response);
+  *c=http_connections[--http_connection_count];
+}
+
+static struct http_connection *http_connection_find(int fd)
+{
+  for(int i=0;i<http_connection_count;i++)
+    if (http_connections[i].fd==fd) return &http_connections[i];
+  return NULL;
+}
+
+// Find the value of header name in a request, or NULL
+static char *http_request_header(char *request,char *name)
+{
+  int len=strlen(name);
+  char *line=strchr(request,'\n');
+  while(line&&line[1]&&line[1]!='\r'&&line[1]!='\n') {
+    line++;
+    if ((!strncasecmp(line,name,len))&&line[len]==':') {
+      line+=len+1;
+      while(*line==' '||*line=='\t') line++;
+      return line;
+    }
+    line=strchr(line,'\n');
+  }
+  return NULL;
+}
+
+static int http_header_is(char *value,char *token)
+{
+  return value&&(!strncasecmp(value,token,strlen(token)));
+}
+
+// Returns the length of the request at the head of the buffer, or 0 if we
+// don't have all of it yet.
+static int http_request_length(struct http_connection *c)
+{
+  c->request[c->request_len]=0;
+  char *crlf=strstr(c->request,"\r\n\r\n");
+  char *lf=strstr(c->request,"\n\n");
+  if (crlf&&((!lf)||crlf<lf)) return crlf+4-c->request;
+  if (lf) return lf+2-c->request;
+  return 0;
+}
+
+// Write as much of the response as the client will take.
+// Returns -1 if the connection should be closed.
+static int http_connection_send(struct http_connection *c)
+{
+  while(c->response_sent<c->response_len) {
+    ssize_t w=send(c->fd,&c->response[c->response_sent],
+		   c->response_len-c->response_sent,0
+#ifdef MSG_NOSIGNAL
+		   |MSG_NOSIGNAL
+#endif
+		   );
+    if (w<0) {
+      if (errno==EAGAIN||errno==EWOULDBLOCK||errno==EINTR) {
+	reactor_want_write(c->fd,1);
+	return 0;
+      }
+      if (debug_http) perror("send(HTTP response)");
+      return -1;
+    }
+    c->response_sent+=w;
+    c->deadline=gettime_ms()+HTTP_SEND_TIMEOUT_MS;
+  }
+
+  reactor_want_write(c->fd,0);
+  free(c->response);
+  c->response=NULL;
+  c->response_len=0;
+  c->response_sent=0;
+  if (!c->keep_alive) return -1;
+  if (c->read_closed&&!http_request_length(c)) return -1;
+  c->deadline=gettime_ms()+(c->request_len?HTTP_REQUEST_TIMEOUT_MS
+			    :HTTP_KEEPALIVE_TIMEOUT_MS);
+  return 0;
+}
+
+static int http_connection_respond_error(struct http_connection *c,char *status)
+{
+  char m[1024];
+  snprintf(m,1024,"HTTP/1.0 %s\nServer: Serval LBARD\nContent-length: 0\n\n",status);
+  c->response=strdup(m);
+  c->response_len=c->response?strlen(m):0;
+  c->response_sent=0;
+  c->keep_alive=0;
+  c->request_len=0;
+  return http_connection_send(c);
+}
+
+// Build and start sending the response to the request at the head of the buffer.
+static int http_connection_respond(struct http_connection *c,int request_len)
+{
+  char *request=c->request;
+  char saved=request[request_len];
+  request[request_len]=0;
+
+  // HTTP/1.1 is persistent unless the client says otherwise, HTTP/1.0 only
+  // if it asks.
+  char *connection=http_request_header(request,"Connection");
+  char *eol=strchr(request,'\n');
+  int http11=eol&&eol-request>=9
+    &&(!strncmp(eol-(eol[-1]=='\r'?9:8),"HTTP/1.1",8));
+  c->keep_alive=http11?!http_header_is(connection,"close")
+    :http_header_is(connection,"keep-alive");
+
+  char *body=NULL;
+  size_t body_len=0;
+  FILE *out=open_memstream(&body,&body_len);
+  if (!out) return http_connection_respond_error(c,"500 Out of memory");
+  // Some requests still wait for servald, so make sure that shows up
+  account_time("http_process()");
+  http_process(&c->cliaddr,servald_server,credential,my_sid_hex,request,out);
+  account_time("HTTP connection");
+  fclose(out);
+
+  request[request_len]=saved;
+  memmove(request,&request[request_len],c->request_len-request_len);
+  c->request_len-=request_len;
+
+  // We can only keep the connection if the client can tell where the
+  // response ends.
+  char *header_end=strstr(body,"\n\n");
+  if (c->keep_alive&&header_end
+      &&strcasestr(body,"\nContent-length:")
+      &&strcasestr(body,"\nContent-length:")<header_end) {
+    char *status_end=strchr(body,'\n');
+    char *m="Connection: keep-alive\n";
+    char *response=malloc(body_len+strlen(m));
+    if (response) {
+      int status_len=status_end+1-body;
+      memcpy(response,body,status_len);
+      memcpy(&response[status_len],m,strlen(m));
+      memcpy(&response[status_len+strlen(m)],&body[status_len],body_len-status_len);
+      free(body);
+      body=response;
+      body_len+=strlen(m);
+    } else c->keep_alive=0;
+  } else c->keep_alive=0;
+
+  c->response=body;
+  c->response_len=body_len;
+  c->response_sent=0;
+  c->deadline=gettime_ms()+HTTP_SEND_TIMEOUT_MS;
+  return http_connection_send(c);
+}
+
+// Connections move about in http_connections[], so we find them by fd
+int http_connection_ready(int fd,void *context)
+{
+  struct http_connection *c=http_connection_find(fd);
+  if (!c) {
+    reactor_unwatch_fd(fd);
+    close(fd);
+    return -1;
+  }
+
+  if (c->response&&http_connection_send(c)) {
+    http_connection_close(c);
+    return 0;
+  }
+
+  if ((!c->read_closed)&&c->request_len<HTTP_MAX_REQUEST) {
+    ssize_t r=read(fd,&c->request[c->request_len],HTTP_MAX_REQUEST-c->request_len);
+    if (r<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK&&errno!=EINTR) {
+      http_connection_close(c);
+      return 0;
+    }
+    if (r==0) {
+      // Half-closed (e.g., shutdown(SHUT_WR) after sending the request):
+      // finish any response, and answer any complete requests, then close.
+      c->read_closed=1;
+      if ((!c->response)&&(!http_request_length(c))) {
+	http_connection_close(c);
+	return 0;
+      }
+    }
+    if (r>0) {
+      if ((!c->request_len)&&(!c->response))
+	c->deadline=gettime_ms()+HTTP_REQUEST_TIMEOUT_MS;
+      c->request_len+=r;
+    }
+  }
+
+  // Deal with as many (pipelined) requests as we can before the client
+  // stops reading.
+  while(!c->response) {
+    int len=http_request_length(c);
+    if (!len) {
+      if (c->read_closed) {
+	http_connection_close(c);
+	return 0;
+      }
+      if (c->request_len<HTTP_MAX_REQUEST) break;
+      if (http_connection_respond_error(c,"431 Request header fields too large")) {
+	http_connection_close(c);
+	return 0;
+      }
+      break;
+    }
+    if (http_connection_respond(c,len)) {
+      http_connection_close(c);
+      return 0;
+    }
+  }
+
+  // Descriptors are level-triggered, so don't ask to hear about input we
+  // aren't going to read.
+  reactor_want_read(fd,(!c->read_closed)&&c->request_len<HTTP_MAX_REQUEST);
+  return 0;
+}
+
+// Close connections that have gone quiet.  Deadlines can move closer while we
+// sleep, so we check every second while there are any connections.
+static long long http_connection_timer(long long now,void *context)
+{
+  long long next=http_connection_count?now+1000:now+3600000;
+  for(int i=0;i<http_connection_count;) {
+    if (http_connections[i].deadline<=now) {
+      if (debug_http) printf("Closing idle HTTP connection\n");
+      http_connection_close(&http_connections[i]);
+      continue;
+    }
+    if (http_connections[i].deadline<next) next=http_connections[i].deadline;
+    i++;
+  }
+  return next;
+}
+
+// Accept all pending connections on our listening socket
+int http_accept(int listen_fd)
+{
+  while(1) {
+    struct sockaddr cliaddr;
+    socklen_t addrlen=sizeof(cliaddr);
+    int s=accept(listen_fd,&cliaddr,&addrlen);
+    if (s<0) return 0;
+    set_nonblock(s);
+
+    if (http_connection_count>=HTTP_MAX_CONNECTIONS) {
+      char *m="HTTP/1.0 503 Too many connections\nServer: Serval LBARD\nContent-length: 0\n\n";
+      send(s,m,strlen(m),0
+#ifdef MSG_NOSIGNAL
+	   |MSG_NOSIGNAL
+#endif
+	   );
+      close(s);
+      continue;
+    }
+
+    struct http_connection *c=&http_connections[http_connection_count];
+    bzero(c,sizeof(*c));
+    c->fd=s;
+    c->cliaddr=cliaddr;
+    c->deadline=gettime_ms()+HTTP_REQUEST_TIMEOUT_MS;
+    if (reactor_watch_fd(s,"HTTP connection",http_connection_ready,NULL)) {
+      close(s);
+      continue;
+    }
+    http_connection_count++;
+
+    if (http_timer<0)
+      http_timer=reactor_add_timer("HTTP connection timeouts",gettime_ms()+1000,
+				   http_connection_timer,NULL);
+    else reactor_timer_set_due(http_timer,gettime_ms()+1000);
+  }
+}
@@ -49,6 +49,7 @@
 #include "radios.h"
 #include "hf.h"
 #include "code_instrumentation.h"
+#include "trace.h"
 
 extern int serial_errors;
 
@@ -220,10 +221,316 @@ void crash_handler(int signal)
   exit(0);
 }
 
+// Only note the signal here: the main loop then exits normally, so that the
+// atexit() handlers (e.g., the function profile dump) run outside of signal
+// context.
+volatile sig_atomic_t stop_signal=0;
+
+void stop_handler(int signal)
+{
+  stop_signal=signal;
+}
+
 unsigned int option_flags=0;
 
 char *serial_port = "/dev/null";
 
+int timesocket = -1;
+int httpsocket = -1;
+
+// Token for fetching only new bundles from servald's bundle list
+char bundlelist_token[1024] = "";
+int bundlelist_watched_socket = -1;
+
+int message_update_timer = -1;
+
+/*
+  The main loop is driven by the event reactor (see reactor.c): the following
+  are called either when one of our file descriptors becomes readable, or when
+  one of our timers falls due.
+*/
+
+int main_radio_readable(int fd, void *context)
+{
+  radio_read_bytes(fd, monitor_mode);
+
+  // Let the radio driver react to what it has just received straight away,
+  // and if that has made the radio ready for a message that is already due,
+  // send it now instead of waiting for the next retry.
+  radio_types[radio_get_type()].serviceloop(fd);
+  if (radio_ready() && (gettime_ms() >= next_message_update_time))
+  {
+    reactor_timer_set_due(message_update_timer, gettime_ms());
+  }
+  return 0;
+}
+
+long long main_radio_service(long long now, void *context)
+{
+  radio_types[radio_get_type()].serviceloop(serialfd);
+  return now + RADIO_SERVICE_INTERVAL_MS;
+}
+
+int main_outernet_readable(int fd, void *context)
+{
+  return outernet_rx_serviceloop();
+}
+
+int main_stun_readable(int fd, void *context)
+{
+  return stun_serviceloop();
+}
+
+int main_time_readable(int fd, void *context)
+{
+  unsigned char msg[1024];
+  int r;
+
+  while ((r = recvfrom(fd, msg, 1024, MSG_DONTWAIT, NULL, 0)) >= 0)
+  {
+    if (r == (1+1+8+3)) 
+    {
+      // see rxmessages.c for more explanation
+      int offset = 1;
+      int stratum = msg[offset++];
+      struct timeval tv;
+      bzero(&tv, sizeof(struct timeval));
+      for (int i = 0; i < 8; i++) 
+      {
+        tv.tv_sec|=msg[offset++]<<(i*8);
+      }
+
+      for (int i = 0; i < 3; i++) 
+      {
+        tv.tv_usec|=msg[offset++]<<(i*8);
+      }
+
+      // ethernet delay is typically 0.1 - 5ms, so assume 5ms
+      tv.tv_usec += 5000;
+
+      saw_timestamp("          UDP", stratum, &tv);
+    }
+  }
+  return 0;
+}
+
+int main_http_accept(int fd, void *context)
+{
+  // Each connection is then serviced by the reactor (see httpd.c)
+  return http_accept(fd);
+}
+
+int main_bundlelist_readable(int fd, void *context);
+
+// Read what we can of the bundle list from servald, and make sure that we are
+// waiting on whichever socket it is currently coming in on.
+int main_service_bundlelist(void)
+{
+  load_rhizome_db_async(servald_server, credential, bundlelist_token);
+
+  if ((bundlelist_watched_socket >= 0)
+      && (bundlelist_watched_socket != load_rhizome_db_socket))
+  {
+    reactor_unwatch_fd(bundlelist_watched_socket);
+  }
+  if (load_rhizome_db_socket >= 0)
+  {
+    reactor_watch_fd(load_rhizome_db_socket, "load_rhizome_db_async()",
+                     main_bundlelist_readable, NULL);
+  }
+  bundlelist_watched_socket = load_rhizome_db_socket;
+  return 0;
+}
+
+int main_bundlelist_readable(int fd, void *context)
+{
+  return main_service_bundlelist();
+}
+
+long long main_bundlelist_timer(long long now, void *context)
+{
+  // Opens a new request when the last one has finished, and times out
+  // stalled ones.
+  main_service_bundlelist();
+  return now + BUNDLELIST_SERVICE_INTERVAL_MS;
+}
+
+long long main_periodic_requests(long long now, void *context)
+{
+  make_periodic_requests();
+  return now + 1000;
+}
+
+long long main_message_update(long long now, void *context)
+{
+  unsigned char msg_out[LINK_MTU];
+
+  // Deal gracefully with clocks that run backwards from time to time.
+  if (last_message_update_time > now)
+  {
+    LOG_WARN("Clock went backwards: clock delta=%lld",last_message_update_time-now);
+    last_message_update_time = now;
+  }
+
+  // The clock may have been stepped since we were scheduled
+  if (now < next_message_update_time)
+  {
+    return next_message_update_time;
+  }
+
+  account_time("time server: announce ");
+
+  if (! time_server) 
+  {
+    // Decay my time stratum slightly
+    if (my_time_stratum < 0xffff)
+    {
+      my_time_stratum++;
+    }
+  } 
+  else 
+  {
+    my_time_stratum = 0x0100;
+  }
+
+  // Send time packet
+  if (udp_time && (timesocket != -1)) 
+  {
+    // Occassionally announce our time
+    // T + (our stratum) + (64 bit seconds since 1970) +
+    // + (24 bit microseconds)
+    // = 1+1+8+3 = 13 bytes
+    unsigned char msg_out[1024];
+    int offset=0;
+    append_timestamp(msg_out,&offset);
+
+    // Now broadcast on every interface to port 0x5401
+    // Oh that's right, UDP sockets don't have an easy way to do that.
+    // We could interrogate the OS to ask about all interfaces, but we
+    // can instead get away with having a single simple broadcast address
+    // supplied as part of the timeserver command line argument.
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr)); 
+    addr.sin_family = AF_INET; 
+    addr.sin_port = htons(0x5401);
+    int i;
+    for ( i = 0; time_broadcast_addrs[i]; i++) 
+    {
+      addr.sin_addr.s_addr = inet_addr(time_broadcast_addrs[i]);
+      errno=0;
+      sendto(
+        timesocket,
+        msg_out,
+        offset,
+        MSG_DONTROUTE
+        | MSG_DONTWAIT
+#ifdef MSG_NOSIGNAL
+        | MSG_NOSIGNAL
+#endif         
+       , (const struct sockaddr *)&addr, 
+       sizeof(addr));
+    }
+    // printf("--- Sent %d time announcement packets.\n",i);
+  }
+
+  account_time("update_my_message()");
+
+  if (monitor_mode)
+  {
+    return gettime_ms() + message_update_interval;
+  }
+
+  if (! radio_ready())
+  {
+    // Try again shortly. We also get kicked when bytes arrive from the radio.
+    return gettime_ms() + RADIO_NOT_READY_RETRY_MS;
+  }
+
+  update_my_message(
+    serialfd,
+    my_sid,
+    my_sid_hex,
+    LINK_MTU,
+    msg_out,
+    servald_server,
+    credential);
+
+  // Vary next update time by upto 250ms, to prevent radios getting lock-stepped.
+  if (message_update_interval_randomness)
+  {
+    next_message_update_time = gettime_ms() + (random()%message_update_interval_randomness) + message_update_interval;
+  }
+  else
+  {
+    next_message_update_time = gettime_ms() + message_update_interval;
+  }
+  return next_message_update_time;
+}
+
+long long main_status_dump(long long now, void *context)
+{
+  // Update the state file to help debug things
+  // (but not too often, since it is SLOW on the MR3020s
+  //  XXX fix all those linear searches, and it will be fine!)
+  if (last_status_time>time(0)) 
+  {
+    last_status_time=time(0);
+  }
+
+  if (time(0) > last_status_time) {
+    last_status_time = time(0) + 2;
+    status_dump();
+  }
+  return now + 1000;
+}
+
+// Things that only need checking about once a second
+long long main_housekeeping(long long now, void *context)
+{
+  account_time("ID regenerate");
+
+  // Refresh our instance ID every four minutes, so that any bundle list sync bugs
+  // can only block transmission for a few minutes.
+  if ((time(0) - last_instance_time) > 240) 
+  {
+    my_instance_id = 0;
+    while(my_instance_id == 0)
+    {
+      urandombytes((unsigned char *) &my_instance_id, sizeof(unsigned int));
+    }
+
+    last_instance_time = time(0);
+  }
+
+  account_time("stuck serial reboot check");
+
+  if ((serial_errors>20) && reboot_when_stuck) 
+  {
+    LOG_ERROR("rebooting");        
+    // If we are unable to write to the serial port repeatedly for a while,
+    // we could be facing funny serial port behaviour bugs that we see on the MR3020.
+    // In which case, if authorised, ask the MR3020 to reboot
+    system("reboot");
+  }
+
+  // Keep trying to open the STUN port if someone else had it when we started.
+  if ((! nostun) && (stun_socket() >= 0))
+  {
+    reactor_watch_fd(stun_socket(), "stun_serviceloop()",
+                     main_stun_readable, NULL);
+  }
+
+  account_time("show_progress()");
+
+  if (time(0) > last_summary_time) 
+  {
+    last_summary_time = time(0);
+    show_progress(stderr, 0);
+  }
+
+  return now + 1000;
+}
+
 int main(int argc, char **argv)
 {
   int exitVal = 0;
@@ -717,6 +1024,26 @@ int main(int argc, char **argv)
           debug_noprioritisation = 1;
           LOG_NOTE("debug_noprioritisation set to 1");
         }
+        else if (! strcasecmp("trace", argv[n])) 
+        {
+          // Record events in the trace ring, for /trace.bin
+          if (trace_enable()) {
+            exitVal = -1;
+            break;
+          }
+          LOG_NOTE("trace ring enabled");
+        }
+        else if (! strncasecmp("trace=", argv[n], 6)) 
+        {
+          // ... and also write them to a file as we go
+          if (trace_start_writer(&argv[n][6])) {
+            fprintf(stderr,"Could not write trace to '%s'\n",&argv[n][6]);
+            exitVal = -1;
+            break;
+          }
+          LOG_NOTE("trace file: %s", &argv[n][6]);
+          fprintf(stderr,"Writing binary trace to '%s'\n",&argv[n][6]);
+        }
         else if (! strcasecmp("nohttpd", argv[n])) 
         {
           http_server = 0;
@@ -812,7 +1139,6 @@ int main(int argc, char **argv)
 
     // Open UDP socket to listen for time updates from other LBARD instances
     // (poor man's NTP for LBARD nodes that lack internal clocks)
-    int timesocket = -1;
     if (udp_time) 
     {
       timesocket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -845,7 +1171,6 @@ int main(int argc, char **argv)
     // HTTP Server socket for accepting MeshMS message submission via web form
     // (Used for sending anonymous messages to a help desk for a mesh network, and
     //  for providing simple web-based diagnostics).
-    int httpsocket=-1;
     if (http_server) 
     {
       httpsocket=socket(AF_INET, SOCK_STREAM, 0);
@@ -869,261 +1194,77 @@ int main(int argc, char **argv)
       
     }
 
-    char token[1024] = "";
-    
-    while (exitVal == 0) 
+    if (radio_get_type() < 0)
     {
-      unsigned char msg_out[LINK_MTU];
-
-      account_time("ID regenerate");
-
-      // Refresh our instance ID every four minutes, so that any bundle list sync bugs
-      // can only block transmission for a few minutes.
-      if ((time(0) - last_instance_time) > 240) 
-      {
-        my_instance_id = 0;
-        while(my_instance_id == 0)
-        {
-          urandombytes((unsigned char *) &my_instance_id, sizeof(unsigned int));
-        }
-
-        last_instance_time = time(0);
-      }
-      
-      account_time("radio_read_bytes()");
-      
-      radio_read_bytes(serialfd, monitor_mode);
-
-      account_time("outernet_rx_serviceloop()");
-      
-      outernet_rx_serviceloop();
-      
-      account_time("load_rhizome_db_async()");
-
-      load_rhizome_db_async(servald_server, credential, token);
-
-      account_time("make_periodic_requests()");
-
-      make_periodic_requests();
-
-      account_time("radio.serviceloop()");
+      LOG_ERROR("Unknown radio type");
+      fprintf(stderr,"ERROR: Connected to unknown radio type.\n");
+      exitVal = -1;
+      break;
+    }
+    if (! radio_types[radio_get_type()].serviceloop) 
+    {
+      LOG_ERROR("Illegal radio type");
+      fprintf(
+        stderr,
+        "Radio type set to illegal value %d\n",
+        radio_get_type());
+      exitVal = -1;
+      break;
+    }
 
-      if (radio_get_type() >= 0) 
-      {
-        if (! radio_types[radio_get_type()].serviceloop) 
-        {
-          LOG_ERROR("Illegal radio type");
-          fprintf(
-            stderr,
-            "Radio type set to illegal value %d\n",
-            radio_get_type());
-          exitVal = -1;
-          break;
-        }
+    if (reactor_init())
+    {
+      LOG_ERROR("Could not initialise event reactor");
+      exitVal = -1;
+      break;
+    }
 
-        radio_types[radio_get_type()].serviceloop(serialfd);
-      }
-      else 
+    // Everything from here on happens either when one of these file
+    // descriptors becomes readable, or when one of the timers falls due.
+    if (serialfd >= 0)
+    {
+      if (reactor_watch_fd(serialfd, "radio_read_bytes()", main_radio_readable, NULL))
       {
-        LOG_ERROR("Unknown radio type");
-        fprintf(stderr,"ERROR: Connected to unknown radio type.\n");
+        LOG_ERROR("Could not watch serial port for received bytes");
         exitVal = -1;
         break;
       }
+    }
+    if (timesocket >= 0)
+    {
+      reactor_watch_fd(timesocket, "time server: rx ", main_time_readable, NULL);
+    }
+    if (httpsocket >= 0)
+    {
+      reactor_watch_fd(httpsocket, "HTTP accept()", main_http_accept, NULL);
+    }
+    if (outernet_socket >= 0)
+    {
+      reactor_watch_fd(outernet_socket, "outernet_rx_serviceloop()",
+                       main_outernet_readable, NULL);
+    }
 
-      account_time("time server: reverse timeflow check");
-
-      // Deal gracefully with clocks that run backwards from time to time.
-      if (last_message_update_time > gettime_ms())
-      {
-        LOG_WARN("Clock went backwards: clock delta=%lld",last_message_update_time-gettime_ms());
-        last_message_update_time = gettime_ms();
-      }
-      
-      account_time("time server: announce ");
-      
-      if (gettime_ms() >= next_message_update_time)
-      {
-        if (! time_server) 
-        {
-          // Decay my time stratum slightly
-          if (my_time_stratum < 0xffff)
-          {
-            my_time_stratum++;
-          }
-        } 
-        else 
-        {
-          my_time_stratum = 0x0100;
-        }
-
-        // Send time packet
-        if (udp_time && (timesocket !=- 1)) 
-        {
-          // Occassionally announce our time
-          // T + (our stratum) + (64 bit seconds since 1970) +
-          // + (24 bit microseconds)
-          // = 1+1+8+3 = 13 bytes
-          struct timeval tv;
-          gettimeofday(&tv,NULL);    
-          
-          unsigned char msg_out[1024];
-          int offset=0;
-          append_timestamp(msg_out,&offset);
-          
-          // Now broadcast on every interface to port 0x5401
-          // Oh that's right, UDP sockets don't have an easy way to do that.
-          // We could interrogate the OS to ask about all interfaces, but we
-          // can instead get away with having a single simple broadcast address
-          // supplied as part of the timeserver command line argument.
-          struct sockaddr_in addr;
-          bzero(&addr, sizeof(addr)); 
-          addr.sin_family = AF_INET; 
-          addr.sin_port = htons(0x5401);
-          int i;
-          for ( i = 0; time_broadcast_addrs[i]; i++) 
-          {
-            addr.sin_addr.s_addr = inet_addr(time_broadcast_addrs[i]);
-            errno=0;
-            sendto(
-              timesocket,
-              msg_out,
-              offset,
-              MSG_DONTROUTE
-              | MSG_DONTWAIT
-#ifdef MSG_NOSIGNAL
-              | MSG_NOSIGNAL
-#endif         
-             , (const struct sockaddr *)&addr, 
-             sizeof(addr));
-          }
-          // printf("--- Sent %d time announcement packets.\n",i);
-
-      	  account_time("time server: rx ");
-
-          // Check for time packet
-          if (timesocket != -1)
-          {
-            unsigned char msg[1024];
-            int offset = 0;
-            int r = recvfrom(timesocket, msg, 1024, 0, NULL, 0);
-            if (r == (1+1+8+3)) 
-            {
-              // see rxmessages.c for more explanation
-              offset++;
-              int stratum = msg[offset++];
-              struct timeval tv;
-              bzero(&tv, sizeof(struct timeval));
-              for (int i = 0; i < 8; i++) 
-              {
-                tv.tv_sec|=msg[offset++]<<(i*8);
-              }
-
-              for (int i = 0; i < 3; i++) 
-              {
-                tv.tv_usec|=msg[offset++]<<(i*8);
-              }
-
-              // ethernet delay is typically 0.1 - 5ms, so assume 5ms
-              tv.tv_usec += 5000;
-
-              saw_timestamp("          UDP", stratum, &tv);
-            }
-          } 
-        }
-        if (httpsocket != -1)
-        {
-          struct sockaddr cliaddr;
-          socklen_t addrlen;
-     	    account_time("HTTP accept()");
-          int s = accept(httpsocket, &cliaddr, &addrlen);
-          if (s != -1) 
-          {
-            // HTTP request socket
-            //   printf("HTTP Socket connection\n");
-            // Process socket
-            // XXX This is synchronous to keep things simple,
-            // which is part of why we only check every second or so
-            // for one new connection.  We also don't allow the request
-            // to linger: if it doesn't contain the request almost immediately,
-            // we reject it with a timeout error.
-    	      account_time("http_process()");
-            http_process(&cliaddr, servald_server, credential, my_sid_hex, s);
-          }
-        }
-
-        account_time("update_my_message()");
-        
-        if ((! monitor_mode) && radio_ready()) 
-        {
-          update_my_message(
-            serialfd,
-            my_sid,
-            my_sid_hex,
-            LINK_MTU,
-            msg_out,
-            servald_server,
-            credential);
-    
-          // Vary next update time by upto 250ms, to prevent radios getting lock-stepped.
-          if (message_update_interval_randomness)
-          {
-            next_message_update_time = gettime_ms() + (random()%message_update_interval_randomness) + message_update_interval;
-          }
-          else
-          {
-            next_message_update_time = gettime_ms() + message_update_interval;
-          }
-        }
-    
-       	account_time("status_dump()");
-    
-        // Update the state file to help debug things
-        // (but not too often, since it is SLOW on the MR3020s
-        //  XXX fix all those linear searches, and it will be fine!)
-      	if (last_status_time>time(0)) 
-      	{
-        	last_status_time=time(0);
-        }
-
-        if (time(0) > last_status_time) {
-          last_status_time = time(0) + 2;
-          status_dump();
-        }
-        
-      	account_time("post_status_dump()");
-      	
-      }
-
-      account_time("stuck serial reboot check");
-
-      if ((serial_errors>20) && reboot_when_stuck) 
-      {
-        LOG_ERROR("rebooting");        
-        // If we are unable to write to the serial port repeatedly for a while,
-        // we could be facing funny serial port behaviour bugs that we see on the MR3020.
-        // In which case, if authorised, ask the MR3020 to reboot
-        system("reboot");
-      }
-      
-      account_time("stun_serviceloop()");
-
-      if (! nostun) stun_serviceloop();
-
-      account_time("usleep()");
-      
-      usleep(10000);
-
-      account_time("show_progress()");
-
-      if (time(0) > last_summary_time) 
-      {
-        last_summary_time = time(0);
-        show_progress(stderr, 0);
-      }
-      
-      account_time("End of loop");
-      
+    long long now = gettime_ms();
+    reactor_add_timer("housekeeping", now, main_housekeeping, NULL);
+    reactor_add_timer("radio.serviceloop()", now, main_radio_service, NULL);
+    reactor_add_timer("load_rhizome_db_async()", now, main_bundlelist_timer, NULL);
+    reactor_add_timer("make_periodic_requests()", now, main_periodic_requests, NULL);
+    message_update_timer =
+      reactor_add_timer("update_my_message()", now, main_message_update, NULL);
+    reactor_add_timer("status_dump()", now, main_status_dump, NULL);
+
+    // Report where the time went when we are stopped
+    atexit(code_instrumentation_report_at_exit);
+    signal(SIGTERM, stop_handler);
+    signal(SIGINT, stop_handler);
+
+    while ((exitVal == 0) && (!stop_signal))
+    {
+      reactor_run_once();
+    }
+    if (stop_signal)
+    {
+      fprintf(stderr,"Signal %d intercepted. Exiting cleanly.\n",(int)stop_signal);
     }
   }
   while (0);
@@ -57,7 +57,7 @@ int sync_schedule_progress_report(int peer, int partial, int randomJump)
   // Work out where we will request data to be sent from
   int isReallyFirstByte=0;
   int first_required_body_offset
-    =partial_find_missing_byte(partials[partial].body_segments,&isReallyFirstByte);
+    =partial_find_missing_byte(&partials[partial].body,&isReallyFirstByte);
   
   if (slot>=REPORT_QUEUE_LEN) slot=random()%REPORT_QUEUE_LEN;
 
@@ -41,6 +41,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "sync.h"
 #include "lbard.h"
+#include "trace.h"
 
 int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 				  unsigned char *p, int is_manifest,
@@ -174,6 +175,57 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
   return actual_bytes;
 }
 
+/*
+  Called by the rhizome import queue once servald has accepted or rejected a
+  bundle that we finished receiving in saw_piece().
+*/
+static int saw_piece_import_done(int result,unsigned char *manifest,
+				 int manifest_len,void *context)
+{
+  char bid[1024];
+  char version[1024];
+
+  manifest_get_field(manifest,manifest_len,"id",bid);
+  manifest_get_field(manifest,manifest_len,"version",version);
+
+  if ((result<200)||(result>202)) {
+    // Failed to insert, so mark this bundle for deprioritisation, so that we
+    // don't just keep asking for it.
+    fprintf(stderr,"Failed to insert bundle %s/%s (result=%d)\n",
+	    bid,version,result);
+    dump_bytes(stdout,"manifest",manifest,manifest_len);
+#ifdef SYNC_BY_BAR
+    int peer=(long)context;
+    int bundle=bid_to_peer_bundle_index(peer,bid);
+    if (peer_records[peer]->insert_failures[bundle]<255)
+      peer_records[peer]->insert_failures[bundle]++;
+#endif
+  } else {
+    // Insert succeeded, so clear any failure deprioritisation (although it
+    // shouldn't matter).
+#ifdef SYNC_BY_BAR
+    int peer=(long)context;
+    int bundle=bid_to_peer_bundle_index(peer,bid);
+    peer_records[peer]->insert_failures[bundle]=0;
+#endif
+    char bid_prefix[8*2+1];
+    snprintf(bid_prefix,sizeof(bid_prefix),"%.16s",bid);
+    progress_log_bundle_receipt(bid_prefix,strtoll(version,NULL,10));
+  }
+  return 0;
+}
+
+// Trace a piece event, identified by sender SID prefix and BID prefix.
+static void trace_piece(int type,int flags,struct peer_state *p,
+			unsigned char *bid_prefix_bin,
+			long long a,long long b,long long c)
+{
+  unsigned char ids[PEER_PREFIX_BYTES+8];
+  memcpy(ids,p->sid_prefix_bin,PEER_PREFIX_BYTES);
+  memcpy(&ids[PEER_PREFIX_BYTES],bid_prefix_bin,8);
+  trace_event(type,flags,a,b,c,ids,sizeof(ids));
+}
+
 int saw_piece(char *peer_prefix,int for_me,
 	      char *bid_prefix, unsigned char *bid_prefix_bin,
 	      long long version,
@@ -192,6 +244,12 @@ int saw_piece(char *peer_prefix,int for_me,
     return -1;
   }
 
+  int trace_flags=(is_manifest_piece?TRACE_FLAG_MANIFEST:0)
+    |(is_end_piece?TRACE_FLAG_END:0)|(for_me?TRACE_FLAG_FOR_ME:0);
+  if (trace_enabled)
+    trace_piece(TRACE_PIECE_RX,trace_flags,peer_records[peer],bid_prefix_bin,
+		piece_offset,piece_bytes,version);
+
   if (debug_pieces)
   printf(">>> %s Saw a piece of BID=%s* from SID=%s*: %s [%lld,%lld) %s\n",
 	 timestamp_str(),bid_prefix,peer_prefix,
@@ -212,9 +270,13 @@ int saw_piece(char *peer_prefix,int for_me,
     if (sync_is_bundle_recently_received(bid_prefix,version)) {
       // We have this version already: mark it for announcement to sender,
       // and then return immediately.
-      fprintf(stderr,
-	      "We recently received %s* version %lld - ignoring piece.\n",
-	      bid_prefix,version);
+      if (trace_enabled)
+	trace_piece(TRACE_PIECE_HAVE,trace_flags,peer_records[peer],bid_prefix_bin,
+		    1,-1,version);
+      if (debug_pieces)
+	fprintf(stderr,
+		"We recently received %s* version %lld - ignoring piece.\n",
+		bid_prefix,version);
       sync_tell_peer_we_have_bundle_by_id(peer,bid_prefix_bin,version);
       return 0;      
     }
@@ -230,8 +292,12 @@ int saw_piece(char *peer_prefix,int for_me,
 	bundles[i].announce_bar_now=1;
 #endif
 	if (for_me) {
-	  fprintf(stderr,"We already have %s* version %lld - ignoring piece.\n",
-		  bid_prefix,version);
+	  if (trace_enabled)
+	    trace_piece(TRACE_PIECE_HAVE,trace_flags,peer_records[peer],bid_prefix_bin,
+			0,i,bundles[i].version);
+	  if (debug_pieces)
+	    fprintf(stderr,"We already have %s* version %lld - ignoring piece.\n",
+		    bid_prefix,version);
 	  sync_tell_peer_we_have_this_bundle(peer,i);
 	}
 
@@ -241,8 +307,11 @@ int saw_piece(char *peer_prefix,int for_me,
 	// Update progress bitmaps for all peers whenver we see a piece received that we
 	// think that they might want.  This stops us from resending the same piece later.
 	if (bundle_number>=0) {
-	  printf(">>> %s Examining transmitted piece for bitmap updates.\n",
-		 timestamp_str());
+	  TRACE(TRACE_PIECE_BITMAPS,trace_flags,bundle_number,piece_offset,piece_bytes,
+		bid_prefix_bin,8);
+	  if (debug_pieces)
+	    printf(">>> %s Examining transmitted piece for bitmap updates.\n",
+		   timestamp_str());
 	  peer_update_request_bitmaps_due_to_transmitted_piece(bundle_number,is_manifest_piece,
 							       piece_offset,piece_bytes);
 	}
@@ -262,67 +331,38 @@ int saw_piece(char *peer_prefix,int for_me,
   // Update progress bitmaps for all peers whenver we see a piece received that we
   // think that they might want.  This stops us from resending the same piece later.
   if (bundle_number>=0) {
-    printf(">>> %s Examining transmitted piece for bitmap updates.\n",
-	   timestamp_str());
+    TRACE(TRACE_PIECE_BITMAPS,trace_flags,bundle_number,piece_offset,piece_bytes,
+	  bid_prefix_bin,8);
+    if (debug_pieces)
+      printf(">>> %s Examining transmitted piece for bitmap updates.\n",
+	     timestamp_str());
     peer_update_request_bitmaps_due_to_transmitted_piece(bundle_number,is_manifest_piece,
 							 piece_offset,piece_bytes);
   }
   
-  int i;
-  int spare_record=random()%MAX_BUNDLES_IN_FLIGHT;
-  for(i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
-    if (!partials[i].bid_prefix) {
-      if (spare_record==-1) spare_record=i;
-    } else {
-      if (!strcasecmp(partials[i].bid_prefix,bid_prefix))
-	{
-	  if (debug_pieces) printf("Saw another piece for BID=%s* from SID=%s: ",
-			 bid_prefix,peer_prefix);
-	  if (debug_pieces) printf("[%lld..%lld)\n",
-			 piece_offset,piece_offset+piece_bytes);
-
-	  break;
-	}
-      else {
-	if (debug_pieces) {
-	  printf("  this isn't the partial we are looking for.\n");
-	  printf("  piece is of %s*, but slot #%d has %s*\n",
-		 bid_prefix,i,
-		 partials[i].bid_prefix);
-	}
-      }
-    }
+  int i=partial_find(bid_prefix_bin);
+  if (i>=0) {
+    if (debug_pieces) printf("Saw another piece for BID=%s* from SID=%s: ",
+			     bid_prefix,peer_prefix);
+    if (debug_pieces) printf("[%lld..%lld)\n",
+			     piece_offset,piece_offset+piece_bytes);
   }
 
   if (debug_pieces)
     printf("Saw a piece of interesting bundle BID=%s*/%lld from SID=%s\n",
 	    bid_prefix,version, peer_prefix);
   
-  if (i==MAX_BUNDLES_IN_FLIGHT) {
-    if (spare_record>0) i=spare_record;
-    if (debug_pieces)
-      printf("Didn't find bundle in partials for this peer. first spare slot =%d\n",spare_record);
-    // Didn't find bundle in the progress list.
-    // Abort one of the ones in the list at random, and replace, unless there is
-    // a spare record slot to use.
-    if (spare_record==-1) {
-      i=random()%MAX_BUNDLES_IN_FLIGHT;
-      clear_partial(&partials[i]);
-    } else {
-      i=spare_record;
-      // Clear it just to make sure.
-      clear_partial(&partials[i]);
-    }
+  if (i<0) {
+    // Didn't find bundle in the progress list, so start a new one, abandoning
+    // the least valuable transfer in progress if there are no free slots.
+    i=partial_allocate(bid_prefix_bin,version);
     if (debug_pieces)
       printf("@@@   Using slot %d\n",i);
-
-    // Now prepare the partial record
-    partials[i].bid_prefix=strdup(bid_prefix);
-    partials[i].bundle_version=version;
-    partials[i].manifest_length=-1;
-    partials[i].body_length=-1;
   }
 
+  partials[i].last_piece_time=time(0);
+  if (for_me) partials[i].addressed_to_us=1;
+
   partial_update_recent_senders(&partials[i],peer_prefix);
   
   int piece_end=piece_offset+piece_bytes;
@@ -339,21 +379,20 @@ int saw_piece(char *peer_prefix,int for_me,
     partials[i].body_length=version;
   }
 
+  // Size the buffers up front when we know how long the streams are.
+  if (partials[i].manifest_length>=0)
+    partial_stream_reserve(&partials[i].manifest,partials[i].manifest_length);
+  if (partials[i].body_length>=0)
+    partial_stream_reserve(&partials[i].body,partials[i].body_length);
+
   if ((bundle_number>-1)
-      &&(!partials[i].body_segments)) {
+      &&(!partials[i].body.extent_count)) {
     // This is a bundle that for which we already have a previous version, and
-    // for which we as yet have no body segments.  So fetch from Rhizome the content
-    // that we do have, and prepopulate the body segment.
+    // for which we as yet have no body bytes.  So fetch from Rhizome the content
+    // that we do have, and prepopulate the body.
     fprintf(stderr,"%s:%d:My SID as hex is %s\n",__FILE__,__LINE__,my_sid_hex);
-    if (!prime_bundle_cache(bundle_number,my_sid_hex,servald_server,credential)) {
-      struct segment_list *s=calloc(1,sizeof(struct segment_list));
-      assert(s);
-      s->data=malloc(cached_body_len);
-      assert(s->data);
-      bcopy(cached_body,s->data,cached_body_len);
-      s->start_offset=0;
-      s->length=cached_body_len;
-      partials[i].body_segments=s;
+    if ((!prime_bundle_cache(bundle_number,my_sid_hex,servald_server,credential))
+	&&(partial_stream_add(&partials[i].body,0,cached_body,cached_body_len,NULL)>=0)) {
       if (debug_pieces)
 	printf("Preloaded %d bytes from old version of journal bundle.\n",
 		cached_body_len);
@@ -364,148 +403,46 @@ int saw_piece(char *peer_prefix,int for_me,
     }
   }
 
-  // Now we have the right partial, we need to look for the right segment to add this
-  // piece to, if any.
-  struct segment_list **s;
-  if (is_manifest_piece) s=&partials[i].manifest_segments;
-  else s=&partials[i].body_segments;
-
-  /*
-    The segment lists are maintained in reverse order, since pieces will generally
-    arrive in ascending address order.
-  */
-  int segment_start;
-  int segment_end;
-  while(1) {
-    if (*s) {
-      segment_start=(*s)->start_offset;
-      segment_end=segment_start+(*s)->length;
-    } else {
-      segment_start=-1; segment_end=-1;
-    }
-    
-    if ((!(*s))||(segment_end<piece_offset)) {
-      // Create a new segment before the current one
-      new_bytes_in_piece=piece_bytes;
-
-      if (debug_pieces) printf("Inserting piece [%lld..%lld) before [%d..%d)\n",
-		     piece_offset,piece_offset+piece_bytes,
-		     segment_start,segment_end);
-
-      struct segment_list *ns=calloc(1,sizeof(struct segment_list));
-      assert(ns);
-
-      // Link into the list
-      ns->next=*s;
-      if (*s) ns->prev=(*s)->prev; else ns->prev=NULL;
-      if (*s) (*s)->prev=ns;
-      *s=ns;
-
-      // Set start and ends and allocate and copy in piece data
-      ns->start_offset=piece_offset;
-      ns->length=piece_bytes;
-      ns->data=malloc(piece_bytes);
-      bcopy(piece,ns->data,piece_bytes);
-
-      // This is data that is new, and the next byte would also be new, so
-      // no need to tell the peer to change where they are sending from in the bundle.
-      next_byte_would_be_useful=1;
-      
-      break;
-    } else if ((segment_start<=piece_offset)&&(segment_end>=piece_end)) {
-      // Piece fits entirely within a current segment, i.e., is not new data
-      new_bytes_in_piece=0;
-      break;
-    } else if (piece_end<segment_start) {
-      // Piece ends before this segment starts, so proceed down the list further.
-      if (debug_pieces)
-	printf("Piece [%lld..%lld) comes before [%d..%d)\n",
-		piece_offset,piece_offset+piece_bytes,
-		segment_start,segment_end);
-      
-      s=&(*s)->next;
-    } else {
-      // Segment should abutt or overlap with new piece.
-      // Pieces can be different sizes, so it is possible to extend both directions
-      // at once.
-
-      // New piece and existing segment should overlap or adjoin.  Otherwise abort.
-      int piece_start=piece_offset;
-      assert( ((segment_start>=piece_start)&&(segment_start<=piece_end))
-	      ||((segment_end>=piece_start)&&(segment_end<=piece_end))
-	      );      
-      if (0)
-      {
-	message_buffer_length+=
-	  snprintf(&message_buffer[message_buffer_length],
-		   message_buffer_size-message_buffer_length,
-		   "Received %s",bid_prefix);
-	message_buffer_length+=
-	  snprintf(&message_buffer[message_buffer_length],
-		   message_buffer_size-message_buffer_length,
-		   "* version %lld %s segment [%d,%d)\n",
-		   version,
-		   is_manifest_piece?"manifest":"payload",
-		   piece_start,piece_start+piece_bytes);
-      }
-            
-      if (piece_start<segment_start) {
-	// Need to stick bytes on the start
-	int extra_bytes=segment_start-piece_start;
-	int new_length=(*s)->length+extra_bytes;
-	unsigned char *d=malloc(new_length);
-        assert(d);
-	bcopy(piece,d,extra_bytes);
-	bcopy((*s)->data,&d[extra_bytes],(*s)->length);
-	(*s)->start_offset=piece_start;
-	(*s)->length=new_length;
-	free((*s)->data); (*s)->data=d;
-	new_bytes_in_piece+=extra_bytes;
-      }
-      if (piece_end>segment_end) {
-	// Need to sick bytes on the end
-	int extra_bytes=piece_end-segment_end;
-	int new_length=(*s)->length+extra_bytes;
-	(*s)->data=realloc((*s)->data,new_length);
-        assert((*s)->data);
-	bcopy(&piece[piece_bytes-extra_bytes],&(*s)->data[(*s)->length],
-	      extra_bytes);
-	(*s)->length=new_length;
-	new_bytes_in_piece+=extra_bytes;
-
-	// We have extended beyond the end, so the next byte is most likely
-	// useful, unless it happens to extend to the start of the next segment.
-	// XXX - We are ignoring that case for now, as worst it will cause only
-	// one wasted packet.  But it would be nice to detect this situation.
-	next_byte_would_be_useful=1;
-      }
-      
-      break;
-    } 
+  // Now we have the right partial, copy the piece into place.
+  struct partial_stream *stream;
+  if (is_manifest_piece) stream=&partials[i].manifest;
+  else stream=&partials[i].body;
+
+  new_bytes_in_piece=partial_stream_add(stream,piece_offset,piece,piece_bytes,
+					&next_byte_would_be_useful);
+  if (new_bytes_in_piece<0) {
+    printf(">>> %s Could not store piece [%lld,%lld) of BID=%s* -- ignoring.\n",
+	   timestamp_str(),piece_offset,piece_offset+piece_bytes,bid_prefix);
+    return -1;
   }
+  if (trace_enabled)
+    trace_piece(TRACE_PIECE_STORED,trace_flags,peer_records[peer],bid_prefix_bin,
+		piece_offset,piece_bytes,new_bytes_in_piece);
+  if (debug_pieces)
+    printf("Piece [%lld..%lld) contained %d new bytes.\n",
+	   piece_offset,piece_offset+piece_bytes,new_bytes_in_piece);
 
-  merge_segments(&partials[i].manifest_segments);
-  merge_segments(&partials[i].body_segments);
   partial_update_request_bitmap(&partials[i]);
-  fprintf(stderr,"(Piece was [%lld,%lld)\n",piece_offset,piece_offset+piece_bytes);
 
   partials[i].recent_bytes += piece_bytes;
   
   // Check if we have the whole bundle now
-  // XXX - this breaks when we have nothing about the bundle, because then we think the length is zero, so we think we have it all, when really we have none.
-  if (partials[i].manifest_segments
-      &&partials[i].body_segments
-      &&(!partials[i].manifest_segments->next)
-      &&(!partials[i].body_segments->next)
-      &&(partials[i].manifest_segments->start_offset==0)
-      &&(partials[i].body_segments->start_offset==0)
-      &&(partials[i].manifest_segments->length
-	 ==partials[i].manifest_length)
-      &&(partials[i].body_segments->length
-	 ==partials[i].body_length))
+  if (partials[i].manifest.extent_count
+      &&partial_stream_complete(&partials[i].manifest,partials[i].manifest_length)
+      &&partial_stream_complete(&partials[i].body,partials[i].body_length))
     {
-      // We have a single segment for body and manifest that span the complete
+      // We have a single extent for body and manifest that span the complete
       // size.
+
+      // Servald is slow to accept bundles, so imports are queued and handed to
+      // it in the background.  If the queue is full, hold on to the completed
+      // partial, and try again when the next piece of it arrives.
+      if (rhizome_import_queue_full()) {
+	printf(">>> %s Have the entire bundle %s*/%lld, but rhizome import queue is full. Deferring.\n",
+	       timestamp_str(),bid_prefix,version);
+	return 0;
+      }
+      
       printf(">>> %s We have the entire bundle %s*/%lld now.\n",
 	     timestamp_str(),bid_prefix,version);
 
@@ -513,21 +450,22 @@ int saw_piece(char *peer_prefix,int for_me,
       unsigned char manifest[1024];
       int manifest_len;
 
-      int insert_result=-999;
-      
       if (!manifest_binary_to_text
-	  (partials[i].manifest_segments->data,
+	  (partials[i].manifest.data,
 	   partials[i].manifest_length,
 	   manifest,&manifest_len)) {
 
 	// Display decompressed manifest
 	dump_bytes(stdout,"Decompressed Manifest",manifest,manifest_len);
-	
-	insert_result=
-	  rhizome_update_bundle(manifest,manifest_len,
-				partials[i].body_segments->data,
-				partials[i].body_length,
-				servald_server,credential);
+
+	// The manifest and body are copied into the import queue, so the partial
+	// can be released straight away.
+	if (rhizome_import_bundle(manifest,manifest_len,
+				  partials[i].body.data,
+				  partials[i].body_length,
+				  servald_server,credential,
+				  saw_piece_import_done,(void *)(long)peer))
+	  saw_piece_import_done(-1,manifest,manifest_len,(void *)(long)peer);
 
 	if (debug_bundlelog) {
 	  // Write details of bundle to a log file for monitoring
@@ -580,40 +518,9 @@ int saw_piece(char *peer_prefix,int for_me,
 	// manifest.
 	// XXX - Decompress manifest as soon as we have it to catch this problem
 	// earlier. 
-      }
-      if (insert_result) {
-	// Failed to insert, so mark this bundle for deprioritisation, so that we
-	// don't just keep asking for it.
-	fprintf(stderr,"Failed to insert bundle %s*/%lld (result=%d)\n",
+	fprintf(stderr,"Could not decompress manifest of bundle %s*/%lld\n",
 		partials[i].bid_prefix,
-		partials[i].bundle_version,insert_result);
-	dump_bytes(stdout,"manifest",manifest,manifest_len);
-	dump_bytes(stdout,"payload",
-		   partials[i].body_segments->data,
-		   partials[i].body_length);
-
-	char bid[32*2+1];
-	if (!manifest_extract_bid(partials[i].manifest_segments->data,
-				  bid)) {
-#ifdef SYNC_BY_BAR
-	  int bundle=bid_to_peer_bundle_index(peer,bid);
-	  if (peer_records[peer]->insert_failures[bundle]<255)
-	    peer_records[peer]->insert_failures[bundle]++;
-#endif
-	}
-      } else {
-	// Insert succeeded, so clear any failure deprioritisation (although it
-	// shouldn't matter).
-	char bid[32*2+1];
-	if (!manifest_extract_bid(partials[i].manifest_segments->data,
-				  bid)) {
-#ifdef SYNC_BY_BAR
-	  int bundle=bid_to_peer_bundle_index(peer,bid);
-	  peer_records[peer]->insert_failures[bundle]=0;
-#endif
-	}
-	progress_log_bundle_receipt(partials[i].bid_prefix,
-				    partials[i].bundle_version);
+		partials[i].bundle_version);
       }
 
       // Tell peer we have the whole thing now.
@@ -61,26 +61,19 @@ int announce_bundle_length(int mtu, unsigned char *msg,int *offset,
   return 0;
 }
 
-int saw_length(char *peer_prefix,char *bid_prefix,long long version,
+int saw_length(char *peer_prefix,unsigned char *bid_prefix_bin,long long version,
 	       int body_length)
 {
   // Note length of payload for this bundle, if we don't already know it
   int peer=find_peer_by_prefix(peer_prefix);
   if (peer<0) return -1;
 
-  int i;
-  int spare_record=random()%MAX_BUNDLES_IN_FLIGHT;
-  for(i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
-    if (!partials[i].bid_prefix) {
-      if (spare_record==-1) spare_record=i;
-    } else {
-      if (!strcasecmp(partials[i].bid_prefix,bid_prefix))
-	if (partials[i].bundle_version==version)
-	  {
-	    partials[i].body_length=body_length;
-	    return 0;
-	  }
-    }
+  int i=partial_find(bid_prefix_bin);
+  if ((i>=0)&&(partials[i].bundle_version==version)) {
+    partials[i].body_length=body_length;
+    // Now that we know how big the payload is, allocate it in one go.
+    partial_stream_reserve(&partials[i].body,body_length);
+    return 0;
   }
   return -1;
 }
@@ -102,10 +95,6 @@ int message_parser_4C(struct peer_state *sender,char *sender_prefix,
   offset++;
   
   int bid_prefix_offset=offset;
-  char bid_prefix[2*8+1+1];
-  snprintf(bid_prefix,8*2+1,"%02x%02x%02x%02x%02x%02x%02x%02x",
-	   msg[offset+0],msg[offset+1],msg[offset+2],msg[offset+3],
-	   msg[offset+4],msg[offset+5],msg[offset+6],msg[offset+7]);
   offset+=8;
   long long version=0;
   for(int i=0;i<8;i++) version|=((long long)msg[offset+i])<<(i*8LL);
@@ -128,7 +117,7 @@ int message_parser_4C(struct peer_state *sender,char *sender_prefix,
       monitor_log(sender_prefix,NULL,monitor_log_buf);
     }
   
-  saw_length(sender_prefix,bid_prefix,version,offset_compound);
+  saw_length(sender_prefix,&msg[bid_prefix_offset],version,offset_compound);
   
   return offset;
 }
@@ -0,0 +1,74 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc..
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports, 
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Adaptive Reed-Solomon strength reports (see radio_fec_parity_bytes()).
+
+  Nodes that use the non-default RS codes end every packet with an 'E' field
+  saying how many errors they have recently had to correct in the frames they
+  receive.  This tells other nodes both that they can decode the other codes,
+  and how well they are hearing the channel.  It goes last, because older
+  versions of LBARD stop processing a packet at the first field they don't
+  recognise.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+int append_fec_report(unsigned char *msg_out,int *offset)
+{
+  // E + error level = 2 bytes
+  int level=radio_fec_error_level();
+  if (level<0||level>=FEC_REPORT_UNKNOWN) level=FEC_REPORT_UNKNOWN;
+
+  msg_out[(*offset)++]='E';
+  msg_out[(*offset)++]=level;
+  return 0;
+}
+
+int message_parser_45(struct peer_state *sender,char *sender_prefix,
+		      char *servald_server, char *credential,
+		      unsigned char *msg,int length)
+{
+  if (length<FEC_REPORT_LENGTH) return -1;
+
+  sender->fec_report=msg[1];
+  sender->fec_report_time=gettime_ms();
+  return FEC_REPORT_LENGTH;
+}
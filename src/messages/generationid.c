@@ -68,22 +68,21 @@ int message_parser_47(struct peer_state *sender,char *sender_prefix,
       // Peer's instance ID has changed: Forget all knowledge of the peer and
       // return (ignoring the rest of the packet).
 #ifndef SYNC_BY_BAR
-      int peer_index=-1;
-      for(int i=0;i<peer_count;i++) if (sender==peer_records[i]) { peer_index=i; break; }
-      if (peer_index==-1) {
-	// Could not find peer structure. This should not happen.
-	return 0;
-      }
-      
-      free_peer(peer_records[peer_index]);
+      struct peer_state *old=sender;
       sender=calloc(1,sizeof(struct peer_state));
-      for(int i=0;i<4;i++) sender->sid_prefix_bin[i]=msg[i];
+      bcopy(old->sid_prefix_bin,sender->sid_prefix_bin,PEER_PREFIX_BYTES);
       sender->sid_prefix=strdup(sender_prefix);
       sender->last_message_number=-1;
+      sender->last_message_time=old->last_message_time;
       sender->tx_bundle=-1;
       sender->instance_id=peer_instance_id;
+      if (peer_replace(old,sender)<0) {
+	// Could not find peer structure. This should not happen.
+	free(sender->sid_prefix);
+	free(sender);
+	return 0;
+      }
       printf("Peer %s* has restarted -- discarding stale knowledge of its state.\n",sender->sid_prefix);
-      peer_records[peer_index]=sender;
 #endif
     }
   }
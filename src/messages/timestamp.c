@@ -76,6 +76,7 @@ int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv)
 	if (last_status_time) last_status_time+=delta;
 	if (radio_last_heartbeat_time) radio_last_heartbeat_time+=delta;
 	log_rssi_timewarp(delta);
+	reactor_timewarp(delta);
 	if (status_dump_epoch) status_dump_epoch+=delta;
 	if (last_servald_contact) last_servald_contact+=delta;
 	
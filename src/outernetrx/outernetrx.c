@@ -525,7 +525,7 @@ int outernet_rx_serviceloop(void)
   LOG_ENTRY;
 
   do {
-    bytes_recv = recvfrom( outernet_socket, buffer, sizeof(buffer), 0, 0, 0 );
+    bytes_recv = recvfrom( outernet_socket, buffer, sizeof(buffer), MSG_DONTWAIT, 0, 0 );
     while(bytes_recv>0) {
       LOG_NOTE("Received %d bytes via Outernet UNIX domain socket",bytes_recv);
 
@@ -534,7 +534,7 @@ int outernet_rx_serviceloop(void)
 	LOG_ERROR("outernet_rx_saw_packet() reported an error");
       }
       
-      bytes_recv = recvfrom( outernet_socket, buffer, sizeof(buffer), 0, 0, 0 );
+      bytes_recv = recvfrom( outernet_socket, buffer, sizeof(buffer), MSG_DONTWAIT, 0, 0 );
     }
   } while(0);
 
@@ -0,0 +1,335 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports,
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Event reactor for the main loop.
+
+  File descriptors (the serial port, UDP and HTTP sockets etc) register a
+  callback that is called whenever they become readable, and periodic work
+  is attached to named timers.  reactor_run_once() runs any timers that are
+  due, and then sleeps in epoll_wait() (or poll() on non-Linux systems) until
+  either a watched descriptor becomes readable or the next timer falls due.
+  This means that received bytes are handled as soon as they arrive, and that
+  we don't wake up at all when there is nothing to do.
+
+  Timers are kept as absolute deadlines in gettime_ms() time, rather than as
+  timerfds, so that they can be shifted along with everything else when we
+  step the system clock (see reactor_timewarp()).  There are only ever a
+  handful of them, so a linear scan to find the next one is fine.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include "sync.h"
+#include "lbard.h"
+
+struct reactor_fd {
+  int fd;
+  char *name;
+  reactor_fd_callback callback;
+  void *context;
+  // Call the callback when the descriptor becomes readable (the default)
+  // and/or writable
+  int want_read;
+  int want_write;
+};
+
+struct reactor_timer {
+  char *name;
+  long long due;
+  reactor_timer_callback callback;
+  void *context;
+};
+
+static struct reactor_fd reactor_fds[REACTOR_MAX_FDS];
+static int reactor_fd_count=0;
+
+static struct reactor_timer reactor_timers[REACTOR_MAX_TIMERS];
+static int reactor_timer_count=0;
+
+#ifdef __linux__
+static int reactor_epoll_fd=-1;
+#endif
+
+long long reactor_wakeups=0;
+
+int reactor_init(void)
+{
+#ifdef __linux__
+  if (reactor_epoll_fd<0) {
+    reactor_epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+    if (reactor_epoll_fd<0) {
+      perror("epoll_create1");
+      return -1;
+    }
+  }
+#endif
+  return 0;
+}
+
+static int reactor_find_fd(int fd)
+{
+  for(int i=0;i<reactor_fd_count;i++)
+    if (reactor_fds[i].fd==fd) return i;
+  return -1;
+}
+
+int reactor_watch_fd(int fd,char *name,reactor_fd_callback callback,
+		     void *context)
+{
+  if (fd<0) return -1;
+  if (reactor_init()) return -1;
+
+  int slot=reactor_find_fd(fd);
+  if (slot<0) {
+    if (reactor_fd_count>=REACTOR_MAX_FDS) {
+      fprintf(stderr,"WARNING: Too many file descriptors to watch (%s)\n",name);
+      return -1;
+    }
+    slot=reactor_fd_count++;
+  }
+  reactor_fds[slot].fd=fd;
+  reactor_fds[slot].name=name;
+  reactor_fds[slot].callback=callback;
+  reactor_fds[slot].context=context;
+  reactor_fds[slot].want_read=1;
+  reactor_fds[slot].want_write=0;
+
+#ifdef __linux__
+  // A descriptor that was closed without being unwatched will have silently
+  // dropped out of the epoll set, so we always (re-)add it here.
+  struct epoll_event ev;
+  bzero(&ev,sizeof(ev));
+  ev.events=EPOLLIN;
+  ev.data.fd=fd;
+  if (epoll_ctl(reactor_epoll_fd,EPOLL_CTL_ADD,fd,&ev)) {
+    if ((errno!=EEXIST)||epoll_ctl(reactor_epoll_fd,EPOLL_CTL_MOD,fd,&ev)) {
+      perror("epoll_ctl");
+      reactor_fds[slot]=reactor_fds[--reactor_fd_count];
+      return -1;
+    }
+  }
+#endif
+  return 0;
+}
+
+/*
+  Ask for the callback of a watched descriptor to also be called when it is
+  writable, e.g., while a large request is queued on a non-blocking socket.
+  The callback is not told which condition occurred, and should just try
+  whatever it is waiting to do.
+*/
+static int reactor_update_events(int slot)
+{
+#ifdef __linux__
+  struct epoll_event ev;
+  bzero(&ev,sizeof(ev));
+  ev.events=(reactor_fds[slot].want_read?EPOLLIN:0)
+    |(reactor_fds[slot].want_write?EPOLLOUT:0);
+  ev.data.fd=reactor_fds[slot].fd;
+  if (epoll_ctl(reactor_epoll_fd,EPOLL_CTL_MOD,reactor_fds[slot].fd,&ev)) {
+    perror("epoll_ctl");
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+int reactor_want_write(int fd,int want_write)
+{
+  int slot=reactor_find_fd(fd);
+  if (slot<0) return -1;
+  if (reactor_fds[slot].want_write==want_write) return 0;
+  reactor_fds[slot].want_write=want_write;
+  return reactor_update_events(slot);
+}
+
+/*
+  Stop (or resume) calling the callback when a watched descriptor is
+  readable, e.g., when a client has closed its end of a connection, but we
+  still have a response to send, as otherwise it stays readable and we spin.
+*/
+int reactor_want_read(int fd,int want_read)
+{
+  int slot=reactor_find_fd(fd);
+  if (slot<0) return -1;
+  if (reactor_fds[slot].want_read==want_read) return 0;
+  reactor_fds[slot].want_read=want_read;
+  return reactor_update_events(slot);
+}
+
+int reactor_unwatch_fd(int fd)
+{
+  int slot=reactor_find_fd(fd);
+  if (slot<0) return -1;
+#ifdef __linux__
+  // Fails harmlessly if the descriptor has already been closed.
+  epoll_ctl(reactor_epoll_fd,EPOLL_CTL_DEL,fd,NULL);
+#endif
+  reactor_fds[slot]=reactor_fds[--reactor_fd_count];
+  return 0;
+}
+
+int reactor_add_timer(char *name,long long due,
+		      reactor_timer_callback callback,void *context)
+{
+  if (reactor_timer_count>=REACTOR_MAX_TIMERS) {
+    fprintf(stderr,"WARNING: Too many reactor timers (%s)\n",name);
+    return -1;
+  }
+  int t=reactor_timer_count++;
+  reactor_timers[t].name=name;
+  reactor_timers[t].due=due;
+  reactor_timers[t].callback=callback;
+  reactor_timers[t].context=context;
+  return t;
+}
+
+int reactor_timer_set_due(int timer,long long due)
+{
+  if ((timer<0)||(timer>=reactor_timer_count)) return -1;
+  reactor_timers[timer].due=due;
+  return 0;
+}
+
+// Called when the system clock is stepped, so that timers keep their
+// relative spacing.
+int reactor_timewarp(long long delta)
+{
+  for(int t=0;t<reactor_timer_count;t++)
+    if (reactor_timers[t].due) reactor_timers[t].due+=delta;
+  return 0;
+}
+
+static long long reactor_run_timers(void)
+{
+  long long now=gettime_ms();
+  long long next=now+REACTOR_MAX_WAIT_MS;
+
+  for(int t=0;t<reactor_timer_count;t++) {
+    struct reactor_timer *timer=&reactor_timers[t];
+
+    // Deal gracefully with clocks that run backwards from time to time.
+    if (timer->due>now+REACTOR_MAX_TIMER_PERIOD) timer->due=now;
+
+    if (timer->due<=now) {
+      account_time(timer->name);
+      timer->due=timer->callback(now,timer->context);
+      now=gettime_ms();
+      // Don't let a timer spin: it gets run again on the next pass at the
+      // earliest.
+      if (timer->due<=now) timer->due=now+1;
+    }
+    if (timer->due<next) next=timer->due;
+  }
+  return next;
+}
+
+/*
+  Call the callback for a descriptor that is ready.  A descriptor that has
+  hung up (e.g., a serial port that has gone away) stays readable forever, so
+  if the callback doesn't deal with it, we stop watching it rather than spin.
+*/
+static int reactor_dispatch(int fd,int hangup)
+{
+  int slot=reactor_find_fd(fd);
+  if (slot<0) return -1;
+  account_time(reactor_fds[slot].name);
+  char *name=reactor_fds[slot].name;
+  int result=reactor_fds[slot].callback(fd,reactor_fds[slot].context);
+  if (hangup&&(reactor_find_fd(fd)>=0)) {
+    fprintf(stderr,"WARNING: %s (fd %d) has hung up, no longer watching it\n",
+	    name,fd);
+    reactor_unwatch_fd(fd);
+  }
+  return result;
+}
+
+/*
+  Run any timers that are due, then wait until the next one falls due or a
+  watched descriptor becomes readable, and dispatch the callbacks for any
+  that did. Returns the number of descriptors that were ready.
+*/
+int reactor_run_once(void)
+{
+  long long next_due=reactor_run_timers();
+
+  long long wait_ms=next_due-gettime_ms();
+  if (wait_ms<0) wait_ms=0;
+  if (wait_ms>REACTOR_MAX_WAIT_MS) wait_ms=REACTOR_MAX_WAIT_MS;
+
+  account_time("reactor wait");
+
+  int ready=0;
+#ifdef __linux__
+  struct epoll_event events[REACTOR_MAX_FDS];
+  ready=epoll_wait(reactor_epoll_fd,events,REACTOR_MAX_FDS,(int)wait_ms);
+  reactor_wakeups++;
+  if (ready<0) {
+    if (errno!=EINTR) perror("epoll_wait");
+    return 0;
+  }
+  for(int i=0;i<ready;i++)
+    reactor_dispatch(events[i].data.fd,
+		     (events[i].events&(EPOLLHUP|EPOLLERR))?1:0);
+#else
+  struct pollfd fds[REACTOR_MAX_FDS];
+  int count=reactor_fd_count;
+  for(int i=0;i<count;i++) {
+    fds[i].fd=reactor_fds[i].fd;
+    fds[i].events=(reactor_fds[i].want_read?POLLIN:0)
+      |(reactor_fds[i].want_write?POLLOUT:0);
+    fds[i].revents=0;
+  }
+  ready=poll(fds,count,(int)wait_ms);
+  reactor_wakeups++;
+  if (ready<0) {
+    if (errno!=EINTR) perror("poll");
+    return 0;
+  }
+  for(int i=0;i<count;i++) {
+    if (fds[i].revents&POLLNVAL) reactor_unwatch_fd(fds[i].fd);
+    else if (fds[i].revents)
+      reactor_dispatch(fds[i].fd,(fds[i].revents&(POLLHUP|POLLERR))?1:0);
+  }
+#endif
+  return ready;
+}
@@ -58,15 +58,205 @@ int _report_file(const char *filename,const char *file,
   return 0;
 }
 
+/*
+  Cache of bundles that we are currently sending, so that serving several peers
+  that each want a different bundle doesn't require re-fetching the manifest and
+  body from servald every time we switch between them.
+
+  Entries are keyed on BID and version, and are evicted in least-recently-used
+  order once either all slots are in use, or the total size of the cached
+  manifests and bodies exceeds BUNDLE_CACHE_MEMORY_BUDGET.  A single bundle
+  larger than the budget is still cached, but will be the first to go.
+
+  The cached_* globals always describe the entry most recently returned by
+  prime_bundle_cache(), as the rest of the code expects.
+*/
+#define BUNDLE_CACHE_SLOTS 32
+#define BUNDLE_CACHE_MEMORY_BUDGET (8*1024*1024)
+
+struct bundle_cache_entry {
+  int in_use;
+  unsigned char bid_bin[32];
+  char *bid_hex;
+  long long version;
+
+  int manifest_encoded_len;
+  unsigned char *manifest_encoded;
+  struct http_buffer body;
+
+  // Value of bundle_cache_clock when last used, for LRU eviction
+  long long last_used;
+};
+
+struct bundle_cache_entry bundle_cache[BUNDLE_CACHE_SLOTS];
+long long bundle_cache_clock=0;
+long long bundle_cache_bytes=0;
+
+long long bundle_cache_hits=0;
+long long bundle_cache_misses=0;
+long long bundle_cache_evictions=0;
+
 char *bid_of_cached_bundle=NULL;
 long long cached_version=0;
-int cached_manifest_len=0;
-unsigned char *cached_manifest=NULL;
 int cached_manifest_encoded_len=0;
 unsigned char *cached_manifest_encoded=NULL;
 int cached_body_len=0;
 unsigned char *cached_body=NULL;
 
+// Bodies that were spilled to a mapped file don't count against the memory
+// budget.
+int bundle_cache_entry_bytes(struct bundle_cache_entry *e)
+{
+  return e->manifest_encoded_len+(e->body.mmapped?0:e->body.len);
+}
+
+// Forget the selected entry, so that nobody mistakes it for another bundle
+int bundle_cache_deselect(void)
+{
+  bid_of_cached_bundle=NULL;
+  cached_version=0;
+  cached_manifest_encoded=NULL; cached_manifest_encoded_len=0;
+  cached_body=NULL; cached_body_len=0;
+  return 0;
+}
+
+int bundle_cache_entries_in_use(void)
+{
+  int count=0;
+  for(int i=0;i<BUNDLE_CACHE_SLOTS;i++)
+    if (bundle_cache[i].in_use) count++;
+  return count;
+}
+
+int bundle_cache_release_entry(struct bundle_cache_entry *e)
+{
+  if (!e->in_use) return 0;
+
+  if (e->bid_hex==bid_of_cached_bundle) bundle_cache_deselect();
+
+  bundle_cache_bytes-=bundle_cache_entry_bytes(e);
+  free(e->bid_hex);
+  free(e->manifest_encoded);
+  http_buffer_free(&e->body);
+  bzero(e,sizeof(struct bundle_cache_entry));
+  return 0;
+}
+
+int bundle_cache_evict_lru(void)
+{
+  int victim=-1;
+  for(int i=0;i<BUNDLE_CACHE_SLOTS;i++)
+    if (bundle_cache[i].in_use)
+      if ((victim==-1)||(bundle_cache[i].last_used<bundle_cache[victim].last_used))
+	victim=i;
+  if (victim==-1) return -1;
+  if (0)
+    fprintf(stderr,"Evicting bundle %s*/%lld from bundle cache\n",
+	    bundle_cache[victim].bid_hex,bundle_cache[victim].version);
+  bundle_cache_release_entry(&bundle_cache[victim]);
+  bundle_cache_evictions++;
+  return victim;
+}
+
+int bundle_cache_select(struct bundle_cache_entry *e)
+{
+  e->last_used=++bundle_cache_clock;
+  
+  bid_of_cached_bundle=e->bid_hex;
+  cached_version=e->version;
+  cached_manifest_encoded=e->manifest_encoded;
+  cached_manifest_encoded_len=e->manifest_encoded_len;
+  cached_body=e->body.data;
+  cached_body_len=e->body.len;
+  return 0;
+}
+
+struct bundle_cache_entry *bundle_cache_find(unsigned char *bid_bin,long long version)
+{
+  for(int i=0;i<BUNDLE_CACHE_SLOTS;i++)
+    if (bundle_cache[i].in_use
+	&&(bundle_cache[i].version==version)
+	&&(!memcmp(bundle_cache[i].bid_bin,bid_bin,32)))
+      return &bundle_cache[i];
+  return NULL;
+}
+
+// Make space for a new entry of the given size, and return a free slot for it.
+struct bundle_cache_entry *bundle_cache_make_room(int bytes)
+{
+  while ((bundle_cache_bytes+bytes)>BUNDLE_CACHE_MEMORY_BUDGET)
+    if (bundle_cache_evict_lru()<0) break;
+  
+  for(int i=0;i<BUNDLE_CACHE_SLOTS;i++)
+    if (!bundle_cache[i].in_use) return &bundle_cache[i];
+
+  int slot=bundle_cache_evict_lru();
+  assert(slot>=0);
+  return &bundle_cache[slot];
+}
+
+// Fetch manifest and body of a bundle from servald into the supplied entry.
+// Both are received directly into memory, without going via temporary files.
+int bundle_cache_fetch(struct bundle_cache_entry *e,int bundle_number,
+		       char *servald_server, char *credential)
+{
+  char path[8192];
+  struct http_buffer manifest;
+  
+  snprintf(path,8192,"/restful/rhizome/%s.rhm",
+	   bundles[bundle_number].bid_hex);
+  
+  long long t1=gettime_ms();
+  
+  int result_code=http_get_buffer(servald_server,credential,path,&manifest,5000);
+  if(result_code!=200) {
+    fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
+    http_buffer_free(&manifest);
+    return -1;
+  }
+  long long t2=gettime_ms();
+  if (0) fprintf(stderr,"  manifest is %d bytes long.\n",manifest.len);
+  
+  // Reject over-length manifests
+  if (manifest.len>1024) {
+    http_buffer_free(&manifest);
+    return -1;
+  }
+  
+  // Generate binary encoded manifest from plain text version
+  e->manifest_encoded=malloc(1024);
+  assert(e->manifest_encoded);
+  e->manifest_encoded_len=0;
+  if (manifest_text_to_binary(manifest.data,manifest.len,
+			      e->manifest_encoded,
+			      &e->manifest_encoded_len)) {
+    // Failed to binary encode manifest, so just copy it
+    bcopy(manifest.data,e->manifest_encoded,manifest.len);
+    e->manifest_encoded_len = manifest.len;	
+  }        
+  http_buffer_free(&manifest);
+  
+  snprintf(path,8192,"/restful/rhizome/%s/raw.bin",
+	   bundles[bundle_number].bid_hex);
+  result_code=http_get_buffer(servald_server,credential,path,&e->body,5000);
+  if(result_code!=200) {
+    fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
+    return -1;
+  }
+  long long t3=gettime_ms();
+  
+  if (0)
+    fprintf(stderr,"  HTTP pre-fetching of next bundle to send took %lldms + %lldms\n",
+	    t2-t1,t3-t2);
+  
+  if (!e->body.len) fprintf(stderr,"WARNING:Body len = 0 bytes!\n");
+  if (1)
+    fprintf(stderr,"  body is %d bytes long%s. result_code=%d\n",
+	    e->body.len,e->body.mmapped?" (spilled to file)":"",result_code);
+
+  return 0;
+}
+
 int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
 		       char *servald_server, char *credential)
 {
@@ -79,133 +269,38 @@ int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
       exit(-1);
     }
   }
-  
-  if ((!bid_of_cached_bundle)
-      ||strcasecmp(bundles[bundle_number].bid_hex,bid_of_cached_bundle)
-      ||(cached_version!=bundles[bundle_number].version)
-      ) {
-    // Cache is invalid - release
-    if (bid_of_cached_bundle) {
-      free(bid_of_cached_bundle); bid_of_cached_bundle=NULL;
-      free(cached_manifest); cached_manifest=NULL;
-      free(cached_manifest_encoded); cached_manifest_encoded=NULL;
-      free(cached_body); cached_body=NULL;
-    }
 
-    // Load bundle into cache
-    char path[8192];
-    char filename[1024];
-    
-    snprintf(path,8192,"/restful/rhizome/%s.rhm",
-	     bundles[bundle_number].bid_hex);
-
-    long long t1=gettime_ms();
-
-    char pathbuf[1024];
-    snprintf(filename,1024,"%s/%d.%s.manifest",getcwd(pathbuf,1024),getpid(),
-	     sid_prefix_hex);
-      
-    unlink(filename);
-    FILE *f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"could not open output file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    int result_code=http_get_simple(servald_server,
-				    credential,path,f,5000,NULL,0);
-    fclose(f);
-    if(result_code!=200) {
-      fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
-      return -1;
-    }
-    long long t2=gettime_ms();
-    f=fopen(filename,"r");
-    if (!f) {
-      fprintf(stderr,"ERROR: Could not open '%s' to read bundle manifest in prime_bundle_cache() call for bundle #%d\n",
-	      filename,bundle_number);
-      perror("fopen");
-      return -1;
-    }
-    if (cached_manifest) free(cached_manifest);
-    cached_manifest=malloc(8192);
-    assert(cached_manifest);
-    cached_manifest_len=fread(cached_manifest,1,8192,f);
-    cached_manifest=realloc(cached_manifest,cached_manifest_len);
-    assert(cached_manifest);
-    fclose(f);
-    unlink(filename);
-    if (0) fprintf(stderr,"  manifest is %d bytes long.\n",cached_manifest_len);
-
-    // Reject over-length manifests
-    if (cached_manifest_len>1024) return -1;
-    
-    // Generate binary encoded manifest from plain text version
-    if (cached_manifest_encoded) free(cached_manifest_encoded);
-    cached_manifest_encoded=malloc(1024);
-    assert(cached_manifest_encoded);
-    cached_manifest_encoded_len=0;
-    if (manifest_text_to_binary(cached_manifest,cached_manifest_len,
-				cached_manifest_encoded,
-				&cached_manifest_encoded_len)) {
-      // Failed to binary encode manifest, so just copy it
-      bcopy(cached_manifest,cached_manifest_encoded,cached_manifest_len);
-      cached_manifest_encoded_len = cached_manifest_len;	
-    }        
-    
-    snprintf(path,8192,"/restful/rhizome/%s/raw.bin",
-	     bundles[bundle_number].bid_hex);
-    snprintf(filename,1024,"%d.%s.raw",getpid(),sid_prefix_hex);
-    unlink(filename);
-    f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"could not open output file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    result_code=http_get_simple(servald_server,
-				credential,path,f,5000,NULL,0);
-    fclose(f); f=NULL;
-    if(result_code!=200) {
-      fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
-      return -1;
-    }
-    long long t3=gettime_ms();
-
-    if (0)
-      fprintf(stderr,"  HTTP pre-fetching of next bundle to send took %lldms + %lldms\n",
-	      t2-t1,t3-t2);
-    
-    // XXX - This transport only allows bundles upto 5MB!
-    // (and that is probably pushing it a bit for a mesh extender with only 32MB RAM
-    // for everything!)
-    f=fopen(filename,"r");
-    if (!f) {
-      fprintf(stderr,"could read file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    if (cached_body) free(cached_body);
-    cached_body=malloc(5*1024*1024);
-    assert(cached_body);
-    // XXX - Should check that we read all the bytes
-    cached_body_len=fread(cached_body,1,5*1024*1024,f);    
-    cached_body=realloc(cached_body,cached_body_len);
-    if (cached_body_len) assert(cached_body); else fprintf(stderr,"WARNING:Body len = 0 bytes!\n");
-    fclose(f);
-    unlink(filename);
-    if (1)
-      fprintf(stderr,"  body is %d bytes long. result_code=%d\n",
-	      cached_body_len,result_code);
-
-    bid_of_cached_bundle=strdup(bundles[bundle_number].bid_hex);
-
-    cached_version=bundles[bundle_number].version;
-
-    if (0)
-      fprintf(stderr,"Cached manifest and body for %s\n",
-	      bundles[bundle_number].bid_hex);
+  struct bundle_cache_entry *e=bundle_cache_find(bundles[bundle_number].bid_bin,
+						 bundles[bundle_number].version);
+  if (e) {
+    bundle_cache_hits++;
+    bundle_cache_select(e);
+    return 0;
   }
+  bundle_cache_misses++;
+
+  struct bundle_cache_entry fetched;
+  bzero(&fetched,sizeof(fetched));
+  if (bundle_cache_fetch(&fetched,bundle_number,servald_server,credential)) {
+    free(fetched.manifest_encoded);
+    http_buffer_free(&fetched.body);
+    bundle_cache_deselect();
+    return -1;
+  }
+  
+  e=bundle_cache_make_room(bundle_cache_entry_bytes(&fetched));
+  *e=fetched;
+  e->in_use=1;
+  bcopy(bundles[bundle_number].bid_bin,e->bid_bin,32);
+  e->bid_hex=strdup(bundles[bundle_number].bid_hex);
+  e->version=bundles[bundle_number].version;
+  bundle_cache_bytes+=bundle_cache_entry_bytes(e);
+  bundle_cache_select(e);
+  
+  if (0)
+    fprintf(stderr,"Cached manifest and body for %s (%d entries, %lld bytes)\n",
+	    bundles[bundle_number].bid_hex,
+	    bundle_cache_entries_in_use(),bundle_cache_bytes);
   
   return 0;
 }
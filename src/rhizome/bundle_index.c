@@ -0,0 +1,181 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports,
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Indexes over bundles[], so that we don't have to do linear searches of the
+  bundle list every time a piece, BAR or bundlelist.json line arrives.
+
+  There are two indexes:
+
+  1. An open-addressing hash table keyed on the full binary BID, used by
+     register_bundle() to find whether we already hold a bundle.
+
+  2. An array of bundle numbers kept sorted by binary BID, so that all bundles
+     matching a BID prefix form a contiguous run that can be found by binary
+     search.
+
+  Bundles are never removed from bundles[], and the BID of a slot never changes
+  once it has been assigned, so we only ever need to insert into the indexes.
+  BIDs are public keys, and thus already uniformly distributed, so we use the
+  leading bytes of the BID directly as the hash.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+// Must be a power of two, and comfortably larger than MAX_BUNDLES so that
+// probe sequences remain short.
+#define BUNDLE_HASH_SLOTS 32768
+
+// Holds bundle number + 1, so that zero means an empty slot.
+static int bundle_hash[BUNDLE_HASH_SLOTS];
+
+static int bundles_by_bid[MAX_BUNDLES];
+static int bundles_by_bid_count=0;
+
+static unsigned int bundle_hash_of_bid(const unsigned char *bid_bin)
+{
+  return ((bid_bin[0]<<16)|(bid_bin[1]<<8)|bid_bin[2])&(BUNDLE_HASH_SLOTS-1);
+}
+
+int bundle_index_find_bid(const unsigned char *bid_bin)
+{
+  unsigned int slot=bundle_hash_of_bid(bid_bin);
+  while(bundle_hash[slot]) {
+    int bundle=bundle_hash[slot]-1;
+    if (!memcmp(bundles[bundle].bid_bin,bid_bin,32)) return bundle;
+    slot=(slot+1)&(BUNDLE_HASH_SLOTS-1);
+  }
+  return -1;
+}
+
+// Compare the first prefix_bits bits of a BID with a prefix.
+static int bundle_bid_prefix_compare(const unsigned char *bid_bin,
+				     const unsigned char *prefix,int prefix_bits)
+{
+  int bytes=prefix_bits>>3;
+  int r=memcmp(bid_bin,prefix,bytes);
+  if (r) return r;
+  if (prefix_bits&7) {
+    int mask=(0xff00>>(prefix_bits&7))&0xff;
+    return (bid_bin[bytes]&mask)-(prefix[bytes]&mask);
+  }
+  return 0;
+}
+
+// Returns the position of the first entry in bundles_by_bid[] that is not less
+// than the supplied prefix.
+static int bundle_index_lower_bound(const unsigned char *prefix,int prefix_bits)
+{
+  int lo=0, hi=bundles_by_bid_count;
+  while(lo<hi) {
+    int mid=(lo+hi)>>1;
+    if (bundle_bid_prefix_compare(bundles[bundles_by_bid[mid]].bid_bin,
+				  prefix,prefix_bits)<0)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return lo;
+}
+
+int bundle_index_add(int bundle_number)
+{
+  unsigned char *bid_bin=bundles[bundle_number].bid_bin;
+
+  if (bundle_index_find_bid(bid_bin)>=0) return 0;
+  if (bundles_by_bid_count>=MAX_BUNDLES) return -1;
+
+  unsigned int slot=bundle_hash_of_bid(bid_bin);
+  while(bundle_hash[slot]) slot=(slot+1)&(BUNDLE_HASH_SLOTS-1);
+  bundle_hash[slot]=bundle_number+1;
+
+  int pos=bundle_index_lower_bound(bid_bin,32*8);
+  memmove(&bundles_by_bid[pos+1],&bundles_by_bid[pos],
+	  (bundles_by_bid_count-pos)*sizeof(int));
+  bundles_by_bid[pos]=bundle_number;
+  bundles_by_bid_count++;
+
+  return 0;
+}
+
+/*
+  Find the run of bundles whose BID begins with the given binary prefix.
+  Returns the number of matching bundles, and sets *first to the position in
+  the sorted index of the first of them, for use with bundle_index_at().
+*/
+int bundle_index_prefix_range(const unsigned char *prefix,int prefix_bits,
+			      int *first)
+{
+  if (prefix_bits>32*8) prefix_bits=32*8;
+  int start=bundle_index_lower_bound(prefix,prefix_bits);
+  int end=start;
+  while((end<bundles_by_bid_count)
+	&&(!bundle_bid_prefix_compare(bundles[bundles_by_bid[end]].bid_bin,
+				      prefix,prefix_bits)))
+    end++;
+  *first=start;
+  return end-start;
+}
+
+// As above, but for a (possibly odd-length) hex BID prefix string.
+int bundle_index_hex_prefix_range(const char *hex_prefix,int *first)
+{
+  unsigned char prefix[32];
+  int nybls;
+
+  bzero(prefix,sizeof(prefix));
+  for(nybls=0;(nybls<64)&&hex_prefix[nybls];nybls++) {
+    if (!ishex(hex_prefix[nybls])) {
+      // Not a BID prefix, so can't match anything
+      *first=0;
+      return 0;
+    }
+    int v=chartohexnybl(hex_prefix[nybls]);
+    if (nybls&1) prefix[nybls>>1]|=v;
+    else prefix[nybls>>1]|=v<<4;
+  }
+
+  return bundle_index_prefix_range(prefix,nybls*4,first);
+}
+
+int bundle_index_at(int position)
+{
+  return bundles_by_bid[position];
+}
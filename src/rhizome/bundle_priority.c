@@ -0,0 +1,88 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports,
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+  Cached bundle priorities.
+
+  The intrinsic priority of a bundle (see calculate_bundle_intrinsic_priority())
+  only depends on the bundle itself, and on whether its recipient is one of our
+  peers.  So we calculate it once when the bundle is registered, keep it in
+  the bundle record, and only recalculate it for the bundles addressed to a peer
+  when that peer arrives or is dropped from the peer table.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+// Whether bundles[i].intrinsic_priority has been calculated yet
+static char bundle_priority_cached[MAX_BUNDLES];
+
+// (Re)calculate the cached priority of a bundle.  Called whenever a bundle is
+// registered or updated.
+int bundle_priority_update(int bundle)
+{
+  if ((bundle<0)||(bundle>=MAX_BUNDLES)) return -1;
+
+  struct bundle_record *b=&bundles[bundle];
+  b->intrinsic_priority=
+    calculate_bundle_intrinsic_priority(b->bid_hex,b->length,b->version,
+					b->service,b->recipient,
+					0 /* it is a bundle in rhizome, so
+					     insert_failures is meaningless here. */
+					);
+  bundle_priority_cached[bundle]=1;
+  return 0;
+}
+
+// A peer has arrived or been dropped, so bundles addressed to it may have
+// changed priority.
+int bundle_priority_peer_changed(char *sid_prefix)
+{
+  for(int i=0;i<bundle_count;i++)
+    if (bundles[i].recipient&&(!strncmp(bundles[i].recipient,sid_prefix,8*2)))
+      bundle_priority_update(i);
+  return 0;
+}
+
+long long bundle_intrinsic_priority(int bundle)
+{
+  if (!bundle_priority_cached[bundle]) bundle_priority_update(bundle);
+  return bundles[bundle].intrinsic_priority;
+}
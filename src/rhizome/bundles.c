@@ -101,6 +101,7 @@ int note_new_or_updated_bundle(int bundle_number)
 struct bundle_record bundles[MAX_BUNDLES];
 int bundle_count=0;
 int ignored_bundles=0;
+long long bundles_generation=0;
 
 int register_bundle(char *service,
 		    char *bid,
@@ -168,35 +169,24 @@ int register_bundle(char *service,
     return 0;
   }
   
+  unsigned char bid_bin[32];
+  for(i=0;i<32;i++) {
+    char hex[3]={bid[i*2+0],bid[i*2+1],0};
+    bid_bin[i]=strtoll(hex,NULL,16);
+  }
+
   // Remove bundle from partial lists of all peers if we have other transmissions
   // to us in progress of this bundle
-  // XXX - Linear searches! Replace with hash table etc
-  for(i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) {
-    if (partials[i].bid_prefix) {
-      // Here is a bundle in flight
-      char *bid_prefix=partials[i].bid_prefix;
-      long long bid_version=partials[i].bundle_version;
-      
-      if (versionll>=bid_version)
-	if (!strncasecmp(bid,bid_prefix,strlen(bid_prefix)))
-	  {
-	    fprintf(stderr,"--- Culling in-progress transfer for bundle that has shown up in Rhizome.\n");
-	    clear_partial(&partials[i]);
-	    break;
-	  }
-    }
+  int partial=partial_find(bid_bin);
+  if ((partial>=0)&&(versionll>=partials[partial].bundle_version)) {
+    fprintf(stderr,"--- Culling in-progress transfer for bundle that has shown up in Rhizome.\n");
+    clear_partial(&partials[partial]);
   }
   
-  // XXX - Linear search through bundles!
-  // Use a hash table or something so that it doesn't cost O(n^2) with number
-  // of bundles.
-  int bundle_number=bundle_count;
-  for(i=0;i<bundle_count;i++) {
-    if (!strcmp(bundles[i].bid_hex,bid)) {
-      // Updating an existing bundle
-      bundle_number=i; break;
-    }
-  }
+  // Look the bundle up in the BID hash, so that this doesn't cost O(n^2) with
+  // number of bundles.
+  int bundle_number=bundle_index_find_bid(bid_bin);
+  if (bundle_number<0) bundle_number=bundle_count;
 
   if (bundle_number>=MAX_BUNDLES) return -1;
   
@@ -226,12 +216,8 @@ int register_bundle(char *service,
   } else {    
     // New bundle
     bundles[bundle_number].bid_hex=strdup(bid);
-    {
-      for(int i=0;i<32;i++) {
-	char hex[3]={bid[i*2+0],bid[i*2+1],0};
-	bundles[bundle_number].bid_bin[i]=strtoll(hex,NULL,16);
-      }
-    }
+    bcopy(bid_bin,bundles[bundle_number].bid_bin,32);
+    bundle_index_add(bundle_number);
     // Never announced
     bundles[bundle_number].last_offset_announced=0;
     bundles[bundle_number].last_version_of_manifest_announced=0;
@@ -261,6 +247,9 @@ int register_bundle(char *service,
   bundles[bundle_number].sync_key=bundle_sync_key;
   
   bundles[bundle_number].index=bundle_number;
+  bundles_generation++;
+
+  bundle_priority_update(bundle_number);
   
   // Add bundle to the sync tree 
   sync_add_key(sync_state,&bundle_sync_key,&bundles[bundle_number]);
@@ -302,15 +291,13 @@ int register_bundle(char *service,
 
 int we_have_this_bundle_or_newer(char *bid_prefix, long long version)
 {
-  int i;
-  for(i=0;i<bundle_count;i++) {
-    if (!strncasecmp(bundles[i].bid_hex,bid_prefix,strlen(bid_prefix))) {
-      // We have this bundle, but do we have this version?
-      if (bundles[i].version>=version) {
-	// Ok, we have this already
-	return 1;
-	break;
-      }
+  int first;
+  int count=bundle_index_hex_prefix_range(bid_prefix,&first);
+  for(int i=first;i<first+count;i++) {
+    // We have this bundle, but do we have this version?
+    if (bundles[bundle_index_at(i)].version>=version) {
+      // Ok, we have this already
+      return 1;
     }
   }
   return 0;
@@ -323,12 +310,9 @@ int we_have_this_bundle_or_newer(char *bid_prefix, long long version)
 // then use the recipient from there.
 char *bundle_recipient_if_known(char *bid_prefix)
 {
-  int i;
-  for(i=0;i<bundle_count;i++) {
-    if (!strncasecmp(bundles[i].bid_hex,bid_prefix,strlen(bid_prefix))) {
-      return bundles[i].recipient;
-    }
-  }
+  int first;
+  if (bundle_index_hex_prefix_range(bid_prefix,&first))
+    return bundles[bundle_index_at(first)].recipient;
 
   return NULL;
 }
@@ -0,0 +1,340 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports,
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+  Asynchronous insertion of received bundles into servald.
+
+  Posting a bundle to /rhizome/import can take servald many seconds, and
+  doing it synchronously stopped us from servicing the radio for all of that
+  time.  Instead, completed bundles are put on a small bounded queue, and the
+  POST request for each is written to a non-blocking socket and its response
+  read by the reactor, one import at a time.  When an import finishes, the
+  callback supplied when it was queued is called with the HTTP result.
+
+  Imports that fail because servald was unreachable, too slow or returned a
+  server error are retried a few times after a delay.  If the queue is full,
+  rhizome_import_queue_full() lets the caller hold on to the bundle until there
+  is space, rather than throwing it away.
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+#define RHIZOME_IMPORT_QUEUE_LEN 8
+#define RHIZOME_IMPORT_TIMEOUT_MS 15000
+#define RHIZOME_IMPORT_MAX_ATTEMPTS 3
+#define RHIZOME_IMPORT_RETRY_DELAY_MS 2000
+
+#define IMPORT_FREE 0
+#define IMPORT_WAITING 1
+#define IMPORT_SENDING 2
+#define IMPORT_READING 3
+
+struct rhizome_import {
+  int state;
+  // Imports are started in the order they were queued
+  long long sequence;
+  int attempts;
+  // When to start (or retry) the import, or when to give up waiting for it
+  long long due;
+
+  unsigned char *manifest;
+  int manifest_length;
+  char *request;
+  int request_length;
+  int request_sent;
+  char response[256];
+  int response_length;
+
+  int sock;
+  char *servald_server;
+  rhizome_import_callback callback;
+  void *context;
+};
+
+static struct rhizome_import imports[RHIZOME_IMPORT_QUEUE_LEN];
+static long long import_sequence=0;
+static int import_timer=-1;
+
+int rhizome_imports_queued=0;
+long long rhizome_imports_completed=0;
+long long rhizome_imports_failed=0;
+long long rhizome_imports_retried=0;
+
+static long long rhizome_import_timer(long long now,void *context);
+
+int rhizome_import_queue_full(void)
+{
+  return rhizome_imports_queued>=RHIZOME_IMPORT_QUEUE_LEN;
+}
+
+static int rhizome_import_active(void)
+{
+  for(int i=0;i<RHIZOME_IMPORT_QUEUE_LEN;i++)
+    if (imports[i].state>IMPORT_WAITING) return 1;
+  return 0;
+}
+
+static void rhizome_import_close(struct rhizome_import *job)
+{
+  if (job->sock>=0) {
+    reactor_unwatch_fd(job->sock);
+    close(job->sock);
+  }
+  job->sock=-1;
+}
+
+static void rhizome_import_finish(struct rhizome_import *job,int result)
+{
+  rhizome_import_close(job);
+
+  // Retry if servald couldn't be reached, timed out or had an internal error,
+  // but not if it rejected the bundle.
+  if (((result<0)||(result>=500))
+      &&(job->attempts<RHIZOME_IMPORT_MAX_ATTEMPTS)) {
+    fprintf(stderr,"Import of bundle into rhizome failed (result=%d), retrying (attempt %d of %d).\n",
+	    result,job->attempts+1,RHIZOME_IMPORT_MAX_ATTEMPTS);
+    rhizome_imports_retried++;
+    job->state=IMPORT_WAITING;
+    job->request_sent=0;
+    job->response_length=0;
+    job->due=gettime_ms()+RHIZOME_IMPORT_RETRY_DELAY_MS*job->attempts;
+  } else {
+    if ((result>=200)&&(result<=202)) {
+      printf("http result code = %d\n",result);
+      last_servald_contact=gettime_ms();
+      rhizome_imports_completed++;
+    } else {
+      printf("POST bundle to rhizome failed: http result = %d\n",result);
+      rhizome_log_rejected_bundle(job->manifest,job->manifest_length,NULL,0,result);
+      rhizome_imports_failed++;
+    }
+    if (job->callback)
+      job->callback(result,job->manifest,job->manifest_length,job->context);
+    free(job->manifest);
+    free(job->request);
+    bzero(job,sizeof(struct rhizome_import));
+    job->sock=-1;
+    rhizome_imports_queued--;
+  }
+
+  // Start the next import, if any
+  if (import_timer>=0) reactor_timer_set_due(import_timer,gettime_ms());
+}
+
+// Returns the HTTP result code once the status line has arrived, or 0 if we
+// are still waiting for it.
+static int rhizome_import_parse_response(struct rhizome_import *job)
+{
+  char *eol=memchr(job->response,'\n',job->response_length);
+  if (!eol) {
+    if (job->response_length>=sizeof(job->response)-1) return -1;
+    return 0;
+  }
+  *eol=0;
+  int http_response=-1;
+  if (sscanf(job->response,"HTTP/%*d.%*d %d",&http_response)!=1) return -1;
+  return http_response;
+}
+
+static int rhizome_import_io(int fd,void *context)
+{
+  struct rhizome_import *job=context;
+
+  if (job->state==IMPORT_SENDING) {
+    while(job->request_sent<job->request_length) {
+      int w=send(job->sock,&job->request[job->request_sent],
+		 job->request_length-job->request_sent,0
+#ifdef MSG_NOSIGNAL
+		 |MSG_NOSIGNAL
+#endif
+		 );
+      if (w<0) {
+	if ((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)) return 0;
+	rhizome_import_finish(job,-1);
+	return 0;
+      }
+      job->request_sent+=w;
+    }
+    // Whole request sent, so now wait for the response
+    reactor_want_write(job->sock,0);
+    job->state=IMPORT_READING;
+  }
+
+  if (job->state==IMPORT_READING) {
+    while(1) {
+      int r=read(job->sock,&job->response[job->response_length],
+		 sizeof(job->response)-1-job->response_length);
+      if (r<0) {
+	if ((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)) return 0;
+	rhizome_import_finish(job,-1);
+	return 0;
+      }
+      if (!r) {
+	// Connection closed before we saw a complete status line
+	rhizome_import_finish(job,-1);
+	return 0;
+      }
+      job->response_length+=r;
+      int result=rhizome_import_parse_response(job);
+      if (result) {
+	// We don't need the rest of the response, and closing the connection is
+	// simpler than draining it.
+	rhizome_import_finish(job,result);
+	return 0;
+      }
+    }
+  }
+  return 0;
+}
+
+static int rhizome_import_start(struct rhizome_import *job)
+{
+  char server_name[1024];
+  int server_port=-1;
+  job->attempts++;
+  if (sscanf(job->servald_server,"%[^:]:%d",server_name,&server_port)!=2) {
+    rhizome_import_finish(job,-1);
+    return -1;
+  }
+
+  // Connecting to servald on the local host doesn't block for any
+  // appreciable time, so we don't make that asynchronous.
+  job->sock=connect_to_port(server_name,server_port);
+  if (job->sock<0) {
+    rhizome_import_finish(job,-1);
+    return -1;
+  }
+  fcntl(job->sock,F_SETFL,fcntl(job->sock,F_GETFL,NULL)|O_NONBLOCK);
+  if (reactor_watch_fd(job->sock,"rhizome import",rhizome_import_io,job)) {
+    rhizome_import_finish(job,-1);
+    return -1;
+  }
+  reactor_want_write(job->sock,1);
+
+  printf("Submitting rhizome bundle: manifest len=%d, request len=%d\n",
+	 job->manifest_length,job->request_length);
+  job->state=IMPORT_SENDING;
+  job->due=gettime_ms()+RHIZOME_IMPORT_TIMEOUT_MS;
+  return 0;
+}
+
+static long long rhizome_import_timer(long long now,void *context)
+{
+  long long next=now+REACTOR_MAX_WAIT_MS;
+
+  // Give up on an import that servald is taking too long over
+  for(int i=0;i<RHIZOME_IMPORT_QUEUE_LEN;i++)
+    if ((imports[i].state>IMPORT_WAITING)&&(imports[i].due<=now)) {
+      fprintf(stderr,"Timeout waiting for servald to import bundle.\n");
+      rhizome_import_finish(&imports[i],-1);
+    }
+
+  // Start the oldest waiting import that is due, if none is in progress
+  if (!rhizome_import_active()) {
+    struct rhizome_import *oldest=NULL;
+    for(int i=0;i<RHIZOME_IMPORT_QUEUE_LEN;i++)
+      if ((imports[i].state==IMPORT_WAITING)&&(imports[i].due<=now)
+	  &&((!oldest)||(imports[i].sequence<oldest->sequence)))
+	oldest=&imports[i];
+    if (oldest) rhizome_import_start(oldest);
+  }
+
+  // Waiting jobs that are already due can't start until the active one
+  // finishes, and rhizome_import_finish() wakes us up when that happens.
+  int active=rhizome_import_active();
+  for(int i=0;i<RHIZOME_IMPORT_QUEUE_LEN;i++)
+    if (imports[i].state&&(imports[i].due<next)) {
+      if (active&&(imports[i].state==IMPORT_WAITING)&&(imports[i].due<=now))
+	continue;
+      next=imports[i].due;
+    }
+  return next;
+}
+
+/*
+  Queue a bundle for insertion into servald.  The manifest and body are copied,
+  so the caller can free them as soon as we return.  Returns 0 if the bundle was
+  queued, or -1 if the queue is full or the request could not be built.
+*/
+int rhizome_import_bundle(unsigned char *manifest_data,int manifest_length,
+			  unsigned char *body_data,int body_length,
+			  char *servald_server,char *credential,
+			  rhizome_import_callback callback,void *context)
+{
+  if (import_timer<0) {
+    for(int i=0;i<RHIZOME_IMPORT_QUEUE_LEN;i++) imports[i].sock=-1;
+    import_timer=reactor_add_timer("rhizome import",gettime_ms(),
+				   rhizome_import_timer,NULL);
+    if (import_timer<0) return -1;
+  }
+
+  struct rhizome_import *job=NULL;
+  for(int i=0;i<RHIZOME_IMPORT_QUEUE_LEN;i++)
+    if (imports[i].state==IMPORT_FREE) { job=&imports[i]; break; }
+  if (!job) return -1;
+
+  job->request=http_build_bundle_post(servald_server,credential,"/rhizome/import",
+				      manifest_data,manifest_length,
+				      body_data,body_length,&job->request_length);
+  if (!job->request) return -1;
+  job->manifest=malloc(manifest_length);
+  if (!job->manifest) {
+    free(job->request);
+    job->request=NULL;
+    return -1;
+  }
+  bcopy(manifest_data,job->manifest,manifest_length);
+  job->manifest_length=manifest_length;
+  job->servald_server=servald_server;
+  job->callback=callback;
+  job->context=context;
+  job->sequence=import_sequence++;
+  job->attempts=0;
+  job->request_sent=0;
+  job->response_length=0;
+  job->sock=-1;
+  job->due=gettime_ms();
+  job->state=IMPORT_WAITING;
+  rhizome_imports_queued++;
+
+  reactor_timer_set_due(import_timer,job->due);
+  return 0;
+}
@@ -1,5 +1,15 @@
 
-int parse_json_line(char *line,char fields[][8192],int num_fields)
+/*
+  Split a line of a servald JSON list (e.g., a row of bundlelist.json) into its
+  fields, in place.  Each entry of fields[] is set to point to the start of a
+  field within the line, and the delimiter following each field is overwritten
+  with a NUL, so that no copying is required.  Backslash escapes within quoted
+  fields are removed in place.
+
+  Returns the number of fields, or a negative value if the line is not a
+  well-formed list row.
+*/
+int json_parse_line_inplace(char *line,char **fields,int num_fields)
 {
   int field_count=0;
   int offset=0;
@@ -9,22 +19,31 @@ int parse_json_line(char *line,char fields[][8192],int num_fields)
     if (field_count>=num_fields) return -2;
     if (line[offset]=='"') {
       // quoted field
-      int j=0,i;
-      for(i=offset+1;(line[i]!='"')&&(i<8191);i++)
-	fields[field_count][j++]=line[i];
-      fields[field_count++][j]=0;
+      int i,j;
+      fields[field_count++]=&line[offset+1];
+      for(i=offset+1,j=offset+1;line[i]&&(line[i]!='"');i++) {
+	if ((line[i]=='\\')&&line[i+1]) i++;
+	line[j++]=line[i];
+      }
+      if (!line[i]) return -3;
       offset=i+1;
+      line[j]=0;
     } else {
       // naked field
-      int j=0,i;
-      for(i=offset;(line[i]!=',')&&(line[i]!=']')&&(i<8191);i++)
-	fields[field_count][j++]=line[i];
-      fields[field_count++][j]=0;
+      int i;
+      fields[field_count++]=&line[offset];
+      for(i=offset;line[i]&&(line[i]!=',')&&(line[i]!=']');i++)
+	continue;
       if (offset==i) return -4;
       offset=i;
+      if (line[offset]==']') {
+	// Terminate the field, and we are done
+	line[offset]=0;
+	break;
+      }
     }
     if (line[offset]&&(line[offset]!=',')&&(line[offset]!=']')) return -3;
-    if (line[offset]==',') offset++;
+    if (line[offset]==',') line[offset++]=0;
   }
   
   return field_count;
@@ -45,7 +45,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 int free_peer(struct peer_state *p)
 {
   if (p->sid_prefix) { free(p->sid_prefix); } p->sid_prefix=NULL;
-  for(int i=0;i<4;i++) p->sid_prefix_bin[i]=0;
+  bzero(p->sid_prefix_bin,sizeof(p->sid_prefix_bin));
 #ifdef SYNC_BY_BAR
   for(int i=0;i<p->bundle_count;i++) {
     if (p->bid_prefixes[i]) free(p->bid_prefixes[i]);    
@@ -126,14 +126,235 @@ int peer_note_bar(struct peer_state *p,
 
 struct peer_state *peer_records[MAX_PEERS];
 int peer_count=0;
+long long peers_generation=0;
+long long tx_queue_generation=0;
+
+/*
+  Peers are found by the binary SID prefix that starts every packet, via a
+  chained hash table.  SIDs are public keys, and thus already uniformly
+  distributed, so we use the leading bytes directly as the hash.
+
+  We also keep the peers in a doubly linked list ordered by last_message_time,
+  most recent first, so that when peer_records[] is full we can replace the
+  peer we have not heard from for the longest, rather than a random one.
+*/
+
+// Must be a power of two, and larger than MAX_PEERS so that chains are short.
+#define PEER_HASH_SLOTS 4096
+
+static struct peer_state *peer_hash[PEER_HASH_SLOTS];
+static struct peer_state *peers_newest=NULL;
+static struct peer_state *peers_oldest=NULL;
+
+static unsigned int peer_hash_of_prefix(unsigned char *sid_prefix_bin)
+{
+  return ((sid_prefix_bin[0]<<8)|sid_prefix_bin[1])&(PEER_HASH_SLOTS-1);
+}
+
+struct peer_state *peer_find_bin(unsigned char *sid_prefix_bin)
+{
+  struct peer_state *p=peer_hash[peer_hash_of_prefix(sid_prefix_bin)];
+  for(;p;p=p->hash_next)
+    if (!memcmp(p->sid_prefix_bin,sid_prefix_bin,PEER_PREFIX_BYTES)) return p;
+  return NULL;
+}
 
 int find_peer_by_prefix(char *peer_prefix)
 {
-  for(int i=0;i<peer_count;i++)
-    if (!strcasecmp(peer_records[i]->sid_prefix,peer_prefix))
-      return i;
-  
-  return -1;
+  // Peers are only ever known by full length prefixes, so nothing else can
+  // match.
+  unsigned char prefix_bin[PEER_PREFIX_BYTES];
+  if (strlen(peer_prefix)!=PEER_PREFIX_BYTES*2) return -1;
+  for(int i=0;i<PEER_PREFIX_BYTES;i++) {
+    if (!ishex(peer_prefix[i*2])||!ishex(peer_prefix[i*2+1])) return -1;
+    prefix_bin[i]=(chartohexnybl(peer_prefix[i*2])<<4)
+      |chartohexnybl(peer_prefix[i*2+1]);
+  }
+
+  struct peer_state *p=peer_find_bin(prefix_bin);
+  return p?p->peer_index:-1;
+}
+
+static void peer_lru_unlink(struct peer_state *p)
+{
+  if (p->lru_newer) p->lru_newer->lru_older=p->lru_older;
+  else peers_newest=p->lru_older;
+  if (p->lru_older) p->lru_older->lru_newer=p->lru_newer;
+  else peers_oldest=p->lru_newer;
+  p->lru_newer=NULL; p->lru_older=NULL;
+}
+
+static void peer_lru_push_newest(struct peer_state *p)
+{
+  p->lru_newer=NULL;
+  p->lru_older=peers_newest;
+  if (peers_newest) peers_newest->lru_newer=p;
+  else peers_oldest=p;
+  peers_newest=p;
+}
+
+/*
+  Peers we have heard from in the last peer_keepalive_interval seconds are
+  kept in active_peers[], so that the scheduler can pick one, or count them,
+  without looking at the inactive ones.  Peers join when a packet arrives from
+  them, and are dropped by an expiry wheel with one slot per second that is
+  advanced by a reactor timer.
+
+  Peers are only filed in the wheel when they become active.  When their slot
+  comes around, we check last_message_time, and either drop them or refile
+  them for when they would next expire.  This means that receiving a packet
+  never has to touch the wheel, and a peer may stay active for up to a second
+  longer than peer_keepalive_interval.
+*/
+
+// Must be a power of two
+#define PEER_EXPIRY_SLOTS 64
+
+static struct peer_state *active_peers[MAX_PEERS];
+static int active_count=0;
+static int active_next=0;
+
+static struct peer_state *peer_expiry_wheel[PEER_EXPIRY_SLOTS];
+static time_t peer_expiry_second=0;
+static int peer_expiry_timer=-1;
+
+static void peer_active_remove(struct peer_state *p)
+{
+  if (!p->active_position) return;
+  int position=p->active_position-1;
+  active_peers[position]=active_peers[--active_count];
+  active_peers[position]->active_position=position+1;
+  p->active_position=0;
+}
+
+static void peer_expiry_file(struct peer_state *p)
+{
+  int slot=(p->last_message_time+peer_keepalive_interval+1)&(PEER_EXPIRY_SLOTS-1);
+  p->expiry_next=peer_expiry_wheel[slot];
+  peer_expiry_wheel[slot]=p;
+  p->expiry_slot=slot+1;
+}
+
+static void peer_expiry_remove(struct peer_state *p)
+{
+  if (!p->expiry_slot) return;
+  struct peer_state **q=&peer_expiry_wheel[p->expiry_slot-1];
+  while(*q&&*q!=p) q=&(*q)->expiry_next;
+  if (*q) *q=p->expiry_next;
+  p->expiry_next=NULL;
+  p->expiry_slot=0;
+}
+
+static long long peer_expiry_timer_callback(long long now,void *context)
+{
+  time_t second=time(0);
+
+  // Clocks can step in either direction.  There's no point going around the
+  // wheel more than once.
+  if (second<peer_expiry_second||second-peer_expiry_second>PEER_EXPIRY_SLOTS)
+    peer_expiry_second=second-PEER_EXPIRY_SLOTS;
+
+  for(;peer_expiry_second<=second;peer_expiry_second++) {
+    int slot=peer_expiry_second&(PEER_EXPIRY_SLOTS-1);
+    struct peer_state *p=peer_expiry_wheel[slot];
+    peer_expiry_wheel[slot]=NULL;
+    while(p) {
+      struct peer_state *next=p->expiry_next;
+      p->expiry_next=NULL;
+      p->expiry_slot=0;
+      if ((second-p->last_message_time)>peer_keepalive_interval)
+	peer_active_remove(p);
+      else
+	peer_expiry_file(p);
+      p=next;
+    }
+  }
+  return now+1000;
+}
+
+static void peer_active_add(struct peer_state *p)
+{
+  if (p->active_position) return;
+  if (peer_expiry_timer<0) {
+    peer_expiry_second=time(0);
+    peer_expiry_timer=reactor_add_timer("peer expiry",gettime_ms()+1000,
+					peer_expiry_timer_callback,NULL);
+  }
+  active_peers[active_count++]=p;
+  p->active_position=active_count;
+  peer_expiry_file(p);
+}
+
+static void peer_unlink(struct peer_state *p)
+{
+  struct peer_state **q=&peer_hash[peer_hash_of_prefix(p->sid_prefix_bin)];
+  while(*q&&*q!=p) q=&(*q)->hash_next;
+  if (*q) *q=p->hash_next;
+  p->hash_next=NULL;
+  peer_lru_unlink(p);
+  peer_active_remove(p);
+  peer_expiry_remove(p);
+}
+
+static void peer_link(struct peer_state *p,int peer_index)
+{
+  unsigned int slot=peer_hash_of_prefix(p->sid_prefix_bin);
+  p->hash_next=peer_hash[slot];
+  peer_hash[slot]=p;
+  peer_lru_push_newest(p);
+  p->peer_index=peer_index;
+  peer_records[peer_index]=p;
+  peers_generation++;
+}
+
+/*
+  Add a newly seen peer to peer_records[], replacing the least recently heard
+  from peer if the table is full.  Returns the peer's index.
+*/
+int peer_register(struct peer_state *p)
+{
+  if (peer_count<MAX_PEERS) {
+    peer_link(p,peer_count++);
+    return p->peer_index;
+  }
+
+  struct peer_state *old=peers_oldest;
+  int peer_index=old->peer_index;
+  char old_prefix[16+1];
+  snprintf(old_prefix,sizeof(old_prefix),"%s",old->sid_prefix);
+  printf("Peer table full: forgetting %s*, last heard from %lld seconds ago\n",
+	 old_prefix,(long long)(time(0)-old->last_message_time));
+  peer_unlink(old);
+  free_peer(old);
+  peer_link(p,peer_index);
+  bundle_priority_peer_changed(old_prefix);
+  return peer_index;
+}
+
+// Free old, and put p in its place, e.g., when a peer restarts.
+int peer_replace(struct peer_state *old,struct peer_state *p)
+{
+  int peer_index=old->peer_index;
+  if (peer_records[peer_index]!=old) return -1;
+  peer_unlink(old);
+  free_peer(old);
+  peer_link(p,peer_index);
+  if ((time(0)-p->last_message_time)<=peer_keepalive_interval)
+    peer_active_add(p);
+  return peer_index;
+}
+
+// Note that we have just heard from this peer.
+int peer_saw_message(struct peer_state *p)
+{
+  p->last_message_time=time(0);
+  peers_generation++;
+  if (peers_newest!=p) {
+    peer_lru_unlink(p);
+    peer_lru_push_newest(p);
+  }
+  peer_active_add(p);
+  return 0;
 }
 
 #ifdef SYNC_BY_BAR
@@ -207,67 +428,35 @@ int hex_to_val(int c)
 
 int last_peer_requested=0;
 
+// Returns the index of the next active peer, taking them in turn, or -1 if
+// there are none.
 int random_active_peer()
 {
-  int peer;
-  int the_peer=-1;
-
-  // Work out who to ask next?
-  // (consider all peers in round-robin)
-  peer=last_peer_requested+1;
-  if (peer>=peer_count) peer=0;
-  if (peer<0) peer=0;
-  
-  for(;peer<peer_count;peer++)
-    {
-      if (!peer_records[peer]) continue;
-      if ((time(0)-peer_records[peer]->last_message_time)>peer_keepalive_interval) {
-	continue;
-      }
-      the_peer=peer;
-      break;
-    }
-  if (the_peer==-1)
-    for(peer=0;(peer<=last_peer_requested)&&(peer<peer_count);peer++)
-      {
-	if (!peer_records[peer]) continue;
-	if ((time(0)-peer_records[peer]->last_message_time)>peer_keepalive_interval) {
-	  continue;
-	}
-	the_peer=peer;
-	break;
-      }
-
-#if 0  
-  char active_peers[1024];
-  int apl=0;
-  for(peer=0;(peer<peer_count);peer++)
-    {
-      if (!peer_records[peer]) continue;
-      if ((time(0)-peer_records[peer]->last_message_time)>peer_keepalive_interval)
-	continue;
-      snprintf(&active_peers[apl],1024-apl,"%d, ",peer);
-      apl=strlen(active_peers);
-      printf("     active_peers='%s'\n",active_peers);
-    }
-  if (apl>1) active_peers[apl-2]=0;
-  else strcpy(active_peers,"<none>");
-  printf("T+%lldms : Random peer is %d (active peer(s) = %s, last requested = %d)\n",gettime_ms()-start_time,peer,active_peers,last_peer_requested);
-#endif
-  
-  peer=the_peer;
-  if (peer>=-1) last_peer_requested=peer;
-  
-  return peer;
+  if (!active_count) return -1;
+  if (active_next>=active_count) active_next=0;
+  return active_peers[active_next++]->peer_index;
 }
 
 int active_peer_count()
 {
-  int count=0;
-  for(int peer=0;peer<peer_count;peer++)
-    if ((time(0)-peer_records[peer]->last_message_time)<=peer_keepalive_interval)
-      count++;
-  return count;
+  return active_count;
+}
+
+// Returns the worst error level reported by the active peers, or -1 if there
+// are none, or if any of them hasn't told us recently that it can decode the
+// non-default RS codes.
+int active_peers_fec_report()
+{
+  long long now=gettime_ms();
+  int worst=-1;
+  for(int i=0;i<active_count;i++) {
+    struct peer_state *p=active_peers[i];
+    if ((!p->fec_report_time)||(now-p->fec_report_time)>FEC_REPORT_MAX_AGE_MS)
+      return -1;
+    if (p->fec_report==FEC_REPORT_UNKNOWN) return -1;
+    if (p->fec_report>worst) worst=p->fec_report;
+  }
+  return worst;
 }
 
 
@@ -441,6 +630,7 @@ int peer_queue_bundle_tx(struct peer_state *p,struct bundle_record *b, int prior
   if (pn>-1)
     describe_bundle(RESOLVE_SIDS,stdout,NULL,b->index,pn,-1,-1);
   printf(" for transmission to %s*\n",p->sid_prefix);
+  tx_queue_generation++;
   
   // Don't queue if already in the queue
   for(i=0;i<p->tx_queue_len;i++) 
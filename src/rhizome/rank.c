@@ -200,15 +200,7 @@ int calculate_stored_bundle_priority(int i,int versus)
   // Start with intrinsic priority of the bundle based on size, service,
   // who it is addressed to, and whether we have had problems inserting it
   // into rhizome.
-  long long this_bundle_priority=
-    calculate_bundle_intrinsic_priority(bundles[i].bid_hex,
-					bundles[i].length,
-					bundles[i].version,
-					bundles[i].service,
-					bundles[i].recipient,
-					0 /* it is a bundle in rhizome, so
-					     insert_failures is meaningless here. */
-					);
+  long long this_bundle_priority=bundle_intrinsic_priority(i);
   
   long long time_delta=0;
   
@@ -266,6 +258,9 @@ int calculate_stored_bundle_priority(int i,int versus)
     // last sent time for this bundle.
     bundles[i].last_announced_time=0;
   }
+  if ((bundles[i].num_peers_that_dont_have_it!=num_peers_that_dont_have_it)
+      ||(bundles[i].last_priority!=this_bundle_priority))
+    bundles_generation++;
   bundles[i].num_peers_that_dont_have_it=num_peers_that_dont_have_it;
 
   // Remember last calculated priority so that we can help debug problems with
@@ -94,8 +94,6 @@ int load_rhizome_db_async_start(char *servald_server,
   return load_rhizome_db_socket;
 }
 
-char load_rhizome_db_line[1024];
-int load_rhizome_db_line_bytes=0;
 long long load_rhizome_db_socket_timeout=0;
 long long load_rhizome_db_last_socket_open=0;
 
@@ -104,7 +102,7 @@ int load_rhizome_db_async(char *servald_server,
 {
   // Make sure we have a socket, and that it isn't stale
   if (load_rhizome_db_socket_timeout<gettime_ms()) {
-    if (load_rhizome_db_socket>=0) close(load_rhizome_db_socket);
+    if (load_rhizome_db_socket>=0) http_close_async(load_rhizome_db_socket);
     load_rhizome_db_socket=-1;
   }
   if (load_rhizome_db_socket<0) {
@@ -118,26 +116,30 @@ int load_rhizome_db_async(char *servald_server,
   }
   
   while (1) {
-    int r=http_read_next_line(load_rhizome_db_socket,
-			      load_rhizome_db_line,
-			    &load_rhizome_db_line_bytes,1024);
+    // Lines are parsed in place in the HTTP receive buffer, and the fields handed
+    // straight to register_bundle(), so that large bundle lists don't need to be
+    // copied around.
+    char *line;
+    int line_len;
+    int r=http_read_next_line_inplace(load_rhizome_db_socket,&line,&line_len);
 
-    if (load_rhizome_db_line[0]=='}') {
-      // End of JSON
-      close(load_rhizome_db_socket);
-      load_rhizome_db_socket=-1;
-      return 0;
-    }
-    
     switch(r) {
     case 0: // Got a line
       {
+	if (line[0]=='}') {
+	  // End of JSON
+	  http_close_async(load_rhizome_db_socket);
+	  load_rhizome_db_socket=-1;
+	  return 0;
+	}
+
 	last_servald_contact=gettime_ms();
 
-	char fields[14][8192];
-	int n=parse_json_line(load_rhizome_db_line,fields,14);
+	char *fields[14];
+	int n=json_parse_line_inplace(line,fields,14);
 	if (n==14) {
-	  if (strcmp(fields[0],"null")) {
+	  // (token is the 1024 byte buffer from main())
+	  if (strcmp(fields[0],"null")&&(strlen(fields[0])<1024)) {
 	    // We have a token that will allow us to ask for only newer bundles in a
 	    // future call. Remember it and use it.
 	    
@@ -184,6 +186,28 @@ int hex_byte_value(char *hexstring)
   return strtoll(hex,NULL,16);
 }
 
+// Keep a copy of a bundle that servald refused, to help work out why.
+int rhizome_log_rejected_bundle(unsigned char *manifest_data,int manifest_length,
+				unsigned char *body_data,int body_length,
+				int result_code)
+{
+  if (!debug_insert) return 0;
+  char filename[1024];
+  snprintf(filename,1024,"/tmp/lbard.rejected.manifest");
+  FILE *f=fopen(filename,"w");
+  if (f) { fwrite(manifest_data,manifest_length,1,f); fclose(f); }
+  snprintf(filename,1024,"/tmp/lbard.rejected.body");
+  f=fopen(filename,"w");
+  if (f) { fwrite(body_data,body_length,1,f); fclose(f); }
+  snprintf(filename,1024,"/tmp/lbard.rejected.result");
+  f=fopen(filename,"w");
+  if (f) {
+    fprintf(f,"http result code = %d\n",result_code);
+    fclose(f);
+  }
+  return 0;
+}
+
 int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 			  unsigned char *body_data,int body_length,
 			  char *servald_server,char *credential)
@@ -222,22 +246,8 @@ int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
   
   if(result_code<200||result_code>202) {
     printf("POST bundle to rhizome failed: http result = %d\n",result_code);
-
-    if (debug_insert) {
-      char filename[1024];
-      snprintf(filename,1024,"/tmp/lbard.rejected.manifest");
-      FILE *f=fopen(filename,"w");
-      if (f) { fwrite(manifest_data,manifest_length,1,f); fclose(f); }
-      snprintf(filename,1024,"/tmp/lbard.rejected.body");
-      f=fopen(filename,"w");
-      if (f) { fwrite(body_data,body_length,1,f); fclose(f); }
-      snprintf(filename,1024,"/tmp/lbard.rejected.result");
-      f=fopen(filename,"w");
-      if (f) {
-	fprintf(f,"http result code = %d\n",result_code);
-	fclose(f);
-      }
-    }
+    rhizome_log_rejected_bundle(manifest_data,manifest_length,
+				body_data,body_length,result_code);
     return result_code;
   }
   else
@@ -0,0 +1,199 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports,
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  /metrics page in the Prometheus text exposition format.
+
+  Unlike the status pages, this is built straight from the counters kept in
+  memory, without touching the file system, so that it is cheap enough to be
+  scraped every second.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+static void metric_header(FILE *f,char *name,char *type,char *help)
+{
+  fprintf(f,"# HELP %s %s\n# TYPE %s %s\n",name,help,name,type);
+}
+
+static void metric_counter(FILE *f,char *name,char *help,long long value)
+{
+  metric_header(f,name,"counter",help);
+  fprintf(f,"%s %lld\n",name,value);
+}
+
+static void metric_gauge(FILE *f,char *name,char *help,double value)
+{
+  metric_header(f,name,"gauge",help);
+  fprintf(f,"%s %g\n",name,value);
+}
+
+// Label value for a message type, which is usually a printable character
+static void metric_message_type(char *out,int type)
+{
+  if (type>' '&&type<0x7f&&type!='"'&&type!='\\') snprintf(out,8,"%c",type);
+  else snprintf(out,8,"0x%02x",type);
+}
+
+int metrics_write(FILE *f)
+{
+  metric_counter(f,"lbard_radio_packets_sent_total",
+		 "Radio packets sent",radio_packets_sent);
+  metric_counter(f,"lbard_radio_bytes_sent_total",
+		 "Radio bytes sent, including FEC",radio_bytes_sent);
+  metric_counter(f,"lbard_radio_packets_received_total",
+		 "Radio packets received",radio_packets_received);
+  metric_counter(f,"lbard_radio_bytes_received_total",
+		 "Radio bytes received, including FEC",radio_bytes_received);
+
+  metric_counter(f,"lbard_fec_frames_corrected_total",
+		 "Received frames that needed Reed-Solomon correction",
+		 radio_fec_frames_corrected);
+  metric_counter(f,"lbard_fec_bytes_corrected_total",
+		 "Bytes corrected by Reed-Solomon decoding",
+		 radio_fec_bytes_corrected);
+  metric_counter(f,"lbard_fec_frames_rejected_total",
+		 "Received frames that could not be decoded",
+		 radio_fec_frames_rejected);
+
+  metric_header(f,"lbard_messages_received_total","counter",
+		"Message fields handled, by type");
+  for(int t=0;t<256;t++) {
+    char label[8];
+    if (!message_type_count[t]) continue;
+    metric_message_type(label,t);
+    fprintf(f,"lbard_messages_received_total{type=\"%s\"} %lld\n",
+	    label,message_type_count[t]);
+  }
+  metric_header(f,"lbard_message_bytes_received_total","counter",
+		"Bytes of message fields handled, by type");
+  for(int t=0;t<256;t++) {
+    char label[8];
+    if (!message_type_count[t]) continue;
+    metric_message_type(label,t);
+    fprintf(f,"lbard_message_bytes_received_total{type=\"%s\"} %lld\n",
+	    label,message_type_bytes[t]);
+  }
+
+  metric_gauge(f,"lbard_sync_keys","Keys in the sync tree",
+	       sync_state?sync_key_count(sync_state):0);
+  metric_gauge(f,"lbard_bundles","Bundles we know about",bundle_count);
+  metric_gauge(f,"lbard_partials_in_flight","Bundles being received",
+	       partials_in_flight());
+  metric_gauge(f,"lbard_peers","Peers in the peer table",peer_count);
+  metric_gauge(f,"lbard_active_peers","Peers heard from recently",
+	       active_peer_count());
+
+  metric_counter(f,"lbard_bundle_cache_hits_total",
+		 "Bundle cache hits",bundle_cache_hits);
+  metric_counter(f,"lbard_bundle_cache_misses_total",
+		 "Bundle cache misses",bundle_cache_misses);
+  metric_counter(f,"lbard_bundle_cache_evictions_total",
+		 "Bundles evicted from the cache",bundle_cache_evictions);
+  metric_gauge(f,"lbard_bundle_cache_bytes","Bytes held in the bundle cache",
+	       bundle_cache_bytes);
+
+  metric_header(f,"lbard_servald_request_seconds","histogram",
+		"Time until servald sent response headers");
+  long long cumulative=0;
+  for(int b=0;b<HTTP_LATENCY_BUCKETS;b++) {
+    cumulative+=http_latency_buckets[b];
+    fprintf(f,"lbard_servald_request_seconds_bucket{le=\"%g\"} %lld\n",
+	    http_latency_bucket_ms[b]/1000.0,cumulative);
+  }
+  cumulative+=http_latency_buckets[HTTP_LATENCY_BUCKETS];
+  fprintf(f,"lbard_servald_request_seconds_bucket{le=\"+Inf\"} %lld\n",cumulative);
+  fprintf(f,"lbard_servald_request_seconds_sum %g\n",http_request_us_total/1000000.0);
+  fprintf(f,"lbard_servald_request_seconds_count %lld\n",http_requests);
+  metric_counter(f,"lbard_servald_request_failures_total",
+		 "Requests to servald that got no response",http_request_failures);
+  metric_counter(f,"lbard_servald_connections_opened_total",
+		 "HTTP connections opened to servald",http_connections_opened);
+  metric_counter(f,"lbard_servald_connections_reused_total",
+		 "HTTP requests sent on kept-alive connections",http_connections_reused);
+  metric_counter(f,"lbard_rhizome_imports_completed_total",
+		 "Bundles imported into servald",rhizome_imports_completed);
+  metric_counter(f,"lbard_rhizome_imports_failed_total",
+		 "Bundles servald rejected or failed to import",rhizome_imports_failed);
+  metric_counter(f,"lbard_rhizome_imports_retried_total",
+		 "Bundle imports retried",rhizome_imports_retried);
+  metric_gauge(f,"lbard_rhizome_imports_queued","Bundle imports in progress",
+	       rhizome_imports_queued);
+
+  metric_gauge(f,"lbard_tx_interval_seconds",
+	       "Mean interval between our transmissions",
+	       message_update_interval/1000.0);
+  metric_gauge(f,"lbard_tx_interval_randomness_seconds",
+	       "Random variation added to the transmission interval",
+	       message_update_interval_randomness/1000.0);
+  metric_gauge(f,"lbard_congestion_ratio",
+	       "Transmissions seen in the last congestion period, relative to the target",
+	       congestion_ratio);
+  metric_gauge(f,"lbard_congestion_transmissions_seen",
+	       "Transmissions by others in the last congestion period",
+	       congestion_transmissions_seen);
+  metric_gauge(f,"lbard_congestion_transmissions_ours",
+	       "Our transmissions in the last congestion period",
+	       congestion_transmissions_byus);
+  metric_gauge(f,"lbard_congestion_target_transmissions",
+	       "Target transmissions per congestion period",
+	       target_transmissions_per_4seconds);
+
+  metric_counter(f,"lbard_reactor_wakeups_total",
+		 "Times the main loop woke up",reactor_wakeups);
+  metric_gauge(f,"lbard_uptime_seconds","Time since LBARD started",
+	       (gettime_ms()-start_time)/1000.0);
+  return 0;
+}
+
+int http_report_metrics(FILE *out)
+{
+  char *body=NULL;
+  size_t body_len=0;
+  FILE *f=open_memstream(&body,&body_len);
+  if (!f) {
+    char *m="HTTP/1.0 500 Couldn't build metrics\nServer: Serval LBARD\n\n";
+    fputs(m,out);
+    return -1;
+  }
+  metrics_write(f);
+  fclose(f);
+
+  http_send_buffer(out,body,body_len,"text/plain; version=0.0.4");
+  free(body);
+  return 0;
+}
@@ -47,7 +47,7 @@ int message_buffer_length=0;
 
 
 int generate_segment_progress_string(int stream_length,
-				     struct segment_list *s, char *progress)
+				     struct partial_stream *s, char *progress)
 {
   // Apply some sanity when dealing with manifests where we don't know the length yet.
   if (stream_length<1) stream_length=1024;
@@ -58,19 +58,21 @@ int generate_segment_progress_string(int stream_length,
   
 
   
-  while(s) {
+  for(int e=0;e<s->extent_count;e++) {
     int bin;
+    int start_offset=s->extents[e].start_offset;
+    int end_offset=s->extents[e].end_offset;
 
     for(bin=0;bin<10;bin++) {
       int start_of_bin=stream_length*bin/10;
       int end_of_bin=stream_length*(bin+1)/10-1;
-      if ((s->start_offset<=start_of_bin)
-	  &&((s->start_offset+s->length-1)>=end_of_bin))
+      if ((start_offset<=start_of_bin)
+	  &&((end_offset-1)>=end_of_bin))
 	{
 	  progress[bin]='#';
 	}
-      else if ((s->start_offset>=start_of_bin)
-	       &&((s->start_offset+s->length-1)<end_of_bin)) {
+      else if ((start_offset>=start_of_bin)
+	       &&((end_offset-1)<end_of_bin)) {
 	switch(progress[bin]) {
 	case ' ': progress[bin]='.'; break;
 	case '.': progress[bin]=':'; break;
@@ -80,7 +82,6 @@ int generate_segment_progress_string(int stream_length,
 	}
       }
     }
-    s=s->next;
   }
   return 0;
 }
@@ -95,23 +96,14 @@ int generate_progress_string(struct partial_bundle *partial,
   // Draw up template
   snprintf(progress,80,"M          /B           ");
   
-  generate_segment_progress_string(partial->manifest_length,partial->manifest_segments,
+  generate_segment_progress_string(partial->manifest_length,&partial->manifest,
 				   &progress[1]);
-  generate_segment_progress_string(partial->body_length,partial->body_segments,
+  generate_segment_progress_string(partial->body_length,&partial->body,
 				   &progress[13]);
 
 
-  int manifest_bytes =0,body_bytes=0;
-  struct segment_list *s=partial->manifest_segments;
-  while(s) {
-    manifest_bytes+=s->length;
-    s=s->next;
-  }
-  s=partial->body_segments;
-  while(s) {
-    body_bytes+=s->length;
-    s=s->next;
-  }
+  int manifest_bytes=partial_stream_bytes(&partial->manifest);
+  int body_bytes=partial_stream_bytes(&partial->body);
 
   if (partial->recent_bytes)
     snprintf(&progress[24],54," %d/%d, %d/%d  [%d since last report]",
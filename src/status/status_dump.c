@@ -41,6 +41,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "sync.h"
 #include "lbard.h"
+#include "code_instrumentation.h"
 #include "serial.h"
 #include "version.h"
 #include "radio_type.h"
@@ -48,6 +49,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define TMPDIR "/tmp"
 
+#define STATUS_BUNDLES_PER_PAGE 100
+
 int mesh_extender_sad=0;
 
 struct b {
@@ -58,12 +61,14 @@ struct b {
 char *msgs[1024];
 long long msg_times[1024];
 int msg_count=0;
+long long msgs_generation=0;
 
 int status_log(char *msg)
 {
   if (msg_count<1024) {
     msgs[msg_count]=strdup(msg);
     msg_times[msg_count++]=gettime_ms();
+    msgs_generation++;
     return 0;
   }
   return -1;
@@ -213,6 +218,14 @@ char *home_page="\n"
 "      } else x.style.display=\"none\";\n"
 "      }\n"
 "\n"
+"      // The bundle list is shown a page at a time\n"
+"      var bundlelist_page = 0;\n"
+"      function showBundleListPage(n) {\n"
+"      bundlelist_page = n;\n"
+"      document.getElementById('bundlelist').busy=false;\n"
+"      refreshDiv('bundlelist');\n"
+"      }\n"
+"\n"
 "      function refreshDiv(d) {\n"
 "      var x = document.getElementById(d);\n"
 "      if (x.style.display === \"none\") return;\n"
@@ -231,7 +244,9 @@ char *home_page="\n"
 "      }\n"
 "      x.busy=true;\n"
 "      x.style.backgroundColor='#cfcfcf';\n"					   
-"      r.open(\"GET\", \"/status/\"+d, true);\n"
+"      var url = \"/status/\"+d;\n"
+"      if (d === 'bundlelist') url += \"?page=\"+bundlelist_page;\n"
+"      r.open(\"GET\", url, true);\n"
 "      r.send();\n"
 "      \n"
 "      }\n"
@@ -300,7 +315,7 @@ char *home_page="\n"
 "</html>\n"
 ;
 
-int send_status_home_page(int socket)
+int send_status_home_page(FILE *out)
 {
   // Get SID prefix
   char my_sid_hex_prefix[17];
@@ -320,8 +335,8 @@ int send_status_home_page(int socket)
 	   "\n",(int)strlen(home_page_data));
 
   // Now send it all
-  write_all(socket,header,strlen(header));
-  write_all(socket,home_page_data,strlen(home_page_data));
+  fputs(header,out);
+  fputs(home_page_data,out);
   
   return 0;
 }
@@ -376,7 +391,7 @@ int status_dump()
 }
   
 
-int status_dump_meinfo(FILE *f,char *topic)
+int status_dump_meinfo(FILE *f,char *topic,int page)
 {
   fprintf(f,"<p>LBARD Version commit:%s branch:%s [MD5: %s] @ %s\n<p>\n",
 	  GIT_VERSION_STRING,GIT_BRANCH,VERSION_STRING,BUILD_DATE);    
@@ -390,7 +405,7 @@ int status_dump_meinfo(FILE *f,char *topic)
   return 0;
 }
 
-int status_dump_radioinfo(FILE *f, char *topic)
+int status_dump_radioinfo(FILE *f,char *topic,int page)
 {
   fprintf(f,"Radio detected as '%s'.\n",radio_types[radio_get_type()].name);
   if (radio_last_heartbeat_time)
@@ -412,7 +427,7 @@ int status_dump_radioinfo(FILE *f, char *topic)
   return 0;
 }
 
-int status_dump_radiolinks(FILE *f, char *topic)
+int status_dump_radiolinks(FILE *f,char *topic,int page)
 {
   int i;
   
@@ -461,7 +476,7 @@ int status_dump_radiolinks(FILE *f, char *topic)
   return 0;
 }
 
-int status_dump_bundlerx(FILE *f,char *topic)
+int status_dump_bundlerx(FILE *f,char *topic,int page)
 {
   int i;
   
@@ -495,13 +510,14 @@ int status_dump_bundlerx(FILE *f,char *topic)
 	    now-msg_times[i],msgs[i]);
     free(msgs[i]); msgs[i]=NULL;
   }
+  if (msg_count) msgs_generation++;
   msg_count=0;
   fprintf(f,"</table>\n");
 
   return 0;
 }
 
-int status_dump_txqueue(FILE *f, char *topic)
+int status_dump_txqueue(FILE *f,char *topic,int page)
 {
   int i;
   fprintf(f,"<table border=1 padding=2 spacing=2><tr><th>Bundle</th></tr>\n");
@@ -524,11 +540,14 @@ int status_dump_txqueue(FILE *f, char *topic)
     }
   }
   fprintf(f,"</table>\n");
+  fprintf(f,"<p>Bundle cache: %lld hits, %lld misses, %lld evictions, %lld bytes cached.\n",
+	  bundle_cache_hits,bundle_cache_misses,bundle_cache_evictions,
+	  bundle_cache_bytes);
 
   return 0;
 }
 
-int status_dump_servaldinfo(FILE *f,char *topic)
+int status_dump_servaldinfo(FILE *f,char *topic,int page)
 {
   long long last_read_time=0;
 
@@ -544,19 +563,66 @@ int status_dump_servaldinfo(FILE *f,char *topic)
   return 0;
 }
 
-int status_dump_bundlelist(FILE *f,char *topic)
+// Bundles in priority order, re-sorted only when bundles_generation changes
+struct b *bundle_order=NULL;
+int bundle_order_count=0;
+int bundle_order_alloc=0;
+long long bundle_order_generation=-1;
+
+int status_sort_bundles(void)
+{
+  if ((bundle_order_generation==bundles_generation)
+      &&(bundle_order_count==bundle_count))
+    return 0;
+  
+  if (bundle_count>bundle_order_alloc) {
+    int alloc=bundle_order_alloc?bundle_order_alloc:1024;
+    while(alloc<bundle_count) alloc*=2;
+    struct b *order=realloc(bundle_order,alloc*sizeof(struct b));
+    if (!order) return -1;
+    bundle_order=order;
+    bundle_order_alloc=alloc;
+  }
+  for (int i=0;i<bundle_count;i++) {
+    bundle_order[i].order=i;
+    bundle_order[i].priority=bundles[i].last_priority;
+  }
+  qsort(bundle_order,bundle_count,sizeof(struct b),compare_b);
+  bundle_order_count=bundle_count;
+  bundle_order_generation=bundles_generation;
+  return 0;
+}
+
+void status_page_links(FILE *f,int page,int pages)
+{
+  fprintf(f,"<p>Page %d of %d ",page+1,pages);
+  if (page>0)
+    fprintf(f,"<a href=\"javascript:showBundleListPage(%d);\">Previous</a> ",page-1);
+  if (page<pages-1)
+    fprintf(f,"<a href=\"javascript:showBundleListPage(%d);\">Next</a>",page+1);
+  fprintf(f,"\n");
+}
+
+int status_dump_bundlelist(FILE *f,char *topic,int page)
 {
   int i,n;
-  struct b order[bundle_count];
-  for (i=0;i<bundle_count;i++) {
-    order[i].order=i;
-    order[i].priority=bundles[i].last_priority;
+  if (status_sort_bundles()) {
+    fprintf(f,"<p>Out of memory sorting bundle list.\n");
+    return -1;
   }
-  qsort(order,bundle_count,sizeof(struct b),compare_b);
-  
+
+  int pages=(bundle_order_count+STATUS_BUNDLES_PER_PAGE-1)/STATUS_BUNDLES_PER_PAGE;
+  if (pages<1) pages=1;
+  if (page>=pages) page=pages-1;
+  if (page<0) page=0;
+  int first=page*STATUS_BUNDLES_PER_PAGE;
+  int last=first+STATUS_BUNDLES_PER_PAGE;
+  if (last>bundle_order_count) last=bundle_order_count;
+
+  if (pages>1) status_page_links(f,page,pages);
   fprintf(f,"<table border=1 padding=2 spacing=2><tr><th>Bundle #</th><th>Bundle</th><th>Bundle version</th><th>Bundle length</th><th>Priority</th><th># peers without it</th></tr>\n");
-  for (n=0;n<bundle_count;n++) {
-    i=order[n].order;
+  for (n=first;n<last;n++) {
+    i=bundle_order[n].order;
     fprintf(f,"<tr><td>#%d</td><td>",i);
     describe_bundle(RESOLVE_SIDS ,f,NULL,i,-1,-1,-1);
     
@@ -567,7 +633,7 @@ int status_dump_bundlelist(FILE *f,char *topic)
 	    bundles[i].num_peers_that_dont_have_it);
   }
   fprintf(f,"</table>\n");
-  fflush(f);
+  if (pages>1) status_page_links(f,page,pages);
 
   return 0;
 }
@@ -679,7 +745,7 @@ int update_mesh_extender_health(FILE *f)
   return 0; 
 }
 
-int status_dump_diags(FILE *f,char *topic)
+int status_dump_diags(FILE *f,char *topic,int page)
 {
   update_mesh_extender_health(f);
   show_time_accounting(f);
@@ -687,52 +753,124 @@ int status_dump_diags(FILE *f,char *topic)
   return 0;
 }
 
-// Keep track of when each topic was last updated, and
+int status_dump_profile(FILE *f,char *topic,int page)
+{
+  code_instrumentation_report(f,1);
+  return 0;
+}
+
+/*
+  The state behind each topic has a generation count, which is bumped
+  whenever it changes.  Pages are rendered into memory when they are asked
+  for, and re-rendered only if the generation has changed since (and then no
+  more often than update_interval), or if they are more than a minute old,
+  since they also show how long ago things happened.  Topics without a
+  generation are re-rendered every update_interval, as before.
+*/
+
+long long status_radiolinks_generation(void)
+{
+  return peers_generation+tx_queue_generation;
+}
+
+long long status_txqueue_generation(void)
+{
+  return peers_generation+tx_queue_generation
+    +bundle_cache_hits+bundle_cache_misses;
+}
+
+long long status_bundlerx_generation(void)
+{
+  return partials_generation+msgs_generation;
+}
+
+long long status_bundlelist_generation(void)
+{
+  return bundles_generation;
+}
+
+// Keep track of when each topic was last rendered, and
 // how often we should update them.
 struct topic_report {
   char name[16];
-  time_t last_time;
+  long long last_time;
   int update_interval;
-  int (*func)(FILE *f,char *);
+  int (*func)(FILE *f,char *topic,int page);
+  long long (*generation)(void);
+
+  // The last rendering
+  char *page;
+  size_t page_len;
+  int page_number;
+  long long page_generation;
 };
 
 struct topic_report topics[]={
-  {"meinfo",0,1000,status_dump_meinfo},
-  {"radiolinks",0,1000,status_dump_radiolinks},
-  {"servaldinfo",0,2000,status_dump_servaldinfo},
-  {"txqueue",0,3000,status_dump_txqueue},
-  {"bundlerx",0,2000,status_dump_bundlerx},
-  {"bundlelist",0,10000,status_dump_bundlelist},
-  {"radioinfo",0,5000,status_dump_radioinfo},
-  {"diags",0,2000,status_dump_diags},
+  {"meinfo",0,1000,status_dump_meinfo,NULL},
+  {"radiolinks",0,1000,status_dump_radiolinks,status_radiolinks_generation},
+  {"servaldinfo",0,2000,status_dump_servaldinfo,NULL},
+  {"txqueue",0,3000,status_dump_txqueue,status_txqueue_generation},
+  {"bundlerx",0,2000,status_dump_bundlerx,status_bundlerx_generation},
+  {"bundlelist",0,10000,status_dump_bundlelist,status_bundlelist_generation},
+  {"radioinfo",0,5000,status_dump_radioinfo,NULL},
+  {"diags",0,2000,status_dump_diags,NULL},
+  {"profile",0,2000,status_dump_profile,NULL},
   {"",-1,-1}
 };
 
-int http_report_network_status(int socket,char *topic)
+int status_render_topic(struct topic_report *t,int page)
 {
-  if (socket==-1) return -1;
+  char *data=NULL;
+  size_t len=0;
+  FILE *f=open_memstream(&data,&len);
+  if (!f) {
+    perror("open_memstream");
+    return -1;
+  }
+  t->page_generation=t->generation?t->generation():0;
+  t->func(f,t->name,page);
+  fclose(f);
+
+  free(t->page);
+  t->page=data;
+  t->page_len=len;
+  t->page_number=page;
+  t->last_time=gettime_ms();
+  return 0;
+}
 
+int http_report_network_status(FILE *out,char *topic)
+{
   //  fprintf(stderr,"Request for status page '%s'\n",topic);
-  
-  // Get filename we need
-  char filename[1024];
-  snprintf(filename,1024,"%s/%s",TMPDIR,topic);
+
+  // Separate topic name from any query, e.g., bundlelist?page=2
+  char name[sizeof(topics[0].name)];
+  int page=0;
+  int i;
+  for(i=0;topic[i]&&topic[i]!='?'&&i<(sizeof(name)-1);i++) name[i]=topic[i];
+  name[i]=0;
+  char *query=strchr(topic,'?');
+  if (query) {
+    char *p=strstr(query,"page=");
+    if (p) page=atoi(&p[5]);
+    if (page<0) page=0;
+  }
   
   // Which topic do we need the status for?
   int t=-1;
   for(t=0;topics[t].name[0];t++)
-    if (!strcmp(topic,topics[t].name)) break;
+    if (!strcmp(name,topics[t].name)) break;
   if (!topics[t].name[0]) {
     // Illegal topic
     char m[1024];
     fprintf(stderr,"404 for unknown status page '%s'\n",topic);
-    snprintf(m,1024,"HTTP/1.0 404 File not found\nServer: Serval LBARD\n\nCould not read file '%s'\n",filename);
-    write_all(socket,m,strlen(m));
+    snprintf(m,1024,"HTTP/1.0 404 File not found\nServer: Serval LBARD\n\nNo such status page '%s'\n",name);
+    fputs(m,out);
     return -1;
   }
 
   long long age=-1;
-  if (topics[t].last_time) {
+  if (topics[t].page) {
     if (topics[t].last_time>gettime_ms()) {
       // Last update was in the future, so assume time has
       // run backwards, and thus we should refresh.
@@ -746,47 +884,47 @@ int http_report_network_status(int socket,char *topic)
       if (age>60000) age=-1;
     }
   }
+  if (topics[t].page_number!=page) age=-1;
+
+  int refresh=(age<0);
+  if ((!refresh)&&(age>=topics[t].update_interval)) {
+    if (!topics[t].generation) refresh=1;
+    else if (topics[t].generation()!=topics[t].page_generation) refresh=1;
+  }
   
-  // Make file as needing refreshing if the file doesn't exist.
-  FILE *f=fopen(filename,"r");
-  if (!f) age=-1; else fclose(f);
-
-  if (age<0||age>=topics[t].update_interval) {
-    // Update file
-    FILE *f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"500 for unknown status page '%s', filename='%s'\n",topic,filename);
-      perror("fopen");
-      char *m="HTTP/1.0 500 Couldn't create temporary file\nServer: Serval LBARD\n\nCould not create temporariy file";
-      write_all(socket,m,strlen(m));
-      
+  if (refresh) {
+    //    fprintf(stderr,"Regenerating status page '%s'\n",topic);
+    if (status_render_topic(&topics[t],page)) {
+      char *m="HTTP/1.0 500 Couldn't render page\nServer: Serval LBARD\n\nCould not render page";
+      fputs(m,out);
       return -1;
     }
-    // Call function to get file updated
-    //    fprintf(stderr,"Regenerating status page '%s'\n",topic);
-    topics[t].func(f,topic);
-    fclose(f);
-    topics[t].last_time=gettime_ms();
   }
 
   //  fprintf(stderr,"200 for known status page '%s'\n",topic);
-  return http_send_file(socket,filename,"text/html");  
+  return http_send_buffer(out,topics[t].page,topics[t].page_len,"text/html");
 }
 
 time_t last_json_network_status_call=0;
-int http_report_network_status_json(int socket)
+char *network_status_json=NULL;
+size_t network_status_json_len=0;
+
+int http_report_network_status_json(FILE *out)
 {
-  if (((time(0)-last_json_network_status_call)>1)||
+  if ((!network_status_json)||
+      ((time(0)-last_json_network_status_call)>1)||
       ((time(0)-last_json_network_status_call)<0))
     {
-      last_json_network_status_call=time(0);
-      FILE *f=fopen("/tmp/networkstatus.json","w");
+      char *data=NULL;
+      size_t len=0;
+      FILE *f=open_memstream(&data,&len);
       if (!f) {
-	char *m="HTTP/1.0 500 Couldn't create temporary file\nServer: Serval LBARD\n\nCould not create temporariy file";
-	write_all(socket,m,strlen(m));
+	char *m="HTTP/1.0 500 Couldn't render page\nServer: Serval LBARD\n\nCould not render page";
+	fputs(m,out);
 	
 	return -1;
       }
+      last_json_network_status_call=time(0);
 
       // List peers
       fprintf(f,"{\n\"neighbours\": [\n     ");
@@ -811,7 +949,27 @@ int http_report_network_status_json(int socket)
       fprintf(f,"   ]\n}\n\n");      
       
       fclose(f);
+      free(network_status_json);
+      network_status_json=data;
+      network_status_json_len=len;
     }
-  return http_send_file(socket,"/tmp/networkstatus.json","application/json");
+  return http_send_buffer(out,network_status_json,network_status_json_len,
+			  "application/json");
 }
 
+int http_report_time_accounting_json(FILE *out)
+{
+  char *data=NULL;
+  size_t len=0;
+  FILE *f=open_memstream(&data,&len);
+  if (!f) {
+    char *m="HTTP/1.0 500 Couldn't render page\nServer: Serval LBARD\n\nCould not render page";
+    fputs(m,out);
+    return -1;
+  }
+  time_accounting_json(f);
+  fclose(f);
+  http_send_buffer(out,data,len,"application/json");
+  free(data);
+  return 0;
+}
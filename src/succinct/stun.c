@@ -44,9 +44,12 @@ struct heard{
 
 struct heard heard[STUN_ADDRS];
 
-int stun_serviceloop(){
-  static int fd = -1;
-    if (fd < 0){
+static int stun_fd = -1;
+
+// Returns the STUN socket, opening it first if necessary, so that the main
+// loop can wait for it to become readable.
+int stun_socket(void){
+    if (stun_fd < 0){
       struct sockaddr_in in_addr;
       in_addr.sin_family = AF_INET;
       in_addr.sin_addr.s_addr = INADDR_ANY;
@@ -54,24 +57,31 @@ int stun_serviceloop(){
       // this port.
       in_addr.sin_port = htons(4043);
 
-      fd = socket(in_addr.sin_family, SOCK_DGRAM, 0);
-      if (fd < 0){
-        fprintf(stderr, "\nsocket() = %d (%d)\n", fd, errno);
-        return 1;
+      stun_fd = socket(in_addr.sin_family, SOCK_DGRAM, 0);
+      if (stun_fd < 0){
+        fprintf(stderr, "\nsocket() = %d (%d)\n", stun_fd, errno);
+        return -1;
       }
       int r;
-      if ((r = bind(fd, (struct sockaddr *)&in_addr, sizeof in_addr))<0){
-        // fprintf(stderr, "\nbind() = %d (%d)\n", fd, errno);
-        close(fd);
-	fd=-1;
-        return 1;
+      if ((r = bind(stun_fd, (struct sockaddr *)&in_addr, sizeof in_addr))<0){
+        // fprintf(stderr, "\nbind() = %d (%d)\n", stun_fd, errno);
+        close(stun_fd);
+	stun_fd=-1;
+        return -1;
       }
+      set_nonblock(stun_fd);
     }
+    return stun_fd;
+}
+
+int stun_serviceloop(){
+    int fd = stun_socket();
+    if (fd < 0)
+      return 1;
     struct socket_address addr;
     uint8_t buff[1024];
     addr.addr_len = sizeof addr.store;
 
-    set_nonblock(fd);
     ssize_t r = recvfrom(fd, buff, sizeof buff, 0, &addr.addr, &addr.addr_len);
     if (r<0){
 //      fprintf(stderr, "\nrecvfrom() = %zd (%d)\n", r, errno);
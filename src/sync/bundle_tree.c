@@ -44,6 +44,7 @@ extern char *my_sid_hex;
 #include "lbard.h"
 #include "sha1.h"
 #include "util.h"
+#include "trace.h"
 
 int report_queue_length=0;
 uint8_t report_queue[REPORT_QUEUE_LEN][MAX_REPORT_LEN];
@@ -308,27 +309,40 @@ int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
   // First of all, tell any peers any acknowledgement messages that are required.
   while (report_queue_length&&((*offset)<(mtu-MAX_REPORT_LEN))) {
     report_queue_length--;
+    struct peer_state *report_peer=report_queue_peers[report_queue_length];
     if (append_bytes(offset,mtu,msg_out,report_queue[report_queue_length],
 		     report_lengths[report_queue_length])) {
-      fprintf(stderr,"Tried to send report_queue message '%s' to %s*, but append_bytes reported no more space.\n",
-	      report_queue_message[report_queue_length],
-	      report_queue_peers[report_queue_length]->sid_prefix);
+      TRACE(TRACE_REPORT_NO_SPACE,0,report_lengths[report_queue_length],
+	    report_queue_length,0,report_peer->sid_prefix_bin,PEER_PREFIX_BYTES);
+      if (debug_sync)
+	fprintf(stderr,"Tried to send report_queue message '%s' to %s*, but append_bytes reported no more space.\n",
+		report_queue_message[report_queue_length],
+		report_peer->sid_prefix);
       report_queue_length++;
     } else {
-      fprintf(stderr,">>> %s Flushing %d byte report from queue, %d remaining.\n",
-	      timestamp_str(),	      
-	      report_lengths[report_queue_length],
-	      report_queue_length);
-      fprintf(stderr,"T+%lldms : Flushing %d byte report from queue, %d remaining.\n",
-	      gettime_ms()-start_time,
-	      report_lengths[report_queue_length],
-	      report_queue_length);
-      fprintf(stderr,"Sent report_queue message '%s' to %s*\n",
-	      report_queue_message[report_queue_length],
-	      report_queue_peers[report_queue_length]->sid_prefix);
-      dump_bytes(stderr,"report_queue message",
-		 (unsigned char *)report_queue_message[report_queue_length],
-		 report_lengths[report_queue_length]);
+      if (trace_enabled) {
+	// Sender SID prefix, followed by as much of the report as fits
+	unsigned char report[TRACE_PAYLOAD_BYTES];
+	int report_len=report_lengths[report_queue_length];
+	if (report_len>TRACE_PAYLOAD_BYTES-PEER_PREFIX_BYTES)
+	  report_len=TRACE_PAYLOAD_BYTES-PEER_PREFIX_BYTES;
+	memcpy(report,report_peer->sid_prefix_bin,PEER_PREFIX_BYTES);
+	memcpy(&report[PEER_PREFIX_BYTES],report_queue[report_queue_length],report_len);
+	trace_event(TRACE_REPORT_FLUSH,0,report_lengths[report_queue_length],
+		    report_queue_length,0,report,PEER_PREFIX_BYTES+report_len);
+      }
+      if (debug_sync) {
+	fprintf(stderr,">>> %s Flushing %d byte report from queue, %d remaining.\n",
+		timestamp_str(),	      
+		report_lengths[report_queue_length],
+		report_queue_length);
+	fprintf(stderr,"Sent report_queue message '%s' to %s*\n",
+		report_queue_message[report_queue_length],
+		report_peer->sid_prefix);
+	dump_bytes(stderr,"report_queue message",
+		   (unsigned char *)report_queue_message[report_queue_length],
+		   report_lengths[report_queue_length]);
+      }
 		 
       free(report_queue_message[report_queue_length]);
       report_queue_message[report_queue_length]=NULL;
@@ -336,6 +350,7 @@ int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
   }
   
   int count=10; if (count>peer_count) count=peer_count;
+  int peers_tried=0;
 
   /* Try sending something new.
      Sync trees, and if space remains (because we have synchronised trees),
@@ -350,6 +365,7 @@ int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
     if ((count--)<0) break;
     int peer=random_active_peer();
     if (peer<0) break;
+    peers_tried++;
     int space=mtu-(*offset);
     if (space>10) {
       sync_tree_send_data(offset,mtu,msg_out,peer,
@@ -362,6 +378,8 @@ int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
   if (sync_not_sent)
     // Don't waste any space: sync what we can
     sync_tree_send_message(offset,mtu,msg_out);
+
+  TRACE(TRACE_TX_STUFFED,0,*offset,mtu,peers_tried,NULL,0);
   
   return 0;
 }
@@ -439,16 +457,12 @@ int lookup_bundle_by_prefix(const unsigned char *prefix,int len)
   if (len>8) len=8;
   
   int best_bundle=-1;
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<len;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==len) {
-      if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
-	best_bundle=bundle;      
-    }
+  int first;
+  int count=bundle_index_prefix_range(prefix,len*8,&first);
+  for(int i=first;i<first+count;i++) {
+    int bundle=bundle_index_at(i);
+    if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
+      best_bundle=bundle;      
   }
   if (0)
     printf("  %02X%02X%02X%02x* is bundle #%d of %d\n",
@@ -459,16 +473,12 @@ int lookup_bundle_by_prefix(const unsigned char *prefix,int len)
 
 int lookup_bundle_by_prefix_bin_and_version_exact(unsigned char *prefix, long long version)
 {
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version==version)
-	return bundle;
-    }
+  int first;
+  int count=bundle_index_prefix_range(prefix,8*8,&first);
+  for(int i=first;i<first+count;i++) {
+    int bundle=bundle_index_at(i);
+    if (bundles[bundle].version==version)
+      return bundle;
   }
   return -1;
 }
@@ -477,18 +487,13 @@ int lookup_bundle_by_prefix_bin_and_version_exact(unsigned char *prefix, long lo
 int lookup_bundle_by_prefix_bin_and_version_or_newer(unsigned char *prefix, long long version)
 {
   int best_bundle=-1;
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version>=version) {
-	if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
-	  best_bundle=bundle;
-      }
-      
+  int first;
+  int count=bundle_index_prefix_range(prefix,8*8,&first);
+  for(int i=first;i<first+count;i++) {
+    int bundle=bundle_index_at(i);
+    if (bundles[bundle].version>=version) {
+      if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
+	best_bundle=bundle;
     }
   }
   return best_bundle;
@@ -496,16 +501,12 @@ int lookup_bundle_by_prefix_bin_and_version_or_newer(unsigned char *prefix, long
 
 int lookup_bundle_by_prefix_bin_and_version_or_older(unsigned char *prefix, long long version)
 {
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version<=version)
-	return bundle;
-    }
+  int first;
+  int count=bundle_index_prefix_range(prefix,8*8,&first);
+  for(int i=first;i<first+count;i++) {
+    int bundle=bundle_index_at(i);
+    if (bundles[bundle].version<=version)
+      return bundle;
   }
   return -1;
 }
@@ -514,13 +515,9 @@ int lookup_bundle_by_prefix_bin_and_version_or_older(unsigned char *prefix, long
 int sync_queue_bundle(struct peer_state *p,int bundle)
 {
   struct bundle_record *b=&bundles[bundle];
+  tx_queue_generation++;
 
-  int priority=calculate_bundle_intrinsic_priority(b->bid_hex,
-						   b->length,
-						   b->version,
-						   b->service,
-						   b->recipient,
-						   0);
+  int priority=bundle_intrinsic_priority(bundle);
 
   // TX queue has something in it.
   if (p->tx_bundle>=0) {
@@ -601,11 +598,10 @@ int sync_queue_bundle(struct peer_state *p,int bundle)
 int sync_dequeue_bundle(struct peer_state *p,int bundle)
 {
   if (!p) return -1;
+  tx_queue_generation++;
   
-  int peer=0;
-  for(peer=0;peer<peer_count;peer++)
-    if (p==peer_records[peer]) break;
-  if (peer>=peer_count) return -1;
+  int peer=p->peer_index;
+  if (peer<0||peer>=peer_count||peer_records[peer]!=p) return -1;
   
   printf("Dequeuing TX of bundle #%d (",bundle);
   describe_bundle(RESOLVE_SIDS,stdout,NULL,bundle,
@@ -29,9 +29,9 @@ static void *allocate(size_t length){
 
 #define KEY_LEN_BITS (KEY_LEN<<3)
 
-// Note PREFIX_STEP_BITS >1 hasn't been tested yet
 #define NODE_CHILDREN (1<<PREFIX_STEP_BITS)
 #define INTERESTING_COUNT 16
+#define EMPTY_PREFIX_QUEUE 16
 
 typedef struct {
   uint8_t min_prefix_len:7;
@@ -50,14 +50,38 @@ typedef struct {
 #define QUEUED 2
 #define DONT_SEND 3
 
+/*
+  Tree nodes are allocated from slabs owned by the sync_state, and refer to each
+  other by 32-bit index instead of by pointer. This roughly halves the size of a
+  node, keeps the nodes of a tree close together in memory, and means that we
+  don't call malloc() and free() for every node we add or remove.
+  Slabs are never moved once allocated, so a struct node * (or a pointer to one
+  of its child references) remains valid while other nodes are allocated.
+  Index 0 is never allocated, and is used to mean "no node".
+*/
+typedef uint32_t node_ref;
+#define NODE_NONE 0
+#define NODE_SLAB_BITS 10
+#define NODE_SLAB_SIZE (1<<NODE_SLAB_BITS)
+
 struct node{
-  struct node *transmit_next;
-  struct node *transmit_prev;
+  node_ref transmit_next;
+  node_ref transmit_prev;
+  node_ref children[NODE_CHILDREN];
   key_message_t message;
   uint8_t send_state;
   uint8_t sent_count;
   void *context;
-  struct node *children[NODE_CHILDREN];
+};
+
+struct node_pool{
+  struct node **slabs;
+  unsigned slab_count;
+  // next never-used index
+  node_ref next_unused;
+  // released nodes, chained through transmit_next
+  node_ref free_list;
+  unsigned in_use;
 };
 
 struct sync_peer_state{
@@ -65,7 +89,7 @@ struct sync_peer_state{
   void *peer_context;
   unsigned send_count;
   unsigned recv_count;
-  struct node *root;
+  node_ref root;
 };
 
 struct sync_state{
@@ -81,10 +105,45 @@ struct sync_state{
   unsigned received_uninteresting;
   unsigned progress;
   struct sync_peer_state *peers;
-  struct node *root;
-  struct node *transmit_ptr;
+  node_ref root;
+  node_ref transmit_ptr;
+  struct node_pool pool;
+#if NODE_CHILDREN > 2
+  // prefixes that a peer has told us about, but under which we have no keys
+  key_message_t empty_prefixes[EMPTY_PREFIX_QUEUE];
+  unsigned empty_prefix_count;
+#endif
 };
 
+#define NODE(S,R) (&(S)->pool.slabs[(R)>>NODE_SLAB_BITS][(R)&(NODE_SLAB_SIZE-1)])
+
+static node_ref node_alloc(struct sync_state *state)
+{
+  struct node_pool *pool = &state->pool;
+  node_ref ref = pool->free_list;
+  
+  if (ref != NODE_NONE){
+    pool->free_list = NODE(state, ref)->transmit_next;
+  }else{
+    ref = pool->next_unused++;
+    if ((ref>>NODE_SLAB_BITS) >= pool->slab_count){
+      pool->slabs = realloc(pool->slabs, (pool->slab_count+1)*sizeof(struct node *));
+      assert(pool->slabs);
+      pool->slabs[pool->slab_count++] = allocate(NODE_SLAB_SIZE*sizeof(struct node));
+    }
+  }
+  pool->in_use++;
+  bzero(NODE(state, ref), sizeof(struct node));
+  return ref;
+}
+
+static void node_release(struct sync_state *state, node_ref ref)
+{
+  NODE(state, ref)->transmit_next = state->pool.free_list;
+  state->pool.free_list = ref;
+  state->pool.in_use--;
+}
+
 
 
 // XOR the source key into the destination key
@@ -117,7 +176,7 @@ static void sync_xor(const sync_key_t *src_key, key_message_t *dest_key)
 static uint8_t sync_get_bits(uint8_t offset, uint8_t len, const sync_key_t *key)
 {
   assert(len <= 8);
-  assert(offset+len < KEY_LEN_BITS);
+  assert(offset+len <= KEY_LEN_BITS);
   unsigned start_byte = (offset>>3);
   uint16_t context = key->key[start_byte] <<8;
   if (start_byte+1 < KEY_LEN)
@@ -155,48 +214,50 @@ static int cmp_message(const key_message_t *first, const key_message_t *second)
 }
 
 // XOR all existing children of *node, into this destination key.
-static void xor_children(struct node *node, key_message_t *dest)
+static void xor_children(struct sync_state *state, node_ref ref, key_message_t *dest)
 {
   unsigned i;
+  struct node *node = NODE(state, ref);
   if (node->message.prefix_len == KEY_LEN_BITS){
     sync_xor(&node->message.key, dest);
   }else{
     for (i=0;i<NODE_CHILDREN;i++){
       if (node->children[i])
-	xor_children(node->children[i], dest);
+	xor_children(state, node->children[i], dest);
     }
   }
 }
 
 // Add a new key into the state tree, XOR'ing the key into each parent node
-static struct node *add_key(struct node **root, const sync_key_t *key, void *context, uint8_t stored)
+static node_ref add_key(struct sync_state *state, node_ref *root, const sync_key_t *key, void *context, uint8_t stored)
 {
   uint8_t prefix_len = 0;
-  struct node **node = root;
+  node_ref *node = root;
   uint8_t min_prefix_len = prefix_len;
   while(*node){
+    struct node *n = NODE(state, *node);
     uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, key);
     
-    if ((*node)->message.prefix_len == prefix_len){
-      sync_xor_node((*node), key);
+    if (n->message.prefix_len == prefix_len){
+      sync_xor_node(n, key);
       
-      if ((*node)->send_state == SENT)
-	(*node)->send_state = NOT_SENT;
-      if ((*node)->send_state == QUEUED && (*node)->sent_count>0)
-	(*node)->send_state = DONT_SEND;
+      if (n->send_state == SENT)
+	n->send_state = NOT_SENT;
+      if (n->send_state == QUEUED && n->sent_count>0)
+	n->send_state = DONT_SEND;
 	
       // reset the send counter
-      (*node)->sent_count=0;
+      n->sent_count=0;
       prefix_len += PREFIX_STEP_BITS;
       min_prefix_len = prefix_len;
-      node = &(*node)->children[child_index];
+      node = &n->children[child_index];
       if (!*node)
 	break;
       continue;
     }
     
     // this node represents a range of prefix bits
-    uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &(*node)->message.key);
+    uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &n->message.key);
     
     // if the prefix matches the key, keep searching.
     if (child_index == node_child_index){
@@ -205,132 +266,138 @@ static struct node *add_key(struct node **root, const sync_key_t *key, void *con
     }
     
     // if there is a mismatch in the range of prefix bits, we need to create a new node to represent the new range.
-    struct node *parent = allocate(sizeof(struct node));
+    node_ref parent_ref = node_alloc(state);
+    struct node *parent = NODE(state, parent_ref);
     parent->message.min_prefix_len = min_prefix_len;
     parent->message.prefix_len = prefix_len;
     parent->message.stored = stored;
     parent->children[node_child_index] = *node;
     
     min_prefix_len = prefix_len + PREFIX_STEP_BITS;
-    assert(min_prefix_len <= (*node)->message.prefix_len);
+    assert(min_prefix_len <= n->message.prefix_len);
     
-    (*node)->message.min_prefix_len = min_prefix_len;
+    n->message.min_prefix_len = min_prefix_len;
     
     // xor all the existing children of this node, we can't assume the prefix bits are right in the existing node.
     // we might be able to speed this up by using the prefix bits of the passed in key
-    xor_children(parent, &parent->message);
+    xor_children(state, parent_ref, &parent->message);
     
-    *node = parent;
+    *node = parent_ref;
   }
   // create final leaf node
-  *node = allocate(sizeof(struct node));
-  (*node)->message.key = *key;
-  (*node)->message.min_prefix_len = min_prefix_len;
-  (*node)->message.prefix_len = KEY_LEN_BITS;
-  (*node)->message.stored = stored;
-  (*node)->context = context;
-  return (*node);
+  node_ref leaf_ref = node_alloc(state);
+  struct node *leaf = NODE(state, leaf_ref);
+  leaf->message.key = *key;
+  leaf->message.min_prefix_len = min_prefix_len;
+  leaf->message.prefix_len = KEY_LEN_BITS;
+  leaf->message.stored = stored;
+  leaf->context = context;
+  *node = leaf_ref;
+  return leaf_ref;
 }
 
-// Recursively free the memory used by this tree
-static void free_node(struct sync_state *state, struct node *node)
+// Recursively return the nodes of this tree to the pool
+static void free_node(struct sync_state *state, node_ref ref)
 {
-  if (!node)
+  if (!ref)
     return;
   
+  struct node *node = NODE(state, ref);
   for (unsigned i=0;i<NODE_CHILDREN;i++)
     free_node(state, node->children[i]);
   
   if (node->transmit_next){
-    assert(state);
     assert(node->transmit_prev);
     
-    if (node->transmit_next == node){
-      assert(node->transmit_prev==node);
-      state->transmit_ptr = NULL;
+    if (node->transmit_next == ref){
+      assert(node->transmit_prev==ref);
+      state->transmit_ptr = NODE_NONE;
     }else{
-      if (state->transmit_ptr == node)
+      if (state->transmit_ptr == ref)
 	state->transmit_ptr = node->transmit_prev;
-      node->transmit_next->transmit_prev = node->transmit_prev;
-      node->transmit_prev->transmit_next = node->transmit_next;
+      NODE(state, node->transmit_next)->transmit_prev = node->transmit_prev;
+      NODE(state, node->transmit_prev)->transmit_next = node->transmit_next;
     }
   }
   
-  free(node);
+  node_release(state, ref);
 }
 
-static void remove_key(struct sync_state *state, struct node **root, const sync_key_t *key)
+static void remove_key(struct sync_state *state, node_ref *root, const sync_key_t *key)
 {
   uint8_t prefix_len = 0;
-  struct node **node = root;
-  struct node **parent = NULL;
+  node_ref *node = root;
+  node_ref *parent = NULL;
   
-  while((*node)->message.prefix_len != KEY_LEN_BITS){
+  while(NODE(state, *node)->message.prefix_len != KEY_LEN_BITS){
+    struct node *n = NODE(state, *node);
     uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, key);
     
     // this node represents a range of prefix bits
-    if (prefix_len < (*node)->message.prefix_len){
-      uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &(*node)->message.key);
+    if (prefix_len < n->message.prefix_len){
+      uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &n->message.key);
       assert(child_index == node_child_index);
       prefix_len += PREFIX_STEP_BITS;
       continue;
     }
     
-    sync_xor_node((*node), key);
-    if ((*node)->send_state == SENT)
-      (*node)->send_state = NOT_SENT;
-    if ((*node)->send_state == QUEUED && (*node)->sent_count>0)
-      (*node)->send_state = DONT_SEND;
+    sync_xor_node(n, key);
+    if (n->send_state == SENT)
+      n->send_state = NOT_SENT;
+    if (n->send_state == QUEUED && n->sent_count>0)
+      n->send_state = DONT_SEND;
       
     // reset the send counter
-    (*node)->sent_count=0;
+    n->sent_count=0;
     
     parent = node;
-    node = &(*node)->children[child_index];
+    node = &n->children[child_index];
     assert(*node);
     prefix_len += PREFIX_STEP_BITS;
   }
   
-  free_node(state, (*node));
-  *node = NULL;
+  free_node(state, *node);
+  *node = NODE_NONE;
   
   if (!parent)
     return;
   
+  struct node *p = NODE(state, *parent);
   node = NULL;
   // If *parent has <= 1 child now, we need to remove *parent as well
   for (unsigned i=0;i<NODE_CHILDREN;i++){
-    if ((*parent)->children[i]){
+    if (p->children[i]){
       if (node)
 	return;
-      node = &(*parent)->children[i];
+      node = &p->children[i];
     }
   }
   assert(node);
 
-  struct node *c = *node;
+  node_ref c = *node;
 
-  // remove child ptr so it isn't free'd
-  *node = NULL;
-  c->message.min_prefix_len = (*parent)->message.min_prefix_len;
+  // remove child ref so it isn't free'd
+  *node = NODE_NONE;
+  NODE(state, c)->message.min_prefix_len = p->message.min_prefix_len;
   
   free_node(state, *parent);
   
   *parent = c;
 }
 
-// find the node which matches this key, or NULL
-static const struct node * find_message(const struct node *node, const key_message_t *message)
+// find the node which matches this key, or NODE_NONE
+static node_ref find_message(const struct sync_state *state, node_ref ref, const key_message_t *message)
 {
-  if (!node)
-    return NULL;
+  if (!ref)
+    return NODE_NONE;
+  const struct node *node = NODE(state, ref);
   uint8_t prefix_len = node->message.prefix_len;
   
   while(1){
     if (cmp_message(&node->message, message)==0)
-      return node;
+      return ref;
     if (node->message.prefix_len == KEY_LEN_BITS)
-      return NULL;
+      return NODE_NONE;
     
     uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &message->key);
     
@@ -338,11 +405,12 @@ static const struct node * find_message(const struct node *node, const key_messa
       // TODO optimise this case by comparing all possible prefix bits in one hit
       uint8_t node_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &node->message.key);
       if (node_index != child_index)
-	return NULL;
+	return NODE_NONE;
     }else{
-      node = node->children[child_index];
-      if (!node)
-	return NULL;
+      ref = node->children[child_index];
+      if (!ref)
+	return NODE_NONE;
+      node = NODE(state, ref);
     }
     prefix_len+=PREFIX_STEP_BITS;
   }
@@ -351,7 +419,12 @@ static const struct node * find_message(const struct node *node, const key_messa
 int sync_key_exists(const struct sync_state *state, const sync_key_t *key)
 {
   key_message_t message = MESSAGE_FROM_KEY(key);
-  return find_message(state->root, &message) ? 1:0;
+  return find_message(state, state->root, &message) ? 1:0;
+}
+
+unsigned sync_key_count(const struct sync_state *state)
+{
+  return state->key_count;
 }
 
 int sync_has_transmit_queued(const struct sync_state *state)
@@ -359,13 +432,13 @@ int sync_has_transmit_queued(const struct sync_state *state)
   return state->transmit_ptr?1:0;
 }
 
-// returns NULL if the node already exists
-static struct node * add_key_if_missing(struct node **root, const key_message_t *message, uint8_t stored)
+// returns NODE_NONE if the node already exists
+static node_ref add_key_if_missing(struct sync_state *state, node_ref *root, const key_message_t *message, uint8_t stored)
 {
   assert(message->prefix_len == KEY_LEN_BITS);
-  if (find_message(*root, message)!=NULL)
-    return NULL;
-  return add_key(root, &message->key, NULL, stored);
+  if (find_message(state, *root, message)!=NODE_NONE)
+    return NODE_NONE;
+  return add_key(state, root, &message->key, NULL, stored);
 }
 
 void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context)
@@ -375,8 +448,9 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
 	 ((unsigned char *)key)[0],((unsigned char *)key)[1]);
   
   key_message_t message = MESSAGE_FROM_KEY(key);
-  struct node *node = (struct node *)find_message(state->root, &message);
-  if (node){
+  node_ref ref = find_message(state, state->root, &message);
+  if (ref){
+    struct node *node = NODE(state, ref);
     node->message.stored = 1;
     node->context = context;
     return;
@@ -384,11 +458,11 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
   
   state->key_count++;
   state->progress=0;
-  add_key(&state->root, key, context, 1);
+  add_key(state, &state->root, key, context, 1);
   
   struct sync_peer_state *peer_state = state->peers;
   while(peer_state){
-    if (find_message(peer_state->root, &message)){
+    if (find_message(state, peer_state->root, &message)){
       remove_key(state, &peer_state->root, key);
       peer_state->recv_count--;
     }
@@ -401,6 +475,8 @@ void sync_free_peer_state(struct sync_state *state, void *peer_context){
   while(*peer_state){
     if ((*peer_state)->peer_context == peer_context){
       struct sync_peer_state *free_peer = (*peer_state);
+      // The peer's nodes go back onto the free list in a single pass, ready to be
+      // reused by the next peer, rather than being handed back to malloc.
       free_node(state, free_peer->root);
       *peer_state = free_peer->next;
       free(free_peer);
@@ -416,25 +492,20 @@ struct sync_state* sync_alloc_state(void *context, peer_has has, peer_does_not_h
   state->has = has;
   state->has_not = has_not;
   state->now_has = now_has;
+  state->pool.next_unused = 1;
   return state;
 }
 
 // clear all memory used by this state
 void sync_free_state(struct sync_state *state){
-  while(state->transmit_ptr){
-    struct node *p = state->transmit_ptr;
-    state->transmit_ptr = state->transmit_ptr->transmit_next;
-    p->transmit_next=NULL;
-    p->transmit_prev=NULL;
-  }
-  
-  free_node(NULL, state->root);
+  // Every node of every tree lives in our slabs, so there is no need to walk
+  // the trees.
+  for (unsigned i=0;i<state->pool.slab_count;i++)
+    free(state->pool.slabs[i]);
+  free(state->pool.slabs);
     
   while(state->peers){
     struct sync_peer_state *peer_state = state->peers;
-    
-    free_node(NULL, peer_state->root);
-    
     state->peers = peer_state->next;
     free(peer_state);
   }
@@ -462,10 +533,19 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
   state->sent_messages++;
   state->progress++;
   
-  struct node *tail = state->transmit_ptr;
+#if NODE_CHILDREN > 2
+  while(state->empty_prefix_count && offset + MESSAGE_BYTES<=len){
+    copy_message(&buff[offset], &state->empty_prefixes[--state->empty_prefix_count]);
+    offset+=MESSAGE_BYTES;
+    state->sent_record_count++;
+  }
+#endif
+
+  node_ref tail = state->transmit_ptr;
   
   while(tail && offset + MESSAGE_BYTES<=len){
-    struct node *head = tail->transmit_next;
+    node_ref head_ref = NODE(state, tail)->transmit_next;
+    struct node *head = NODE(state, head_ref);
     assert(head->transmit_prev == tail);
     
     if (head->send_state == QUEUED){
@@ -479,25 +559,25 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
     
     if (head->send_state == QUEUED){
       // advance tail pointer
-      tail = head;
+      tail = head_ref;
     }else{
-      struct node *next = head->transmit_next;
-      head->transmit_next = NULL;
-      head->transmit_prev = NULL;
+      node_ref next = head->transmit_next;
+      head->transmit_next = NODE_NONE;
+      head->transmit_prev = NODE_NONE;
       
-      if (head == tail || next == head){
+      if (head_ref == tail || next == head_ref){
 	// transmit loop is now empty
-	tail = NULL;
+	tail = NODE_NONE;
 	break;
       }else{
 	// remove from the transmit loop
-	tail->transmit_next = next;
-	next->transmit_prev = tail;
+	NODE(state, tail)->transmit_next = next;
+	NODE(state, next)->transmit_prev = tail;
       }
     }
     
     // stop if we just sent everything in the loop once.
-    if (head == state->transmit_ptr)
+    if (head_ref == state->transmit_ptr)
       break;
   }
   
@@ -506,7 +586,7 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
   // If we don't have anything else to send, always send our root tree node
   if(offset + MESSAGE_BYTES<=len && offset==0){
     state->sent_root++;
-    copy_message(&buff[offset], state->root ? &state->root->message : NULL);
+    copy_message(&buff[offset], state->root ? &NODE(state, state->root)->message : NULL);
     offset+=MESSAGE_BYTES;
     state->sent_record_count++;
   }
@@ -517,8 +597,9 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
 
 // Add a tree node into our transmission queue
 // the node can be added to the head or tail of the list.
-static void queue_node(struct sync_state *state, struct node *node, uint8_t head)
+static void queue_node(struct sync_state *state, node_ref ref, uint8_t head)
 {
+  struct node *node = NODE(state, ref);
   node->send_state = QUEUED;
   if (node->transmit_next)
     return;
@@ -528,27 +609,53 @@ static void queue_node(struct sync_state *state, struct node *node, uint8_t head
   
   // insert this node into the transmit loop
   if (!state->transmit_ptr){
-    state->transmit_ptr = node;
-    node->transmit_next = node;
-    node->transmit_prev = node;
+    state->transmit_ptr = ref;
+    node->transmit_next = ref;
+    node->transmit_prev = ref;
   }else{
-    node->transmit_next = state->transmit_ptr->transmit_next;
+    node->transmit_next = NODE(state, state->transmit_ptr)->transmit_next;
     node->transmit_prev = state->transmit_ptr;
     
-    node->transmit_next->transmit_prev = node;
-    node->transmit_prev->transmit_next = node;
+    NODE(state, node->transmit_next)->transmit_prev = ref;
+    NODE(state, node->transmit_prev)->transmit_next = ref;
     
     // advance past this node to transmit it last
     if (!head)
-      state->transmit_ptr = node;
+      state->transmit_ptr = ref;
   }
 }
 
-static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state *peer, const struct node *node, uint8_t allow_remove)
+#if NODE_CHILDREN > 2
+// Queue a node with an empty XOR of keys, which the peer will treat as us
+// knowing none of the keys under that prefix.
+static int queue_empty_prefix(struct sync_state *state, const key_message_t *message, uint8_t min_prefix_len)
 {
-  const struct node *peer_node = find_message(peer->root, &node->message);
-  if (peer_node){
-    if (peer_node->message.stored && allow_remove){
+  key_message_t empty;
+  bzero(&empty, sizeof empty);
+  empty.stored = 1;
+  empty.min_prefix_len = min_prefix_len;
+  empty.prefix_len = message->prefix_len;
+  memcpy(&empty.key, &message->key, (empty.prefix_len+7)>>3);
+  if (empty.prefix_len&7)
+    empty.key.key[empty.prefix_len>>3] &= (0xFF00>>(empty.prefix_len&7)) & 0xFF;
+  
+  for (unsigned i=0;i<state->empty_prefix_count;i++)
+    if (cmp_message(&empty, &state->empty_prefixes[i])==0)
+      return 0;
+  if (state->empty_prefix_count >= EMPTY_PREFIX_QUEUE)
+    return -1;
+  state->empty_prefixes[state->empty_prefix_count++] = empty;
+  state->progress=0;
+  return 0;
+}
+#endif
+
+static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state *peer, node_ref ref, uint8_t allow_remove)
+{
+  struct node *node = NODE(state, ref);
+  node_ref peer_ref = find_message(state, peer->root, &node->message);
+  if (peer_ref){
+    if (NODE(state, peer_ref)->message.stored && allow_remove){
       // peer has now received this key?
       if (state->now_has)
 	state->now_has(state->context, peer->peer_context, node->context, &node->message.key);
@@ -559,7 +666,7 @@ static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state
     return 0;
   }
   
-  add_key(&peer->root, &node->message.key, node->context, 1);
+  add_key(state, &peer->root, &node->message.key, node->context, 1);
   peer->send_count ++;
   state->progress=0;
   if (state->has_not)
@@ -571,11 +678,12 @@ static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state
 // optionally ignoring a single child of this node.
 static void peer_missing_leaf_nodes(
     struct sync_state *state, struct sync_peer_state *peer, 
-    struct node *node, unsigned except, uint8_t allow_remove)
+    node_ref ref, unsigned except, uint8_t allow_remove)
 {
+  struct node *node = NODE(state, ref);
   if (node->message.prefix_len == KEY_LEN_BITS){
-    if (peer_is_missing(state, peer, node, allow_remove))
-      queue_node(state, node, 1);
+    if (peer_is_missing(state, peer, ref, allow_remove))
+      queue_node(state, ref, 1);
   }else{
     for (unsigned i=0;i<NODE_CHILDREN;i++){
       if (i!=except && node->children[i])
@@ -589,7 +697,7 @@ static void peer_add_key(struct sync_state *state, struct sync_peer_state *peer_
   if (message->prefix_len != KEY_LEN_BITS || !message->stored)
     return;
     
-  struct node *node = add_key_if_missing(&peer_state->root, message, 0);
+  node_ref node = add_key_if_missing(state, &peer_state->root, message, 0);
   
   if (node){
     //Yay, they told us something we didn't know.
@@ -612,11 +720,12 @@ static void de_queue(struct node *node){
 }
 */
 
-static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer_state *peer_state, struct node *peer_node)
+static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer_state *peer_state, node_ref peer_ref)
 {
-  if (!peer_node)
+  if (!peer_ref)
     return 0;
   unsigned ret=0;
+  struct node *peer_node = NODE(state, peer_ref);
   if (peer_node->message.prefix_len == KEY_LEN_BITS){
     if (peer_node->message.stored){
       if (state->now_has)
@@ -626,8 +735,8 @@ static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer
       ret=1;
     }
   }else{
-    // duplicate the child pointers, as removing an immediate child key *will* also free this peer node.
-    struct node *children[NODE_CHILDREN];
+    // duplicate the child refs, as removing an immediate child key *will* also free this peer node.
+    node_ref children[NODE_CHILDREN];
     memcpy(children, peer_node->children, sizeof(children));
     for (unsigned i=0;i<NODE_CHILDREN;i++)
       ret+=peer_has_received_all(state, peer_state, children[i]);
@@ -638,13 +747,14 @@ static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer
 // add information about keys sent to this peer,
 // remove information about keys received from this peer
 // (both operations are XOR's)
-// returns a struct node if this message is an exact match
-static struct node * remove_differences(struct sync_peer_state *peer_state, key_message_t *message)
+// returns a node if this message is an exact match
+static node_ref remove_differences(struct sync_state *state, struct sync_peer_state *peer_state, key_message_t *message)
 {
   if (!peer_state->root || !message->stored)
-    return NULL;
+    return NODE_NONE;
   
-  struct node *peer_node = peer_state->root;
+  node_ref peer_ref = peer_state->root;
+  struct node *peer_node = NODE(state, peer_ref);
   uint8_t prefix_len = 0;
   
   while(prefix_len < message->prefix_len){
@@ -653,7 +763,7 @@ static struct node * remove_differences(struct sync_peer_state *peer_state, key_
       if (cmp_message(message, &peer_node->message)==0)
 	break;
       if (message->prefix_len == KEY_LEN_BITS)
-	return NULL;
+	return NODE_NONE;
     }
     
     uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &message->key);
@@ -662,11 +772,12 @@ static struct node * remove_differences(struct sync_peer_state *peer_state, key_
       // TODO optimise this case by comparing all possible prefix bits in one hit
       uint8_t node_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &peer_node->message.key);
       if (node_index != child_index)
-	return NULL; // no match
+	return NODE_NONE; // no match
     }else{
-      peer_node = peer_node->children[child_index];
-      if (!peer_node)
-	return NULL;
+      peer_ref = peer_node->children[child_index];
+      if (!peer_ref)
+	return NODE_NONE;
+      peer_node = NODE(state, peer_ref);
     }
     prefix_len+=PREFIX_STEP_BITS;
   }
@@ -677,10 +788,10 @@ static struct node * remove_differences(struct sync_peer_state *peer_state, key_
       sync_xor(&peer_node->message.key, message);
     }else{
       // we need to xor all children so we can get the prefix bits right.
-      xor_children(peer_node, message);
+      xor_children(state, peer_ref, message);
     }
   }
-  return peer_node;
+  return peer_ref;
 }
 
 // Proccess one incoming tree record.
@@ -724,8 +835,9 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
   key_message_t peer_message = *message;
   
   // first, remove information from peer_message that we have already learnt about this peer
-  struct node *peer_node = remove_differences(peer_state, &peer_message);
-  struct node *node = state->root;
+  node_ref peer_node = remove_differences(state, peer_state, &peer_message);
+  node_ref ref = state->root;
+  struct node *node = NODE(state, ref);
   uint8_t prefix_len = 0;
   uint8_t is_blank = 1;
   for (unsigned i=(peer_message.prefix_len>>3)+1;i<KEY_LEN && is_blank;i++)
@@ -745,7 +857,7 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 	  state->received_uninteresting++;
       }else{
 	// peer is ACK'ing that they need to know this key, which we have
-	if (peer_is_missing(state, peer_state, node, 0)==0)
+	if (peer_is_missing(state, peer_state, ref, 0)==0)
 	  state->received_uninteresting++;
       }
       return 0;
@@ -762,10 +874,10 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     if (peer_message.prefix_len <= prefix_len){
       if (is_blank){
 	// This peer doesn't know any of the children of this node
-	peer_missing_leaf_nodes(state, peer_state, node, NODE_CHILDREN, 1);
+	peer_missing_leaf_nodes(state, peer_state, ref, NODE_CHILDREN, 1);
       }else if (node->message.prefix_len > peer_message.prefix_len){
 	// reply with our matching node
-	queue_node(state, node, 1);
+	queue_node(state, ref, 1);
       }else{
 	// compare their node to our tree, test if we can easily detect a part of our tree they don't know
 	// Note, this only works if there are an odd number of different leaf nodes
@@ -776,12 +888,13 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 	sync_xor(&node->message.key, &test_message);
 	
 	// if we can explain the difference based on a matching node, queue all leaf nodes
-	struct node *test_node = node;
+	node_ref test_ref = ref;
 	uint8_t test_prefix = prefix_len;
-	while(test_node) {
+	while(test_ref) {
+	  struct node *test_node = NODE(state, test_ref);
 	  if (cmp_message(&test_message, &test_node->message)==0){
 	    // This peer doesn't know any of the children of this node
-	    peer_missing_leaf_nodes(state, peer_state, test_node, NODE_CHILDREN, 1);
+	    peer_missing_leaf_nodes(state, peer_state, test_ref, NODE_CHILDREN, 1);
 	    return 0;
 	  }
 	  if (test_node->message.prefix_len == KEY_LEN_BITS)
@@ -793,16 +906,38 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 	    if (node_index != child_index)
 	      break; // no match
 	  }else{
-	    test_node = test_node->children[child_index];
+	    test_ref = test_node->children[child_index];
 	  }
 	  test_prefix+=PREFIX_STEP_BITS;
 	}
-	
+
+#if NODE_CHILDREN > 2
+	// With an even number of different keys, the prefix bits of the
+	// difference are wiped out, so the walk above can't find the child
+	// the peer is missing. But cmp_message() ignores the prefix bits of
+	// the child, so we can just try each of them.
+	for (unsigned i=0;i<NODE_CHILDREN;i++){
+	  if (node->children[i] && cmp_message(&test_message, &NODE(state, node->children[i])->message)==0){
+	    peer_missing_leaf_nodes(state, peer_state, node->children[i], NODE_CHILDREN, 1);
+	    return 0;
+	  }
+	}
+#endif
+
 	// queue the transmission of all child nodes of this node
 	for (unsigned i=0;i<NODE_CHILDREN;i++){
 	  if (node->children[i])
 	    queue_node(state, node->children[i], 0);
 	}
+#if NODE_CHILDREN > 2
+	// In a binary tree, a peer that lacks one whole side of this node
+	// has no node at this level at all, which we detect above from its
+	// min_prefix_len. With wider fan-out, the peer may have a node here that
+	// is only missing some of our children, and it can only discover which
+	// by comparing our children against its own. So also send this node,
+	// prompting the peer to reply with its children in the same way.
+	queue_node(state, ref, 0);
+#endif
       }
       return 0;
     }
@@ -818,12 +953,12 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 	// If the prefix of our node differs from theirs, they don't have any of these keys
 	// send them all
 	if (prefix_len >= peer_message.min_prefix_len && peer_message.stored){
-	  peer_missing_leaf_nodes(state, peer_state, node, NODE_CHILDREN, 0);
+	  peer_missing_leaf_nodes(state, peer_state, ref, NODE_CHILDREN, 0);
 	  
 	  if (peer_message.prefix_len != KEY_LEN_BITS)
 	    // and after they have added all these missing keys, they need to know 
 	    // this summary node so they can be reminded to send this key or it's children again.
-	    queue_node(state, node, 0);
+	    queue_node(state, ref, 0);
 	}
 	
 	if (peer_message.prefix_len == KEY_LEN_BITS)
@@ -842,7 +977,7 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     if (peer_message.min_prefix_len <= node->message.prefix_len && peer_message.stored){
       // send all keys to the other party, except for the child @key_index
       // they don't have any of these siblings
-      peer_missing_leaf_nodes(state, peer_state, node, key_index, 0);
+      peer_missing_leaf_nodes(state, peer_state, ref, key_index, 0);
     }
     
     // look at the next node in our graph
@@ -851,9 +986,16 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
       if (peer_message.prefix_len == KEY_LEN_BITS){
 	peer_add_key(state, peer_state, &peer_message);
       }else{
+#if NODE_CHILDREN > 2
+	// Unlike a binary tree, our node can't tell the peer which of its
+	// children we are missing, so tell them directly that we have nothing
+	// under this prefix.
+	if (queue_empty_prefix(state, &peer_message, prefix_len + PREFIX_STEP_BITS)==0)
+	  return 0;
+#endif
 	// hopefully the other party will tell us something,
 	// and we won't get stuck in a loop talking about the same node.
-	queue_node(state, node, 0);
+	queue_node(state, ref, 0);
       }
       return 0;
     }
@@ -863,7 +1005,8 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     //if (node->sent_count>0 && node->send_state == QUEUED)
     //  node->send_state = SENT;
     
-    node = node->children[key_index];
+    ref = node->children[key_index];
+    node = NODE(state, ref);
     prefix_len += PREFIX_STEP_BITS;
   }
 }
@@ -0,0 +1,167 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports,
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+  Benchmark for the sync tree (sync.c).
+
+  Simulates a number of nodes that share a single broadcast channel, each with
+  a random subset of a common pool of keys.  Each round, every node in turn
+  builds one sync message of up to MTU bytes, which every other node receives.
+  Whenever a node learns that a peer lacks a key, the key is handed to that
+  peer at the end of the round, standing in for the bundle transfer.
+
+  We report how many rounds, bytes on air and sync records it takes until every
+  node holds every key, and the CPU time spent in the sync code.  Build with
+  different values of PREFIX_STEP_BITS to compare trie widths, e.g., via
+  "make syncbench".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sync.h"
+
+#define MAX_NODES 16
+#define MTU 200
+#define MAX_ROUNDS 100000
+// Mirrors the sync record size in sync.c
+#define RECORD_BYTES (KEY_LEN+2)
+
+struct bench_node {
+  int id;
+  struct sync_state *state;
+  sync_key_t *pending;
+  int pending_count;
+  int pending_size;
+};
+
+struct bench_node nodes[MAX_NODES];
+int node_count=0;
+
+void bench_peer_has(void *context, void *peer_context, const sync_key_t *key)
+{
+}
+
+void bench_peer_does_not_have(void *context, void *peer_context,
+			      void *key_context, const sync_key_t *key)
+{
+  // Pretend we sent them the bundle
+  struct bench_node *peer=peer_context;
+  if (peer->pending_count<peer->pending_size)
+    peer->pending[peer->pending_count++]=*key;
+}
+
+void bench_peer_now_has(void *context, void *peer_context, void *key_context,
+			const sync_key_t *key)
+{
+}
+
+int main(int argc,char **argv)
+{
+  if (argc<3) {
+    fprintf(stderr,"usage: syncbench <keys> <nodes> [percent of keys held by all nodes] [seed]\n");
+    exit(-1);
+  }
+  int key_count=atoi(argv[1]);
+  node_count=atoi(argv[2]);
+  int shared_percent=argc>3?atoi(argv[3]):90;
+  int seed=argc>4?atoi(argv[4]):1;
+  if ((node_count<2)||(node_count>MAX_NODES)||(key_count<1)) {
+    fprintf(stderr,"Need between 2 and %d nodes, and at least one key.\n",MAX_NODES);
+    exit(-1);
+  }
+
+  // sync_add_key() is chatty on stdout, which would swamp the CPU measurement
+  if (!freopen("/dev/null","w",stdout)) perror("freopen");
+
+  srandom(seed);
+  sync_key_t *keys=calloc(key_count,sizeof(sync_key_t));
+  for(int i=0;i<node_count;i++) {
+    nodes[i].id=i;
+    nodes[i].state=sync_alloc_state(&nodes[i],bench_peer_has,
+				    bench_peer_does_not_have,bench_peer_now_has);
+    // Each key is normally delivered at most once per sender in a round
+    nodes[i].pending_size=key_count*node_count;
+    nodes[i].pending=calloc(nodes[i].pending_size,sizeof(sync_key_t));
+  }
+
+  clock_t cpu=0;
+  clock_t start=clock();
+  for(int k=0;k<key_count;k++) {
+    for(int j=0;j<KEY_LEN;j++) keys[k].key[j]=random();
+    if ((random()%100)<shared_percent) {
+      for(int i=0;i<node_count;i++) sync_add_key(nodes[i].state,&keys[k],NULL);
+    } else
+      sync_add_key(nodes[random()%node_count].state,&keys[k],NULL);
+  }
+  clock_t setup=clock()-start;
+
+  long long bytes=0;
+  int round;
+  int converged=0;
+  for(round=1;round<=MAX_ROUNDS&&!converged;round++) {
+    start=clock();
+    for(int i=0;i<node_count;i++) {
+      unsigned char msg[MTU];
+      size_t len=sync_build_message(nodes[i].state,msg,MTU);
+      bytes+=len;
+      for(int j=0;j<node_count;j++)
+	if (j!=i) sync_recv_message(nodes[j].state,&nodes[i],msg,len);
+    }
+    for(int i=0;i<node_count;i++) {
+      for(int p=0;p<nodes[i].pending_count;p++)
+	sync_add_key(nodes[i].state,&nodes[i].pending[p],NULL);
+      nodes[i].pending_count=0;
+    }
+    cpu+=clock()-start;
+
+    converged=1;
+    for(int i=0;i<node_count&&converged;i++)
+      for(int k=0;k<key_count;k++)
+	if (!sync_key_exists(nodes[i].state,&keys[k])) { converged=0; break; }
+  }
+  round--;
+
+  fprintf(stderr,"radix=%-2d keys=%d nodes=%d shared=%d%%: %s after %d rounds, "
+	  "%lld bytes (%lld records), setup %.1fms, sync CPU %.1fms\n",
+	  1<<PREFIX_STEP_BITS,key_count,node_count,shared_percent,
+	  converged?"converged":"NOT converged",round,
+	  bytes,bytes/RECORD_BYTES,
+	  setup*1000.0/CLOCKS_PER_SEC,cpu*1000.0/CLOCKS_PER_SEC);
+
+  for(int i=0;i<node_count;i++) {
+    sync_free_state(nodes[i].state);
+    free(nodes[i].pending);
+  }
+  free(keys);
+  return converged?0:1;
+}
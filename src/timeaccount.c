@@ -60,10 +60,130 @@ struct time_excursion recent[MAX_TIME_EXCURSIONS];
 int alltime_count = 0;
 struct time_excursion alltime[MAX_TIME_EXCURSIONS];
 
+/*
+  Every interval also goes into a latency histogram for its source, so that we
+  can see where the time goes below the excursion threshold.  Buckets are
+  logarithmic, with four per power of two of microseconds, which keeps
+  percentiles within about 20% of the truth.  Besides the all-time counts, we
+  keep TIME_WINDOW_EPOCHS epochs of TIME_EPOCH_SECONDS each, which form the
+  sliding window of recent activity.
+*/
+#define MAX_TIME_SOURCES 64
+#define TIME_HISTOGRAM_BUCKETS 120
+#define TIME_EPOCH_SECONDS 10
+#define TIME_WINDOW_EPOCHS 6
+
+struct time_counts {
+  long long count;
+  long long sum_us;
+  long long max_us;
+  unsigned int buckets[TIME_HISTOGRAM_BUCKETS];
+};
+
+struct time_histogram {
+  char source[32];
+  struct time_counts alltime;
+  long long epoch_numbers[TIME_WINDOW_EPOCHS];
+  struct time_counts epochs[TIME_WINDOW_EPOCHS];
+};
+
+int time_histogram_count = 0;
+struct time_histogram time_histograms[MAX_TIME_SOURCES];
+
 long long accumulated_time = 0;
 long long current_interval_start = 0;
 char current_interval_source[32] = "(none)";
 
+static int time_bucket(long long us)
+{
+  if (us < 4) return us < 0 ? 0 : us;
+  if (us > 0x7fffffff) us = 0x7fffffff;
+  int octave = 63 - __builtin_clzll(us);
+  return 4 * (octave - 1) + ((us >> (octave - 2)) & 3);
+}
+
+// Smallest interval that falls into the bucket
+static long long time_bucket_lower(int bucket)
+{
+  if (bucket < 4) return bucket;
+  int octave = bucket / 4 + 1;
+  return (4LL + (bucket & 3)) << (octave - 2);
+}
+
+static struct time_histogram *time_histogram_find(char *source)
+{
+  // There are only a couple of dozen sources
+  for (int i = 0; i < time_histogram_count; i++)
+    if (!strncmp(time_histograms[i].source, source, sizeof(time_histograms[i].source) - 1))
+      return &time_histograms[i];
+  if (time_histogram_count >= MAX_TIME_SOURCES)
+    return NULL;
+
+  struct time_histogram *h = &time_histograms[time_histogram_count++];
+  bzero(h, sizeof(*h));
+  snprintf(h->source, sizeof(h->source), "%s", source);
+  return h;
+}
+
+static void time_counts_add(struct time_counts *c, long long us)
+{
+  c->count++;
+  c->sum_us += us;
+  if (us > c->max_us) c->max_us = us;
+  c->buckets[time_bucket(us)]++;
+}
+
+static void log_time_histogram(long long interval_us, char *source)
+{
+  if (interval_us < 0) interval_us = 0;
+
+  struct time_histogram *h = time_histogram_find(source);
+  if (!h) return;
+
+  time_counts_add(&h->alltime, interval_us);
+
+  long long epoch = gettime_ms() / (TIME_EPOCH_SECONDS * 1000);
+  int slot = epoch % TIME_WINDOW_EPOCHS;
+  if (h->epoch_numbers[slot] != epoch) {
+    bzero(&h->epochs[slot], sizeof(h->epochs[slot]));
+    h->epoch_numbers[slot] = epoch;
+  }
+  time_counts_add(&h->epochs[slot], interval_us);
+}
+
+// Sum the epochs that are still within the sliding window
+static void time_histogram_window(struct time_histogram *h, struct time_counts *w)
+{
+  long long epoch = gettime_ms() / (TIME_EPOCH_SECONDS * 1000);
+  bzero(w, sizeof(*w));
+  for (int e = 0; e < TIME_WINDOW_EPOCHS; e++) {
+    if (h->epoch_numbers[e] <= epoch - TIME_WINDOW_EPOCHS) continue;
+    if (h->epoch_numbers[e] > epoch) continue;
+    w->count += h->epochs[e].count;
+    w->sum_us += h->epochs[e].sum_us;
+    if (h->epochs[e].max_us > w->max_us) w->max_us = h->epochs[e].max_us;
+    for (int b = 0; b < TIME_HISTOGRAM_BUCKETS; b++)
+      w->buckets[b] += h->epochs[e].buckets[b];
+  }
+}
+
+// Upper bound of the bucket containing the given percentile, but no more
+// than the largest interval actually seen.
+static long long time_percentile(struct time_counts *c, int percent)
+{
+  if (!c->count) return 0;
+  long long wanted = (c->count * percent + 99) / 100;
+  long long seen = 0;
+  for (int b = 0; b < TIME_HISTOGRAM_BUCKETS; b++) {
+    seen += c->buckets[b];
+    if (seen >= wanted) {
+      long long upper = time_bucket_lower(b + 1) - 1;
+      return upper < c->max_us ? upper : c->max_us;
+    }
+  }
+  return c->max_us;
+}
+
 int log_time(long long interval, char *source)
 {
   int retVal = -1;
@@ -84,7 +204,7 @@ int log_time(long long interval, char *source)
 
     // Shuffle down recent time excursions
     int i;
-    for (i = MAX_TIME_EXCURSIONS; i > 0; i--) {
+    for (i = MAX_TIME_EXCURSIONS - 1; i > 0; i--) {
       recent[i]=recent[i-1];
     }
 
@@ -111,7 +231,7 @@ int log_time(long long interval, char *source)
       insert = 0;
     }
 
-    for (i = MAX_TIME_EXCURSIONS; i > insert; i--) {
+    for (i = MAX_TIME_EXCURSIONS - 1; i > insert; i--) {
       alltime[i] = alltime[i-1];
     }
 
@@ -134,7 +254,7 @@ int account_time_pause()
 {  
   LOG_ENTRY;
 
-  accumulated_time += (gettime_ms() - current_interval_start);
+  accumulated_time += (gettime_us() - current_interval_start);
 
   LOG_EXIT;
 
@@ -145,7 +265,7 @@ int account_time_resume()
 {
   LOG_ENTRY;
 
-  current_interval_start = gettime_ms();
+  current_interval_start = gettime_us();
 
   LOG_EXIT;
 
@@ -157,16 +277,19 @@ int account_time(char *source)
 
   LOG_ENTRY;
 
+  long long now = gettime_us();
+
   if (current_interval_start) {
     // Close of current interval
-    long long interval_duration = gettime_ms() - current_interval_start;
+    long long interval_duration = now - current_interval_start;
     interval_duration += accumulated_time;
     accumulated_time = 0;
 
-    log_time(interval_duration, current_interval_source);
+    log_time_histogram(interval_duration, current_interval_source);
+    log_time(interval_duration / 1000, current_interval_source);
   }
 
-  current_interval_start = gettime_ms();
+  current_interval_start = now;
   accumulated_time = 0;
   strncpy(current_interval_source, source, sizeof(current_interval_source));
 
@@ -176,6 +299,52 @@ int account_time(char *source)
   
 }
 
+static void time_counts_json(FILE *f, struct time_counts *c)
+{
+  fprintf(f, "{ \"count\": %lld, \"sum_us\": %lld, \"max_us\": %lld, "
+	  "\"p50_us\": %lld, \"p99_us\": %lld, \"buckets\": [",
+	  c->count, c->sum_us, c->max_us,
+	  time_percentile(c, 50), time_percentile(c, 99));
+  int first = 1;
+  for (int b = 0; b < TIME_HISTOGRAM_BUCKETS; b++) {
+    if (!c->buckets[b]) continue;
+    fprintf(f, "%s[%lld, %u]", first ? "" : ", ",
+	    time_bucket_lower(b), c->buckets[b]);
+    first = 0;
+  }
+  fprintf(f, "] }");
+}
+
+/*
+  Write the latency histograms as JSON.  Each bucket is given as
+  [smallest interval in microseconds, count], and empty buckets are left out.
+*/
+int time_accounting_json(FILE *f)
+{
+  if (!f) return -1;
+
+  fprintf(f, "{\n\"window_seconds\": %d,\n\"sources\": [\n",
+	  TIME_EPOCH_SECONDS * TIME_WINDOW_EPOCHS);
+  for (int i = 0; i < time_histogram_count; i++) {
+    struct time_histogram *h = &time_histograms[i];
+    struct time_counts window;
+    time_histogram_window(h, &window);
+
+    fprintf(f, "%s  { \"source\": \"", i ? ",\n" : "");
+    for (char *c = h->source; *c; c++) {
+      if (*c == '"' || *c == '\\') fputc('\\', f);
+      if (*c >= ' ') fputc(*c, f);
+    }
+    fprintf(f, "\",\n    \"alltime\": ");
+    time_counts_json(f, &h->alltime);
+    fprintf(f, ",\n    \"window\": ");
+    time_counts_json(f, &window);
+    fprintf(f, " }");
+  }
+  fprintf(f, "\n]\n}\n");
+  return 0;
+}
+
 int show_time_accounting(FILE *f)
 {
   LOG_ENTRY;
@@ -223,6 +392,22 @@ int show_time_accounting(FILE *f)
 
     fprintf(f,"</table></td></tr></table>\n");
 
+    fprintf(f,
+      "<h2>Latency by source (last %d seconds)</h2>\n"
+      "<table border=1 padding=2>\n"
+      "<tr><th>Source</th><th>Count</th><th>Total</th><th>p50</th><th>p99</th><th>Max</th></tr>\n",
+      TIME_EPOCH_SECONDS * TIME_WINDOW_EPOCHS);
+    for (int i = 0; i < time_histogram_count; i++) {
+      struct time_counts window;
+      time_histogram_window(&time_histograms[i], &window);
+      if (!window.count) continue;
+      fprintf(f,"<tr><td>%s</td><td>%lld</td><td>%lld ms</td><td>%lld us</td><td>%lld us</td><td>%lld us</td></tr>\n",
+        time_histograms[i].source, window.count, window.sum_us / 1000,
+        time_percentile(&window, 50), time_percentile(&window, 99),
+        window.max_us);
+    }
+    fprintf(f,"</table>\n");
+
   }
   while (0);
 
@@ -0,0 +1,236 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Binary event trace ring (see trace.h).
+
+  Writers claim a slot with one atomic increment of trace_head, clear the
+  slot's sequence number, fill it in, and then publish it by storing the
+  sequence number.  Readers (the writer thread, and trace_dump()) copy a
+  record and then check that its sequence number didn't change while they
+  were doing so, in the manner of a seqlock.  If a reader falls more than a
+  ring behind, the records it missed are counted in a TRACE_DROPPED record
+  rather than blocking anyone.
+
+  This file has no dependencies beyond trace.h, so that fakecsmaradio and
+  tracedecode can use it too.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define TRACE_RING_MASK (TRACE_RING_RECORDS-1)
+
+// How often the writer thread wakes up to drain the ring
+#define TRACE_WRITER_INTERVAL_MS 100
+
+int trace_enabled=0;
+
+static struct trace_record *trace_ring=NULL;
+static uint64_t trace_head=0;
+
+static FILE *trace_file=NULL;
+static uint64_t trace_tail=0;
+static pthread_t trace_writer_thread;
+static volatile int trace_writer_running=0;
+
+#define TRACE_EVENT(id,name,a,b,c) { name, { a, b, c } },
+static const struct {
+  const char *name;
+  const char *args[3];
+} trace_event_info[TRACE_EVENT_COUNT]={ TRACE_EVENTS };
+#undef TRACE_EVENT
+
+const char *trace_event_name(int type)
+{
+  if (type<0||type>=TRACE_EVENT_COUNT) return "unknown";
+  return trace_event_info[type].name;
+}
+
+const char *trace_event_arg_name(int type,int arg)
+{
+  if (type<0||type>=TRACE_EVENT_COUNT||arg<0||arg>2) return "";
+  return trace_event_info[type].args[arg];
+}
+
+static int64_t trace_time_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return ts.tv_sec*1000000LL+ts.tv_nsec/1000;
+}
+
+int trace_enable(void)
+{
+  if (!trace_ring) {
+    trace_ring=calloc(TRACE_RING_RECORDS,sizeof(struct trace_record));
+    if (!trace_ring) {
+      perror("calloc(trace ring)");
+      return -1;
+    }
+  }
+  trace_enabled=1;
+  return 0;
+}
+
+void trace_event(int type,int flags,int64_t a,int64_t b,int64_t c,
+		 const void *payload,int len)
+{
+  if (!trace_ring) return;
+  uint64_t index=__atomic_fetch_add(&trace_head,1,__ATOMIC_RELAXED);
+  struct trace_record *r=&trace_ring[index&TRACE_RING_MASK];
+
+  __atomic_store_n(&r->sequence,0,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  r->time_us=trace_time_us();
+  r->type=type;
+  r->flags=flags;
+  r->a=a; r->b=b; r->c=c;
+  if (len>TRACE_PAYLOAD_BYTES) len=TRACE_PAYLOAD_BYTES;
+  if (len<0||!payload) len=0;
+  r->payload_len=len;
+  memcpy(r->payload,payload,len);
+  memset(&r->payload[len],0,TRACE_PAYLOAD_BYTES-len);
+  __atomic_store_n(&r->sequence,(uint32_t)(index+1),__ATOMIC_RELEASE);
+}
+
+/*
+  Copy record index out of the ring.
+  Returns 1 if it was copied, 0 if it is still being written, and -1 if it
+  has already been overwritten.
+*/
+static int trace_read(uint64_t index,struct trace_record *out)
+{
+  struct trace_record *r=&trace_ring[index&TRACE_RING_MASK];
+  uint32_t want=(uint32_t)(index+1);
+  uint32_t seq=__atomic_load_n(&r->sequence,__ATOMIC_ACQUIRE);
+  if (seq!=want) return ((int32_t)(seq-want)>0)?-1:0;
+  memcpy(out,r,sizeof(*out));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  seq=__atomic_load_n(&r->sequence,__ATOMIC_RELAXED);
+  if (seq!=want) return -1;
+  return 1;
+}
+
+static void trace_write_header(FILE *f)
+{
+  struct trace_file_header h;
+  memset(&h,0,sizeof(h));
+  strncpy(h.magic,TRACE_MAGIC,sizeof(h.magic));
+  h.version=TRACE_FORMAT_VERSION;
+  h.record_size=sizeof(struct trace_record);
+  fwrite(&h,sizeof(h),1,f);
+}
+
+static void trace_write_dropped(FILE *f,uint64_t dropped,int64_t time_us)
+{
+  struct trace_record r;
+  memset(&r,0,sizeof(r));
+  r.time_us=time_us;
+  r.type=TRACE_DROPPED;
+  r.a=dropped;
+  fwrite(&r,sizeof(r),1,f);
+}
+
+// Write out records from *tail up to head, noting any that we missed.
+static void trace_drain(FILE *f,uint64_t *tail)
+{
+  uint64_t head=__atomic_load_n(&trace_head,__ATOMIC_ACQUIRE);
+  uint64_t dropped=0;
+
+  if (head-*tail>TRACE_RING_RECORDS) {
+    dropped=head-TRACE_RING_RECORDS-*tail;
+    *tail=head-TRACE_RING_RECORDS;
+  }
+  while(*tail<head) {
+    struct trace_record r;
+    int result=trace_read(*tail,&r);
+    if (!result) break;
+    if (result<0) dropped++;
+    else {
+      // Stamped with the time of the next record, to keep the file in order
+      if (dropped) { trace_write_dropped(f,dropped,r.time_us); dropped=0; }
+      fwrite(&r,sizeof(r),1,f);
+    }
+    (*tail)++;
+  }
+  if (dropped) trace_write_dropped(f,dropped,trace_time_us());
+}
+
+static void *trace_writer(void *arg)
+{
+  struct timespec interval={0,TRACE_WRITER_INTERVAL_MS*1000000L};
+  while(trace_writer_running) {
+    nanosleep(&interval,NULL);
+    trace_drain(trace_file,&trace_tail);
+    fflush(trace_file);
+  }
+  return NULL;
+}
+
+// Start a thread that appends the trace to filename as it is recorded.
+int trace_start_writer(char *filename)
+{
+  if (trace_writer_running) return -1;
+  if (trace_enable()) return -1;
+  trace_file=fopen(filename,"w");
+  if (!trace_file) {
+    perror("fopen(trace file)");
+    return -1;
+  }
+  trace_write_header(trace_file);
+  trace_tail=__atomic_load_n(&trace_head,__ATOMIC_ACQUIRE);
+  trace_writer_running=1;
+  if (pthread_create(&trace_writer_thread,NULL,trace_writer,NULL)) {
+    perror("pthread_create(trace writer)");
+    trace_writer_running=0;
+    fclose(trace_file);
+    trace_file=NULL;
+    return -1;
+  }
+  atexit(trace_stop_writer);
+  return 0;
+}
+
+// Stop the writer thread, after writing out everything recorded so far.
+void trace_stop_writer(void)
+{
+  if (!trace_writer_running) return;
+  trace_writer_running=0;
+  pthread_join(trace_writer_thread,NULL);
+  trace_drain(trace_file,&trace_tail);
+  fclose(trace_file);
+  trace_file=NULL;
+}
+
+// Write whatever is currently in the ring to f, in trace file format.
+int trace_dump(FILE *f)
+{
+  trace_write_header(f);
+  if (!trace_ring) return 0;
+  uint64_t head=__atomic_load_n(&trace_head,__ATOMIC_ACQUIRE);
+  uint64_t tail=head>TRACE_RING_RECORDS?head-TRACE_RING_RECORDS:0;
+  trace_drain(f,&tail);
+  return 0;
+}
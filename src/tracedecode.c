@@ -0,0 +1,128 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2018 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Decode binary traces written by lbard or fakecsmaradio (see trace.h) into
+  text or CSV.
+
+  usage: tracedecode [-c] [trace file ...]
+
+  Reads standard input if no files are given.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+static int csv=0;
+static int64_t first_time_us=-1;
+
+static void print_payload(FILE *out,struct trace_record *r)
+{
+  int len=r->payload_len;
+  if (len>TRACE_PAYLOAD_BYTES) len=TRACE_PAYLOAD_BYTES;
+  for(int i=0;i<len;i++) fprintf(out,"%02x",r->payload[i]);
+}
+
+static void print_record(FILE *out,struct trace_record *r)
+{
+  if (first_time_us<0) first_time_us=r->time_us;
+
+  if (csv) {
+    fprintf(out,"%lld,%u,%s,%lld,%lld,%lld,%d,",
+	    (long long)r->time_us,r->sequence,trace_event_name(r->type),
+	    (long long)r->a,(long long)r->b,(long long)r->c,r->flags);
+    print_payload(out,r);
+    fprintf(out,"\n");
+    return;
+  }
+
+  time_t secs=r->time_us/1000000;
+  struct tm tm;
+  localtime_r(&secs,&tm);
+  fprintf(out,"%02d:%02d:%02d.%06d T+%.6f %-16s",
+	  tm.tm_hour,tm.tm_min,tm.tm_sec,(int)(r->time_us%1000000),
+	  (r->time_us-first_time_us)/1000000.0,trace_event_name(r->type));
+  int64_t args[3]={r->a,r->b,r->c};
+  for(int i=0;i<3;i++) {
+    const char *name=trace_event_arg_name(r->type,i);
+    if (!name[0]) continue;
+    if (!strcmp(name,"type")&&args[i]>' '&&args[i]<0x7f)
+      fprintf(out," %s='%c'",name,(int)args[i]);
+    else
+      fprintf(out," %s=%lld",name,(long long)args[i]);
+  }
+  if (r->flags) fprintf(out," flags=0x%02x",r->flags);
+  if (r->payload_len) {
+    fprintf(out," data=");
+    print_payload(out,r);
+  }
+  fprintf(out,"\n");
+}
+
+static int decode_file(FILE *in,char *name)
+{
+  struct trace_file_header h;
+  if (fread(&h,sizeof(h),1,in)!=1
+      ||strncmp(h.magic,TRACE_MAGIC,sizeof(h.magic))) {
+    fprintf(stderr,"%s is not an LBARD trace file.\n",name);
+    return -1;
+  }
+  if (h.version!=TRACE_FORMAT_VERSION
+      ||h.record_size!=sizeof(struct trace_record)) {
+    fprintf(stderr,"%s has unsupported trace format version %d (record size %d).\n",
+	    name,h.version,h.record_size);
+    return -1;
+  }
+
+  struct trace_record r;
+  while(fread(&r,sizeof(r),1,in)==1) print_record(stdout,&r);
+  return 0;
+}
+
+int main(int argc,char **argv)
+{
+  int n=1;
+  int retVal=0;
+
+  if (argc>1&&!strcmp(argv[1],"-c")) { csv=1; n++; }
+  if (argc>n&&argv[n][0]=='-'&&argv[n][1]) {
+    fprintf(stderr,"usage: tracedecode [-c] [trace file ...]\n");
+    exit(-1);
+  }
+
+  if (csv) printf("time_us,sequence,event,a,b,c,flags,data\n");
+
+  if (n>=argc) return decode_file(stdin,"<stdin>")?1:0;
+
+  for(;n<argc;n++) {
+    FILE *in=strcmp(argv[n],"-")?fopen(argv[n],"r"):stdin;
+    if (!in) {
+      perror(argv[n]);
+      retVal=1;
+      continue;
+    }
+    if (decode_file(in,argv[n])) retVal=1;
+    if (in!=stdin) fclose(in);
+  }
+  return retVal;
+}
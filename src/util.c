@@ -502,59 +502,25 @@ int ascii64_decode(char *in, unsigned char *out, int out_len, int radio_type)
 
     while (*in && out_ofs+3 < out_len) {
 
-      *out = (*in - 0x20) & 0x3f;
-      in++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out |= (((*in - 0x20) & 0x03) << 6);
-      in++;
-      out++;
-      out_ofs++;
-
-      if (! *in) 
+      // Each group of 4 characters carries 3 bytes, packed as by
+      // ascii64_encode()
+      unsigned char ib[4];
+      int j;
+      for(j = 0; j < 4; j++)
       {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out = (((*in - 0x20) & 0x3c) >> 2);
-      in++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out |= (((*in - 0x20) & 0x0f) << 4);
-      in++;
-      out++;
-      out_ofs++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
-      }
-
-      *out = (((*in - 0x20) & 0x30) >> 4);
-      in++;
-
-      if (! *in) 
-      {
-        LOG_ERROR("premature string end");
-        break; //while
+        if (! in[j])
+        {
+          LOG_ERROR("premature string end");
+          break; //for
+        }
+        ib[j] = (in[j] - 0x20) & 0x3f;
       }
+      if (j < 4) break; //while
+      in += 4;
 
-      *out |= (((*in - 0x20) & 0x3f) << 2);
-      in++;
-      out++;
-      out_ofs++;
+      out[out_ofs++] =  ib[0]         + ((ib[1] & 0x03) << 6);
+      out[out_ofs++] = (ib[1] >> 2)   + ((ib[2] & 0x0f) << 4);
+      out[out_ofs++] = (ib[2] >> 4)   +  (ib[3] << 2);
 
     }
 
@@ -161,6 +161,161 @@ int partial_update_recent_senders(struct partial_bundle *p,char *sender_prefix_h
   return retVal;
 }
 
+/*
+  Index of the partials[] in use, keyed on the binary BID prefix, so that we
+  don't have to do a linear search with strcasecmp() for every piece that we
+  receive.  This is an open-addressing hash table with linear probing, that
+  holds partial number + 1, so that zero means an empty slot.  Entries are
+  removed by shifting later members of the probe sequence back, so that we
+  never need tombstones.  BID prefixes are uniformly distributed, so we use
+  their leading bytes directly as the hash.
+
+  Unused partials are kept on a stack, so that allocating one is also O(1).
+*/
+#define PARTIAL_HASH_SLOTS (MAX_BUNDLES_IN_FLIGHT*2)
+
+static int partial_hash[PARTIAL_HASH_SLOTS];
+static int partial_free_slots[MAX_BUNDLES_IN_FLIGHT];
+static int partial_free_count = -1;
+
+long long partials_generation = 0;
+
+static unsigned int partial_hash_of_prefix(const unsigned char *bid_prefix_bin)
+{
+  return ((bid_prefix_bin[0] << 8) | bid_prefix_bin[1]) & (PARTIAL_HASH_SLOTS - 1);
+}
+
+static void partial_index_init(void)
+{
+  if (partial_free_count >= 0) return;
+  partial_free_count = 0;
+  // Push in reverse, so that partials are handed out from slot 0 upwards
+  for (int i = MAX_BUNDLES_IN_FLIGHT - 1; i >= 0; i--)
+  {
+    if (! partials[i].bid_prefix)
+    {
+      partial_free_slots[partial_free_count++] = i;
+    }
+  }
+}
+
+int partials_in_flight(void)
+{
+  partial_index_init();
+  return MAX_BUNDLES_IN_FLIGHT - partial_free_count;
+}
+
+int partial_find(unsigned char *bid_prefix_bin)
+{
+  unsigned int slot = partial_hash_of_prefix(bid_prefix_bin);
+  while (partial_hash[slot])
+  {
+    int i = partial_hash[slot] - 1;
+    if (! memcmp(partials[i].bid_prefix_bin, bid_prefix_bin, 8))
+    {
+      return i;
+    }
+    slot = (slot + 1) & (PARTIAL_HASH_SLOTS - 1);
+  }
+  return -1;
+}
+
+static void partial_index_remove(int partial)
+{
+  unsigned int slot = partial_hash_of_prefix(partials[partial].bid_prefix_bin);
+  while (partial_hash[slot] && (partial_hash[slot] != partial + 1))
+  {
+    slot = (slot + 1) & (PARTIAL_HASH_SLOTS - 1);
+  }
+  if (! partial_hash[slot]) return;
+
+  // Close the gap, by moving back any following entry whose home slot does
+  // not lie cyclically between the gap and its current position.
+  unsigned int gap = slot;
+  partial_hash[gap] = 0;
+  slot = (slot + 1) & (PARTIAL_HASH_SLOTS - 1);
+  while (partial_hash[slot])
+  {
+    unsigned int home = partial_hash_of_prefix(partials[partial_hash[slot] - 1].bid_prefix_bin);
+    if (((slot - home) & (PARTIAL_HASH_SLOTS - 1)) >= ((slot - gap) & (PARTIAL_HASH_SLOTS - 1)))
+    {
+      partial_hash[gap] = partial_hash[slot];
+      partial_hash[slot] = 0;
+      gap = slot;
+    }
+    slot = (slot + 1) & (PARTIAL_HASH_SLOTS - 1);
+  }
+}
+
+/*
+  Choose which partial to abandon when all are in use.  Transfers that a peer
+  is sending to us are worth more than ones we have only overheard, and after
+  that we give up on the one that has been idle for longest, and then the one
+  with the least received.
+*/
+static int partial_choose_victim(void)
+{
+  int victim = 0;
+  for (int i = 1; i < MAX_BUNDLES_IN_FLIGHT; i++)
+  {
+    struct partial_bundle *a = &partials[i], *b = &partials[victim];
+    if (a->addressed_to_us != b->addressed_to_us)
+    {
+      if (a->addressed_to_us < b->addressed_to_us) victim = i;
+    }
+    else if (a->last_piece_time != b->last_piece_time)
+    {
+      if (a->last_piece_time < b->last_piece_time) victim = i;
+    }
+    else if (partial_stream_bytes(&a->body) + partial_stream_bytes(&a->manifest)
+             < partial_stream_bytes(&b->body) + partial_stream_bytes(&b->manifest))
+    {
+      victim = i;
+    }
+  }
+  return victim;
+}
+
+// Set up a partial for a bundle we are not yet receiving, abandoning another
+// transfer if necessary.  Returns the partial number.
+int partial_allocate(unsigned char *bid_prefix_bin, long long version)
+{
+  partial_index_init();
+
+  if (! partial_free_count)
+  {
+    int victim = partial_choose_victim();
+    if (debug_pieces)
+    {
+      printf("Abandoning reception of %s*/%lld to make room.\n",
+             partials[victim].bid_prefix, partials[victim].bundle_version);
+    }
+    clear_partial(&partials[victim]);
+  }
+  int i = partial_free_slots[--partial_free_count];
+
+  char bid_prefix[8*2+1];
+  snprintf(bid_prefix, sizeof(bid_prefix), "%02x%02x%02x%02x%02x%02x%02x%02x",
+           bid_prefix_bin[0], bid_prefix_bin[1], bid_prefix_bin[2], bid_prefix_bin[3],
+           bid_prefix_bin[4], bid_prefix_bin[5], bid_prefix_bin[6], bid_prefix_bin[7]);
+  partials[i].bid_prefix = strdup(bid_prefix);
+  memcpy(partials[i].bid_prefix_bin, bid_prefix_bin, 8);
+  partials[i].bundle_version = version;
+  partials[i].manifest_length = -1;
+  partials[i].body_length = -1;
+  partials[i].last_piece_time = time(0);
+
+  unsigned int slot = partial_hash_of_prefix(bid_prefix_bin);
+  while (partial_hash[slot])
+  {
+    slot = (slot + 1) & (PARTIAL_HASH_SLOTS - 1);
+  }
+  partial_hash[slot] = i + 1;
+  partials_generation++;
+
+  return i;
+}
+
 int clear_partial(struct partial_bundle *p)
 {
   int retVal = -1;
@@ -177,61 +332,203 @@ int clear_partial(struct partial_bundle *p)
     }
 #endif
 
+    if (p->bid_prefix)
+    {
+      // Release the partial for reuse
+      partial_index_init();
+      partial_index_remove(p - partials);
+      partial_free_slots[partial_free_count++] = p - partials;
+      free(p->bid_prefix);
+    }
+    if (p->manifest.data) free(p->manifest.data);
+    if (p->manifest.extents) free(p->manifest.extents);
+    if (p->body.data) free(p->body.data);
+    if (p->body.extents) free(p->body.extents);
+
+    bzero(p, sizeof(struct partial_bundle));
+    partials_generation++;
+
+    retVal = 0;
+  }
+  while (0);
+
+  LOG_EXIT;
+
+  return retVal;
+}
+
+/*
+  Make sure that the stream buffer can hold at least length bytes.  When the
+  length of the stream is known, we are called with exactly that, so that the
+  buffer is allocated only once.  Otherwise we grow it geometrically as pieces
+  arrive, so that the cost of copying remains linear in the stream length.
+*/
+int partial_stream_reserve(struct partial_stream *s, int length)
+{
+  int retVal = -1;
+
+  do
+  {
+    if ((length < 0) || (length > MAX_PARTIAL_STREAM_LENGTH))
+    {
+      LOG_WARN("stream length out of range");
+      break;
+    }
+
     retVal = 0;
-    while (p->manifest_segments) 
+    if (length <= s->data_size)
     {
-      struct segment_list *s = p->manifest_segments;
-#if COMPILE_TEST_LEVEL >= TEST_LEVEL_LIGHT
-      if (! s) 
-      {
-        LOG_ERROR("s is null");
-        retVal = -1;
-        break; // while
-      }
-#endif
-      p->manifest_segments = s->next;
-      if (s->data) 
-      {
-        free(s->data); 
-        s->data = NULL;
-      }
-      free(s);
-      s = NULL;
+      break;
     }
 
-    while(p->body_segments) 
+    unsigned char *d = realloc(s->data, length);
+    if (! d)
     {
-      struct segment_list *s = p->body_segments;
-#if COMPILE_TEST_LEVEL >= TEST_LEVEL_LIGHT
-      if (! s) 
-      {
-        LOG_ERROR("s is null");
-        retVal = -1;
-        break; // while
-      }
-#endif
-      p->body_segments = s->next;
-      if (s->data) 
+      LOG_ERROR("realloc failed");
+      retVal = -1;
+      break;
+    }
+    bzero(&d[s->data_size], length - s->data_size);
+    s->data = d;
+    s->data_size = length;
+  }
+  while (0);
+
+  return retVal;
+}
+
+/*
+  Copy a received piece into the stream, and merge its range into the extent
+  list.  Returns the number of bytes that we did not already have, or -1 on
+  error.  If next_byte_useful is supplied, it is set if the piece contained
+  new bytes, and the byte following it is still missing, i.e., the sender
+  need not be redirected to a different part of the stream.
+*/
+int partial_stream_add(struct partial_stream *s, int offset,
+                       unsigned char *bytes, int length, int *next_byte_useful)
+{
+  int retVal = -1;
+
+  do
+  {
+    if (next_byte_useful)
+    {
+      *next_byte_useful = 0;
+    }
+    if ((offset < 0) || (length < 0)
+        || (offset + length > MAX_PARTIAL_STREAM_LENGTH))
+    {
+      LOG_WARN("piece lies outside of the stream");
+      break;
+    }
+
+    if (! length)
+    {
+      retVal = 0;
+      break;
+    }
+
+    int end = offset + length;
+    if (end > s->data_size)
+    {
+      int new_size = s->data_size * 2;
+      if (new_size < end) new_size = end;
+      if (new_size > MAX_PARTIAL_STREAM_LENGTH) new_size = MAX_PARTIAL_STREAM_LENGTH;
+      if (partial_stream_reserve(s, new_size))
       {
-        free(s->data); 
-        s->data = NULL;
+        break;
       }
+    }
+    bcopy(bytes, &s->data[offset], length);
 
-      free(s);
-      s = NULL;
+    // Find the run of extents [first,last) that overlap or abut this piece.
+    int first = 0;
+    while ((first < s->extent_count) && (s->extents[first].end_offset < offset))
+    {
+      first++;
+    }
+    int last = first;
+    int held = 0;
+    int start = offset;
+    while ((last < s->extent_count) && (s->extents[last].start_offset <= end))
+    {
+      int overlap_start = s->extents[last].start_offset;
+      int overlap_end = s->extents[last].end_offset;
+      if (overlap_start < offset) overlap_start = offset;
+      if (overlap_end > end) overlap_end = end;
+      if (overlap_end > overlap_start) held += overlap_end - overlap_start;
+
+      if (s->extents[last].start_offset < start) start = s->extents[last].start_offset;
+      if (s->extents[last].end_offset > end) end = s->extents[last].end_offset;
+      last++;
     }
 
-    bzero(p, sizeof(struct partial_bundle));
+    if (first == last)
+    {
+      // Nothing to merge with, so insert a new extent
+      if (s->extent_count == s->extent_slots)
+      {
+        int slots = s->extent_slots ? s->extent_slots * 2 : 8;
+        struct partial_extent *e = realloc(s->extents, slots * sizeof(struct partial_extent));
+        if (! e)
+        {
+          LOG_ERROR("realloc failed");
+          break;
+        }
+        s->extents = e;
+        s->extent_slots = slots;
+      }
+      memmove(&s->extents[first + 1], &s->extents[first],
+              (s->extent_count - first) * sizeof(struct partial_extent));
+      s->extent_count++;
+    }
+    else if (last - first > 1)
+    {
+      // The piece bridges one or more gaps, so collapse those extents into one
+      memmove(&s->extents[first + 1], &s->extents[last],
+              (s->extent_count - last) * sizeof(struct partial_extent));
+      s->extent_count -= last - first - 1;
+    }
+    s->extents[first].start_offset = start;
+    s->extents[first].end_offset = end;
 
+    retVal = length - held;
+    if (retVal)
+    {
+      partials_generation++;
+    }
+    if (next_byte_useful && retVal && (end == offset + length))
+    {
+      *next_byte_useful = 1;
+    }
   }
   while (0);
 
-  LOG_EXIT;
-
   return retVal;
 }
 
-int dump_segment_list(struct segment_list *s)
+int partial_stream_bytes(struct partial_stream *s)
+{
+  int bytes = 0;
+  for (int i = 0; i < s->extent_count; i++)
+  {
+    bytes += s->extents[i].end_offset - s->extents[i].start_offset;
+  }
+  return bytes;
+}
+
+// Returns non-zero if the stream holds every byte of a stream of the given
+// length.
+int partial_stream_complete(struct partial_stream *s, int length)
+{
+  if (length < 0) return 0;
+  if (! length) return 1;
+  return (s->extent_count == 1)
+    && (s->extents[0].start_offset == 0)
+    && (s->extents[0].end_offset == length);
+}
+
+int dump_partial_stream(struct partial_stream *s)
 {
   int retVal = -1;
 
@@ -245,14 +542,13 @@ int dump_segment_list(struct segment_list *s)
       break;
     }
 
-    while (s) 
+    for (int i = 0; i < s->extent_count; i++)
     {
       fprintf(
         stderr,
         "    [%d,%d)\n", 
-        s->start_offset, 
-        s->start_offset+s->length);
-      s = s->next;
+        s->extents[i].start_offset, 
+        s->extents[i].end_offset);
     }
 
     retVal = 0;
@@ -314,9 +610,9 @@ int dump_partial(struct partial_bundle *p)
     if (0) 
     {
       fprintf(stderr,"  Manifest pieces received:\n");
-      dump_segment_list(p->manifest_segments);
+      dump_partial_stream(&p->manifest);
       fprintf(stderr,"  Body pieces received:\n");
-      dump_segment_list(p->body_segments);
+      dump_partial_stream(&p->body);
       fprintf(
         stderr,
         "  Request bitmap: start=%d, bits=\n    ",
@@ -330,103 +626,9 @@ int dump_partial(struct partial_bundle *p)
   return retVal;
 }
 
-int merge_segments(struct segment_list **s)
-{
-  int retVal = -1;
-
-  LOG_ENTRY;
-
-  do
-  {
-
-    if (! s) 
-    {
-      LOG_NOTE("s is null");
-      break;
-    }
-
-    if (!(*s))
-    {
-      LOG_NOTE("*s is null");
-      break;
-    }
-
-    retVal = 0;
-
-    // Segments are sorted in descending order
-    while((*s) && (*s)->next) 
-    {
-      struct segment_list *me = *s;
-      struct segment_list *next = (*s)->next;
-
-      if (me->start_offset > (next->start_offset + next->length)) 
-      {
-        s = &(*s)->next;
-      }
-      else
-      {
-        // Merge this piece onto the end of the next piece
-        if (debug_pieces)
-        {
-          fprintf(
-            stderr, 
-            "Merging [%d..%d) and [%d..%d)\n",
-            me->start_offset,
-            me->start_offset + me->length,
-            next->start_offset,
-            next->start_offset + next->length);
-        }
-
-        int extra_bytes = 
-          (me->start_offset + me->length) 
-          - (next->start_offset + next->length);
-
-        int new_length = next->length + extra_bytes;
-
-        next->data = realloc(next->data,new_length);
-        if (! next->data)
-        {
-          LOG_ERROR("realloc failed");
-          retVal = -1;
-        }
-        assert(next->data);
-
-        bcopy(
-          &me->data[me->length - extra_bytes],
-          &next->data[next->length],
-          extra_bytes);
-
-        next->length = new_length;
-
-        // Excise redundant segment from list
-        *s = next;
-        next->prev = me->prev;
-        if (me->prev) 
-        {
-          me->prev->next = next;
-        }
-
-        // Free redundant segment.
-
-        free(me->data); 
-        me->data=NULL;
-
-        free(me); 
-        me=NULL;
-      } 
-    }
-
-  }
-  while (0);
-
-  LOG_EXIT;
-
-  return retVal;
-}
-
-/* Find the first byte missing in the following segment list.
+/* Find the first byte missing in the following stream.
    Basically this boils down to being either byte 0, or the
-   first byte after the first segment. 
+   first byte after the first extent. 
 
    However, we actually want to randomise the byte we ask for,
    so that if a peer is sending to multiple peers, that we can
@@ -436,7 +638,7 @@ int merge_segments(struct segment_list **s)
    to one of our partial pieces.  However, we need to take care to
    not make the sender think that we have it all.
 */
-int partial_find_missing_byte(struct segment_list *s, int *isFirstMissingByte)
+int partial_find_missing_byte(struct partial_stream *s, int *isFirstMissingByte)
 {
   int retVal = -1;
 
@@ -464,22 +666,20 @@ int partial_find_missing_byte(struct segment_list *s, int *isFirstMissingByte)
     int candidates[16];
     int candidate_count = 0;
     
-    // Walk the segment list. Adjacent segments should be merged,
-    // so the offset following each segment is a valid candidate,
-    // except if a candidate is the end of the file.
-    while (s) 
+    // Walk the extents from the end of the stream backwards. Adjacent extents
+    // are always merged, so the offset following each extent is a valid
+    // candidate, except if a candidate is the end of the file.
+    for (int e = s ? s->extent_count - 1 : -1; e >= 0; e--)
     {
-      if (!s->start_offset) 
+      if (!s->extents[e].start_offset) 
       {
         add_zero = 0;
       }
 
       if (candidate_count < 16)
       {
-        candidates[candidate_count++] = s->start_offset + s->length;
+        candidates[candidate_count++] = s->extents[e].end_offset;
       }
-
-      s = s->next;
     }
 
     if ((candidate_count < 16) && add_zero) 
@@ -53,18 +53,25 @@ int dump_progress_bitmap(FILE *f, unsigned char *b,int blocks)
 }
 
 
+// Mark blocks [first,last) of a progress bitmap as received
+static void bitmap_mark_blocks(unsigned char *bitmap,int first,int last)
+{
+  while((first<last)&&(first&7)) { bitmap[first>>3]|=(1<<(first&7)); first++; }
+  if (last-first>=8) {
+    memset(&bitmap[first>>3],0xff,(last-first)>>3);
+    first+=(last-first)&~7;
+  }
+  while(first<last) { bitmap[first>>3]|=(1<<(first&7)); first++; }
+}
+
 /*
   Generate the starting offset and bitmap of 64 byte segments that we need
   relative to that point in the payload stream.  The purpose is to provide a list
   with enough pending 64 byte segments so that all our current senders know where they
   should next send from.
 
-  The bitmap is based on the absolute first hole in the stream that we are missing.
-
-  The segment list is arranged in reverse order, so we start by getting the last
-  piece in the segment list. If it starts at 0, then our starting point is the end
-  of the first segment. If not, then our starting point is 0. We then mark the bitmap
-  as requiring all pieces.  Then the segment list is retraversed, and any 64 byte
+  The bitmap is based on the absolute first hole in the stream that we are missing,
+  i.e., the end of the first extent if that starts at 0, or else 0. Then any 64 byte
   region that we have in its entirety is marked as already held.
 */
 int partial_update_request_bitmap(struct partial_bundle *p)
@@ -74,34 +81,22 @@ int partial_update_request_bitmap(struct partial_bundle *p)
   // 32*8*64= 16KiB of data, enough for several seconds, even with 16 senders.
   unsigned char bitmap[32];
   bzero(&bitmap[0],32);
-  struct segment_list *l=p->body_segments;
-  while(l&&l->next) l=l->next;
-  if (l) {
-    if (!l->start_offset) starting_position=l->length;
-  }
-
-  l=p->body_segments;
-  while(l) {
-    if ((l->start_offset>=starting_position)
-	&&(l->start_offset<=(starting_position+32*8*64))) {
-      int start=l->start_offset;
-      int length=l->length;
-      // Ignore any first partial 
-      if (start&63) {
-	int trim=64-(start&63);
-	start+=trim;
-	length-=trim;
-      }
-      // Work out first block number
-      int block=(start-starting_position)>>6; //  divide by 64
-      // Then mark as received all those we already have
-      while (length>=64&&(block<32*8)) {
-	bitmap[block>>3]|=(1<<(block&7));
-	block++; length-=64;
-      }
-    }
-
-    l=l->next;
+  struct partial_stream *s=&p->body;
+  if (s->extent_count&&(!s->extents[0].start_offset))
+    starting_position=s->extents[0].end_offset;
+
+  for(int e=0;e<s->extent_count;e++) {
+    int start=s->extents[e].start_offset;
+    int end=s->extents[e].end_offset;
+    if (start<starting_position) continue;
+    if (start>(starting_position+32*8*64)) break;
+    // Ignore any first partial block, and work out the range of whole blocks
+    start=(start+63)&~63;
+    if (end-start<64) continue;
+    int first_block=(start-starting_position)>>6;
+    int last_block=first_block+((end-start)>>6);
+    if (last_block>32*8) last_block=32*8;
+    bitmap_mark_blocks(bitmap,first_block,last_block);
   }
 
   // Save request bitmap
@@ -112,69 +107,33 @@ int partial_update_request_bitmap(struct partial_bundle *p)
   unsigned char manifest_bitmap[2];
   bzero(&manifest_bitmap[0],2);
 
-  l=p->manifest_segments;
-  while(l&&l->next) l=l->next;
-  if (l) {
-    if (!l->start_offset) starting_position=l->length;
-  }
-
-  l=p->manifest_segments;
-  while(l) {
-    if ((l->start_offset>=0)
-	&&(l->start_offset<=1024)) {
-      int start=l->start_offset;
-      int length=l->length;
+  s=&p->manifest;
+  for(int e=0;e<s->extent_count;e++) {
+    int start=s->extents[e].start_offset;
+    int end=s->extents[e].end_offset;
+    if (start>1024) break;
 
-      if (debug_bitmap)
-	printf("  manifest_bitmap: applying segment [%d,%d)\n",start,start+length);
-      
-      // If the segment covers the last part of the manifest, but isn't a multiple of 64
-      // bytes, then we still need to mark the last piece as received.
-      if ((p->manifest_length!=-1)
-	  &&((start+length)==p->manifest_length)
-	  &&(p->manifest_length&0x3f))
-	{
-	  int block=(start+length)/64;
-	  if (block>=0&&block<16) {
-	    if (debug_bitmap)
-	      printf(">>> BITMAP marking manifest from end-piece #%d onwards as received\n",block);
-	    while(block<16) {
-	      manifest_bitmap[block>>3]|=(1<<(block&7));
-	      block++;
-	    }
-	  }
-	}				        
-
-      // Ignore any first partial block, as we have no way to keep track of those in the bitmap.
-      if (start&63) {
-	int trim=64-(start&63);
-	start+=trim;
-	length-=trim;
-      }
-      // Work out first block number
-      int block=start>>6; //  divide by 64
-
-      // Then mark as received all those we already have
-      while (length>=64&&(block<16)) {
-	if (debug_bitmap) printf("    marking block #%d as received.\n",block);
-	manifest_bitmap[block>>3]|=(1<<(block&7));
-	block++; length-=64;
-      }
-
-      // Mark last piece of manifest as sent for case where manifest
-      // is not a multiple of 64 bytes long
-      if (p->manifest_length>0) {
-	if (start+length==p->manifest_length) {
-	  block=p->manifest_length/64;
-	  while(block<16) {
-	    manifest_bitmap[block>>3]|=(1<<(block&7));
-	    block++;
-	  }
-	}
+    if (debug_bitmap)
+      printf("  manifest_bitmap: applying extent [%d,%d)\n",start,end);
+
+    // If the extent covers the last part of the manifest, but isn't a multiple of 64
+    // bytes, then we still need to mark the last piece as received.
+    if ((p->manifest_length>0)&&(end==p->manifest_length)) {
+      int block=p->manifest_length/64;
+      if (block<16) {
+	if (debug_bitmap)
+	  printf(">>> BITMAP marking manifest from end-piece #%d onwards as received\n",block);
+	bitmap_mark_blocks(manifest_bitmap,block,16);
       }
     }
 
-    l=l->next;
+    // Ignore any first partial block, as we have no way to keep track of those in the bitmap.
+    int first_block=(start+63)>>6;
+    int last_block=end>>6;
+    if (last_block>16) last_block=16;
+    if (debug_bitmap&&(first_block<last_block))
+      printf("    marking blocks #%d..#%d as received.\n",first_block,last_block-1);
+    bitmap_mark_blocks(manifest_bitmap,first_block,last_block);
   }
   memcpy(p->request_manifest_bitmap,manifest_bitmap,2);
   
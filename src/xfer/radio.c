@@ -36,10 +36,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "radios.h"
 
 #include "golay.h"
-#include "fec-3.0.1/fixed.h"
-void encode_rs_8(data_t *data, data_t *parity,int pad);
-int decode_rs_8(data_t *data, int *eras_pos, int no_eras, int pad);
-#define FEC_LENGTH 32
+#include "rs_frame.h"
+#define FEC_LENGTH RS_FRAME_DEFAULT_PARITY
 #define FEC_MAX_BYTES 223
 
 extern unsigned char my_sid[32];
@@ -57,6 +55,15 @@ int serial_errors=0;
 int radio_transmissions_seen=0;
 int radio_transmissions_byus=0;
 
+// Running totals for the /metrics page
+long long radio_packets_sent=0;
+long long radio_bytes_sent=0;
+long long radio_packets_received=0;
+long long radio_bytes_received=0;
+long long radio_fec_frames_corrected=0;
+long long radio_fec_bytes_corrected=0;
+long long radio_fec_frames_rejected=0;
+
 int radio_mode=-1;
 int radio_features=0;
 
@@ -105,36 +112,112 @@ int radio_read_bytes(int serialfd,int monitor_mode)
 }
 
 
+/*
+  Adaptive Reed-Solomon strength (option flag FLAG_ADAPTIVE_FEC).
+
+  We remember how many errors had to be corrected in the last few frames we
+  received, and tell our peers the worst of them (see fecreport.c).  Frames
+  that could not be decoded at all count as one more error than the strongest
+  code can correct.  Older observations count for less, halving every
+  FEC_ERROR_HALF_LIFE_MS, so that one bad frame doesn't hold us at the
+  strongest code for long.
+
+  Our frames are broadcast, so we choose the strength of the code for the
+  frames we send (see rs_frame.c) to suit the peer that is hearing the channel
+  worst.  Unless every active peer has recently told us that it can decode the
+  other codes, we use the default one, which is the only one older versions of
+  LBARD can decode.
+*/
+#define FEC_HISTORY 16
+#define FEC_HISTORY_MAX_AGE_MS 300000
+#define FEC_ERROR_HALF_LIFE_MS 15000
+#define FEC_ERRORS_UNDECODABLE (RS_FRAME_MAX_PARITY/4)
+
+struct fec_observation {
+  long long time;
+  int errors;
+};
+
+static struct fec_observation fec_history[FEC_HISTORY];
+static int fec_history_next=0;
+
+// Strongest last, so that we fall back to it
+static const int fec_parity_choices[]={8,16,32,48};
+#define FEC_PARITY_CHOICES (sizeof(fec_parity_choices)/sizeof(fec_parity_choices[0]))
+
+static int radio_fec_observe(int errors)
+{
+  fec_history[fec_history_next].time=gettime_ms();
+  fec_history[fec_history_next].errors=errors;
+  fec_history_next=(fec_history_next+1)%FEC_HISTORY;
+  return 0;
+}
+
+// Returns the worst recent error count, allowing for age, or -1 if we haven't
+// received anything recently.
+int radio_fec_error_level(void)
+{
+  long long now=gettime_ms();
+  int worst=-1;
+  for(int i=0;i<FEC_HISTORY;i++) {
+    long long age=now-fec_history[i].time;
+    if ((!fec_history[i].time)||age>=FEC_HISTORY_MAX_AGE_MS) continue;
+    if (age<0) age=0;
+    int errors=fec_history[i].errors>>(age/FEC_ERROR_HALF_LIFE_MS);
+    if (errors>worst) worst=errors;
+  }
+  return worst;
+}
+
+int radio_fec_parity_bytes(int length)
+{
+  if (!(option_flags&FLAG_ADAPTIVE_FEC)) return FEC_LENGTH;
+
+  int worst=active_peers_fec_report();
+  if (worst<0) return FEC_LENGTH;
+
+  // Use the weakest code that would have accepted frames with twice as many
+  // errors as the worst any peer has seen recently, and that has room for the
+  // packet.
+  for(int i=0;i<FEC_PARITY_CHOICES;i++) {
+    int parity=fec_parity_choices[i];
+    if ((worst*2*4<parity)&&(length<=rs_frame_max_payload(parity)))
+      return parity;
+  }
+  for(int i=FEC_PARITY_CHOICES-1;i>=0;i--)
+    if (length<=rs_frame_max_payload(fec_parity_choices[i]))
+      return fec_parity_choices[i];
+  return FEC_LENGTH;
+}
+
 int radio_send_message(int serialfd, unsigned char *buffer,int length)
 {
-  unsigned char out[3+FEC_MAX_BYTES+FEC_LENGTH+3];
+  unsigned char out[RS_FRAME_MAX_BYTES];
   int offset=0;
 
-  // Encapsulate message in Reed-Solomon wrapper and send.
-  unsigned char parity[FEC_LENGTH];
-
-  // Calculate RS parity
   if (length>FEC_MAX_BYTES||length<0) {
     printf("%s(): Asked to send packet of illegal length"
 	    " (asked for %d, valid range is 0 -- %d)\n",
 	    __FUNCTION__,length,FEC_MAX_BYTES);
     return -1;
   }
-  encode_rs_8(buffer,parity,FEC_MAX_BYTES-length);
-  
-  // Then, the packet body
-  bcopy(buffer,&out[offset],length);
-  offset+=length;
 
-  // Next comes the RS parity bytes
-  bcopy(parity,&out[offset],FEC_LENGTH);
-  offset+=FEC_LENGTH;
+  // Encapsulate message in Reed-Solomon wrapper of a strength to suit the
+  // channel, and send.
+  int parity_bytes=radio_fec_parity_bytes(length);
+  bcopy(buffer,out,length);
+  offset=rs_frame_encode(out,length,parity_bytes);
+  if (offset<0) {
+    printf("%s(): Could not encode packet of %d bytes with %d parity bytes\n",
+	   __FUNCTION__,length,parity_bytes);
+    return -1;
+  }
 
   if (debug_radio_tx) {
-    dump_bytes(stdout,"sending packet",buffer,offset);
+    dump_bytes(stdout,"sending packet",out,offset);
   }
   
-  assert( offset <= (FEC_MAX_BYTES+FEC_LENGTH) );
+  assert( offset <= RS_FRAME_MAX_BYTES );
 
   if (radio_get_type()>=0) {
     int result=radio_types[radio_get_type()].send_packet(serialfd,out,offset);
@@ -143,6 +226,8 @@ int radio_send_message(int serialfd, unsigned char *buffer,int length)
   
   // Don't forget to count our own transmissions
   radio_transmissions_byus++;
+  radio_packets_sent++;
+  radio_bytes_sent+=offset;
 
   return 0;
 }
@@ -182,9 +267,19 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
 	       char *servald_server,char *credential)
 {
   if (debug_radio) dump_bytes(stdout,"packet before decode_rs",packet_data,packet_bytes);
-  
-  int rs_error_count = decode_rs_8(packet_data,NULL,0,
-				   FEC_MAX_BYTES-packet_bytes+FEC_LENGTH);
+
+  int payload_bytes=0;
+  int parity_bytes=FEC_LENGTH;
+  int rs_error_count = rs_frame_decode(packet_data,packet_bytes,
+				       &payload_bytes,&parity_bytes);
+  radio_fec_observe(rs_error_count<0?FEC_ERRORS_UNDECODABLE:rs_error_count);
+  radio_packets_received++;
+  radio_bytes_received+=packet_bytes;
+  if (rs_error_count<0) radio_fec_frames_rejected++;
+  else if (rs_error_count>0) {
+    radio_fec_frames_corrected++;
+    radio_fec_bytes_corrected+=rs_error_count;
+  }
   
   if (debug_radio) dump_bytes(stdout,"received packet",packet_data,packet_bytes);
 
@@ -197,12 +292,14 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
     return -1;
   }
   
-  if (rs_error_count>=0&&rs_error_count<8) {
+  // rs_frame_decode() only accepts frames with few enough errors to be sure
+  // they have been corrected properly.
+  if (rs_error_count>=0) {
     if (0) printf("CHECKPOINT: %s:%d %s() error counts = %d for packet of %d bytes.\n",
 		  __FILE__,__LINE__,__FUNCTION__,
 		  rs_error_count,packet_bytes);
     
-    saw_message(packet_data,packet_bytes-FEC_LENGTH,rssi,
+    saw_message(packet_data,payload_bytes,rssi,
 		my_sid_hex,prefix,servald_server,credential);
     
     // attach presumed SID prefix
@@ -211,7 +308,8 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,int rssi,
       message_buffer_length+=
 	snprintf(&message_buffer[message_buffer_length],
 		 message_buffer_size-message_buffer_length,
-		 ", FEC OK : sender SID=%02x%02x%02x%02x%02x%02x*\n",
+		 ", FEC OK (%d parity bytes) : sender SID=%02x%02x%02x%02x%02x%02x*\n",
+		 parity_bytes,
 		 packet_data[0],packet_data[1],packet_data[2],
 		 packet_data[3],packet_data[4],packet_data[5]);
     }
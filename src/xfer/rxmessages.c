@@ -41,10 +41,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "sync.h"
 #include "lbard.h"
+#include "trace.h"
 
 extern char *my_sid_hex;
 extern int my_time_stratum;
 
+// Number and total bytes of message fields handled, by type
+long long message_type_count[256];
+long long message_type_bytes[256];
+
 int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
 		char *prefix, char *servald_server,char *credential)
 {
@@ -62,6 +67,8 @@ int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
 
   // Ignore messages from ourselves
   if (!bcmp(msg,my_sid,6)) return -1;
+
+  TRACE(TRACE_MESSAGE_RX,0,msg_number,len,rssi,msg,6);
   
   if (debug_pieces) {
     printf("Decoding message #%d from %s*, length = %d:\n",
@@ -70,32 +77,20 @@ int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
 
   int offset=8; 
 
-  int peer_index=-1;
-  
   // Find or create peer structure for this.
-  struct peer_state *p=NULL;
-  for(int i=0;i<peer_count;i++) {
-    if (!strcasecmp(peer_records[i]->sid_prefix,peer_prefix)) {
-      p=peer_records[i]; peer_index=i; break;
-    }
-  }
+  struct peer_state *p=peer_find_bin(msg);
   
   if (!p) {
     p=calloc(1,sizeof(struct peer_state));
-    for(int i=0;i<4;i++) p->sid_prefix_bin[i]=msg[i];
+    for(int i=0;i<PEER_PREFIX_BYTES;i++) p->sid_prefix_bin[i]=msg[i];
     p->sid_prefix=strdup(peer_prefix);
     p->last_message_number=-1;
     p->tx_bundle=-1;
     p->request_bitmap_bundle=-1;
     printf("Registering peer %s*\n",p->sid_prefix);
-    if (peer_count<MAX_PEERS) {
-      peer_records[peer_count++]=p;      
-    } else {
-      // Peer table full.  Do random replacement.
-      peer_index=random()%MAX_PEERS;
-      free_peer(peer_records[peer_index]);
-      peer_records[peer_index]=p;
-    }
+    peer_register(p);
+    // Bundles addressed to this peer are now more important
+    bundle_priority_peer_changed(p->sid_prefix);
   }
   
   // Update time stamp and most recent message from peer
@@ -105,7 +100,7 @@ int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
     // something more profound has happened.
     p->missed_packet_count+=msg_number-p->last_message_number-1;
   }
-  p->last_message_time=time(0);
+  peer_saw_message(p);
   if (!is_retransmission) p->last_message_number=msg_number;
 
   // Update RSSI log for this sender
@@ -138,6 +133,9 @@ int saw_message(unsigned char *msg,int len,int rssi,char *my_sid,
       } else {
 	if (debug_pieces)
 	  printf("### %s : Handler consumed %d packet bytes.\n",timestamp_str(),advance);
+	TRACE(TRACE_FIELD_RX,0,msg[offset],offset,advance,msg,6);
+	message_type_count[msg[offset]]++;
+	message_type_bytes[msg[offset]]+=advance;
 	offset+=advance;
       }
     } else {
@@ -189,10 +189,15 @@ int update_my_message(int serialfd,
      Basically we need to iterate through the peers and pick who to respond to.
      We also need the sequence numbers to be recipient specific.
   */
-  sync_by_tree_stuff_packet(&offset,mtu,msg_out,
-			    my_sid_hex,servald_server,credential);
+  sync_by_tree_stuff_packet(&offset,
+			    mtu-((option_flags&FLAG_ADAPTIVE_FEC)?FEC_REPORT_LENGTH:0),
+			    msg_out,my_sid_hex,servald_server,credential);
 #endif
 
+  // Must come last (see fecreport.c)
+  if ((option_flags&FLAG_ADAPTIVE_FEC)&&(offset+FEC_REPORT_LENGTH<=mtu))
+    append_fec_report(msg_out,&offset);
+
   // Increment message counter
   message_counter++;
 